@@ -0,0 +1,465 @@
+//
+// Microbenchmarks of hot functions of the server (make microbench)
+//
+// Each function is called in a loop: the number of calls in one repetition
+// is chosen so that it takes at least BENCH_MIN_NS, then there are @warmup
+// repetitions which are not counted and @repetitions timed ones.
+// The median and the best time of one call are reported in nanoseconds and
+// in CPU cycles (perf_event_open(), or rdtsc if perf events are not allowed).
+// The thread is pinned to one CPU, so the numbers of different runs are comparable.
+//
+// It is run like srv, from the directory with 'config', 'mime.types' and wwwroot:
+//   ./microbench [-c cpu] [-r repetitions] [-w warmup] [-n max entries] [-d dir] [filter]
+//
+// @filter      -- run only benchmarks which names contain it
+// @max entries -- listings are generated for synthetic directories of 10, 1000, ...
+//                 entries up to this number (100000 by default, up to 1000000),
+//                 the directories are created in @dir once and reused by the next runs
+//
+// Static functions of request_handling.c and html_generation_for_dir.c are
+// benchmarked too, so these files are included here instead of linking their objects.
+//
+#define _GNU_SOURCE
+#include "request_handling.c"
+#include "html_generation_for_dir.c"
+
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_MIN_NS          (20 * 1000 * 1000)   // min time of one repetition
+#define BENCH_REPETITIONS     7
+#define BENCH_WARMUP          2
+#define BENCH_MAX_ENTRIES     100000
+#define BENCH_MAX_REPETITIONS 101
+#define BENCH_DIR             "/tmp/sss-microbench"
+#define BENCH_BUF_SIZE        1024
+#define BENCH_HTML_ENTRIES    10000   // html listings look up an icon for each entry, bigger ones are too slow
+
+// the log of the server (see log.h), PRINT() writes into /dev/null here
+FILE *logfp;
+
+typedef void (*bench_fn_t)(void *arg, long calls);
+
+static struct {
+  int cpu;
+  int repetitions;
+  int warmup;
+  long max_entries;
+  const char *dir;
+  const char *filter;
+  FILE *out;            // report (stdout of the server is closed, but some functions write into it)
+  int cycles_fd;        // perf event of cpu cycles (-1 -- rdtsc is used)
+  const char *cycles_name;
+} bench = { 0, BENCH_REPETITIONS, BENCH_WARMUP, BENCH_MAX_ENTRIES, BENCH_DIR, NULL, NULL, -1, "tsc" };
+
+// results are added here, so the compiler doesn't throw the calls away
+static volatile unsigned long sink;
+
+static long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long read_cycles() {
+  unsigned long long count = 0;
+
+  if (bench.cycles_fd >= 0) {
+    if (read(bench.cycles_fd, &count, sizeof(count)) != sizeof(count))
+      return 0;
+    return count;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+//
+// count cycles of this thread (with the kernel if it is allowed)
+// it isn't possible in some VMs and containers, then rdtsc is used
+//
+static void open_cycles_counter() {
+  struct perf_event_attr attr;
+  int exclude_kernel;
+
+  for (exclude_kernel = 0; exclude_kernel <= 1; exclude_kernel++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    bench.cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (bench.cycles_fd >= 0) {
+      bench.cycles_name = exclude_kernel ? "ucycles" : "cycles";
+      return;
+    }
+  }
+}
+
+static void pin_to_cpu(int cpu) {
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    fprintf(stderr, "[pin_to_cpu]WARNING: cannot pin to cpu %d (errno=%d)\n", cpu, errno);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+//
+// time @fn, one call of @fn is @ops operations
+// (for example, a listing of a directory is one call, but @ops entries)
+//
+static void run_bench(const char *name, bench_fn_t fn, void *arg, long ops) {
+  double ns[BENCH_MAX_REPETITIONS];
+  double cycles[BENCH_MAX_REPETITIONS];
+  long calls = 1;
+  long long start;
+  unsigned long long start_cycles;
+  int i;
+
+  if (bench.filter && !strstr(name, bench.filter))
+    return;
+
+  // how many calls take BENCH_MIN_NS
+  for (;;) {
+    start = now_ns();
+    fn(arg, calls);
+    if (now_ns() - start >= BENCH_MIN_NS || calls >= (1L << 40))
+      break;
+    calls *= 2;
+  }
+
+  for (i = 0; i < bench.warmup; i++)
+    fn(arg, calls);
+
+  for (i = 0; i < bench.repetitions; i++) {
+    start = now_ns();
+    start_cycles = read_cycles();
+    fn(arg, calls);
+    cycles[i] = (double)(read_cycles() - start_cycles) / calls / ops;
+    ns[i] = (double)(now_ns() - start) / calls / ops;
+  }
+
+  qsort(ns, bench.repetitions, sizeof(double), compare_doubles);
+  qsort(cycles, bench.repetitions, sizeof(double), compare_doubles);
+  fprintf(bench.out, "%-44s %12.1f %12.1f %12.1f %12.1f %10ld\n", name,
+          ns[bench.repetitions / 2], ns[0],
+          cycles[bench.repetitions / 2], cycles[0], calls);
+  fflush(bench.out);
+}
+
+//
+// parser
+//
+
+static char *bench_request =
+  "GET /pictures/2016/holidays/IMG_0042.jpg?size=large HTTP/1.1\r\n"
+  "Host: localhost:7777\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:45.0) Gecko/20100101 Firefox/45.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+  "Connection: keep-alive\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "Content-Length: 0\r\n"
+  "\r\n";
+
+// method, path and version of the request line
+static void bench_read_word(void *arg, long calls) {
+  char buf[BENCH_BUF_SIZE];
+  size_t pos;
+  long i;
+
+  for (i = 0; i < calls; i++) {
+    pos = 0;
+    read_word_from_req_into_buf(bench_request, buf, &pos, sizeof(buf));
+    read_word_from_req_into_buf(bench_request, buf, &pos, sizeof(buf));
+    read_word_from_req_into_buf(bench_request, buf, &pos, sizeof(buf));
+    sink += pos + buf[0];
+  }
+}
+
+static char *bench_methods[] = {
+  "GET / HTTP/1.1\r\n\r\n",
+  "HEAD / HTTP/1.1\r\n\r\n",
+  "POST / HTTP/1.1\r\n\r\n",
+  "PUT / HTTP/1.1\r\n\r\n",
+  "DELETE / HTTP/1.1\r\n\r\n",
+};
+#define BENCH_METHODS_COUNT (sizeof(bench_methods) / sizeof(bench_methods[0]))
+
+static void bench_request_type(void *arg, long calls) {
+  size_t pos;
+  long i;
+
+  for (i = 0; i < calls; i++) {
+    pos = 0;
+    sink += get_request_type(bench_methods[i % BENCH_METHODS_COUNT], &pos);
+  }
+}
+
+// the last header of the request
+static void bench_header_value(void *arg, long calls) {
+  char value[BENCH_BUF_SIZE];
+  long i;
+
+  for (i = 0; i < calls; i++)
+    sink += (unsigned long)get_header_value(bench_request, "Content-Length", value, sizeof(value));
+}
+
+static void bench_header_full(void *arg, long calls) {
+  Node_t node;
+  long i;
+
+  memset(&node, 0, sizeof(node));
+  node.data.header = bench_request;
+  for (i = 0; i < calls; i++) {
+    node.data.header_end = 0;
+    sink += (unsigned long)is_header_full(&node);
+  }
+}
+
+//
+// MIME types and icons
+//
+
+static char *bench_extensions[] = {
+  "html", "css", "js", "png", "jpg", "mp4", "txt", "pdf", "tar", "unknown-ext",
+};
+#define BENCH_EXTENSIONS_COUNT (sizeof(bench_extensions) / sizeof(bench_extensions[0]))
+
+static void bench_mime_support(void *arg, long calls) {
+  char mime_type[MIME_LENGTH];
+  long i;
+
+  for (i = 0; i < calls; i++)
+    sink += check_mime_support(bench_extensions[i % BENCH_EXTENSIONS_COUNT], mime_type);
+}
+
+static char *bench_files[] = {
+  "index.html", "style.css", "photo.jpg", "movie.mp4", "notes.txt", "file.unknown-ext",
+};
+#define BENCH_FILES_COUNT (sizeof(bench_files) / sizeof(bench_files[0]))
+
+// @arg -- descriptor of a directory with @bench_files
+static void bench_icon_path(void *arg, long calls) {
+  int dir_fd = *(int *)arg;
+  char *icon_path;
+  long i;
+
+  for (i = 0; i < calls; i++) {
+    icon_path = get_icon_path(dir_fd, bench_files[i % BENCH_FILES_COUNT]);
+    sink += (unsigned long)icon_path;
+    free(icon_path);
+  }
+}
+
+//
+// listings
+//
+
+typedef struct bench_listing {
+  int dir_fd;
+  const char *query;
+} bench_listing_t;
+
+// generate the whole listing (it isn't sent anywhere)
+static void bench_listing(void *arg, long calls) {
+  bench_listing_t *b = (bench_listing_t *)arg;
+  char query[BENCH_BUF_SIZE];
+  dir_listing_t *l;
+  Node_t node;
+  int dir_fd;
+  long i;
+
+  for (i = 0; i < calls; i++) {
+    dir_fd = openat(b->dir_fd, ".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+      return;
+    strncpy(query, b->query, sizeof(query) - 1);
+    query[sizeof(query) - 1] = '\0';
+    memset(&node, 0, sizeof(node));
+    if (start_dir_listing(&node, dir_fd, "/bench", query, NULL) < 0)
+      return;
+    l = node.data.listing;
+    while (l->state != LISTING_DONE) {
+      fill_listing_chunk(l);
+      sink += l->out_len;
+    }
+    free_dir_listing(l);
+  }
+}
+
+//
+// open (create if it is needed) a directory of @entries files in @bench.dir
+// return its descriptor or -1
+//
+static int open_synthetic_dir(long entries) {
+  static char *extensions[] = { "html", "jpg", "txt", "mp4", "css", "" };
+  char name[BENCH_BUF_SIZE];
+  char done[BENCH_BUF_SIZE];
+  int dir_fd;
+  int fd;
+  long i;
+
+  mkdir(bench.dir, 0755);
+  snprintf(name, sizeof(name), "%s/%ld", bench.dir, entries);
+  snprintf(done, sizeof(done), "%s/%ld.done", bench.dir, entries);
+  mkdir(name, 0755);
+  dir_fd = open(name, O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0) {
+    fprintf(stderr, "[open_synthetic_dir]ERROR: cannot open %s (errno=%d)\n", name, errno);
+    return -1;
+  }
+  if (access(done, F_OK) == 0)
+    return dir_fd;
+
+  if (entries > 0)
+    fprintf(stderr, "creating %ld files in %s...\n", entries, name);
+  for (i = 0; i < entries; i++) {
+    snprintf(name, sizeof(name), "entry-%07ld%s%s", (i * 7919) % entries,
+             extensions[i % 6][0] ? "." : "", extensions[i % 6]);
+    fd = openat(dir_fd, name, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "[open_synthetic_dir]ERROR: cannot create %s (errno=%d)\n", name, errno);
+      close(dir_fd);
+      return -1;
+    }
+    close(fd);
+  }
+  fd = open(done, O_WRONLY | O_CREAT, 0644);
+  if (fd >= 0)
+    close(fd);
+  return dir_fd;
+}
+
+static void run_listing_benches() {
+  static const struct {
+    const char *name;
+    const char *query;
+    long max_entries;
+  } listings[] = {
+    { "html",           "format=html",           BENCH_HTML_ENTRIES },
+    { "json",           "format=json",           0 },
+    { "json,sort=name", "format=json&sort=name", 0 },
+    { "cbor",           "format=cbor",           0 },
+  };
+  char name[BENCH_BUF_SIZE];
+  bench_listing_t b;
+  long entries;
+  size_t i;
+
+  for (entries = 10; entries <= bench.max_entries; entries *= 100) {
+    b.dir_fd = -1;
+    for (i = 0; i < sizeof(listings) / sizeof(listings[0]); i++) {
+      if (listings[i].max_entries && entries > listings[i].max_entries)
+        continue;
+      snprintf(name, sizeof(name), "listing/%s/%ld (per entry)", listings[i].name, entries);
+      if (bench.filter && !strstr(name, bench.filter))
+        continue;
+      if (b.dir_fd < 0 && (b.dir_fd = open_synthetic_dir(entries)) < 0)
+        return;
+      b.query = listings[i].query;
+      run_bench(name, bench_listing, &b, entries);
+    }
+    if (b.dir_fd >= 0)
+      close(b.dir_fd);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-c cpu] [-r repetitions] [-w warmup] [-n max entries] [-d dir] [filter]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  static const char *level_names[] = { "scalar", "sse2", "avx2" };
+  char name[BENCH_BUF_SIZE];
+  int opt;
+  int level;
+  int max_level;
+  int files_fd;
+  size_t i;
+
+  while ((opt = getopt(argc, argv, "c:r:w:n:d:")) != -1) {
+    switch (opt) {
+      case 'c' : bench.cpu = atoi(optarg); break;
+      case 'r' : bench.repetitions = atoi(optarg); break;
+      case 'w' : bench.warmup = atoi(optarg); break;
+      case 'n' : bench.max_entries = atol(optarg); break;
+      case 'd' : bench.dir = optarg; break;
+      default  : usage(argv[0]);
+    }
+  }
+  if (bench.repetitions < 1 || bench.repetitions > BENCH_MAX_REPETITIONS || bench.warmup < 0)
+    usage(argv[0]);
+  if (optind < argc)
+    bench.filter = argv[optind];
+
+  // get_icon_path() prints into stdout, it is closed in the daemon
+  bench.out = fdopen(dup(STDOUT_FILENO), "w");
+  logfp = fopen("/dev/null", "w");
+  if (!bench.out || !logfp || !freopen("/dev/null", "w", stdout)) {
+    fprintf(stderr, "ERROR: cannot open /dev/null\n");
+    return EXIT_FAILURE;
+  }
+
+  if (init_server("config") < 0) {
+    fprintf(stderr, "ERROR: cannot init server (run microbench where 'config' of srv is)\n");
+    return EXIT_FAILURE;
+  }
+
+  pin_to_cpu(bench.cpu);
+  open_cycles_counter();
+
+  fprintf(bench.out, "cpu %d, %d repetitions (+%d warmup), values are per operation\n",
+          bench.cpu, bench.repetitions, bench.warmup);
+  fprintf(bench.out, "%-44s %12s %12s %12s %12s %10s\n", "benchmark", "ns median", "ns best",
+          bench.cycles_name, "(best)", "calls");
+
+  // the parser with each level of scan kernels which the CPU has (see scan.c)
+  max_level = scan_init(SCAN_AVX2);
+  for (level = SCAN_SCALAR; level <= max_level; level++) {
+    scan_init(level);
+    snprintf(name, sizeof(name), "read_word_from_req_into_buf/%s (3 words)", level_names[level]);
+    run_bench(name, bench_read_word, NULL, 3);
+    snprintf(name, sizeof(name), "get_header_value/%s", level_names[level]);
+    run_bench(name, bench_header_value, NULL, 1);
+    snprintf(name, sizeof(name), "is_header_full/%s", level_names[level]);
+    run_bench(name, bench_header_full, NULL, 1);
+  }
+  run_bench("get_request_type", bench_request_type, NULL, 1);
+
+  run_bench("check_mime_support", bench_mime_support, NULL, 1);
+
+  files_fd = open_synthetic_dir(0);
+  if (files_fd >= 0) {
+    for (i = 0; i < BENCH_FILES_COUNT; i++)
+      close(openat(files_fd, bench_files[i], O_WRONLY | O_CREAT, 0644));
+    run_bench("get_icon_path", bench_icon_path, &files_fd, 1);
+    close(files_fd);
+  }
+
+  run_listing_benches();
+
+  deinit_server();
+  fclose(bench.out);
+  return EXIT_SUCCESS;
+}
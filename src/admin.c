@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include "admin.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+//
+// Admin socket (see admin.h)
+//
+// A few clients are kept in a table with their unfinished line.
+// Replies are short, they are sent without waiting (a client which
+// doesn't read them loses them).
+//
+
+typedef struct admin_client {
+  int fd;                         // -1 if the slot is free
+  char line[ADMIN_LINE_MAX];
+  size_t length;
+} admin_client_t;
+
+static int admin_efd = -1;
+static int admin_sfd = -1;
+static char *admin_path;
+static admin_client_t clients[ADMIN_CLIENTS_MAX];
+
+int admin_open(int efd, const char *path) {
+  struct sockaddr_un addr;
+  struct epoll_event event;
+  int i;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    PRINT("[admin_open]ERROR: path %s is too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  admin_sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (admin_sfd < 0) {
+    PRINT("[admin_open]ERROR: socket (errno=%d)\n", errno);
+    return -1;
+  }
+  // (a socket file of the last run)
+  unlink(path);
+  // only the owner of the server may connect
+  if (bind(admin_sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      chmod(path, 0600) < 0 ||
+      listen(admin_sfd, ADMIN_CLIENTS_MAX) < 0) {
+    PRINT("[admin_open]ERROR: cannot listen on %s (errno=%d)\n", path, errno);
+    goto error;
+  }
+
+  admin_path = strdup(path);
+  for (i = 0; i < ADMIN_CLIENTS_MAX; i++)
+    clients[i].fd = -1;
+
+  admin_efd = efd;
+  event.data.fd = admin_sfd;
+  event.events = EPOLLIN;
+  if (!admin_path || epoll_ctl(efd, EPOLL_CTL_ADD, admin_sfd, &event) < 0) {
+    PRINT("[admin_open]ERROR: epoll_ctl (errno=%d)\n", errno);
+    unlink(path);
+    free(admin_path);
+    admin_path = NULL;
+    goto error;
+  }
+  return 0;
+
+error:
+  close(admin_sfd);
+  admin_sfd = -1;
+  return -1;
+}
+
+static void close_client(admin_client_t *client) {
+  // (closing removes it from epoll)
+  close(client->fd);
+  client->fd = -1;
+  client->length = 0;
+}
+
+void admin_close() {
+  int i;
+
+  if (admin_sfd < 0)
+    return;
+  for (i = 0; i < ADMIN_CLIENTS_MAX; i++) {
+    if (clients[i].fd >= 0)
+      close_client(&clients[i]);
+  }
+  close(admin_sfd);
+  admin_sfd = -1;
+  unlink(admin_path);
+  free(admin_path);
+  admin_path = NULL;
+}
+
+static admin_client_t *find_client(int fd) {
+  int i;
+
+  for (i = 0; i < ADMIN_CLIENTS_MAX; i++) {
+    if (clients[i].fd == fd)
+      return &clients[i];
+  }
+  return NULL;
+}
+
+int admin_owns(int fd) {
+  return admin_sfd >= 0 && (fd == admin_sfd || find_client(fd) != NULL);
+}
+
+static void reply(admin_client_t *client, const char *text, size_t length) {
+  send(client->fd, text, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+//
+// do the command @line (without "\n") of @client
+//
+static void do_command(admin_client_t *client, char *line) {
+  char out[ADMIN_LINE_MAX];
+  const char *error;
+  char *command, *name, *value, *save;
+  int i, length;
+
+  command = strtok_r(line, " \t\r", &save);
+  name = strtok_r(NULL, " \t\r", &save);
+  value = strtok_r(NULL, " \t\r", &save);
+  if (!command)
+    return;
+
+  if (!strcmp(command, "list")) {
+    for (i = 0; (length = format_server_setting(i, out, sizeof(out) - 1)) >= 0; i++) {
+      out[length++] = '\n';
+      reply(client, out, length);
+    }
+    return;
+  }
+
+  if (!strcmp(command, "get") && name) {
+    length = format_server_setting(find_server_setting(name), out, sizeof(out) - 1);
+    if (length < 0) {
+      error = "the option is not known";
+      goto error;
+    }
+    out[length++] = '\n';
+    reply(client, out, length);
+    return;
+  }
+
+  if (!strcmp(command, "set") && name && value) {
+    if (set_server_setting(name, value, TRUE, &error) < 0)
+      goto error;
+    PRINT("[admin]%s is set to %s\n", name, value);
+    reply(client, "ok\n", 3);
+    return;
+  }
+  error = "the command is not known (list, get NAME, set NAME VALUE)";
+
+error:
+  length = snprintf(out, sizeof(out), "error: %s\n", error);
+  reply(client, out, length);
+}
+
+static void accept_client() {
+  struct epoll_event event;
+  admin_client_t *client;
+  int fd;
+
+  while ((fd = accept4(admin_sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    client = find_client(-1);
+    if (!client) {
+      send(fd, "error: too many clients\n", 24, MSG_DONTWAIT | MSG_NOSIGNAL);
+      close(fd);
+      continue;
+    }
+    event.data.fd = fd;
+    event.events = EPOLLIN;
+    if (epoll_ctl(admin_efd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->length = 0;
+  }
+}
+
+void admin_handle(int fd, uint32_t events) {
+  admin_client_t *client;
+  char *line, *end;
+  ssize_t count;
+
+  (void)events;
+  if (fd == admin_sfd) {
+    accept_client();
+    return;
+  }
+
+  client = find_client(fd);
+  if (!client)
+    return;
+  count = recv(fd, client->line + client->length, sizeof(client->line) - 1 - client->length, 0);
+  if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (count <= 0) {
+    // the client is gone (or it has sent all its commands)
+    close_client(client);
+    return;
+  }
+  client->length += count;
+  client->line[client->length] = '\0';
+
+  // whole lines are commands
+  line = client->line;
+  while ((end = strchr(line, '\n')) != NULL) {
+    *end = '\0';
+    do_command(client, line);
+    line = end + 1;
+  }
+  client->length -= line - client->line;
+  memmove(client->line, line, client->length);
+
+  if (client->length == sizeof(client->line) - 1) {
+    reply(client, "error: the line is too long\n", 28);
+    close_client(client);
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef _ADMIN_H_
+#define _ADMIN_H_
+
+#include "setup.h"
+#include <stdint.h>
+
+//
+// Admin socket (ADMIN_SOCKET in config, AF_UNIX, only the owner may connect)
+//
+// Commands are lines, each one is answered by lines:
+//   list               -- "NAME VALUE" of all options ("live" ones may be set)
+//   get NAME           -- "NAME VALUE"
+//   set NAME VALUE     -- "ok" or "error: <reason>" (live options only)
+// e.g.  echo "set SEND_RATE 10M" | socat - UNIX-CONNECT:<path>
+//
+// Clients are served by the event loop, so a value is changed between
+// events and its module sees it at once (see set_server_setting() in setup.c).
+//
+
+#define ADMIN_CLIENTS_MAX    4
+#define ADMIN_LINE_MAX       512
+
+// listen on @path (an old socket file is replaced), its descriptor is added to @efd
+// return 0 if success, else -1
+int admin_open(int efd, const char *path);
+void admin_close();
+
+// TRUE if @fd is the admin socket or one of its clients
+int admin_owns(int fd);
+// handle @events of @fd (see admin_owns())
+void admin_handle(int fd, uint32_t events);
+
+#endif // _ADMIN_H_
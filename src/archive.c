@@ -0,0 +1,869 @@
+#define _GNU_SOURCE
+#include "archive.h"
+#include "chunked.h"
+#include "path_resolution.h"
+#include "tls.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+//
+// Archives of directories (see archive.h)
+//
+// A worker prepares a batch: segments of the response, which are bytes of
+// @buf (the chunk header, headers of members, padding) or bytes of an opened
+// file. The event loop sends them, then the next batch is prepared.
+//
+
+#define ARCHIVE_WALK      0     // members of the directories
+#define ARCHIVE_CENTRAL   1     // (zip) the central directory
+#define ARCHIVE_END       2     // the end of the archive
+#define ARCHIVE_DONE      3     // the last chunk is prepared
+
+#define ARCHIVE_HEADER_MAX  (2 * ARCHIVE_PATH_MAX + 2048)  // headers of one member (a pax header and names)
+#define ARCHIVE_SEGMENTS    (3 * ARCHIVE_MEMBERS_BATCH + 8)
+
+#define ARCHIVE_CRC_CHUNK   (64 * 1024)         // bytes read at once for CRC-32 of a file
+
+#define TAR_BLOCK           512
+#define TAR_SIZE_MAX        077777777777ULL     // 11 octal digits (larger sizes are base-256)
+
+#define ZIP_LOCAL_SIG       0x04034b50
+#define ZIP_CENTRAL_SIG     0x02014b50
+#define ZIP_END_SIG         0x06054b50
+#define ZIP64_END_SIG       0x06064b50
+#define ZIP64_LOCATOR_SIG   0x07064b50
+#define ZIP_UTF8            0x0800              // names are UTF-8 (flags)
+#define ZIP_VERSION         20
+#define ZIP64_VERSION       45
+#define ZIP_MADE_BY_UNIX    (3 << 8)
+#define ZIP_MAX16           0xFFFF
+#define ZIP_MAX32           0xFFFFFFFFULL
+#define CRC32_POLY          0xEDB88320          // (reflected)
+
+typedef struct archive_dir {
+  int fd;
+  char *dents;
+  long dents_len;
+  long dents_pos;
+  size_t path_len;            // its path in dir_archive.path (with '/')
+} archive_dir_t;
+
+typedef struct archive_segment {
+  const char *data;           // bytes, or NULL: @length bytes of file @fd
+  int fd;
+  off_t length;
+} archive_segment_t;
+
+// an entry of the zip central directory
+typedef struct zip_entry {
+  size_t name_off;            // in dir_archive.names
+  size_t name_len;
+  uint32_t crc;
+  uint64_t size;
+  uint64_t offset;            // of the local header
+  uint16_t time;
+  uint16_t date;
+  uint32_t mode;
+} zip_entry_t;
+
+typedef struct dir_archive {
+  io_job_t job;               // preparation of the next batch (see send_archive())
+  int format;
+  int state;
+  char *root_name;            // members are "<root_name>/..."
+
+  // the walk: @dirs[0 .. @depth - 1] are being read
+  archive_dir_t dirs[ARCHIVE_DEPTH_MAX];
+  int depth;
+  char path[ARCHIVE_PATH_MAX + 2];
+
+  // the batch
+  char *buf;
+  size_t buf_len;
+  archive_segment_t segs[ARCHIVE_SEGMENTS];
+  int segs_count;
+  int seg;                    // the segment which is being sent
+  off_t seg_pos;
+  uint64_t offset;            // bytes of the archive before the end of the batch
+
+  // (zip) the central directory
+  zip_entry_t *entries;
+  size_t entries_count;
+  size_t entries_cap;
+  size_t next_entry;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  uint64_t central_offset;
+} dir_archive_t;
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static char zero_block[TAR_BLOCK];
+
+//
+// CRC-32 of zip (slicing by 8)
+//
+
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32_table[8][256];
+
+static void init_crc32_table() {
+  uint32_t i, j, c;
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++)
+      c = (c & 1) ? (c >> 1) ^ CRC32_POLY : (c >> 1);
+    crc32_table[0][i] = c;
+  }
+  for (i = 0; i < 256; i++) {
+    for (j = 1; j < 8; j++)
+      crc32_table[j][i] = (crc32_table[j - 1][i] >> 8) ^ crc32_table[0][crc32_table[j - 1][i] & 0xff];
+  }
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t length) {
+  uint32_t lo, hi;
+
+  pthread_once(&crc32_once, init_crc32_table);
+  crc = ~crc;
+  while (length >= 8) {
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+          crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+          crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+          crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+    p += 8;
+    length -= 8;
+  }
+  while (length--)
+    crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+//
+// CRC-32 of @size bytes of file @fd (it is read by ARCHIVE_CRC_CHUNK, a mapping would
+// get SIGBUS if the file is truncated meanwhile)
+// return 0 if success, else -1 (also if the file is shorter than @size now)
+//
+static int file_crc32(int fd, off_t size, uint32_t *crc) {
+  unsigned char *buf;
+  off_t offset = 0;
+  ssize_t n;
+
+  *crc = 0;
+  if (size == 0)
+    return 0;
+  buf = (unsigned char *)malloc(ARCHIVE_CRC_CHUNK);
+  if (!buf)
+    return -1;
+  posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+  while (offset < size) {
+    n = pread(fd, buf, (size - offset < ARCHIVE_CRC_CHUNK) ? (size_t)(size - offset) : ARCHIVE_CRC_CHUNK,
+              offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      // (a short file: its entry would not match the size in its header)
+      if (n == 0)
+        errno = EIO;
+      free(buf);
+      return -1;
+    }
+    *crc = crc32_update(*crc, buf, n);
+    offset += n;
+  }
+  free(buf);
+  return 0;
+}
+
+//
+// Segments of a batch
+//
+
+// @length bytes of @data are the next bytes of the archive
+static void put_bytes(dir_archive_t *a, const void *data, size_t length) {
+  archive_segment_t *last = &a->segs[a->segs_count - 1];
+
+  if (length == 0)
+    return;
+  memcpy(a->buf + a->buf_len, data, length);
+  // (it continues the last segment if that one ends here)
+  if (last->data && last->data + last->length == a->buf + a->buf_len) {
+    last->length += length;
+  } else {
+    last = &a->segs[a->segs_count++];
+    last->data = a->buf + a->buf_len;
+    last->length = length;
+  }
+  a->buf_len += length;
+  a->offset += length;
+}
+
+static void put_file(dir_archive_t *a, int fd, off_t length) {
+  archive_segment_t *s = &a->segs[a->segs_count++];
+
+  s->data = NULL;
+  s->fd = fd;
+  s->length = length;
+  a->offset += length;
+}
+
+static void put_le16(dir_archive_t *a, uint16_t v) {
+  unsigned char b[2] = { v & 0xff, v >> 8 };
+
+  put_bytes(a, b, 2);
+}
+
+static void put_le32(dir_archive_t *a, uint32_t v) {
+  unsigned char b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24 };
+
+  put_bytes(a, b, 4);
+}
+
+static void put_le64(dir_archive_t *a, uint64_t v) {
+  put_le32(a, (uint32_t)v);
+  put_le32(a, (uint32_t)(v >> 32));
+}
+
+//
+// tar (ustar, pax headers for long paths)
+//
+
+// "<length> path=<path>\n", the length includes itself
+static size_t format_pax_path(char *out, size_t size, const char *path) {
+  size_t length = strlen(path) + strlen(" path=\n");
+  int digits = snprintf(NULL, 0, "%zu", length);
+
+  if (snprintf(NULL, 0, "%zu", length + digits) > digits)
+    digits++;
+  return snprintf(out, size, "%zu path=%s\n", length + digits, path);
+}
+
+static void put_tar_header(dir_archive_t *a, const char *path, char type, uint64_t size,
+                           mode_t mode, time_t mtime) {
+  char h[TAR_BLOCK];
+  char pax[ARCHIVE_PATH_MAX + 32];
+  size_t length = strlen(path);
+  const char *slash = NULL;
+  unsigned int sum = 0;
+  size_t pax_len;
+  int i;
+
+  // a path longer than 100 bytes is "prefix/name" (155 and 100 bytes), or a pax header
+  if (length > 100) {
+    // (the first '/' which leaves at most 100 bytes of the name)
+    for (slash = strchr(path, '/'); slash && path + length - slash - 1 > 100; slash = strchr(slash + 1, '/'))
+      ;
+    if (slash && (slash == path || slash - path > 155 || slash[1] == '\0'))
+      slash = NULL;
+    if (!slash) {
+      pax_len = format_pax_path(pax, sizeof(pax), path);
+      put_tar_header(a, "././@PaxHeader", 'x', pax_len, 0644, mtime);
+      put_bytes(a, pax, pax_len);
+      put_bytes(a, zero_block, (TAR_BLOCK - pax_len % TAR_BLOCK) % TAR_BLOCK);
+    }
+  }
+
+  memset(h, 0, sizeof(h));
+  if (length <= 100) {
+    memcpy(h, path, length);
+  } else if (slash) {
+    memcpy(h + 345, path, slash - path);
+    memcpy(h, slash + 1, path + length - slash - 1);
+  } else {
+    // (the name of the pax header is used)
+    memcpy(h, path, 100);
+  }
+  snprintf(h + 100, 8, "%07o", (unsigned int)(mode & 07777));
+  snprintf(h + 108, 8, "%07o", 0);
+  snprintf(h + 116, 8, "%07o", 0);
+  if (size <= TAR_SIZE_MAX) {
+    snprintf(h + 124, 12, "%011llo", (unsigned long long)size);
+  } else {
+    // base-256 (GNU)
+    h[124] = (char)0x80;
+    for (i = 0; i < 8; i++)
+      h[135 - i] = (char)((size >> (8 * i)) & 0xff);
+  }
+  // (mtime is clamped to 11 octal digits)
+  if (mtime < 0)
+    mtime = 0;
+  snprintf(h + 136, 12, "%011llo",
+           ((unsigned long long)mtime > TAR_SIZE_MAX) ? TAR_SIZE_MAX : (unsigned long long)mtime);
+  h[156] = type;
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+
+  // the checksum is counted with spaces in its place
+  memset(h + 148, ' ', 8);
+  for (i = 0; i < TAR_BLOCK; i++)
+    sum += (unsigned char)h[i];
+  snprintf(h + 148, 8, "%06o", sum);
+  h[155] = ' ';
+
+  put_bytes(a, h, TAR_BLOCK);
+}
+
+//
+// zip (stored entries, ZIP64 when sizes or offsets need it)
+//
+
+static void dos_time(time_t mtime, uint16_t *time, uint16_t *date) {
+  struct tm tm;
+
+  localtime_r(&mtime, &tm);
+  if (tm.tm_year < 80) {
+    *time = 0;
+    *date = (1 << 5) | 1;      // 1980-01-01
+    return;
+  }
+  *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+  *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+// remember the entry for the central directory
+// return 0 if success, else -1
+static int add_zip_entry(dir_archive_t *a, const char *path, zip_entry_t *e) {
+  size_t length = strlen(path);
+
+  if (a->entries_count == a->entries_cap) {
+    size_t cap = a->entries_cap ? a->entries_cap * 2 : 256;
+    zip_entry_t *entries = (zip_entry_t *)realloc(a->entries, cap * sizeof(zip_entry_t));
+
+    if (!entries)
+      return -1;
+    a->entries = entries;
+    a->entries_cap = cap;
+  }
+  if (a->names_len + length > a->names_cap) {
+    size_t cap = (a->names_cap ? a->names_cap * 2 : 16384) + length;
+    char *names = (char *)realloc(a->names, cap);
+
+    if (!names)
+      return -1;
+    a->names = names;
+    a->names_cap = cap;
+  }
+  memcpy(a->names + a->names_len, path, length);
+  e->name_off = a->names_len;
+  e->name_len = length;
+  a->names_len += length;
+  a->entries[a->entries_count++] = *e;
+  return 0;
+}
+
+static int put_zip_local(dir_archive_t *a, const char *path, uint64_t size, uint32_t crc,
+                         mode_t mode, time_t mtime) {
+  zip_entry_t e;
+  int zip64 = (size >= ZIP_MAX32);
+
+  e.crc = crc;
+  e.size = size;
+  e.offset = a->offset;
+  e.mode = mode;
+  dos_time(mtime, &e.time, &e.date);
+  if (add_zip_entry(a, path, &e) < 0)
+    return -1;
+
+  put_le32(a, ZIP_LOCAL_SIG);
+  put_le16(a, zip64 ? ZIP64_VERSION : ZIP_VERSION);
+  put_le16(a, ZIP_UTF8);
+  put_le16(a, 0);                         // stored
+  put_le16(a, e.time);
+  put_le16(a, e.date);
+  put_le32(a, crc);
+  put_le32(a, zip64 ? ZIP_MAX32 : size);  // compressed size
+  put_le32(a, zip64 ? ZIP_MAX32 : size);
+  put_le16(a, e.name_len);
+  put_le16(a, zip64 ? 20 : 0);
+  put_bytes(a, path, e.name_len);
+  if (zip64) {
+    put_le16(a, 0x0001);
+    put_le16(a, 16);
+    put_le64(a, size);
+    put_le64(a, size);
+  }
+  return 0;
+}
+
+static void put_zip_central(dir_archive_t *a, zip_entry_t *e) {
+  int big_size = (e->size >= ZIP_MAX32);
+  int big_offset = (e->offset >= ZIP_MAX32);
+  int extra = (big_size ? 16 : 0) + (big_offset ? 8 : 0);
+
+  put_le32(a, ZIP_CENTRAL_SIG);
+  put_le16(a, ZIP_MADE_BY_UNIX | ZIP64_VERSION);
+  put_le16(a, extra ? ZIP64_VERSION : ZIP_VERSION);
+  put_le16(a, ZIP_UTF8);
+  put_le16(a, 0);
+  put_le16(a, e->time);
+  put_le16(a, e->date);
+  put_le32(a, e->crc);
+  put_le32(a, big_size ? ZIP_MAX32 : e->size);
+  put_le32(a, big_size ? ZIP_MAX32 : e->size);
+  put_le16(a, e->name_len);
+  put_le16(a, extra ? extra + 4 : 0);
+  put_le16(a, 0);                         // comment
+  put_le16(a, 0);                         // disk
+  put_le16(a, 0);                         // internal attributes
+  // unix mode (and MS-DOS directory bit)
+  put_le32(a, (e->mode << 16) | (S_ISDIR(e->mode) ? 0x10 : 0));
+  put_le32(a, big_offset ? ZIP_MAX32 : e->offset);
+  put_bytes(a, a->names + e->name_off, e->name_len);
+  if (extra) {
+    put_le16(a, 0x0001);
+    put_le16(a, extra);
+    if (big_size) {
+      put_le64(a, e->size);
+      put_le64(a, e->size);
+    }
+    if (big_offset)
+      put_le64(a, e->offset);
+  }
+}
+
+static void put_zip_end(dir_archive_t *a) {
+  uint64_t central_size = a->offset - a->central_offset;
+  uint64_t zip64_end = a->offset;
+  int zip64 = (a->entries_count >= ZIP_MAX16 || a->central_offset >= ZIP_MAX32 ||
+               central_size >= ZIP_MAX32);
+
+  if (zip64) {
+    put_le32(a, ZIP64_END_SIG);
+    put_le64(a, 44);
+    put_le16(a, ZIP_MADE_BY_UNIX | ZIP64_VERSION);
+    put_le16(a, ZIP64_VERSION);
+    put_le32(a, 0);
+    put_le32(a, 0);
+    put_le64(a, a->entries_count);
+    put_le64(a, a->entries_count);
+    put_le64(a, central_size);
+    put_le64(a, a->central_offset);
+
+    put_le32(a, ZIP64_LOCATOR_SIG);
+    put_le32(a, 0);
+    put_le64(a, zip64_end);
+    put_le32(a, 1);
+  }
+
+  put_le32(a, ZIP_END_SIG);
+  put_le16(a, 0);
+  put_le16(a, 0);
+  put_le16(a, zip64 ? ZIP_MAX16 : a->entries_count);
+  put_le16(a, zip64 ? ZIP_MAX16 : a->entries_count);
+  put_le32(a, zip64 ? ZIP_MAX32 : central_size);
+  put_le32(a, zip64 ? ZIP_MAX32 : a->central_offset);
+  put_le16(a, 0);
+}
+
+//
+// The walk
+//
+
+// the next entry of the deepest directory (except ".", ".." and files of the server)
+// return its name or NULL at the end of the directory
+static char *next_dirent(dir_archive_t *a, archive_dir_t *d) {
+  struct linux_dirent64 *e;
+  long n;
+
+  while (1) {
+    if (d->dents_pos >= d->dents_len) {
+      n = syscall(SYS_getdents64, d->fd, d->dents, ARCHIVE_DENTS_SIZE);
+      if (n <= 0) {
+        if (n < 0)
+          PRINT("[archive]ERROR: getdents64 %s (errno=%d)\n", a->path, errno);
+        return NULL;
+      }
+      d->dents_len = n;
+      d->dents_pos = 0;
+    }
+    e = (struct linux_dirent64 *)(d->dents + d->dents_pos);
+    d->dents_pos += e->d_reclen;
+
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+      continue;
+    // temporary files of uploads, digests (see put_request.c, digest.c)
+    if (!strncmp(e->d_name, SERVER_FILES_PREFIX, strlen(SERVER_FILES_PREFIX)))
+      continue;
+    return e->d_name;
+  }
+}
+
+// the directory @fd, whose path is a->path, is read next
+static int push_dir(dir_archive_t *a, int fd) {
+  archive_dir_t *d = &a->dirs[a->depth];
+  size_t length = strlen(a->path);
+
+  if (!d->dents)
+    d->dents = (char *)malloc(ARCHIVE_DENTS_SIZE);
+  if (!d->dents) {
+    close(fd);
+    return -1;
+  }
+  d->fd = fd;
+  d->dents_len = d->dents_pos = 0;
+  a->path[length] = '/';
+  a->path[length + 1] = '\0';
+  d->path_len = length + 1;
+  a->depth++;
+  return 0;
+}
+
+//
+// add the next entry of the walk to the batch
+// return 1 if a file was opened, 0 if it wasn't, -1 at the end of the walk
+//
+static int walk_next(dir_archive_t *a) {
+  archive_dir_t *d;
+  struct stat st;
+  char *name;
+  uint32_t crc;
+  int fd;
+
+  if (a->depth == 0)
+    return -1;
+  d = &a->dirs[a->depth - 1];
+  a->path[d->path_len] = '\0';
+  name = next_dirent(a, d);
+  if (!name) {
+    close(d->fd);
+    d->fd = -1;
+    a->depth--;
+    return 0;
+  }
+  if (d->path_len + strlen(name) + 1 > ARCHIVE_PATH_MAX) {
+    PRINT("[archive]%s%s is skipped (the path is too long)\n", a->path, name);
+    return 0;
+  }
+  strcpy(a->path + d->path_len, name);
+
+  // (links aren't followed: nothing outside of the directory gets into the archive)
+  if (fstatat(d->fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+    return 0;
+
+  if (S_ISDIR(st.st_mode)) {
+    if (a->depth == ARCHIVE_DEPTH_MAX) {
+      PRINT("[archive]%s is skipped (too deep)\n", a->path);
+      return 0;
+    }
+    fd = openat(d->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0)
+      return 0;
+    // (names of directories end with '/')
+    strcat(a->path, "/");
+    if (a->format == ARCHIVE_TAR) {
+      put_tar_header(a, a->path, '5', 0, st.st_mode, st.st_mtime);
+    } else if (put_zip_local(a, a->path, 0, 0, st.st_mode, st.st_mtime) < 0) {
+      close(fd);
+      return -1;
+    }
+    a->path[strlen(a->path) - 1] = '\0';
+    if (push_dir(a, fd) < 0)
+      return -1;
+    return 0;
+  }
+
+  if (!S_ISREG(st.st_mode))
+    return 0;
+  fd = openat(d->fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+  if (fd < 0)
+    return 0;
+  // (the size of the member is the size at this moment)
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return 0;
+  }
+
+  if (a->format == ARCHIVE_TAR) {
+    put_tar_header(a, a->path, '0', st.st_size, st.st_mode, st.st_mtime);
+    if (st.st_size > 0)
+      put_file(a, fd, st.st_size);
+    else
+      close(fd);
+    put_bytes(a, zero_block, (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK);
+  } else {
+    if (file_crc32(fd, st.st_size, &crc) < 0) {
+      PRINT("[archive]ERROR: cannot read %s (errno=%d)\n", a->path, errno);
+      close(fd);
+      return 0;
+    }
+    if (put_zip_local(a, a->path, st.st_size, crc, st.st_mode, st.st_mtime) < 0) {
+      close(fd);
+      return -1;
+    }
+    if (st.st_size > 0)
+      put_file(a, fd, st.st_size);
+    else
+      close(fd);
+  }
+  return 1;
+}
+
+// files of the sent batch are closed
+static void close_batch_files(dir_archive_t *a) {
+  int i;
+
+  for (i = 0; i < a->segs_count; i++) {
+    if (!a->segs[i].data)
+      close(a->segs[i].fd);
+  }
+  a->segs_count = 0;
+}
+
+//
+// (in a worker thread) prepare the next batch (one chunk)
+//
+static void fill_archive_batch(dir_archive_t *a) {
+  char size_line[CHUNKED_HEADER_MAX + 1];
+  archive_segment_t *s;
+  uint64_t body_len = 0;
+  int files = 0;
+  int res, length, i;
+
+  close_batch_files(a);
+  a->seg = 0;
+  a->seg_pos = 0;
+
+  // segment 0 is the size line of the chunk (it is written at the end)
+  a->buf_len = CHUNKED_HEADER_MAX;
+  a->segs[0].data = a->buf;
+  a->segs[0].length = 0;
+  a->segs_count = 1;
+
+  while (a->state != ARCHIVE_DONE && files < ARCHIVE_MEMBERS_BATCH &&
+         a->buf_len + ARCHIVE_HEADER_MAX <= ARCHIVE_BUFFER_SIZE) {
+    switch (a->state) {
+      case ARCHIVE_WALK :
+        res = walk_next(a);
+        if (res > 0)
+          files++;
+        if (res < 0) {
+          a->central_offset = a->offset;
+          a->state = (a->format == ARCHIVE_ZIP) ? ARCHIVE_CENTRAL : ARCHIVE_END;
+        }
+        break;
+
+      case ARCHIVE_CENTRAL :
+        if (a->next_entry == a->entries_count)
+          a->state = ARCHIVE_END;
+        else
+          put_zip_central(a, &a->entries[a->next_entry++]);
+        break;
+
+      case ARCHIVE_END :
+        if (a->format == ARCHIVE_TAR) {
+          put_bytes(a, zero_block, TAR_BLOCK);
+          put_bytes(a, zero_block, TAR_BLOCK);
+        } else {
+          put_zip_end(a);
+        }
+        a->state = ARCHIVE_DONE;
+        break;
+    }
+  }
+
+  for (i = 1; i < a->segs_count; i++)
+    body_len += a->segs[i].length;
+  if (body_len > 0) {
+    // "<size in hex>\r\n" right before the first byte of the body, "\r\n" after it
+    length = snprintf(size_line, sizeof(size_line), "%llx\r\n", (unsigned long long)body_len);
+    memcpy(a->buf + CHUNKED_HEADER_MAX - length, size_line, length);
+    a->segs[0].data = a->buf + CHUNKED_HEADER_MAX - length;
+    a->segs[0].length = length;
+    s = &a->segs[a->segs_count++];
+    s->data = "\r\n";
+    s->length = 2;
+  } else {
+    a->segs_count = 0;
+  }
+  if (a->state == ARCHIVE_DONE) {
+    s = &a->segs[a->segs_count++];
+    s->data = CHUNKED_LAST;
+    s->length = CHUNKED_LAST_LENGTH;
+  }
+}
+
+int archive_format(const char *query) {
+  const char *p = query;
+
+  while (p && *p) {
+    if (!strncmp(p, "archive=", strlen("archive="))) {
+      p += strlen("archive=");
+      if (!strncmp(p, "tar", 3) && (p[3] == '\0' || p[3] == '&'))
+        return ARCHIVE_TAR;
+      if (!strncmp(p, "zip", 3) && (p[3] == '\0' || p[3] == '&'))
+        return ARCHIVE_ZIP;
+      return 0;
+    }
+    p = strchr(p, '&');
+    if (p)
+      p++;
+  }
+  return 0;
+}
+
+void free_dir_archive(dir_archive_t *a) {
+  int i;
+
+  if (!a)
+    return;
+  close_batch_files(a);
+  for (i = 0; i < ARCHIVE_DEPTH_MAX; i++) {
+    if (i < a->depth)
+      close(a->dirs[i].fd);
+    free(a->dirs[i].dents);
+  }
+  free(a->entries);
+  free(a->names);
+  free(a->buf);
+  free(a->root_name);
+  free(a);
+}
+
+int start_dir_archive(Node_t *node, int dir_fd, const char *dir_name, int format) {
+  dir_archive_t *a;
+  const char *name;
+  size_t length;
+
+  a = (dir_archive_t *)calloc(1, sizeof(dir_archive_t));
+  if (!a) {
+    close(dir_fd);
+    return -1;
+  }
+  a->format = format;
+  a->state = ARCHIVE_WALK;
+
+  // members are in the directory of its name ("files" for WWWROOT)
+  length = strlen(dir_name);
+  while (length > 0 && dir_name[length - 1] == '/')
+    length--;
+  for (name = dir_name + length; name > dir_name && name[-1] != '/'; name--)
+    ;
+  if (name == dir_name + length || !strncmp(name, ".", dir_name + length - name))
+    a->root_name = strdup("files");
+  else
+    a->root_name = strndup(name, dir_name + length - name);
+  a->buf = (char *)malloc(ARCHIVE_BUFFER_SIZE);
+  if (!a->root_name || !a->buf || strlen(a->root_name) >= ARCHIVE_PATH_MAX / 2) {
+    close(dir_fd);
+    free_dir_archive(a);
+    return -1;
+  }
+  strcpy(a->path, a->root_name);
+  if (push_dir(a, dir_fd) < 0) {
+    free_dir_archive(a);
+    return -1;
+  }
+  node->data.archive = a;
+  return 0;
+}
+
+char *get_archive_content_type(dir_archive_t *a) {
+  return (a->format == ARCHIVE_ZIP) ? "application/zip" : "application/x-tar";
+}
+
+void format_archive_headers(dir_archive_t *a, char *out, size_t size) {
+  char *p;
+
+  snprintf(out, size, "\r\nContent-Disposition: attachment; filename=\"%s.%s\"",
+           a->root_name, (a->format == ARCHIVE_ZIP) ? "zip" : "tar");
+  // (a name can't break the quoted string or the header)
+  for (p = out + strlen("\r\nContent-Disposition: attachment; filename=\""); p[1]; p++) {
+    if (*p == '"' || *p == '\\' || (unsigned char)*p < ' ')
+      *p = '_';
+  }
+}
+
+// see server_work.c
+extern void submit_connection_job(Node_t *node, io_job_t *job);
+extern Node_t *finish_connection_job(io_job_t *job);
+
+// (in a worker thread)
+static void fill_archive_job(io_job_t *job) {
+  fill_archive_batch((dir_archive_t *)job);
+}
+
+// (in the event loop) the batch is sent by the next call of send_archive()
+static void fill_archive_completed(io_job_t *job) {
+  if (!finish_connection_job(job)) {
+    // the connection was closed
+    free_dir_archive((dir_archive_t *)job);
+  }
+}
+
+int send_archive(Node_t *node, int sfd) {
+  dir_archive_t *a = node->data.archive;
+  archive_segment_t *s;
+  ssize_t bytes_sent;
+  size_t count;
+
+  while (node->data.send_quota > 0) {
+    if (a->seg == a->segs_count) {
+      if (a->state == ARCHIVE_DONE)
+        goto done;
+      a->job.work = fill_archive_job;
+      a->job.complete = fill_archive_completed;
+      submit_connection_job(node, &a->job);
+      if (node->data.io_job)
+        return -1;
+      continue;
+    }
+
+    // (at most the quota of the send scheduler, see send_sched.c)
+    s = &a->segs[a->seg];
+    count = s->length - a->seg_pos;
+    if (count > node->data.send_quota)
+      count = node->data.send_quota;
+    if (s->data)
+      bytes_sent = tls_send(sfd, s->data + a->seg_pos, count);
+    else
+      bytes_sent = tls_sendfile(sfd, s->fd, count);
+    if (bytes_sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        node->data.send_blocked = TRUE;
+        return -1;
+      }
+      PRINT("[send_archive]ERROR: cannot send an archive to sfd=%d (errno=%d)\n", sfd, errno);
+      goto done;
+    }
+    if (bytes_sent == 0) {
+      // the file was truncated: its member can't be finished (the archive is broken off)
+      PRINT("[send_archive]ERROR: a file was truncated while it was archived (sfd=%d)\n", sfd);
+      goto done;
+    }
+
+    a->seg_pos += bytes_sent;
+    node->data.send_quota -= bytes_sent;
+    if (a->seg_pos == s->length) {
+      a->seg++;
+      a->seg_pos = 0;
+    }
+    if ((size_t)bytes_sent < count) {
+      node->data.send_blocked = TRUE;
+      return -1;
+    }
+  }
+
+  if (a->seg == a->segs_count && a->state == ARCHIVE_DONE)
+    goto done;
+  return -1;
+
+done:
+  free_dir_archive(a);
+  node->data.archive = NULL;
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include "setup.h"
+#include "ext_epoll_data.h"
+#include "io_pool.h"
+
+//
+// Archives of directories (GET /dir?archive=tar|zip)
+//
+// The directory is walked (with its subdirectories) by io workers while the
+// archive is sent, nothing is staged on disk. Headers of members are made in
+// memory and data of files is sent by sendfile() from the files themselves,
+// zip entries are stored (not compressed). A batch of members (up to
+// ARCHIVE_MEMBERS_BATCH opened files) is one chunk of the response.
+//
+// Entries of a tar archive need nothing but stat(): tar is a copy of the
+// directory at the speed of the disk. A zip entry needs CRC-32 of its file,
+// which a worker computes over a mapping of the file before the entry is sent
+// (so the file is read twice, the second time from the page cache).
+// Long paths are pax headers of tar, big files are ZIP64 entries. Symbolic
+// links and special files aren't archived.
+//
+
+#define ARCHIVE_TAR             1
+#define ARCHIVE_ZIP             2
+
+#define ARCHIVE_DEPTH_MAX       64              // nested directories
+#define ARCHIVE_PATH_MAX        4096            // path of a member
+#define ARCHIVE_DENTS_SIZE      (32 * 1024)     // getdents64() batch of a directory
+#define ARCHIVE_BUFFER_SIZE     (64 * 1024)     // headers of a batch
+#define ARCHIVE_MEMBERS_BATCH   64              // files of a batch
+
+struct dir_archive;
+
+// ARCHIVE_TAR or ARCHIVE_ZIP if @query (without '?') has archive=tar|zip, else 0
+int archive_format(const char *query);
+
+// @dir_fd of directory @dir_name (relative to WWWROOT) will be sent as an archive of @format
+// by send_archive() (this function owns @dir_fd)
+// return 0 if success, else -1
+int start_dir_archive(Node_t *node, int dir_fd, const char *dir_name, int format);
+
+// Content-Type and Content-Disposition of the archive of @node ("\r\nName: value")
+char *get_archive_content_type(struct dir_archive *a);
+void format_archive_headers(struct dir_archive *a, char *out, size_t size);
+
+// send the next part of the archive of @node
+// return -1 if the archive isn't sent fully yet, 0 if it was sent (or the connection is broken)
+int send_archive(Node_t *node, int sfd);
+
+void free_dir_archive(struct dir_archive *a);
+
+#endif // _ARCHIVE_H_
@@ -0,0 +1,176 @@
+#include "chunked.h"
+#include <limits.h>
+
+// states of the decoder
+#define CHUNK_SIZE_START  0   // the first digit of a chunk size
+#define CHUNK_SIZE        1
+#define CHUNK_EXTENSION   2   // ";name=value" after the size (ignored)
+#define CHUNK_SIZE_LF     3
+#define CHUNK_DATA        4
+#define CHUNK_DATA_CR     5
+#define CHUNK_DATA_LF     6
+#define CHUNK_TRAILER     7   // the beginning of a trailer line (or of the final CRLF)
+#define CHUNK_TRAILER_LINE 8  // trailer fields are ignored
+#define CHUNK_LAST_LF     9
+#define CHUNK_DONE        10
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// see chunked.h
+char *chunked_wrap(char *data, size_t length, size_t *chunk_length) {
+  static const char digits[] = "0123456789abcdef";
+  char *start = data;
+  size_t size = length;
+
+  // the size line is written backwards
+  *--start = '\n';
+  *--start = '\r';
+  do {
+    *--start = digits[size & 0xf];
+    size >>= 4;
+  } while (size > 0);
+
+  data[length] = '\r';
+  data[length + 1] = '\n';
+  *chunk_length = (data - start) + length + CHUNKED_TRAILER_MAX;
+  return start;
+}
+
+void chunked_decoder_init(chunked_decoder_t *d) {
+  d->state = CHUNK_SIZE_START;
+  d->size = 0;
+}
+
+int chunked_done(chunked_decoder_t *d) {
+  return d->state == CHUNK_DONE;
+}
+
+// the size line is read
+static void end_of_size(chunked_decoder_t *d) {
+  d->state = (d->size > 0) ? CHUNK_DATA : CHUNK_TRAILER;
+}
+
+// see chunked.h
+ssize_t chunked_decode(chunked_decoder_t *d, const char *in, size_t length, char *out, size_t *out_length) {
+  size_t i = 0;
+  size_t o = 0;
+  int v;
+
+  while (i < length && d->state != CHUNK_DONE) {
+    char c = in[i];
+
+    switch (d->state) {
+      case CHUNK_SIZE_START :
+        if ((v = hex_digit(c)) < 0)
+          goto error;
+        d->size = v;
+        d->state = CHUNK_SIZE;
+        i++;
+        break;
+
+      case CHUNK_SIZE :
+        if ((v = hex_digit(c)) >= 0) {
+          if (d->size > (ULLONG_MAX >> 4))
+            goto error;
+          d->size = (d->size << 4) | v;
+        } else if (c == ';' || c == ' ' || c == '\t') {
+          d->state = CHUNK_EXTENSION;
+        } else if (c == '\r') {
+          d->state = CHUNK_SIZE_LF;
+        } else if (c == '\n') {
+          end_of_size(d);
+        } else {
+          goto error;
+        }
+        i++;
+        break;
+
+      case CHUNK_EXTENSION :
+        if (c == '\r')
+          d->state = CHUNK_SIZE_LF;
+        else if (c == '\n')
+          end_of_size(d);
+        i++;
+        break;
+
+      case CHUNK_SIZE_LF :
+        if (c != '\n')
+          goto error;
+        end_of_size(d);
+        i++;
+        break;
+
+      case CHUNK_DATA : {
+        size_t n = length - i;
+
+        if (n > d->size)
+          n = (size_t)d->size;
+        memmove(out + o, in + i, n);
+        o += n;
+        i += n;
+        d->size -= n;
+        if (d->size == 0)
+          d->state = CHUNK_DATA_CR;
+        break;
+      }
+
+      case CHUNK_DATA_CR :
+        if (c == '\r')
+          d->state = CHUNK_DATA_LF;
+        else if (c == '\n')
+          d->state = CHUNK_SIZE_START;
+        else
+          goto error;
+        i++;
+        break;
+
+      case CHUNK_DATA_LF :
+        if (c != '\n')
+          goto error;
+        d->state = CHUNK_SIZE_START;
+        i++;
+        break;
+
+      case CHUNK_TRAILER :
+        if (c == '\r')
+          d->state = CHUNK_LAST_LF;
+        else if (c == '\n')
+          d->state = CHUNK_DONE;
+        else
+          d->state = CHUNK_TRAILER_LINE;
+        i++;
+        break;
+
+      case CHUNK_TRAILER_LINE :
+        if (c == '\n')
+          d->state = CHUNK_TRAILER;
+        i++;
+        break;
+
+      case CHUNK_LAST_LF :
+        if (c != '\n')
+          goto error;
+        d->state = CHUNK_DONE;
+        i++;
+        break;
+    }
+  }
+
+  *out_length = o;
+  return i;
+
+error:
+#ifdef DEBUG
+  PRINT("[chunked_decode]ERROR: broken chunked coding (state=%d)\n", d->state);
+#endif
+  *out_length = o;
+  return -1;
+}
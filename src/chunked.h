@@ -0,0 +1,42 @@
+#ifndef _CHUNKED_H_
+#define _CHUNKED_H_
+
+#include "setup.h"
+
+//
+// Chunked transfer coding (RFC 7230, 4.1)
+//
+// The encoder frames a body which is produced by parts (a listing, compressed data)
+// in place, so a producer writes its data once and the whole body is never kept in memory.
+// The decoder is fed with request bytes as they arrive.
+//
+
+#define CHUNKED_HEADER_MAX   18           // "<size in hex>\r\n" (64-bit size)
+#define CHUNKED_TRAILER_MAX  2            // "\r\n" after the data of a chunk
+#define CHUNKED_LAST         "0\r\n\r\n"  // the last (empty) chunk
+#define CHUNKED_LAST_LENGTH  5
+
+// frame @length bytes at @data as one chunk:
+// the size line is written right before @data (CHUNKED_HEADER_MAX bytes must be reserved there)
+// and CRLF after it (CHUNKED_TRAILER_MAX bytes)
+// return the beginning of the chunk, its length is saved in @chunk_length
+char *chunked_wrap(char *data, size_t length, size_t *chunk_length);
+
+typedef struct chunked_decoder {
+  int state;
+  unsigned long long size;    // remaining bytes of the current chunk
+} chunked_decoder_t;
+
+void chunked_decoder_init(chunked_decoder_t *d);
+
+// decode @length bytes of @in into @out
+// (@out may be equal to @in: decoded data is never longer than encoded one)
+// @out_length -- number of decoded bytes
+// return number of bytes of @in which belong to the body
+//        (it is less than @length if the body ended), or -1 if the coding is broken
+ssize_t chunked_decode(chunked_decoder_t *d, const char *in, size_t length, char *out, size_t *out_length);
+
+// return TRUE if the last chunk and trailer fields are decoded
+int chunked_done(chunked_decoder_t *d);
+
+#endif // _CHUNKED_H_
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include "dedup.h"
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+
+//
+// Content-addressed store of uploads (see dedup.h)
+//
+
+#define REFS_XATTR          "user.sss.refs"
+#define REFS_SIDECAR_SUFFIX ".refs"
+#define REFS_RECORD_MAX     32
+#define DEDUP_TMP_PREFIX    SERVER_FILES_PREFIX "dedup."
+#define OBJECT_NAME_MAX     (3 + 2 * SHA256_LENGTH + 1)     // "ab/<64 hex>"
+
+static int store_fd = -1;
+static int reflink_unsupported;     // FICLONE has failed, hard links are used
+
+int dedup_init() {
+  if (mkdirat(srv_settings.wwwroot_fd, DEDUP_STORE_DIR, 0755) < 0 && errno != EEXIST) {
+    PRINT("[dedup_init]ERROR: cannot create %s/%s (errno=%d)\n", WWWROOT, DEDUP_STORE_DIR, errno);
+    return -1;
+  }
+  store_fd = openat(srv_settings.wwwroot_fd, DEDUP_STORE_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (store_fd < 0) {
+    PRINT("[dedup_init]ERROR: cannot open %s/%s (errno=%d)\n", WWWROOT, DEDUP_STORE_DIR, errno);
+    return -1;
+  }
+  return 0;
+}
+
+// "ab/<64 hex>" of @digest into @object (OBJECT_NAME_MAX bytes)
+static void object_name(file_digest_t *digest, char *object) {
+  char hex[2 * SHA256_LENGTH + 1];
+
+  to_hex(digest->sha256, SHA256_LENGTH, hex);
+  snprintf(object, OBJECT_NAME_MAX, "%.2s/%s", hex, hex);
+}
+
+//
+// add @delta to the references of object @obj_fd (@object in the store)
+// (the object is removed with its last reference)
+// return the new number of references or -1
+//
+static long adjust_refs(int obj_fd, const char *object, long delta) {
+  char record[REFS_RECORD_MAX];
+  char sidecar[OBJECT_NAME_MAX + sizeof(REFS_SIDECAR_SUFFIX)];
+  int sidecar_fd = -1;
+  long refs;
+  ssize_t len;
+
+  // (workers of other processes change it too)
+  if (flock(obj_fd, LOCK_EX) < 0)
+    return -1;
+
+  snprintf(sidecar, sizeof(sidecar), "%s" REFS_SIDECAR_SUFFIX, object);
+  len = fgetxattr(obj_fd, REFS_XATTR, record, sizeof(record) - 1);
+  if (len < 0 && errno == ENOTSUP) {
+    // the file system has no user xattrs
+    sidecar_fd = openat(store_fd, sidecar, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (sidecar_fd < 0) {
+      refs = -1;
+      goto out;
+    }
+    len = pread(sidecar_fd, record, sizeof(record) - 1, 0);
+  }
+  record[len > 0 ? len : 0] = '\0';
+  refs = strtol(record, NULL, 10) + delta;
+  if (refs < 0)
+    refs = 0;
+
+  if (refs == 0) {
+    unlinkat(store_fd, object, 0);
+    if (sidecar_fd >= 0)
+      unlinkat(store_fd, sidecar, 0);
+#ifdef DEBUG
+    PRINT("[adjust_refs]DEBUG: %s is removed\n", object);
+#endif
+    goto out;
+  }
+
+  len = snprintf(record, sizeof(record), "%ld", refs);
+  if (sidecar_fd >= 0) {
+    if (pwrite(sidecar_fd, record, len, 0) != len || ftruncate(sidecar_fd, len) < 0)
+      PRINT("[adjust_refs]ERROR: cannot write %s (errno=%d)\n", sidecar, errno);
+  } else if (fsetxattr(obj_fd, REFS_XATTR, record, len, 0) < 0) {
+    PRINT("[adjust_refs]ERROR: fsetxattr %s (errno=%d)\n", object, errno);
+  }
+
+out:
+  if (sidecar_fd >= 0)
+    close(sidecar_fd);
+  flock(obj_fd, LOCK_UN);
+  return refs;
+}
+
+//
+// a reflink of @src_fd, which is called @name in directory @dir_fd (it mustn't exist)
+// return its descriptor or -1 (then a hard link may be made)
+//
+static int clone_file(int src_fd, int dir_fd, const char *name, mode_t mode) {
+  int fd;
+
+  if (__atomic_load_n(&reflink_unsupported, __ATOMIC_RELAXED))
+    return -1;
+  fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode & 07777);
+  if (fd < 0)
+    return -1;
+  if (ioctl(fd, FICLONE, src_fd) == 0)
+    return fd;
+
+  if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL) {
+    PRINT("[clone_file]the file system can't clone files (errno=%d), the store uses hard links\n", errno);
+    __atomic_store_n(&reflink_unsupported, TRUE, __ATOMIC_RELAXED);
+  }
+  close(fd);
+  unlinkat(dir_fd, name, 0);
+  return -1;
+}
+
+// the object of file @fd (@name in directory @dir_fd, @st is fstat() of @fd) into @object
+// return its descriptor or -1 (the file has no valid digests or the store hasn't its content)
+static int find_object(int fd, int dir_fd, const char *name, struct stat *st, char *object) {
+  file_digest_t digest;
+
+  if (store_fd < 0 || !S_ISREG(st->st_mode) || st->st_size == 0 ||
+      load_file_digest_at(fd, dir_fd, name, st, &digest) < 0)
+    return -1;
+  object_name(&digest, object);
+  return openat(store_fd, object, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+int dedup_refers(int dir_fd, const char *name, int fd) {
+  char object[OBJECT_NAME_MAX];
+  struct stat st;
+  int obj_fd;
+
+  if (fstat(fd, &st) < 0)
+    return FALSE;
+  obj_fd = find_object(fd, dir_fd, name, &st, object);
+  if (obj_fd < 0)
+    return FALSE;
+  close(obj_fd);
+  return TRUE;
+}
+
+int dedup_link(int dir_fd, const char *name, long long size, file_digest_t *digest) {
+  char object[OBJECT_NAME_MAX];
+  char tmp[FILENAME_MAX];
+  struct stat st;
+  int obj_fd, fd;
+
+  if (store_fd < 0 || size == 0)
+    return 0;
+  object_name(digest, object);
+  obj_fd = openat(store_fd, object, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (obj_fd < 0)
+    return 0;
+  if (fstat(obj_fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != size)
+    goto not_shared;
+
+  // the copy is made near the file, then it replaces the file
+  snprintf(tmp, sizeof(tmp), DEDUP_TMP_PREFIX "%s", name);
+  unlinkat(dir_fd, tmp, 0);
+  fd = clone_file(obj_fd, dir_fd, tmp, st.st_mode);
+  if (fd < 0) {
+    if (linkat(store_fd, object, dir_fd, tmp, 0) < 0)
+      goto not_shared;
+    fd = dup(obj_fd);
+  }
+  if (fd < 0 || renameat(dir_fd, tmp, dir_fd, name) < 0) {
+    PRINT("[dedup_link]ERROR: cannot replace %s (errno=%d)\n", name, errno);
+    if (fd >= 0)
+      close(fd);
+    unlinkat(dir_fd, tmp, 0);
+    goto not_shared;
+  }
+
+  adjust_refs(obj_fd, object, 1);
+  save_file_digest(digest, fd, dir_fd, name);
+#ifdef DEBUG
+  PRINT("[dedup_link]DEBUG: %s is %s\n", name, object);
+#endif
+  close(fd);
+  close(obj_fd);
+  return 1;
+
+not_shared:
+  close(obj_fd);
+  return 0;
+}
+
+void dedup_store(int dir_fd, const char *name, int fd, file_digest_t *digest) {
+  char object[OBJECT_NAME_MAX];
+  char tmp[OBJECT_NAME_MAX + 24];
+  struct stat st;
+  int obj_fd;
+
+  if (store_fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+    return;
+  object_name(digest, object);
+  object[2] = '\0';
+  if (mkdirat(store_fd, object, 0755) < 0 && errno != EEXIST) {
+    PRINT("[dedup_store]ERROR: cannot create %s/%s (errno=%d)\n", DEDUP_STORE_DIR, object, errno);
+    return;
+  }
+  object[2] = '/';
+
+  // a clone (a later change of the file doesn't change the object), else a hard link
+  // (if another upload has stored the same content meanwhile, this file stays as it is)
+  snprintf(tmp, sizeof(tmp), "%s.%ld", object, (long)syscall(SYS_gettid));
+  obj_fd = clone_file(fd, store_fd, tmp, st.st_mode);
+  if (obj_fd >= 0) {
+    if (linkat(store_fd, tmp, store_fd, object, 0) < 0) {
+      close(obj_fd);
+      obj_fd = -1;
+    }
+    unlinkat(store_fd, tmp, 0);
+  } else if (linkat(dir_fd, name, store_fd, object, 0) == 0) {
+    obj_fd = openat(store_fd, object, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  }
+  if (obj_fd < 0) {
+#ifdef DEBUG
+    PRINT("[dedup_store]DEBUG: %s isn't stored (errno=%d)\n", name, errno);
+#endif
+    return;
+  }
+  adjust_refs(obj_fd, object, 1);
+  close(obj_fd);
+}
+
+// copy @src_fd (@size bytes) into @fd
+// return 0 if success, else -1
+static int copy_file(int src_fd, int fd, off_t size) {
+  ssize_t n;
+
+  while (size > 0) {
+    n = copy_file_range(src_fd, NULL, fd, NULL, size, 0);
+    if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+      n = sendfile(fd, src_fd, NULL, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    size -= n;
+  }
+  return 0;
+}
+
+int dedup_unshare(int dir_fd, const char *name, int fd) {
+  char object[OBJECT_NAME_MAX];
+  char tmp[FILENAME_MAX];
+  struct stat st, obj_st;
+  int obj_fd, src_fd, copy_fd;
+  int res = 0;
+
+  if (fstat(fd, &st) < 0)
+    return 0;
+  obj_fd = find_object(fd, dir_fd, name, &st, object);
+  if (obj_fd < 0)
+    return 0;
+
+  // a hard link of the object: the data is written into a private copy
+  if (st.st_nlink > 1 && fstat(obj_fd, &obj_st) == 0 &&
+      obj_st.st_ino == st.st_ino && obj_st.st_dev == st.st_dev) {
+    snprintf(tmp, sizeof(tmp), DEDUP_TMP_PREFIX "%s", name);
+    unlinkat(dir_fd, tmp, 0);
+    src_fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    copy_fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, st.st_mode & 07777);
+    if (src_fd < 0 || copy_fd < 0 || copy_file(src_fd, copy_fd, st.st_size) < 0 ||
+        renameat(dir_fd, tmp, dir_fd, name) < 0) {
+      PRINT("[dedup_unshare]ERROR: cannot copy %s (errno=%d)\n", name, errno);
+      if (copy_fd >= 0)
+        unlinkat(dir_fd, tmp, 0);
+      res = -1;
+    } else {
+      res = 1;
+    }
+    if (src_fd >= 0)
+      close(src_fd);
+    if (copy_fd >= 0)
+      close(copy_fd);
+    if (res < 0) {
+      close(obj_fd);
+      return -1;
+    }
+  }
+
+  adjust_refs(obj_fd, object, -1);
+  close(obj_fd);
+  return res;
+}
+
+void dedup_release(int dir_fd, const char *name) {
+  char object[OBJECT_NAME_MAX];
+  struct stat st;
+  int fd, obj_fd;
+
+  if (store_fd < 0)
+    return;
+  fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (fstat(fd, &st) == 0) {
+    obj_fd = find_object(fd, dir_fd, name, &st, object);
+    if (obj_fd >= 0) {
+      adjust_refs(obj_fd, object, -1);
+      close(obj_fd);
+    }
+  }
+  close(fd);
+}
@@ -0,0 +1,56 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "setup.h"
+#include "digest.h"
+#include "path_resolution.h"
+
+//
+// Content-addressed store of uploads (DEDUP on in config)
+//
+// A file, which is uploaded by POST, is hashed while it is written (see
+// upload_writer.c). When its body ends, SHA-256 is looked up in the store
+// WWWROOT/DEDUP_STORE_DIR/<2 hex>/<64 hex>: if the content is there, the
+// file becomes a reflink (FICLONE) of it, or a hard link if the file system
+// can't clone, and the written data is dropped without a flush or a sync.
+// Otherwise the file (after its sync) is added to the store in the same way.
+//
+// Each object keeps the number of files which refer to it in extended
+// attribute "user.sss.refs" (or in file "<64 hex>.refs" near it if the file
+// system has no user xattrs), so the counts survive restarts. A file stops
+// referring to its object when it is appended to (a hard link gets a private
+// copy before the first write) or replaced by PUT; the object is removed
+// with its last reference. Files are recognised by their digests (see
+// digest.h), so a file which was changed outside the server keeps its count.
+//
+
+#define DEDUP_STORE_DIR     SERVER_FILES_PREFIX "store"
+
+// (before workers are started) open (or create) the store
+// return 0 if success, else -1
+int dedup_init();
+
+// (in a worker thread)
+// file @name in directory @dir_fd with @size bytes and @digest becomes a copy of the object
+// with the same content (its digests are saved)
+// return 1 if so, 0 if the store hasn't the content (or it can't be shared)
+int dedup_link(int dir_fd, const char *name, long long size, file_digest_t *digest);
+
+// (in a worker thread)
+// add file @fd (@name in directory @dir_fd, it is synced) to the store
+void dedup_store(int dir_fd, const char *name, int fd, file_digest_t *digest);
+
+// TRUE if file @fd (@name in directory @dir_fd) refers to an object of the store
+int dedup_refers(int dir_fd, const char *name, int fd);
+
+// (in a worker thread)
+// file @fd (@name in directory @dir_fd) is going to be changed: it stops referring to its object
+// return 1 if it was a hard link of the object and @name is a private copy now (it has to be
+// opened again), 0 if @fd may be written, -1 if the copy failed
+int dedup_unshare(int dir_fd, const char *name, int fd);
+
+// (in a worker thread)
+// file @name in directory @dir_fd is going to be replaced
+void dedup_release(int dir_fd, const char *name);
+
+#endif // _DEDUP_H_
@@ -0,0 +1,431 @@
+#include "digest.h"
+#include "path_resolution.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <cpuid.h>
+#include <immintrin.h>
+#include <sys/xattr.h>
+
+#define DIGEST_XATTR          "user.sss.digest"
+#define DIGEST_SIDECAR_PREFIX SERVER_FILES_PREFIX "digest."
+#define DIGEST_RECORD_MAX     160
+#define CRC32C_POLY           0x82F63B78    // (reflected)
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define CPU_SSE42    1
+#define CPU_SHA      2
+
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+static int cpu;
+static uint32_t crc32c_table[256];
+
+// (it is called once, by the first worker which computes a digest)
+static void check_cpu() {
+  unsigned int eax, ebx, ecx, edx;
+  uint32_t i, j, c;
+
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    if (ecx & bit_SSE4_2)
+      cpu |= CPU_SSE42;
+    // SHA-NI code uses SSSE3 and SSE4.1 too
+    if ((ecx & bit_SSSE3) && (ecx & bit_SSE4_1) &&
+        __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+      cpu |= CPU_SHA;
+  }
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : (c >> 1);
+    crc32c_table[i] = c;
+  }
+#ifdef DEBUG
+  PRINT("[check_cpu]DEBUG: crc32c %s, sha256 %s\n", (cpu & CPU_SSE42) ? "sse4.2" : "portable",
+        (cpu & CPU_SHA) ? "sha-ni" : "portable");
+#endif
+}
+
+static int cpu_features() {
+  pthread_once(&cpu_once, check_cpu);
+  return cpu;
+}
+
+//
+// CRC32C
+//
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *p, size_t length) {
+  while (length--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t length) {
+  uint64_t c = crc;
+
+  while (length >= 8) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    length -= 8;
+  }
+  while (length--)
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+  return (uint32_t)c;
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length) {
+  crc = ~crc;
+  if (cpu_features() & CPU_SSE42)
+    crc = crc32c_sse42(crc, (const unsigned char *)data, length);
+  else
+    crc = crc32c_portable(crc, (const unsigned char *)data, length);
+  return ~crc;
+}
+
+//
+// SHA-256
+//
+
+#define ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_portable(uint32_t state[8], const unsigned char *p, size_t blocks) {
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  while (blocks--) {
+    for (i = 0; i < 16; i++)
+      w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) |
+             ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+    for (i = 16; i < 64; i++)
+      w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+             w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+      t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    p += 64;
+  }
+}
+
+// 16 groups of 4 rounds, the message schedule is computed by sha256msg1/sha256msg2
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const unsigned char *p, size_t blocks) {
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, msg, tmp;
+  __m128i m[4];
+  int i;
+
+  tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+  state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);             // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+  state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+  while (blocks--) {
+    abef = state0;
+    cdgh = state1;
+
+    for (i = 0; i < 4; i++)
+      m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+
+    for (i = 0; i < 16; i++) {
+      msg = _mm_add_epi32(m[i & 3], _mm_load_si128((const __m128i *)&sha256_k[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      if (i >= 3 && i <= 14) {
+        tmp = _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4);
+        m[(i + 1) & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(m[(i + 1) & 3], tmp), m[i & 3]);
+      }
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+      if (i >= 1 && i <= 12)
+        m[(i - 1) & 3] = _mm_sha256msg1_epu32(m[(i - 1) & 3], m[i & 3]);
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    p += 64;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static void sha256_blocks(uint32_t state[8], const unsigned char *p, size_t blocks) {
+  if (cpu_features() & CPU_SHA)
+    sha256_blocks_shani(state, p, blocks);
+  else
+    sha256_blocks_portable(state, p, blocks);
+}
+
+void sha256_init(sha256_ctx_t *ctx) {
+  static const uint32_t init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(ctx->state, init, sizeof(init));
+  ctx->length = 0;
+  ctx->buf_len = 0;
+}
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t length) {
+  const unsigned char *p = (const unsigned char *)data;
+  size_t n;
+
+  ctx->length += length;
+  if (ctx->buf_len > 0) {
+    n = 64 - ctx->buf_len;
+    if (n > length)
+      n = length;
+    memcpy(ctx->buf + ctx->buf_len, p, n);
+    ctx->buf_len += n;
+    p += n;
+    length -= n;
+    if (ctx->buf_len < 64)
+      return;
+    sha256_blocks(ctx->state, ctx->buf, 1);
+    ctx->buf_len = 0;
+  }
+
+  // whole blocks are hashed in place
+  if (length >= 64) {
+    sha256_blocks(ctx->state, p, length / 64);
+    p += length & ~(size_t)63;
+    length &= 63;
+  }
+  memcpy(ctx->buf, p, length);
+  ctx->buf_len = length;
+}
+
+void sha256_final(sha256_ctx_t *ctx, unsigned char out[SHA256_LENGTH]) {
+  uint64_t bits = ctx->length * 8;
+  int i;
+
+  ctx->buf[ctx->buf_len++] = 0x80;
+  if (ctx->buf_len > 56) {
+    memset(ctx->buf + ctx->buf_len, 0, 64 - ctx->buf_len);
+    sha256_blocks(ctx->state, ctx->buf, 1);
+    ctx->buf_len = 0;
+  }
+  memset(ctx->buf + ctx->buf_len, 0, 56 - ctx->buf_len);
+  for (i = 0; i < 8; i++)
+    ctx->buf[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+  sha256_blocks(ctx->state, ctx->buf, 1);
+
+  for (i = 0; i < 8; i++) {
+    out[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+    out[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+    out[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+    out[4 * i + 3] = (unsigned char)ctx->state[i];
+  }
+}
+
+void content_digest_init(content_digest_t *d) {
+  d->crc32c = 0;
+  sha256_init(&d->sha256);
+}
+
+void content_digest_update(content_digest_t *d, const void *data, size_t length) {
+  d->crc32c = crc32c_update(d->crc32c, data, length);
+  sha256_update(&d->sha256, data, length);
+}
+
+//
+// stored digests
+//
+
+void to_hex(const unsigned char *data, size_t length, char *out) {
+  static const char hex[] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    out[2 * i] = hex[data[i] >> 4];
+    out[2 * i + 1] = hex[data[i] & 0xf];
+  }
+  out[2 * length] = '\0';
+}
+
+static int from_hex(const char *s, unsigned char *out, size_t length) {
+  size_t i;
+  unsigned int byte;
+
+  for (i = 0; i < length; i++) {
+    if (sscanf(s + 2 * i, "%2x", &byte) != 1)
+      return -1;
+    out[i] = (unsigned char)byte;
+  }
+  return 0;
+}
+
+void content_digest_final(content_digest_t *d, file_digest_t *digest) {
+  digest->crc32c = d->crc32c;
+  sha256_final(&d->sha256, digest->sha256);
+}
+
+int store_file_digest(content_digest_t *d, int fd, int dir_fd, const char *name) {
+  file_digest_t digest;
+
+  content_digest_final(d, &digest);
+  return save_file_digest(&digest, fd, dir_fd, name);
+}
+
+int save_file_digest(file_digest_t *digest, int fd, int dir_fd, const char *name) {
+  char record[DIGEST_RECORD_MAX];
+  char sidecar[FILENAME_MAX];
+  char sha_hex[2 * SHA256_LENGTH + 1];
+  struct stat st;
+  int len, sfd;
+
+  if (fstat(fd, &st) < 0)
+    return -1;
+  to_hex(digest->sha256, SHA256_LENGTH, sha_hex);
+  len = snprintf(record, sizeof(record), "%lld %lld.%09ld %08x %s", (long long)st.st_size,
+                 (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, digest->crc32c, sha_hex);
+
+  if (fsetxattr(fd, DIGEST_XATTR, record, len, 0) == 0)
+    return 0;
+  if (errno != ENOTSUP) {
+    PRINT("[save_file_digest]ERROR: fsetxattr %s (errno=%d)\n", name, errno);
+    return -1;
+  }
+
+  // the file system has no user xattrs
+  snprintf(sidecar, sizeof(sidecar), DIGEST_SIDECAR_PREFIX "%s", name);
+  sfd = openat(dir_fd, sidecar, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (sfd < 0 || write(sfd, record, len) != len) {
+    PRINT("[save_file_digest]ERROR: cannot write %s (errno=%d)\n", sidecar, errno);
+    if (sfd >= 0)
+      close(sfd);
+    return -1;
+  }
+  close(sfd);
+  return 0;
+}
+
+// @record (@len bytes, see digest.h) of a file with @st
+// return 0 if it is correct and the file wasn't changed, else -1
+static int parse_digest_record(char *record, ssize_t len, struct stat *st, file_digest_t *digest) {
+  char sha_hex[2 * SHA256_LENGTH + 1];
+  long long size, sec;
+  long nsec;
+
+  if (len <= 0)
+    return -1;
+  record[len] = '\0';
+
+  if (sscanf(record, "%lld %lld.%ld %x %64s", &size, &sec, &nsec, &digest->crc32c, sha_hex) != 5 ||
+      strlen(sha_hex) != 2 * SHA256_LENGTH || from_hex(sha_hex, digest->sha256, SHA256_LENGTH) < 0)
+    return -1;
+
+  // the file was changed after the upload
+  if (size != (long long)st->st_size || sec != (long long)st->st_mtim.tv_sec || nsec != st->st_mtim.tv_nsec)
+    return -1;
+  return 0;
+}
+
+int load_file_digest(int fd, const char *path, struct stat *st, file_digest_t *digest) {
+  char record[DIGEST_RECORD_MAX];
+  char sidecar[REQUEST_PATH_LENGTH + sizeof(DIGEST_SIDECAR_PREFIX)];
+  const char *name;
+  ssize_t len;
+  int sfd;
+
+  len = fgetxattr(fd, DIGEST_XATTR, record, sizeof(record) - 1);
+  if (len < 0 && errno == ENOTSUP) {
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    snprintf(sidecar, sizeof(sidecar), "%.*s" DIGEST_SIDECAR_PREFIX "%s", (int)(name - path), path, name);
+    sfd = open_beneath_root(sidecar, O_RDONLY, 0);
+    if (sfd < 0)
+      return -1;
+    len = read(sfd, record, sizeof(record) - 1);
+    close(sfd);
+  }
+  return parse_digest_record(record, len, st, digest);
+}
+
+int load_file_digest_at(int fd, int dir_fd, const char *name, struct stat *st, file_digest_t *digest) {
+  char record[DIGEST_RECORD_MAX];
+  char sidecar[FILENAME_MAX];
+  ssize_t len;
+  int sfd;
+
+  len = fgetxattr(fd, DIGEST_XATTR, record, sizeof(record) - 1);
+  if (len < 0 && errno == ENOTSUP) {
+    snprintf(sidecar, sizeof(sidecar), DIGEST_SIDECAR_PREFIX "%s", name);
+    sfd = openat(dir_fd, sidecar, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (sfd < 0)
+      return -1;
+    len = read(sfd, record, sizeof(record) - 1);
+    close(sfd);
+  }
+  return parse_digest_record(record, len, st, digest);
+}
+
+void to_base64(const unsigned char *data, size_t length, char *out) {
+  static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t i;
+  uint32_t v;
+
+  for (i = 0; i + 2 < length; i += 3) {
+    v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+    *out++ = b64[v >> 18];
+    *out++ = b64[(v >> 12) & 63];
+    *out++ = b64[(v >> 6) & 63];
+    *out++ = b64[v & 63];
+  }
+  if (i < length) {
+    v = data[i] << 16;
+    if (i + 1 < length)
+      v |= data[i + 1] << 8;
+    *out++ = b64[v >> 18];
+    *out++ = b64[(v >> 12) & 63];
+    *out++ = (i + 1 < length) ? b64[(v >> 6) & 63] : '=';
+    *out++ = '=';
+  }
+  *out = '\0';
+}
+
+void format_digest_headers(file_digest_t *digest, char *buf, size_t max) {
+  char sha_hex[2 * SHA256_LENGTH + 1];
+  char sha_b64[(SHA256_LENGTH + 2) / 3 * 4 + 1];
+  char crc_b64[9];
+  unsigned char crc[4];
+
+  // (CRC32C is in network byte order, RFC 3230 / RFC 4960)
+  crc[0] = (unsigned char)(digest->crc32c >> 24);
+  crc[1] = (unsigned char)(digest->crc32c >> 16);
+  crc[2] = (unsigned char)(digest->crc32c >> 8);
+  crc[3] = (unsigned char)digest->crc32c;
+
+  to_hex(digest->sha256, SHA256_LENGTH, sha_hex);
+  to_base64(digest->sha256, SHA256_LENGTH, sha_b64);
+  to_base64(crc, sizeof(crc), crc_b64);
+  snprintf(buf, max, "\r\nETag: \"%s\"\r\nDigest: sha-256=%s,crc32c=%s", sha_hex, sha_b64, crc_b64);
+}
@@ -0,0 +1,75 @@
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include "setup.h"
+#include <stdint.h>
+
+//
+// Digests of uploaded files
+//
+// CRC32C and SHA-256 of a file are computed while its data is written
+// (see upload_writer.c), so the file is never read again for them.
+// CRC32C uses the crc32 instruction of SSE4.2, SHA-256 uses SHA-NI;
+// without them portable versions are used (the CPU is checked once, at runtime).
+//
+// Digests are kept in extended attribute "user.sss.digest" of the file
+// (or in file ".sss-digest.<name>" near it if the file system has no user xattrs):
+//   "<size> <mtime sec>.<mtime nsec> <crc32c hex> <sha256 hex>"
+// so they aren't used if the file was changed after the upload.
+// GET of the file returns them as ETag and Digest headers.
+//
+
+#define SHA256_LENGTH         32
+#define DIGEST_HEADERS_MAX    256     // see format_digest_headers()
+
+typedef struct sha256_ctx {
+  uint32_t state[8];
+  uint64_t length;            // bytes
+  unsigned char buf[64];
+  size_t buf_len;
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t length);
+void sha256_final(sha256_ctx_t *ctx, unsigned char out[SHA256_LENGTH]);
+
+// @crc -- 0 for the beginning of data (or CRC32C of previous data)
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length);
+
+typedef struct content_digest {
+  uint32_t crc32c;
+  sha256_ctx_t sha256;
+} content_digest_t;
+
+void content_digest_init(content_digest_t *d);
+void content_digest_update(content_digest_t *d, const void *data, size_t length);
+
+typedef struct file_digest {
+  uint32_t crc32c;
+  unsigned char sha256[SHA256_LENGTH];
+} file_digest_t;
+
+// the digests of all data (@d can't be updated after it)
+void content_digest_final(content_digest_t *d, file_digest_t *digest);
+
+// save the digests of file @fd (it is called @name in directory @dir_fd)
+// return 0 if success, else -1
+int store_file_digest(content_digest_t *d, int fd, int dir_fd, const char *name);
+int save_file_digest(file_digest_t *digest, int fd, int dir_fd, const char *name);
+
+// read the digests of file @fd (@path is relative to WWWROOT, @st is fstat() of @fd)
+// return 0 if they are known and the file wasn't changed, else -1
+int load_file_digest(int fd, const char *path, struct stat *st, file_digest_t *digest);
+// ... of file @fd, which is called @name in directory @dir_fd
+int load_file_digest_at(int fd, int dir_fd, const char *name, struct stat *st, file_digest_t *digest);
+
+// lowercase hex of @data with @length into @out (2 * @length + 1 bytes)
+void to_hex(const unsigned char *data, size_t length, char *out);
+
+// base64 of @data with @length into @out ((@length + 2) / 3 * 4 + 1 bytes)
+void to_base64(const unsigned char *data, size_t length, char *out);
+
+// "\r\nETag: ...\r\nDigest: ..." (for send_header() in request_handling.c)
+void format_digest_headers(file_digest_t *digest, char *buf, size_t max);
+
+#endif // _DIGEST_H_
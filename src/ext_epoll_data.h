@@ -11,16 +11,37 @@
 #define REQUEST_NOT_COMPLETED   0
 #define REQUEST_COMPLETED       1
 
+struct dir_listing;
+struct dir_archive;
+struct io_job;
+struct upload;
+struct readahead;
+struct h2_conn;
+struct proxy_fetch;
+
 // NOT UNION ! 
 typedef struct ext_epoll_data {
   //epoll_data_t data;      // usual (union) epoll_data ( need it ?)
   int status;				// completed / not completed
   int sfd;					// socket fd
   int type;					// type of connection (GET_TYPE, POST_TYPE)
+  int head;					// HEAD request: the body of the response isn't sent (GET_TYPE)
   char *header;            	// header of request
+  size_t header_length;		// (it may be followed by the beginning of the body)
+  size_t header_end;		// length of the header with CRLFCRLF (0 if it isn't full yet)
   FILE *fp;					// a file which the server has to send to client for its request
+  off_t file_left;			// bytes of @fp which aren't sent yet
+  struct readahead *readahead;	// readahead of a big @fp (see readahead.c)
+  size_t send_quota;		// bytes which may be sent now (see send_sched.c)
+  int send_blocked;			// the socket is full (EPOLLOUT is awaited)
+  int send_waiting;			// the response waits for the disk (EPOLLOUT is enabled when it is read)
   //char *filename;         // actually for POST requests when file size is big (but post requests are NOT implemented)
-  size_t content_length;	// for POST requests
+  struct dir_listing *listing;	// a directory listing which is being sent (see html_generation_for_dir.c)
+  struct dir_archive *archive;	// a directory which is being sent as tar or zip (see archive.c)
+  struct io_job *io_job;	// a blocking operation which is in progress (see io_pool.c)
+  struct upload *upload;	// a body of POST request which is being received (see post_request.c)
+  struct h2_conn *h2;		// the connection is HTTP/2 (see http2.c)
+  struct proxy_fetch *proxy;	// the response comes from the upstream (see proxy.c)
 } ext_epoll_data_t;
 
 struct Node {
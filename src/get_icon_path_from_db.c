@@ -1,58 +1,312 @@
+#define _GNU_SOURCE
 
 #include "setup.h"
+#include "digest.h"
 #include <sqlite3.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 
 // 
 #define ICON_PATH_COLUMN_NAME path_to_icon
 #define EXTENSION_COLUMN_NAME extension
 
-int is_dir(const char *file_path) {
-    struct stat statbuf;
+//
+// In-memory table of icons
+//
+// The Icons table of DB_NAME is read once at startup (extension -> path of icon),
+// so listings don't open the database for each entry.
+// The table isn't changed after loading, so lookups are thread-safe.
+// If it cannot be loaded, get_icon_path() queries the database.
+//
 
-    if (access(file_path, F_OK) == -1) {
-        // file doesn't exists
-        return -1;
+#define ICON_TABLE_SIZE 1024    // power of 2, more than twice the number of extensions
+
+typedef struct icon_slot {
+    char *extension;
+    char *icon_path;
+} icon_slot_t;
+
+static icon_slot_t icon_table[ICON_TABLE_SIZE];
+static int icon_table_loaded = FALSE;
+
+//
+// Inline icons of listings
+//
+// With LISTING_ICONS inline each distinct icon of the table is read once at startup
+// and kept as a CSS rule with a data: URI. A listing page inlines each icon,
+// which it shows, once (see print_html_entry() in html_generation_for_dir.c)
+// and entries refer to its class, so a directory page costs one request.
+//
+
+#define INLINE_ICONS_MAX      64            // (a listing keeps a bitmask of sent icons)
+#define INLINE_ICON_SIZE_MAX  (256 * 1024)
+
+typedef struct inline_icon {
+    const char *icon_path;      // (the string of the table)
+    char *style;                // "<style>.iN{...}</style>"
+    size_t style_length;
+} inline_icon_t;
+
+static inline_icon_t inline_icons[INLINE_ICONS_MAX];
+static int inline_icons_count = 0;
+static size_t inline_icon_style_max = 0;
+
+static void free_inline_icons();
+
+// FNV-1a
+static unsigned hash_icon_extension(const char *extension) {
+    unsigned h = 2166136261u;
+
+    for ( ; *extension; extension++) {
+        h ^= (unsigned char)*extension;
+        h *= 16777619u;
     }
+    return h;
+}
 
-    if (stat(file_path, &statbuf) < 0) {
-        // some errors
-        // for example, EACCES (permission denied)
-        return -1;
+static int insert_icon(const char *extension, const char *icon_path) {
+    unsigned i = hash_icon_extension(extension) & (ICON_TABLE_SIZE - 1);
+    unsigned probes;
+
+    for (probes = 0; probes < ICON_TABLE_SIZE; probes++) {
+        if (icon_table[i].extension == NULL) {
+            icon_table[i].extension = strdup(extension);
+            icon_table[i].icon_path = strdup(icon_path);
+            if (!icon_table[i].extension || !icon_table[i].icon_path)
+                return -1;
+            return 0;
+        }
+        if (strcmp(icon_table[i].extension, extension) == 0)
+            return 0;
+        i = (i + 1) & (ICON_TABLE_SIZE - 1);
     }
 
-    return S_ISDIR(statbuf.st_mode);
+    PRINT("[insert_icon]ERROR: icon table is full\n");
+    return -1;
+}
+
+void free_icon_table() {
+    int i;
+
+    free_inline_icons();
+    for (i = 0; i < ICON_TABLE_SIZE; i++) {
+        free(icon_table[i].extension);
+        free(icon_table[i].icon_path);
+        icon_table[i].extension = NULL;
+        icon_table[i].icon_path = NULL;
+    }
+    icon_table_loaded = FALSE;
 }
 
 //
+// read the Icons table of DB_NAME into memory
+// return 0 if success, else -1
 //
-char * get_ext_in_filename(char *dir_path, char *filename) {
-    size_t i;
-    char *file_path;
-#define FULL_FILE_PATH_LENGTH (strlen(dir_path) + strlen(filename) + strlen("/") + 1)
+int load_icon_table() {
+    sqlite3 *db;
+    sqlite3_stmt *res;
+    int count = 0;
+    int step;
 
-    file_path = (char *)malloc(FULL_FILE_PATH_LENGTH * sizeof(char));
-    if (!file_path) {
+    if (sqlite3_open_v2(DB_NAME, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        PRINT("[load_icon_table]ERROR: Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    if (sqlite3_prepare_v2(db, "SELECT extension, path_to_icon FROM Icons", -1, &res, 0) != SQLITE_OK) {
+        PRINT("[load_icon_table]ERROR: failed to execute statement: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+
+    while ((step = sqlite3_step(res)) == SQLITE_ROW) {
+        const char *extension = (const char *)sqlite3_column_text(res, 0);
+        const char *icon_path = (const char *)sqlite3_column_text(res, 1);
+
+        if (!extension || !icon_path)
+            continue;
+        if (insert_icon(extension, icon_path) < 0)
+            break;
+        count++;
+    }
+    sqlite3_finalize(res);
+    sqlite3_close(db);
+
+    if (step != SQLITE_DONE) {
+        free_icon_table();
+        return -1;
+    }
+
+    icon_table_loaded = TRUE;
 #ifdef DEBUG
-        PRINT("[get_ext_in_filename]ERROR: out of memory\n");
+    PRINT("[load_icon_table]DEBUG: %d icons\n", count);
 #endif
+    return 0;
+}
+
+//
+// path of the icon for @filename of @type (DT_DIR, DT_REG, ...) from the table
+// (it isn't freed) or NULL
+//
+const char *lookup_icon_path(const char *filename, unsigned char type) {
+    const char *extension;
+    unsigned i;
+
+    if (type == DT_DIR)
+        extension = "dir";
+    else if ((extension = strchr(filename, '.')) != NULL)
+        extension++;
+    else
         return NULL;
+
+    i = hash_icon_extension(extension) & (ICON_TABLE_SIZE - 1);
+    while (icon_table[i].extension != NULL) {
+        if (strcmp(icon_table[i].extension, extension) == 0)
+            return icon_table[i].icon_path;
+        i = (i + 1) & (ICON_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+// see mime_table.c
+extern const char *lookup_mime_type(const char *extension);
+
+//
+// read @icon_path (it is near DB_NAME) into a CSS rule of class "i<@i>"
+// return 0 if success, else -1
+//
+static int load_inline_icon(int i, const char *icon_path) {
+    const char *db_dir_end = strrchr(DB_NAME, '/');
+    const char *extension = strrchr(icon_path, '.');
+    const char *mime = extension ? lookup_mime_type(extension + 1) : NULL;
+    char path[512];
+    unsigned char *data = NULL;
+    char *base64 = NULL;
+    struct stat statbuf;
+    ssize_t length;
+    int style_length;
+    int fd;
+
+    snprintf(path, sizeof(path), "%.*s/%s", db_dir_end ? (int)(db_dir_end - DB_NAME) : 1,
+             db_dir_end ? DB_NAME : ".", icon_path);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        PRINT("[load_inline_icon]ERROR: cannot open %s (errno=%d)\n", path, errno);
+        return -1;
     }
+    if (fstat(fd, &statbuf) < 0 || statbuf.st_size > INLINE_ICON_SIZE_MAX)
+        goto error;
 
-    // file file_path using @dir_path and @filename
+    data = (unsigned char *)malloc(statbuf.st_size + 1);
+    base64 = (char *)malloc((statbuf.st_size + 2) / 3 * 4 + 1);
+    if (!data || !base64)
+        goto error;
+    length = read(fd, data, statbuf.st_size);
+    if (length != statbuf.st_size)
+        goto error;
+    to_base64(data, length, base64);
 
-    memset(file_path, '\0', FULL_FILE_PATH_LENGTH);
-    file_path = strcat(file_path, dir_path);
-    if (dir_path[strlen(dir_path) - 1] != '/')
-        strcat(file_path, "/");
-    file_path = strcat(file_path, filename);
+    style_length = asprintf(&inline_icons[i].style,
+                            "<style>.i%d{background-image:url(data:%s;base64,%s)}</style>",
+                            i, mime ? mime : "image/png", base64);
+    if (style_length < 0) {
+        inline_icons[i].style = NULL;
+        goto error;
+    }
+    inline_icons[i].style_length = style_length;
+    inline_icons[i].icon_path = icon_path;
+    if (inline_icons[i].style_length > inline_icon_style_max)
+        inline_icon_style_max = inline_icons[i].style_length;
 
-    // check if this file is directory
-    if (is_dir(file_path)) {
+    free(data);
+    free(base64);
+    close(fd);
+    return 0;
 
-        // don't remember free allocated memory
-        free(file_path);
-        
+error:
+    PRINT("[load_inline_icon]ERROR: cannot read %s\n", path);
+    free(data);
+    free(base64);
+    close(fd);
+    return -1;
+}
+
+// number of the inline icon @icon_path (from the table) or -1
+int lookup_inline_icon(const char *icon_path) {
+    int i;
+
+    for (i = 0; i < inline_icons_count; i++) {
+        if (inline_icons[i].icon_path == icon_path || strcmp(inline_icons[i].icon_path, icon_path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+//
+// read all icons of the table for inlining (after load_icon_table())
+// return 0 if success, else -1 (listings link icons then)
+//
+int load_inline_icons() {
+    int i;
+
+    for (i = 0; i < ICON_TABLE_SIZE; i++) {
+        if (icon_table[i].icon_path == NULL || lookup_inline_icon(icon_table[i].icon_path) >= 0)
+            continue;
+        if (inline_icons_count == INLINE_ICONS_MAX)
+            break;
+        // (an icon which cannot be read stays a link)
+        if (load_inline_icon(inline_icons_count, icon_table[i].icon_path) < 0)
+            continue;
+        inline_icons_count++;
+    }
+    if (inline_icons_count == 0)
+        return -1;
+#ifdef DEBUG
+    PRINT("[load_inline_icons]DEBUG: %d icons\n", inline_icons_count);
+#endif
+    return 0;
+}
+
+static void free_inline_icons() {
+    int i;
+
+    for (i = 0; i < inline_icons_count; i++)
+        free(inline_icons[i].style);
+    memset(inline_icons, 0, sizeof(inline_icons));
+    inline_icons_count = 0;
+    inline_icon_style_max = 0;
+}
+
+// CSS rule of inline icon @i (see lookup_inline_icon())
+const char *get_inline_icon_style(int i, size_t *length) {
+    *length = inline_icons[i].style_length;
+    return inline_icons[i].style;
+}
+
+// the longest rule (0 if icons aren't inlined)
+size_t get_inline_icon_style_max() {
+    return inline_icon_style_max;
+}
+
+// @dir_fd -- descriptor of a directory which contains @filename
+int is_dir(int dir_fd, const char *filename) {
+    struct stat statbuf;
+
+    if (fstatat(dir_fd, filename, &statbuf, 0) < 0) {
+        // file doesn't exists or some errors
+        // for example, EACCES (permission denied)
+        return -1;
+    }
+
+    return S_ISDIR(statbuf.st_mode);
+}
+
+//
+//
+char * get_ext_in_filename(int dir_fd, char *filename) {
+    // check if this file is directory
+    if (is_dir(dir_fd, filename) > 0) {
         // @dir is "dir"
         char *dir = (char *)malloc( (strlen("dir") + 1) * sizeof(char));
         dir = strcpy(dir, "dir");
@@ -60,8 +314,6 @@ char * get_ext_in_filename(char *dir_path, char *filename) {
         return dir;
     }
 
-    free(file_path);
-
     // strstr() returns a pointer to the start of substring (".") in @filename if the substring is found
     if (strstr(filename, ".") != NULL) {
         // beginning of file extension is replaced after ".", so +1 (sizeof(char)) 
@@ -70,17 +322,16 @@ char * get_ext_in_filename(char *dir_path, char *filename) {
     return NULL;
 }
 
-char * get_icon_path(char *dir_path, char *filename) {
+char * get_icon_path(int dir_fd, char *filename) {
     char *ext;
     sqlite3 *db;    // this structure defines db handle
-    char *err_msg = 0;
     sqlite3_stmt *res;  // represents a single SQL statement (statement handle)
     char sql[] = "SELECT path_to_icon FROM Icons WHERE extension = ?";
     int step;
     char *icon_path = NULL;
     int rc;
     
-    ext = get_ext_in_filename(dir_path, filename);
+    ext = get_ext_in_filename(dir_fd, filename);
     if (!ext) {
 #ifdef DEBUG
         PRINT("[get_icon_path] ext is NULL\n");
@@ -91,6 +342,16 @@ char * get_icon_path(char *dir_path, char *filename) {
     PRINT("EXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXT %s for %s\n", ext, filename);
 #endif
 
+    if (icon_table_loaded) {
+        // (see load_icon_table())
+        const char *path = lookup_icon_path(strcmp(ext, "dir") == 0 ? "" : filename,
+                                            strcmp(ext, "dir") == 0 ? DT_DIR : DT_REG);
+
+        if (path)
+            icon_path = strdup(path);
+        goto free_memory;
+    }
+
     //return NULL;
 
     // open a new database connection
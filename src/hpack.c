@@ -0,0 +1,455 @@
+#include "hpack.h"
+#include <stdlib.h>
+
+//
+// HPACK decoder and a minimal encoder (see hpack.h)
+//
+
+#define HUFFMAN_SYMBOLS   257     // 256 bytes and EOS
+#define HUFFMAN_EOS       256
+#define HUFFMAN_MAX_BITS  30
+
+#define ENTRY_OVERHEAD    32      // (RFC 7541, 4.1)
+
+typedef struct static_entry {
+  const char *name;
+  const char *value;
+} static_entry_t;
+
+// RFC 7541, Appendix A (index 1 .. 61)
+static const static_entry_t static_table[] = {
+  { NULL, NULL },
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+#define STATIC_TABLE_COUNT  61
+
+// lengths of Huffman codes (RFC 7541, Appendix B),
+// the code is canonical, so the codes follow from their lengths
+static const unsigned char huffman_lengths[HUFFMAN_SYMBOLS] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,  // 0
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,  // 16
+   6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,  // 32
+   5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,  // 48
+  13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  // 64
+   7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,  // 80
+  15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,  // 96
+   6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,  // 112
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,  // 128
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,  // 144
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,  // 160
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,  // 176
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,  // 192
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,  // 208
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,  // 224
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,  // 240
+  30,  // 256
+};
+
+// canonical decoding: codes of each length are consecutive
+static int huffman_ready = FALSE;
+static uint32_t huffman_first[HUFFMAN_MAX_BITS + 1];   // the first code of the length
+static int huffman_count[HUFFMAN_MAX_BITS + 1];        // number of codes of the length
+static int huffman_offset[HUFFMAN_MAX_BITS + 1];       // index of the first one in @huffman_symbols
+static int huffman_symbols[HUFFMAN_SYMBOLS];           // sorted by (length, symbol)
+
+static void build_huffman_table() {
+  uint32_t code = 0;
+  int length, symbol, n = 0;
+
+  for (length = 1; length <= HUFFMAN_MAX_BITS; length++) {
+    code <<= 1;
+    huffman_first[length] = code;
+    huffman_offset[length] = n;
+    for (symbol = 0; symbol < HUFFMAN_SYMBOLS; symbol++) {
+      if (huffman_lengths[symbol] == length)
+        huffman_symbols[n++] = symbol;
+    }
+    huffman_count[length] = n - huffman_offset[length];
+    code += huffman_count[length];
+  }
+  huffman_ready = TRUE;
+}
+
+//
+// decode Huffman-coded @in with @length into @out (@max bytes)
+// return number of decoded bytes or -1
+//
+static ssize_t huffman_decode(const unsigned char *in, size_t length, char *out, size_t max) {
+  uint32_t code = 0;
+  int bits = 0;             // bits in @code
+  int ones = TRUE;          // @code is all ones (it may be padding)
+  size_t i, n = 0;
+  int bit, symbol;
+
+  if (!huffman_ready)
+    build_huffman_table();
+
+  for (i = 0; i < length; i++) {
+    for (bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((in[i] >> bit) & 1);
+      ones = ones && ((in[i] >> bit) & 1);
+      bits++;
+      if (code - huffman_first[bits] < (uint32_t)huffman_count[bits]) {
+        symbol = huffman_symbols[huffman_offset[bits] + code - huffman_first[bits]];
+        if (symbol == HUFFMAN_EOS || n >= max)
+          return -1;
+        out[n++] = (char)symbol;
+        code = 0;
+        bits = 0;
+        ones = TRUE;
+      } else if (bits >= HUFFMAN_MAX_BITS) {
+        return -1;
+      }
+    }
+  }
+
+  // padding is the most significant bits of EOS (at most 7 ones)
+  if (bits > 7 || !ones)
+    return -1;
+  return (ssize_t)n;
+}
+
+//
+// decode an integer with @prefix bits (RFC 7541, 5.1) at @*pos
+// return 0 if success, else -1
+//
+static int decode_int(const unsigned char *in, size_t length, size_t *pos, int prefix, uint32_t *value) {
+  uint32_t max_prefix = (1U << prefix) - 1;
+  uint32_t v;
+  int shift = 0;
+
+  if (*pos >= length)
+    return -1;
+  v = in[(*pos)++] & max_prefix;
+  if (v == max_prefix) {
+    while (1) {
+      if (*pos >= length || shift > 21)
+        return -1;
+      v += (uint32_t)(in[*pos] & 0x7f) << shift;
+      shift += 7;
+      if (!(in[(*pos)++] & 0x80))
+        break;
+    }
+  }
+  *value = v;
+  return 0;
+}
+
+//
+// decode a string literal at @*pos into @out (HPACK_STRING_MAX bytes)
+// return its length or -1
+//
+static ssize_t decode_string(const unsigned char *in, size_t length, size_t *pos, char *out) {
+  int huffman;
+  uint32_t string_length;
+  ssize_t n;
+
+  if (*pos >= length)
+    return -1;
+  huffman = in[*pos] & 0x80;
+  if (decode_int(in, length, pos, 7, &string_length) < 0 || string_length > length - *pos)
+    return -1;
+
+  if (huffman) {
+    n = huffman_decode(in + *pos, string_length, out, HPACK_STRING_MAX);
+  } else {
+    if (string_length > HPACK_STRING_MAX)
+      return -1;
+    memcpy(out, in + *pos, string_length);
+    n = string_length;
+  }
+  *pos += string_length;
+  return n;
+}
+
+void hpack_decoder_init(hpack_decoder_t *d) {
+  memset(d, 0, sizeof(hpack_decoder_t));
+  d->max_size = HPACK_TABLE_SIZE;
+}
+
+static hpack_entry_t *dynamic_entry(hpack_decoder_t *d, size_t i) {
+  return &d->entries[(d->first + i) % d->capacity];
+}
+
+static void evict(hpack_decoder_t *d, size_t max_size) {
+  hpack_entry_t *e;
+
+  while (d->count > 0 && d->size > max_size) {
+    e = dynamic_entry(d, d->count - 1);
+    d->size -= e->size;
+    free(e->name);
+    d->count--;
+  }
+}
+
+void hpack_decoder_free(hpack_decoder_t *d) {
+  evict(d, 0);
+  free(d->entries);
+  d->entries = NULL;
+  d->capacity = 0;
+}
+
+//
+// add a field to the dynamic table (older entries are evicted to make room)
+// return 0 if success, else -1
+//
+static int add_entry(hpack_decoder_t *d, const char *name, size_t name_length,
+                     const char *value, size_t value_length) {
+  size_t size = name_length + value_length + ENTRY_OVERHEAD;
+  hpack_entry_t *entries, *e;
+  size_t i, capacity;
+  char *block;
+
+  if (size > d->max_size) {
+    // (a field bigger than the table empties it)
+    evict(d, 0);
+    return 0;
+  }
+
+  // the name and the value are kept in one block
+  // (they are copied before eviction: the name may be of an entry which is evicted)
+  block = (char *)malloc(name_length + value_length + 2);
+  if (!block)
+    return -1;
+  memcpy(block, name, name_length);
+  block[name_length] = '\0';
+  memcpy(block + name_length + 1, value, value_length);
+  block[name_length + 1 + value_length] = '\0';
+
+  evict(d, d->max_size - size);
+
+  if (d->count == d->capacity) {
+    capacity = d->capacity ? d->capacity * 2 : 16;
+    entries = (hpack_entry_t *)malloc(capacity * sizeof(hpack_entry_t));
+    if (!entries) {
+      free(block);
+      return -1;
+    }
+    for (i = 0; i < d->count; i++)
+      entries[i] = *dynamic_entry(d, i);
+    free(d->entries);
+    d->entries = entries;
+    d->capacity = capacity;
+    d->first = 0;
+  }
+
+  d->first = (d->first + d->capacity - 1) % d->capacity;
+  e = &d->entries[d->first];
+  e->name = block;
+  e->value = block + name_length + 1;
+  e->size = size;
+  d->size += size;
+  d->count++;
+  return 0;
+}
+
+// a field of the static or the dynamic table (index from 1)
+static int lookup_index(hpack_decoder_t *d, uint32_t index, const char **name, const char **value) {
+  hpack_entry_t *e;
+
+  if (index == 0)
+    return -1;
+  if (index <= STATIC_TABLE_COUNT) {
+    *name = static_table[index].name;
+    *value = static_table[index].value;
+    return 0;
+  }
+  index -= STATIC_TABLE_COUNT + 1;
+  if (index >= d->count)
+    return -1;
+  e = dynamic_entry(d, index);
+  *name = e->name;
+  *value = e->value;
+  return 0;
+}
+
+int hpack_decode(hpack_decoder_t *d, const unsigned char *block, size_t length,
+                 hpack_field_cb cb, void *arg) {
+  char *name_buf = NULL, *value_buf = NULL;
+  const char *name, *value;
+  ssize_t name_length, value_length;
+  uint32_t index;
+  size_t pos = 0;
+  int prefix, indexing;
+
+  name_buf = (char *)malloc(HPACK_STRING_MAX);
+  value_buf = (char *)malloc(HPACK_STRING_MAX);
+  if (!name_buf || !value_buf)
+    goto error;
+
+  while (pos < length) {
+    unsigned char b = block[pos];
+
+    if (b & 0x80) {
+      // indexed field
+      if (decode_int(block, length, &pos, 7, &index) < 0 || lookup_index(d, index, &name, &value) < 0)
+        goto error;
+      cb(arg, name, strlen(name), value, strlen(value));
+      continue;
+    }
+
+    if ((b & 0xe0) == 0x20) {
+      // dynamic table size update
+      if (decode_int(block, length, &pos, 5, &index) < 0 || index > HPACK_TABLE_SIZE)
+        goto error;
+      d->max_size = index;
+      evict(d, d->max_size);
+      continue;
+    }
+
+    // literal: with incremental indexing (01), without indexing (0000) or never indexed (0001)
+    indexing = ((b & 0xc0) == 0x40);
+    prefix = indexing ? 6 : 4;
+    if (decode_int(block, length, &pos, prefix, &index) < 0)
+      goto error;
+    if (index) {
+      if (lookup_index(d, index, &name, &value) < 0)
+        goto error;
+      name_length = strlen(name);
+    } else {
+      name_length = decode_string(block, length, &pos, name_buf);
+      if (name_length < 0)
+        goto error;
+      name = name_buf;
+    }
+    value_length = decode_string(block, length, &pos, value_buf);
+    if (value_length < 0)
+      goto error;
+
+    cb(arg, name, name_length, value_buf, value_length);
+    if (indexing && add_entry(d, name, name_length, value_buf, value_length) < 0)
+      goto error;
+  }
+
+  free(name_buf);
+  free(value_buf);
+  return 0;
+
+error:
+  free(name_buf);
+  free(value_buf);
+  return -1;
+}
+
+//
+// encode @value with @prefix bits into @out, @first are the bits above the prefix
+// return number of bytes (at most 6)
+//
+static size_t encode_int(unsigned char *out, int prefix, unsigned char first, uint32_t value) {
+  uint32_t max_prefix = (1U << prefix) - 1;
+  size_t n = 0;
+
+  if (value < max_prefix) {
+    out[n++] = first | value;
+    return n;
+  }
+  out[n++] = first | max_prefix;
+  value -= max_prefix;
+  while (value >= 0x80) {
+    out[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+size_t hpack_encode_status(unsigned char *out, int status) {
+  char value[16];
+
+  switch (status) {
+    case 200 : out[0] = 0x80 | 8;  return 1;
+    case 204 : out[0] = 0x80 | 9;  return 1;
+    case 206 : out[0] = 0x80 | 10; return 1;
+    case 304 : out[0] = 0x80 | 11; return 1;
+    case 400 : out[0] = 0x80 | 12; return 1;
+    case 404 : out[0] = 0x80 | 13; return 1;
+    case 500 : out[0] = 0x80 | 14; return 1;
+  }
+  snprintf(value, sizeof(value), "%03d", status);
+  return hpack_encode_field(out, 24, HPACK_STATUS, NULL, value);
+}
+
+size_t hpack_encode_field(unsigned char *out, size_t max, int name_index,
+                          const char *name, const char *value) {
+  size_t name_length = name ? strlen(name) : 0;
+  size_t value_length = strlen(value);
+  size_t n;
+
+  // (6 bytes for each integer)
+  if (name_length + value_length + 18 > max)
+    return 0;
+
+  // literal without indexing
+  if (name_index) {
+    n = encode_int(out, 4, 0x00, name_index);
+  } else {
+    out[0] = 0x00;
+    n = 1;
+    n += encode_int(out + n, 7, 0x00, name_length);
+    memcpy(out + n, name, name_length);
+    n += name_length;
+  }
+  n += encode_int(out + n, 7, 0x00, value_length);
+  memcpy(out + n, value, value_length);
+  return n + value_length;
+}
@@ -0,0 +1,63 @@
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#include "setup.h"
+#include <stdint.h>
+
+//
+// HPACK (RFC 7541), header compression of HTTP/2
+//
+// The decoder keeps the dynamic table of the connection and decodes
+// Huffman-coded strings. The encoder doesn't use the dynamic table:
+// names are taken from the static table and values are written as literals
+// which aren't indexed (responses of the server have few headers).
+//
+
+#define HPACK_TABLE_SIZE      4096      // SETTINGS_HEADER_TABLE_SIZE of the decoder
+#define HPACK_STRING_MAX      8192      // max length of a decoded name or value
+
+typedef struct hpack_entry {
+  char *name;
+  char *value;
+  size_t size;                // length of the name and the value + 32
+} hpack_entry_t;
+
+typedef struct hpack_decoder {
+  hpack_entry_t *entries;     // a ring, the newest entry is at @first
+  size_t capacity;
+  size_t count;
+  size_t first;
+  size_t size;
+  size_t max_size;            // the size which is set by the encoder (<= HPACK_TABLE_SIZE)
+} hpack_decoder_t;
+
+// a decoded header field
+typedef void (*hpack_field_cb)(void *arg, const char *name, size_t name_length,
+                               const char *value, size_t value_length);
+
+void hpack_decoder_init(hpack_decoder_t *d);
+void hpack_decoder_free(hpack_decoder_t *d);
+
+// decode header block @block with @length, @cb is called for each field
+// return 0 if success, else -1 (COMPRESSION_ERROR)
+int hpack_decode(hpack_decoder_t *d, const unsigned char *block, size_t length,
+                 hpack_field_cb cb, void *arg);
+
+// static table indexes of names which are used by the encoder
+#define HPACK_STATUS            8     // ":status: 200"
+#define HPACK_CONTENT_LENGTH   28
+#define HPACK_CONTENT_TYPE     31
+#define HPACK_ETAG             34
+#define HPACK_SERVER           54
+
+// append field ":status: @status" to @out
+// return number of bytes (@out has at least 24 bytes)
+size_t hpack_encode_status(unsigned char *out, int status);
+
+// append a field, whose name is @name_index of the static table
+// (or literal @name if @name_index is 0), to @out (@max bytes)
+// return number of bytes or 0 if there is no room
+size_t hpack_encode_field(unsigned char *out, size_t max, int name_index,
+                          const char *name, const char *value);
+
+#endif // _HPACK_H_
@@ -1,206 +1,1177 @@
+#define _GNU_SOURCE
 #include "setup.h"
+#include "ext_epoll_data.h"
+#include "io_pool.h"
+#include "chunked.h"
+#include "wwwroot_index.h"
+#include "path_resolution.h"
+#include "tls.h"
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
 
 //
-// generate html name for @dir_name
-// (for example: my_dir/another_dir -> my_dir_another_dir)
-// 
-// return:
-//    if SUCCESS
-//      a pointer to allocated memory, which contains the generated name
-//    else
-//       NULL
-char *generate_html_name(char *dir_name) {
-  char *generated_html_name;
-  size_t i;
-  size_t dir_name_length = strlen(dir_name);
+// Directory listings
+//
+// A listing isn't written into a file before sending: it is generated
+// while it is sent to the client (Transfer-Encoding: chunked),
+// so the first entries go out right after the first getdents64() batch.
+//
+// Without ?sort= entries are sent in the directory order.
+// With ?sort=name|size|mtime (and optional &order=desc) the directory is read
+// in runs of LISTING_RUN_ENTRIES entries. If the whole directory fits into one run,
+// it is sorted in memory, else each run is sorted and spilled into an anonymous file
+// in GENERATED_HTMLS and the runs are merged while the listing is sent
+// (so memory is bounded by one run for any directory).
+//
+// ?offset=N&limit=M select a page of entries.
+//
+// The same scan is sent as html, JSON or CBOR (?format=json|cbor or Accept header),
+// machine-readable formats give name, type, size, mtime and mime type of each entry.
+//
+// Chunks are generated by io_pool workers (getdents64(), stat and icon lookups
+// may block on a cold directory), the event loop only sends them.
+//
+// If the directory is in the index of WWWROOT (see wwwroot_index.c), entries
+// with their stats and icons are taken from the index (in name order)
+// instead of getdents64() and stat().
+//
 
-#define GEN_HTML_NAME_LENGTH (strlen(GENERATED_HTMLS) + strlen(dir_name) + 1)
-  generated_html_name = (char *)malloc( GEN_HTML_NAME_LENGTH * sizeof(char) );
+#define LISTING_GETDENTS_SIZE  (256 * 1024)  // buffer for one getdents64() batch
+#define LISTING_CHUNK_SIZE     (16 * 1024)   // size of one chunk of the listing
+#define LISTING_ENTRY_MAX      8192          // max size of one formatted entry
+#define LISTING_RUN_ENTRIES    65536         // max number of entries sorted in memory
+#define LISTING_SCAN_BATCHES   4             // getdents64() batches for one call of send_listing()
+#define LISTING_NAME_LENGTH    256
+#define LISTING_INDEX_BATCH    256           // entries which are copied from the index at once
 
-  if (!generated_html_name) {
-    PRINT("[generate_html_name]: out of memory for name\n");
-    return NULL;
+#define FORMAT_HTML  0
+#define FORMAT_JSON  1
+#define FORMAT_CBOR  2
+
+#define SORT_NONE   0
+#define SORT_NAME   1
+#define SORT_SIZE   2
+#define SORT_MTIME  3
+
+typedef struct listing_options {
+  int format;         // FORMAT_HTML, FORMAT_JSON, FORMAT_CBOR
+  int sort;           // SORT_NONE, SORT_NAME, ...
+  int desc;           // descending order
+  size_t offset;      // number of entries to skip
+  size_t limit;       // max number of entries (0 -- no limit)
+} listing_options_t;
+
+typedef struct listing_entry {
+  long long size;
+  long long mtime;
+  size_t name_off;            // offset of the name in dir_listing.names
+  unsigned short name_len;
+  unsigned char type;         // DT_DIR, DT_REG, ...
+} listing_entry_t;
+
+// sorted run of entries which is spilled into a file
+typedef struct listing_run {
+  FILE *fp;
+  listing_entry_t cur;              // the current (smallest) entry of the run
+  char name[LISTING_NAME_LENGTH];   // and its name
+} listing_run_t;
+
+// states of a listing
+#define LISTING_HEADER   0
+#define LISTING_STREAM   1    // unsorted: getdents64() batches go to the socket
+#define LISTING_SCAN     2    // sorted: read the directory into runs
+#define LISTING_SORTED   3    // sorted: the single run is in memory
+#define LISTING_MERGE    4    // sorted: merge spilled runs
+#define LISTING_FOOTER   5
+#define LISTING_LAST     6    // the last (empty) chunk
+#define LISTING_DONE     7
+
+typedef struct dir_listing {
+  io_job_t job;               // generation of the next chunk (see send_listing())
+  int state;
+  int chunked;                // parts are framed as chunks (HTTP/1.1), else they are raw (HTTP/2)
+  int dir_fd;
+  char *dir_name;             // normalised path of the directory (for links)
+  listing_options_t opts;
+
+  // the current getdents64() batch
+  char *dents;
+  long dents_len;
+  long dents_pos;
+  int dents_eof;
+
+  // or the current batch of entries of the index
+  int indexed;
+  index_entry_t *index_batch;
+  int index_len;
+  int index_pos;
+  index_entry_t *index_cur;   // the entry which was returned by next_dirent()
+
+  unsigned long long icons_sent;  // inline icons which are in the page already (bits)
+
+  // the current run
+  listing_entry_t *entries;
+  size_t entries_count;
+  size_t entries_cap;
+  size_t next_entry;          // next entry to send (LISTING_SORTED)
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+
+  // spilled runs (LISTING_MERGE), @heap is a min-heap of indexes of @runs
+  listing_run_t *runs;
+  int runs_count;
+  int *heap;
+  int heap_size;
+
+  // pagination
+  size_t skipped;
+  size_t emitted;
+
+  // body of the next chunk, it is framed in place (see chunked_wrap())
+  // and @out points to the chunk which is being sent
+  char *chunk;
+  char *body;
+  size_t body_len;
+  size_t body_max;            // (a chunk, an entry and an inline icon)
+  char *out;
+  size_t out_len;
+  size_t out_pos;
+} dir_listing_t;
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// see get_icon_path_from_db.c
+extern char * get_icon_path(int dir_fd, char *filename);
+extern const char *lookup_icon_path(const char *filename, unsigned char type);
+extern int lookup_inline_icon(const char *icon_path);
+extern const char *get_inline_icon_style(int i, size_t *length);
+extern size_t get_inline_icon_style_max();
+
+// see mime_table.c
+extern const char *lookup_mime_type(const char *extension);
+
+//
+// printf() into the body of the next chunk
+//
+static void listing_printf(dir_listing_t *l, const char *format, ...) {
+  va_list args;
+  int res;
+  size_t room = l->body_max - l->body_len;
+
+  va_start(args, format);
+  res = vsnprintf(l->body + l->body_len, room, format, args);
+  va_end(args);
+
+  if (res < 0)
+    return;
+  l->body_len += ((size_t)res < room) ? (size_t)res : room - 1;
+}
+
+// write raw bytes into the body of the next chunk
+static void listing_write(dir_listing_t *l, const void *data, size_t length) {
+  size_t room = l->body_max - l->body_len;
+
+  if (length > room)
+    length = room;
+  memcpy(l->body + l->body_len, data, length);
+  l->body_len += length;
+}
+
+// print @str escaped for html text and attributes
+static void print_html_escaped(dir_listing_t *l, const char *str) {
+  for ( ; *str; str++) {
+    switch (*str) {
+      case '&':  listing_printf(l, "&amp;");  break;
+      case '<':  listing_printf(l, "&lt;");   break;
+      case '>':  listing_printf(l, "&gt;");   break;
+      case '"':  listing_printf(l, "&quot;"); break;
+      case '\'': listing_printf(l, "&#39;");  break;
+      default:
+        l->body[l->body_len++] = *str;
+    }
   }
+  l->body[l->body_len] = '\0';
+}
 
-  memset(generated_html_name, '\0', GEN_HTML_NAME_LENGTH );
-  strcat(generated_html_name, GENERATED_HTMLS);
-  for (i = 0; i < dir_name_length; i++) {
-    if (i == (dir_name_length - 1) && dir_name[i] == '/') {
-      // if the last symbol is '/'
-      // we shouldn't copy this symbol into @generated_html_name
-      break;
+// print @str percent-encoded for href (it is decoded by normalize_request_path())
+static void print_url_encoded(dir_listing_t *l, const char *str) {
+  for ( ; *str; str++) {
+    unsigned char c = (unsigned char)*str;
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '-' || c == '_' || c == '.' || c == '~' || c == '/')
+      l->body[l->body_len++] = c;
+    else
+      listing_printf(l, "%%%02X", c);
+  }
+  l->body[l->body_len] = '\0';
+}
+
+// is @name the entry of the index which was returned by next_dirent()
+static int is_index_entry(dir_listing_t *l, const char *name) {
+  return l->index_cur && name == l->index_cur->name;
+}
+
+static void print_html_entry(dir_listing_t *l, char *name, unsigned char type) {
+  const char *icon_path;
+  char *icon_buf = NULL;
+  const char *style;
+  size_t style_length;
+  int icon;
+
+  listing_printf(l, "<li>");
+
+  // get icon path
+  if (is_index_entry(l, name))
+    icon_path = l->index_cur->icon;
+  else if (l->indexed)
+    icon_path = lookup_icon_path(name, type);     // (types of the index are known)
+  else
+    icon_path = icon_buf = get_icon_path(l->dir_fd, name);
+
+  if (icon_path && (icon = lookup_inline_icon(icon_path)) >= 0) {
+    // the icon is a CSS class, its data: URI is sent once in the page
+    // (see get_icon_path_from_db.c)
+    if (!(l->icons_sent & (1ULL << icon))) {
+      style = get_inline_icon_style(icon, &style_length);
+      listing_write(l, style, style_length);
+      l->icons_sent |= 1ULL << icon;
     }
-    if (i > 0 && dir_name[i] == '/') {
-      // this @dir_name (dir_path) can contain names of other directories
-      // so we replace '/' symbols with '_'
-      char symbol = '_';
-      strncat(generated_html_name, &symbol, sizeof(char));
-      continue;
+    listing_printf(l, "<i class=\"icon i%d\"></i> \t", icon);
+    free(icon_buf);
+  } else if (icon_path) {
+    // set <img > tag with icon path
+
+    // see ICONS_FOR_TYPES in setup.h
+    if (ICONS_FOR_TYPES[0] != '/') {
+      // we should set '/' symbol at the beginning
+      // it allows to find icons in WWWROOT directory
+      // else browser will try to find icons in current (uri) directory
+      // and for nested directories we cannot find icons
+      listing_printf(l, "<img src=/%s", ICONS_FOR_TYPES);
+    }
+
+    if ( ICONS_FOR_TYPES[strlen(ICONS_FOR_TYPES) - 1] != '/' ) {
+      listing_printf(l, "/");
     }
-    strncat(generated_html_name, dir_name + i, sizeof(char));
+    listing_printf(l, "%s height= \"40\" width= \"40 \" > \t", icon_path);
+
+    // free icon path
+    free(icon_buf);
+  } else {
+    #ifdef DEBUG
+    PRINT("[print_html_entry]icon_path is NULL for %s\n", name);
+    #endif
   }
-  return generated_html_name;
+
+  // write <a href=" "> for entry
+  listing_printf(l, "<a href=\"");
+  print_url_encoded(l, l->dir_name);
+  if ( l->dir_name[strlen(l->dir_name) - 1] != '/' ) {
+    listing_printf(l, "/");
+  }
+  print_url_encoded(l, name);
+  listing_printf(l, "\">");
+  print_html_escaped(l, name);
+  listing_printf(l, "</a></li>\n");
+}
+
+static void print_html_header(dir_listing_t *l) {
+  listing_printf(l, "<!DOCTYPE html>\n");
+  listing_printf(l, "<html>\n");
+  if (get_inline_icon_style_max() > 0)
+    listing_printf(l, "<head><style>.icon{display:inline-block;width:40px;height:40px;"
+                      "background-size:40px 40px;vertical-align:middle}</style></head>\n");
+  listing_printf(l, "<body>\n");
+  listing_printf(l, "<form enctype=\"multipart/form-data\" method=\"post\">\n");
+  listing_printf(l, "<p><input type=\"file\" name=\"f\">\n");
+  listing_printf(l, "<input type=\"submit\" value=\"Send file\"></p>\n");
+  listing_printf(l, "</form>\n");
+  listing_printf(l, "<ul>\n");
+
+  // a link to the parent directory (except WWWROOT)
+  if (strcmp(l->dir_name, "/") != 0)
+    print_html_entry(l, "..", DT_DIR);
 }
 
-#undef GEN_HTML_NAME_LENGTH 
+static void print_html_end(dir_listing_t *l) {
+  listing_printf(l, "</ul>\n");
+
+  // the page is full, so give a link to the next one
+  if (l->opts.limit && l->emitted == l->opts.limit) {
+    listing_printf(l, "<p><a href=\"?offset=%zu&amp;limit=%zu", l->opts.offset + l->opts.limit, l->opts.limit);
+    if (l->opts.sort != SORT_NONE) {
+      listing_printf(l, "&amp;sort=%s", l->opts.sort == SORT_NAME ? "name" :
+                                        l->opts.sort == SORT_SIZE ? "size" : "mtime");
+      if (l->opts.desc)
+        listing_printf(l, "&amp;order=desc");
+    }
+    listing_printf(l, "\">next</a></p>\n");
+  }
+
+  listing_printf(l, "</body>\n");
+  listing_printf(l, "</html>\n");
+}
 
 //
-// this function is used by send_response_for_dir() function
-// it checks if 
+// parse a query of the request (without '?'):
+//    sort=name|size|mtime, order=asc|desc, offset=N, limit=M, format=html|json|cbor
 //
+// @opts->format is -1, if the format isn't specified
 //
-int need_to_generate_html_for_dir(char *dir_path, char *generated_html_name) {
-  return 1;
-  
-#if 0
-  char *temp_html_name;
-  struct stat dir_stat;
-  struct stat html_file_stat;
-  int need = 0;
+static void parse_listing_query(char *query, listing_options_t *opts) {
+  char *p = query;
 
+  memset(opts, 0, sizeof(listing_options_t));
+  opts->format = -1;
+  while (p && *p) {
+    char *next = strchr(p, '&');
+    char *value = strchr(p, '=');
+    size_t key_len;
 
-  // check if corresponding html exists already 
-  if (access(temp_html_name, F_OK) == -1) {
-    // html file for this dir doesn't exists
-    // so we need to generate it
-    need = 1;
+    if (next)
+      *next++ = '\0';
+    if (value) {
+      key_len = value - p;
+      value++;
+
+      if (key_len == 4 && !strncmp(p, "sort", key_len)) {
+        if (!strcmp(value, "name"))
+          opts->sort = SORT_NAME;
+        else if (!strcmp(value, "size"))
+          opts->sort = SORT_SIZE;
+        else if (!strcmp(value, "mtime"))
+          opts->sort = SORT_MTIME;
+      } else if (key_len == 6 && !strncmp(p, "format", key_len)) {
+        if (!strcmp(value, "json"))
+          opts->format = FORMAT_JSON;
+        else if (!strcmp(value, "cbor"))
+          opts->format = FORMAT_CBOR;
+        else if (!strcmp(value, "html"))
+          opts->format = FORMAT_HTML;
+      } else if (key_len == 5 && !strncmp(p, "order", key_len)) {
+        opts->desc = !strcmp(value, "desc");
+      } else if (key_len == 6 && !strncmp(p, "offset", key_len)) {
+        opts->offset = strtoull(value, NULL, 10);
+      } else if (key_len == 5 && !strncmp(p, "limit", key_len)) {
+        opts->limit = strtoull(value, NULL, 10);
+      }
+    }
+    p = next;
   }
+}
 
-free:
-  free(temp_html_name);
-  return need;
-#endif
+// there are no entries in the current getdents64() batch
+static int need_dents_batch(dir_listing_t *l) {
+  if (l->indexed)
+    return l->index_pos >= l->index_len && !l->dents_eof;
+  return l->dents_pos >= l->dents_len && !l->dents_eof;
+}
+
+// the next entry of the index (see next_dirent())
+static int next_index_entry(dir_listing_t *l, char **name, unsigned char *type) {
+  int n;
+
+  while (1) {
+    if (l->index_pos >= l->index_len) {
+      if (l->dents_eof)
+        return -1;
+      // the batch is continued after the last name (the directory may be changed meanwhile)
+      n = wwwroot_index_list(l->dir_name, l->index_len ? l->index_batch[l->index_len - 1].name : "",
+                             l->index_batch, LISTING_INDEX_BATCH);
+      if (n <= 0) {
+        l->dents_eof = 1;
+        return -1;
+      }
+      l->index_len = n;
+      l->index_pos = 0;
+    }
+
+    l->index_cur = &l->index_batch[l->index_pos++];
+    if (!strncmp(l->index_cur->name, SERVER_FILES_PREFIX, strlen(SERVER_FILES_PREFIX)))
+      continue;
+    *name = l->index_cur->name;
+    *type = l->index_cur->type;
+    return 0;
+  }
+}
+
+//
+// get the next entry of the directory (except "." and "..")
+// return 0 if success, -1 at the end of the directory
+//
+static int next_dirent(dir_listing_t *l, char **name, unsigned char *type) {
+  struct linux_dirent64 *d;
+
+  if (l->indexed)
+    return next_index_entry(l, name, type);
+
+  while (1) {
+    if (l->dents_pos >= l->dents_len) {
+      long n;
+
+      if (l->dents_eof)
+        return -1;
+      n = syscall(SYS_getdents64, l->dir_fd, l->dents, LISTING_GETDENTS_SIZE);
+      if (n <= 0) {
+        if (n < 0)
+          PRINT("[next_dirent]ERROR: getdents64 %s (errno=%d)\n", l->dir_name, errno);
+        l->dents_eof = 1;
+        return -1;
+      }
+      l->dents_len = n;
+      l->dents_pos = 0;
+    }
+
+    d = (struct linux_dirent64 *)(l->dents + l->dents_pos);
+    l->dents_pos += d->d_reclen;
+
+    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+      continue;
+    // files of the server: unfinished uploads, digests, the store (see path_resolution.h)
+    if (!strncmp(d->d_name, SERVER_FILES_PREFIX, strlen(SERVER_FILES_PREFIX)))
+      continue;
+    *name = d->d_name;
+    *type = d->d_type;
+    return 0;
+  }
+}
+
+// stat an entry (for sorting and machine-readable formats)
+static void stat_entry(dir_listing_t *l, char *name, listing_entry_t *e) {
+  struct stat statbuf;
+
+  if (is_index_entry(l, name)) {
+    e->size = l->index_cur->size;
+    e->mtime = l->index_cur->mtime;
+    e->type = l->index_cur->type;
+    return;
+  }
+
+  if (fstatat(l->dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    return;
+  e->size = statbuf.st_size;
+  e->mtime = statbuf.st_mtime;
+  if (S_ISDIR(statbuf.st_mode))
+    e->type = DT_DIR;
+  else if (S_ISREG(statbuf.st_mode))
+    e->type = DT_REG;
+  else if (S_ISLNK(statbuf.st_mode))
+    e->type = DT_LNK;
+  else
+    e->type = DT_UNKNOWN;
+}
+
+static const char *entry_type_name(unsigned char type) {
+  switch (type) {
+    case DT_DIR : return "dir";
+    case DT_REG : return "file";
+    case DT_LNK : return "link";
+    default :     return "other";
+  }
 }
 
-static int does_file_exist(char *file_path) {
-  if (access(file_path, F_OK) == -1) {
-    // file doesn't exists
-    return FALSE;
+// mime type of a regular file by the extension of its name (or NULL)
+static const char *entry_mime_type(const char *name, unsigned char type) {
+  const char *dot;
+
+  if (type != DT_REG || (dot = strrchr(name, '.')) == NULL || dot == name)
+    return NULL;
+  return lookup_mime_type(dot + 1);
+}
+
+// print @str as JSON string
+static void print_json_string(dir_listing_t *l, const char *str) {
+  listing_write(l, "\"", 1);
+  for ( ; *str; str++) {
+    unsigned char c = (unsigned char)*str;
+
+    if (c == '"' || c == '\\')
+      listing_printf(l, "\\%c", c);
+    else if (c < 0x20)
+      listing_printf(l, "\\u%04x", c);
+    else
+      listing_write(l, &c, 1);
+  }
+  listing_write(l, "\"", 1);
+}
+
+// head of a CBOR data item (@major -- major type, 0..7)
+static void cbor_head(dir_listing_t *l, unsigned char major, unsigned long long value) {
+  unsigned char buf[9];
+  size_t len;
+  int i;
+
+  if (value < 24) {
+    buf[0] = (major << 5) | value;
+    len = 1;
+  } else {
+    int bytes = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffffULL) ? 4 : 8;
+
+    buf[0] = (major << 5) | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27);
+    for (i = 0; i < bytes; i++)
+      buf[1 + i] = (unsigned char)(value >> (8 * (bytes - 1 - i)));
+    len = 1 + bytes;
+  }
+  listing_write(l, buf, len);
+}
+
+static int is_utf8(const unsigned char *str) {
+  while (*str) {
+    int n = (*str < 0x80) ? 0 : ((*str & 0xe0) == 0xc0) ? 1 :
+            ((*str & 0xf0) == 0xe0) ? 2 : ((*str & 0xf8) == 0xf0) ? 3 : -1;
+
+    if (n < 0)
+      return FALSE;
+    for (str++; n > 0; n--, str++) {
+      if ((*str & 0xc0) != 0x80)
+        return FALSE;
+    }
   }
   return TRUE;
 }
 
-static void print_html_header(FILE *fp) {
-  fprintf(fp, "<!DOCTYPE html>\n");
-  fprintf(fp, "<html>\n");
-  fprintf(fp, "<body>\n");
-  fprintf(fp, "<form enctype=\"multipart/form-data\" method=\"post\">\n");
-  fprintf(fp, "<p><input type=\"file\" name=\"f\">\n");
-  fprintf(fp, "<input type=\"submit\" value=\"Send file\"></p>\n");
-  fprintf(fp, "</form>\n");
+// text string (or byte string, if a file name isn't valid UTF-8)
+static void cbor_string(dir_listing_t *l, const char *str) {
+  size_t len = strlen(str);
+
+  cbor_head(l, is_utf8((const unsigned char *)str) ? 3 : 2, len);
+  listing_write(l, str, len);
 }
 
-static void print_html_end(FILE *fp) {
-  fprintf(fp, "</body>\n");
-  fprintf(fp, "</html>\n");
+static void cbor_int(dir_listing_t *l, long long value) {
+  if (value >= 0)
+    cbor_head(l, 0, value);
+  else
+    cbor_head(l, 1, (unsigned long long)(-1 - value));
 }
 
-// see get_icon_path_from_db.c
-extern char * get_icon_path(char *dir_path, char *filename);
+static void print_json_entry(dir_listing_t *l, char *name, listing_entry_t *e) {
+  const char *mime = entry_mime_type(name, e->type);
+
+  if (l->emitted > 0)
+    listing_write(l, ",", 1);
+  listing_printf(l, "\n{\"name\":");
+  print_json_string(l, name);
+  listing_printf(l, ",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld,\"mime\":",
+                 entry_type_name(e->type), e->size, e->mtime);
+  if (mime)
+    print_json_string(l, mime);
+  else
+    listing_printf(l, "null");
+  listing_write(l, "}", 1);
+}
+
+static void print_cbor_entry(dir_listing_t *l, char *name, listing_entry_t *e) {
+  const char *mime = entry_mime_type(name, e->type);
+
+  cbor_head(l, 5, 5);     // map of 5 pairs
+  cbor_string(l, "name");
+  cbor_string(l, name);
+  cbor_string(l, "type");
+  cbor_string(l, entry_type_name(e->type));
+  cbor_string(l, "size");
+  cbor_int(l, e->size);
+  cbor_string(l, "mtime");
+  cbor_int(l, e->mtime);
+  cbor_string(l, "mime");
+  if (mime)
+    cbor_string(l, mime);
+  else
+    cbor_head(l, 7, 22);  // null
+}
+
+static void print_listing_header(dir_listing_t *l) {
+  switch (l->opts.format) {
+    case FORMAT_JSON :
+      listing_printf(l, "{\"path\":");
+      print_json_string(l, l->dir_name);
+      listing_printf(l, ",\"entries\":[");
+      break;
+    case FORMAT_CBOR :
+      listing_write(l, "\xbf", 1);     // map of indefinite length
+      cbor_string(l, "path");
+      cbor_string(l, l->dir_name);
+      cbor_string(l, "entries");
+      listing_write(l, "\x9f", 1);     // array of indefinite length
+      break;
+    default :
+      print_html_header(l);
+  }
+}
+
+static void print_listing_end(dir_listing_t *l) {
+  int page_is_full = l->opts.limit && l->emitted == l->opts.limit;
+
+  switch (l->opts.format) {
+    case FORMAT_JSON :
+      listing_printf(l, "\n]");
+      if (page_is_full)
+        listing_printf(l, ",\"next_offset\":%zu", l->opts.offset + l->opts.limit);
+      listing_printf(l, "}\n");
+      break;
+    case FORMAT_CBOR :
+      listing_write(l, "\xff", 1);     // end of entries
+      if (page_is_full) {
+        cbor_string(l, "next_offset");
+        cbor_int(l, l->opts.offset + l->opts.limit);
+      }
+      listing_write(l, "\xff", 1);     // end of the map
+      break;
+    default :
+      print_html_end(l);
+  }
+}
 
 //
-// 
+// send one entry, taking into account offset and limit
+// @e -- stats of the entry if they are known (sorted listings), else NULL
 //
-// @dir_path -- for example, (WWWROOT)/my_dir/another_dir
-// @dir_name -- my_dir/another_dir (a path, relative to (WWWROOT) )
+// return 1 if the page is full
 //
-// returns 0 if success (-1 else)
-int generate_html_for_dir(char *dir_path, char *generated_html_name, char *dir_name) {
-  DIR *dp;
-  FILE *fp;
-  struct dirent *ep;
+static int emit_entry(dir_listing_t *l, char *name, unsigned char type, listing_entry_t *e) {
+  listing_entry_t entry;
+
+  if (l->skipped < l->opts.offset) {
+    l->skipped++;
+    return 0;
+  }
+  if (l->opts.limit && l->emitted >= l->opts.limit)
+    return 1;
+
+  if (l->opts.format == FORMAT_HTML) {
+    print_html_entry(l, name, e ? e->type : type);
+  } else {
+    if (!e) {
+      memset(&entry, 0, sizeof(entry));
+      entry.type = type;
+      stat_entry(l, name, &entry);
+      e = &entry;
+    }
+    if (l->opts.format == FORMAT_JSON)
+      print_json_entry(l, name, e);
+    else
+      print_cbor_entry(l, name, e);
+  }
+  l->emitted++;
+  return l->opts.limit && l->emitted >= l->opts.limit;
+}
+
+static int compare_keys(dir_listing_t *l, const listing_entry_t *a, const char *a_name,
+                                          const listing_entry_t *b, const char *b_name) {
   int res = 0;
 
-  if ( (dp = opendir(dir_path) ) == NULL ) {
-    PRINT("Couldn't open the directory %s\n", dir_path);
-    return -1;
+  if (l->opts.sort == SORT_SIZE)
+    res = (a->size > b->size) - (a->size < b->size);
+  else if (l->opts.sort == SORT_MTIME)
+    res = (a->mtime > b->mtime) - (a->mtime < b->mtime);
+  if (res == 0)
+    res = strcmp(a_name, b_name);
+  return l->opts.desc ? -res : res;
+}
+
+static int compare_entries(const void *a, const void *b, void *arg) {
+  dir_listing_t *l = (dir_listing_t *)arg;
+  const listing_entry_t *ea = (const listing_entry_t *)a;
+  const listing_entry_t *eb = (const listing_entry_t *)b;
+
+  return compare_keys(l, ea, l->names + ea->name_off, eb, l->names + eb->name_off);
+}
+
+//
+// add an entry into the current run
+// (stat() is called only if it is needed for sorting)
+//
+static int add_entry(dir_listing_t *l, char *name, unsigned char type) {
+  listing_entry_t *e;
+  size_t name_len = strlen(name);
+
+  if (l->entries_count == l->entries_cap) {
+    size_t cap = l->entries_cap ? l->entries_cap * 2 : 1024;
+    listing_entry_t *entries = (listing_entry_t *)realloc(l->entries, cap * sizeof(listing_entry_t));
+
+    if (!entries)
+      return -1;
+    l->entries = entries;
+    l->entries_cap = cap;
   }
+  if (l->names_len + name_len + 1 > l->names_cap) {
+    size_t cap = l->names_cap ? l->names_cap * 2 : 64 * 1024;
+    char *names = (char *)realloc(l->names, cap);
 
-  #ifdef DEBUG
-  PRINT("generated_html_name =%s\n", generated_html_name);
-  #endif
-  // create a file for @generated_html_name
-  fp = fopen(generated_html_name, "w+");
-  if (fp == NULL) {
-    PRINT("[generate_html_for_dir]ERROR: file %s not created\n", generated_html_name);
-    res = -1;
-    goto close_dir;
+    if (!names)
+      return -1;
+    l->names = names;
+    l->names_cap = cap;
   }
 
-  print_html_header(fp);
+  e = &l->entries[l->entries_count++];
+  e->name_off = l->names_len;
+  e->name_len = name_len;
+  e->type = type;
+  e->size = 0;
+  e->mtime = 0;
+  memcpy(l->names + l->names_len, name, name_len + 1);
+  l->names_len += name_len + 1;
 
-  fprintf(fp, "<ul>\n");
+  // machine-readable formats need stats of all entries anyway
+  if (l->opts.sort == SORT_SIZE || l->opts.sort == SORT_MTIME || l->opts.format != FORMAT_HTML)
+    stat_entry(l, name, e);
+  return 0;
+}
 
-  // read each entry in @dir_path
-  while ( (ep = readdir(dp)) != NULL ) {
-    if (strcmp(ep->d_name, ".") == 0) {
-      continue;
-    }
+// create an anonymous file for a run
+static FILE *create_run_file() {
+  char path[FILENAME_MAX];
+  FILE *fp;
+  int fd;
 
-    fprintf(fp, "<li>");
+  fd = open(GENERATED_HTMLS, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    // file system doesn't support O_TMPFILE
+    snprintf(path, sizeof(path), "%s/listing_run_XXXXXX", GENERATED_HTMLS);
+    fd = mkstemp(path);
+    if (fd < 0)
+      return NULL;
+    unlink(path);
+  }
 
-    // get icon path
-    char *icon_path = get_icon_path(dir_path, ep->d_name);
+  fp = fdopen(fd, "w+");
+  if (!fp)
+    close(fd);
+  return fp;
+}
 
-    if (icon_path) {
-      #ifdef DEBUG
-      PRINT("%s\n", dir_path);
-      PRINT("[generate_html_for_dir] icCCCon_path=%s, for %s\n", icon_path, ep->d_name);
-      #endif
+//
+// sort the current run and write it into a file
+//
+static int spill_run(dir_listing_t *l) {
+  listing_run_t *runs;
+  FILE *fp;
+  size_t i;
 
-      // set <img > tag with icon path
+  runs = (listing_run_t *)realloc(l->runs, (l->runs_count + 1) * sizeof(listing_run_t));
+  if (!runs)
+    return -1;
+  l->runs = runs;
 
-      // see ICONS_FOR_TYPES in setup.h
-      if (ICONS_FOR_TYPES[0] != '/') {
-        // we should set '/' symbol at the beginning
-        // it allows to find icons in WWWROOT directory
-        // else browser will try to find icons in current (uri) directory
-        // and for nested directories we cannot find icons
-        fprintf(fp, "<img src=/%s", ICONS_FOR_TYPES);
-      }
-      
-      if ( ICONS_FOR_TYPES[strlen(ICONS_FOR_TYPES) - 1] != '/' ) {
-        fprintf(fp, "/");
-      }
-      fprintf(fp, "%s height= \"40\" width= \"40 \" > \t", icon_path);
-
-      // free icon path
-      free(icon_path);
-    } else {
-      #ifdef DEBUG
-      PRINT("[generate_html_for_dir]icon_path is NULL for %s\n", ep->d_name);
-      #endif
+  fp = create_run_file();
+  if (!fp) {
+    PRINT("[spill_run]ERROR: cannot create a file in %s (errno=%d)\n", GENERATED_HTMLS, errno);
+    return -1;
+  }
+
+  qsort_r(l->entries, l->entries_count, sizeof(listing_entry_t), compare_entries, l);
+  for (i = 0; i < l->entries_count; i++) {
+    listing_entry_t *e = &l->entries[i];
+
+    if (fwrite(e, sizeof(listing_entry_t), 1, fp) != 1 ||
+        fwrite(l->names + e->name_off, e->name_len, 1, fp) != 1) {
+      PRINT("[spill_run]ERROR: cannot write a run (errno=%d)\n", errno);
+      fclose(fp);
+      return -1;
     }
+  }
+  rewind(fp);
+
+  l->runs[l->runs_count].fp = fp;
+  l->runs_count++;
+  l->entries_count = 0;
+  l->names_len = 0;
 
 #ifdef DEBUG
-    PRINT("DIR_NAME %s\n", dir_name);
+  PRINT("[spill_run]run %d of %s is spilled\n", l->runs_count, l->dir_name);
 #endif
+  return 0;
+}
 
-    // write <a href=" "> for entry
-    
-    fprintf(fp, "<a href=\"%s", dir_name);
-    if ( dir_name[strlen(dir_name) - 1] != '/' ) {
-      fprintf(fp, "/");
+// read the next entry of @run
+// return -1 at the end of the run
+static int read_run_entry(listing_run_t *run) {
+  if (fread(&run->cur, sizeof(listing_entry_t), 1, run->fp) != 1)
+    return -1;
+  if (run->cur.name_len >= LISTING_NAME_LENGTH ||
+      fread(run->name, run->cur.name_len, 1, run->fp) != 1)
+    return -1;
+  run->name[run->cur.name_len] = '\0';
+  return 0;
+}
+
+static int heap_less(dir_listing_t *l, int a, int b) {
+  listing_run_t *ra = &l->runs[l->heap[a]];
+  listing_run_t *rb = &l->runs[l->heap[b]];
+
+  return compare_keys(l, &ra->cur, ra->name, &rb->cur, rb->name) < 0;
+}
+
+static void heap_sift_down(dir_listing_t *l, int i) {
+  while (1) {
+    int smallest = i;
+    int left = 2 * i + 1;
+    int right = 2 * i + 2;
+    int tmp;
+
+    if (left < l->heap_size && heap_less(l, left, smallest))
+      smallest = left;
+    if (right < l->heap_size && heap_less(l, right, smallest))
+      smallest = right;
+    if (smallest == i)
+      return;
+
+    tmp = l->heap[i];
+    l->heap[i] = l->heap[smallest];
+    l->heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+// the smallest entry was sent: take the next one from its run
+static void advance_merge(dir_listing_t *l) {
+  if (read_run_entry(&l->runs[l->heap[0]]) < 0) {
+    l->heap[0] = l->heap[--l->heap_size];
+  }
+  heap_sift_down(l, 0);
+}
+
+//
+// the whole directory was read: prepare sorted output
+// return 0 if success, else -1
+//
+static int finish_scan(dir_listing_t *l) {
+  int i;
+
+  if (l->runs_count == 0) {
+    // the directory fits into memory
+    qsort_r(l->entries, l->entries_count, sizeof(listing_entry_t), compare_entries, l);
+    l->next_entry = 0;
+    l->state = LISTING_SORTED;
+    return 0;
+  }
+
+  if (l->entries_count > 0 && spill_run(l) < 0)
+    return -1;
+
+  // the memory of the last run isn't needed anymore
+  free(l->entries);
+  free(l->names);
+  l->entries = NULL;
+  l->names = NULL;
+  l->entries_cap = l->names_cap = 0;
+
+  l->heap = (int *)malloc(l->runs_count * sizeof(int));
+  if (!l->heap)
+    return -1;
+  l->heap_size = 0;
+  for (i = 0; i < l->runs_count; i++) {
+    if (read_run_entry(&l->runs[i]) == 0)
+      l->heap[l->heap_size++] = i;
+  }
+  for (i = l->heap_size / 2 - 1; i >= 0; i--)
+    heap_sift_down(l, i);
+
+  l->state = LISTING_MERGE;
+  return 0;
+}
+
+//
+// "<size in hex>\r\n<body>\r\n"
+// (the body isn't changed until the chunk is sent, see send_listing())
+//
+static void frame_chunk(dir_listing_t *l) {
+  if (l->chunked) {
+    l->out = chunked_wrap(l->body, l->body_len, &l->out_len);
+  } else {
+    l->out = l->body;
+    l->out_len = l->body_len;
+  }
+  l->out_pos = 0;
+  l->body_len = 0;
+}
+
+//
+// generate the next chunk of the listing into @l->out
+// (it may be empty, if the directory is being read for sorting)
+//
+static void fill_listing_chunk(dir_listing_t *l) {
+  int batches = 0;      // getdents64() batches read in this call
+  int stats_known = (l->opts.sort == SORT_SIZE || l->opts.sort == SORT_MTIME ||
+                     l->opts.format != FORMAT_HTML);
+  char *name;
+  unsigned char type;
+  listing_entry_t *e;
+
+  while (l->body_len < LISTING_CHUNK_SIZE) {
+    switch (l->state) {
+      case LISTING_HEADER :
+        print_listing_header(l);
+        l->state = (l->opts.sort == SORT_NONE) ? LISTING_STREAM : LISTING_SCAN;
+        break;
+
+      case LISTING_STREAM :
+        if (need_dents_batch(l) && batches++ >= LISTING_SCAN_BATCHES)
+          goto frame;
+        if (next_dirent(l, &name, &type) < 0 || emit_entry(l, name, type, NULL))
+          l->state = LISTING_FOOTER;
+        break;
+
+      case LISTING_SCAN :
+        if (need_dents_batch(l) && batches++ >= LISTING_SCAN_BATCHES)
+          goto frame;
+        if (next_dirent(l, &name, &type) < 0) {
+          if (finish_scan(l) < 0)
+            l->state = LISTING_FOOTER;
+          break;
+        }
+        if (add_entry(l, name, type) < 0 ||
+            (l->entries_count == LISTING_RUN_ENTRIES && spill_run(l) < 0)) {
+          PRINT("[fill_listing_chunk]ERROR: cannot sort %s\n", l->dir_name);
+          l->state = LISTING_FOOTER;
+        }
+        break;
+
+      case LISTING_SORTED :
+        if (l->next_entry >= l->entries_count) {
+          l->state = LISTING_FOOTER;
+          break;
+        }
+        e = &l->entries[l->next_entry++];
+        if (emit_entry(l, l->names + e->name_off, e->type, stats_known ? e : NULL))
+          l->state = LISTING_FOOTER;
+        break;
+
+      case LISTING_MERGE :
+        if (l->heap_size == 0) {
+          l->state = LISTING_FOOTER;
+          break;
+        }
+        if (emit_entry(l, l->runs[l->heap[0]].name, l->runs[l->heap[0]].cur.type,
+                       stats_known ? &l->runs[l->heap[0]].cur : NULL))
+          l->state = LISTING_FOOTER;
+        else
+          advance_merge(l);
+        break;
+
+      case LISTING_FOOTER :
+        print_listing_end(l);
+        l->state = LISTING_LAST;
+        break;
+
+      case LISTING_LAST :
+        if (!l->chunked) {
+          // (HTTP/2 ends the stream instead of the last chunk)
+          l->state = LISTING_DONE;
+          goto frame;
+        }
+        if (l->body_len > 0)
+          goto frame;
+        // the last chunk
+        l->out = CHUNKED_LAST;
+        l->out_len = CHUNKED_LAST_LENGTH;
+        l->out_pos = 0;
+        l->state = LISTING_DONE;
+        return;
+
+      default :
+        goto frame;
     }
-    fprintf(fp, "%s\">%s</a></li>\n", ep->d_name, ep->d_name);
+  }
+
+frame:
+  if (l->body_len > 0)
+    frame_chunk(l);
+}
+
+void free_dir_listing(dir_listing_t *l) {
+  int i;
+
+  if (!l)
+    return;
+  if (l->dir_fd >= 0)
+    close(l->dir_fd);
+  for (i = 0; i < l->runs_count; i++)
+    fclose(l->runs[i].fp);
+  free(l->runs);
+  free(l->heap);
+  free(l->entries);
+  free(l->names);
+  free(l->dents);
+  free(l->index_batch);
+  free(l->chunk);
+  free(l->dir_name);
+  free(l);
+}
+
+//
+// prepare a listing of a directory
+//
+// @dir_fd   -- opened directory (this function owns it)
+// @dir_name -- normalised path of the directory (relative to WWWROOT)
+// @query    -- query of the request without '?' (it may be changed)
+// @accept   -- value of Accept header (or NULL), it is used if there is no format= in @query
+// @chunked  -- parts are framed as chunks (FALSE for HTTP/2 streams)
+//
+// returns the listing or NULL
+dir_listing_t *open_dir_listing(int dir_fd, char *dir_name, char *query, char *accept, int chunked) {
+  dir_listing_t *l;
+
+  l = (dir_listing_t *)calloc(1, sizeof(dir_listing_t));
+  if (!l) {
+    close(dir_fd);
+    return NULL;
+  }
+  l->dir_fd = dir_fd;
+  l->state = LISTING_HEADER;
+  l->chunked = chunked;
+  parse_listing_query(query, &l->opts);
+  if (l->opts.format < 0) {
+    if (accept && strstr(accept, "application/json"))
+      l->opts.format = FORMAT_JSON;
+    else if (accept && strstr(accept, "application/cbor"))
+      l->opts.format = FORMAT_CBOR;
+    else
+      l->opts.format = FORMAT_HTML;
+  }
+
+  // the directory is read from the index if it is there
+  l->indexed = (wwwroot_index_lookup(dir_name, NULL) == INDEX_FOUND);
+
+  l->dir_name = strdup(dir_name);
+  if (l->indexed)
+    l->index_batch = (index_entry_t *)malloc(LISTING_INDEX_BATCH * sizeof(index_entry_t));
+  else
+    l->dents = (char *)malloc(LISTING_GETDENTS_SIZE);
+  l->body_max = LISTING_CHUNK_SIZE + LISTING_ENTRY_MAX + get_inline_icon_style_max();
+  l->chunk = (char *)malloc(CHUNKED_HEADER_MAX + l->body_max + CHUNKED_TRAILER_MAX);
+  if (!l->dir_name || (!l->dents && !l->index_batch) || !l->chunk) {
+    PRINT("[open_dir_listing]ERROR: out of memory for %s\n", dir_name);
+    free_dir_listing(l);
+    return NULL;
+  }
+  l->body = l->chunk + CHUNKED_HEADER_MAX;
+  return l;
+}
+
+//
+// prepare a listing of a directory for @node
+// (it will be sent by send_listing(), see open_dir_listing() for arguments)
+//
+// returns 0 if success (-1 else)
+int start_dir_listing(Node_t *node, int dir_fd, char *dir_name, char *query, char *accept) {
+  dir_listing_t *l = open_dir_listing(dir_fd, dir_name, query, accept, TRUE);
+
+  if (!l)
+    return -1;
+  node->data.listing = l;
+  return 0;
+}
 
+// Content-Type of the listing
+char *get_listing_content_type(dir_listing_t *l) {
+  switch (l->opts.format) {
+    case FORMAT_JSON : return "application/json";
+    case FORMAT_CBOR : return "application/cbor";
+    default :          return "text/html";
   }
+}
+
+//
+// Parts of a listing for other senders (HTTP/2 streams, see http2.c)
+//
 
-  fprintf(fp, "</ul>\n");
-  print_html_end(fp);
+// (in a worker thread) generate the next part, when the current one is consumed
+void fill_dir_listing(dir_listing_t *l) {
+  fill_listing_chunk(l);
+}
+
+// unsent bytes of the current part
+size_t get_listing_output(dir_listing_t *l, char **data) {
+  *data = l->out + l->out_pos;
+  return l->out_len - l->out_pos;
+}
 
-  if (fclose(fp) != 0) {
-    PRINT("[generate_html_for_dir]ERROR: fclose %s!\n", generated_html_name);
-    res = -1;
+void consume_listing_output(dir_listing_t *l, size_t bytes) {
+  l->out_pos += bytes;
+}
+
+// TRUE if the whole listing is consumed
+int is_listing_done(dir_listing_t *l) {
+  return l->out_pos == l->out_len && l->state == LISTING_DONE;
+}
+
+// see server_work.c
+extern void submit_connection_job(Node_t *node, io_job_t *job);
+extern Node_t *finish_connection_job(io_job_t *job);
+
+// (in a worker thread)
+static void fill_listing_job(io_job_t *job) {
+  fill_listing_chunk((dir_listing_t *)job);
+}
+
+// (in the event loop) the chunk is sent by the next call of send_listing()
+static void fill_listing_completed(io_job_t *job) {
+  if (!finish_connection_job(job)) {
+    // the connection was closed
+    free_dir_listing((dir_listing_t *)job);
+  }
+}
+
+//
+// send the next chunk of the listing of @node
+//
+// return:
+//     -1, if the listing was not sent fully yet
+//     0,  if the listing was sent (or the connection is broken)
+int send_listing(Node_t *node, int sfd) {
+  dir_listing_t *l = node->data.listing;
+  ssize_t bytes_sent;
+  size_t count;
+
+  if (l->out_pos == l->out_len) {
+    if (l->state == LISTING_DONE)
+      goto done;
+    l->job.work = fill_listing_job;
+    l->job.complete = fill_listing_completed;
+    submit_connection_job(node, &l->job);
+    if (node->data.io_job)
+      return -1;
   }
 
-close_dir:
-  if ( closedir(dp) < 0 ) {
-    PRINT("[generate_html_for_dir]ERROR: closedir %s!\n", dir_path);
-    res = -1;
+  // (at most the quota of the send scheduler, see send_sched.c)
+  count = l->out_len - l->out_pos;
+  if (count > node->data.send_quota)
+    count = node->data.send_quota;
+  if (count > 0) {
+    bytes_sent = tls_send(sfd, l->out + l->out_pos, count);
+    if (bytes_sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        node->data.send_blocked = TRUE;
+        return -1;
+      }
+      PRINT("[send_listing]ERROR: cannot send a listing to sfd=%d (errno=%d)\n", sfd, errno);
+      goto done;
+    }
+    l->out_pos += bytes_sent;
+    node->data.send_quota -= bytes_sent;
+    if ((size_t)bytes_sent < count)
+      node->data.send_blocked = TRUE;
   }
 
-  return res;
+  if (l->out_pos == l->out_len && l->state == LISTING_DONE)
+    goto done;
+  return -1;
+
+done:
+  free_dir_listing(l);
+  node->data.listing = NULL;
+  return 0;
 }
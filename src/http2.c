@@ -0,0 +1,1152 @@
+#define _GNU_SOURCE
+#include "http2.h"
+#include "readahead.h"
+#include "wwwroot_index.h"
+#include "trace.h"
+#include "tls.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+//
+// HTTP/2 connections (see http2.h)
+//
+
+#define FRAME_HEADER_LENGTH   9
+#define DATA_FRAME_MAX        (64 * 1024)   // max payload of DATA (if the client allows it)
+#define WINDOW_MAX            0x7fffffffLL
+#define WEIGHT_DEFAULT        16
+
+// frame types
+#define FRAME_DATA            0x0
+#define FRAME_HEADERS         0x1
+#define FRAME_PRIORITY        0x2
+#define FRAME_RST_STREAM      0x3
+#define FRAME_SETTINGS        0x4
+#define FRAME_PUSH_PROMISE    0x5
+#define FRAME_PING            0x6
+#define FRAME_GOAWAY          0x7
+#define FRAME_WINDOW_UPDATE   0x8
+#define FRAME_CONTINUATION    0x9
+
+// flags
+#define FLAG_END_STREAM       0x1
+#define FLAG_ACK              0x1
+#define FLAG_END_HEADERS      0x4
+#define FLAG_PADDED           0x8
+#define FLAG_PRIORITY         0x20
+
+// settings
+#define SETTINGS_ENABLE_PUSH              0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS   0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE      0x4
+#define SETTINGS_MAX_FRAME_SIZE           0x5
+
+// error codes
+#define NO_ERROR              0x0
+#define PROTOCOL_ERROR        0x1
+#define INTERNAL_ERROR        0x2
+#define FLOW_CONTROL_ERROR    0x3
+#define STREAM_CLOSED         0x5
+#define FRAME_SIZE_ERROR      0x6
+#define REFUSED_STREAM        0x7
+#define COMPRESSION_ERROR     0x9
+
+// states of connections
+#define H2_PREFACE_WAIT       0     // the client preface is awaited
+#define H2_FRAMES             1
+#define H2_GOAWAY             2     // GOAWAY is queued, the connection is closed when it is sent
+#define H2_BROKEN             3     // the connection is closed at once
+
+// phases of streams
+#define STREAM_RESOLVING      0     // the resource is being opened
+#define STREAM_HEADERS        1     // the header of the response is to be sent
+#define STREAM_BODY           2
+
+// see server_work.c
+extern int set_connection_events(int sfd, uint32_t events);
+
+// see request_handling.c
+extern int get_extension(char *filename, char *extension, size_t max_extension_length);
+
+// see mime_table.c
+extern const char *lookup_mime_type(const char *extension);
+
+// see html_generation_for_dir.c
+extern struct dir_listing *open_dir_listing(int dir_fd, char *dir_name, char *query, char *accept, int chunked);
+extern void free_dir_listing(struct dir_listing *l);
+extern char *get_listing_content_type(struct dir_listing *l);
+extern void fill_dir_listing(struct dir_listing *l);
+extern size_t get_listing_output(struct dir_listing *l, char **data);
+extern void consume_listing_output(struct dir_listing *l, size_t bytes);
+extern int is_listing_done(struct dir_listing *l);
+
+static uint32_t get_u32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+  p[0] = (unsigned char)(value >> 24);
+  p[1] = (unsigned char)(value >> 16);
+  p[2] = (unsigned char)(value >> 8);
+  p[3] = (unsigned char)value;
+}
+
+static void put_frame_header(unsigned char *p, size_t length, int type, int flags, uint32_t stream_id) {
+  p[0] = (unsigned char)(length >> 16);
+  p[1] = (unsigned char)(length >> 8);
+  p[2] = (unsigned char)length;
+  p[3] = (unsigned char)type;
+  p[4] = (unsigned char)flags;
+  put_u32(p + 5, stream_id & 0x7fffffff);
+}
+
+//
+// room for @length bytes at the end of the output
+// return NULL if there is too much unsent output (the connection is broken then)
+//
+static unsigned char *reserve_output(h2_conn_t *c, size_t length) {
+  unsigned char *out;
+  size_t cap;
+
+  if (c->out_pos == c->out_len)
+    c->out_pos = c->out_len = 0;
+  if (c->out_len + length <= c->out_cap)
+    return c->out + c->out_len;
+
+  // sent bytes are dropped first
+  if (c->out_pos > 0) {
+    memmove(c->out, c->out + c->out_pos, c->out_len - c->out_pos);
+    c->out_len -= c->out_pos;
+    c->out_pos = 0;
+    if (c->out_len + length <= c->out_cap)
+      return c->out + c->out_len;
+  }
+
+  cap = c->out_cap ? c->out_cap : (FRAME_HEADER_LENGTH + H2_FRAME_SIZE);
+  while (cap < c->out_len + length)
+    cap *= 2;
+  if (c->out_len + length > H2_OUTPUT_MAX + FRAME_HEADER_LENGTH + DATA_FRAME_MAX)
+    goto broken;
+  out = (unsigned char *)realloc(c->out, cap);
+  if (!out)
+    goto broken;
+  c->out = out;
+  c->out_cap = cap;
+  return c->out + c->out_len;
+
+broken:
+  PRINT("[reserve_output]ERROR: too much output on sfd=%d\n", c->sfd);
+  c->state = H2_BROKEN;
+  return NULL;
+}
+
+static void queue_frame(h2_conn_t *c, int type, int flags, uint32_t stream_id,
+                        const void *payload, size_t length) {
+  unsigned char *p = reserve_output(c, FRAME_HEADER_LENGTH + length);
+
+  if (!p)
+    return;
+  put_frame_header(p, length, type, flags, stream_id);
+  if (length)
+    memcpy(p + FRAME_HEADER_LENGTH, payload, length);
+  c->out_len += FRAME_HEADER_LENGTH + length;
+}
+
+// a connection error: GOAWAY is sent and the connection is closed
+static void send_goaway(h2_conn_t *c, uint32_t error) {
+  unsigned char payload[8];
+
+  if (c->state >= H2_GOAWAY)
+    return;
+#ifdef DEBUG
+  PRINT("[send_goaway]sfd=%d error=%u\n", c->sfd, error);
+#endif
+  put_u32(payload, c->last_stream_id);
+  put_u32(payload + 4, error);
+  queue_frame(c, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+  if (c->state != H2_BROKEN)
+    c->state = H2_GOAWAY;
+}
+
+static void send_rst_stream(h2_conn_t *c, uint32_t stream_id, uint32_t error) {
+  unsigned char payload[4];
+
+  put_u32(payload, error);
+  queue_frame(c, FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void send_window_update(h2_conn_t *c, uint32_t stream_id, uint32_t increment) {
+  unsigned char payload[4];
+
+  put_u32(payload, increment);
+  queue_frame(c, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+//
+// Streams
+//
+
+static h2_stream_t *find_stream(h2_conn_t *c, uint32_t id) {
+  h2_stream_t *s;
+
+  for (s = c->streams; s; s = s->next) {
+    if (s->id == id)
+      return s;
+  }
+  return NULL;
+}
+
+static h2_stream_t *new_stream(h2_conn_t *c, uint32_t id, int weight) {
+  h2_stream_t *s, **tail;
+
+  s = (h2_stream_t *)calloc(1, sizeof(h2_stream_t));
+  if (!s)
+    return NULL;
+  s->conn = c;
+  s->id = id;
+  s->weight = weight;
+  s->window = c->initial_window;
+  // (a new stream doesn't take the turns which the others have used)
+  s->pass = c->pass;
+  s->fd = -1;
+  s->phase = STREAM_RESOLVING;
+
+  for (tail = &c->streams; *tail; tail = &(*tail)->next)
+    ;
+  *tail = s;
+  c->streams_count++;
+  return s;
+}
+
+static void free_stream(h2_stream_t *s) {
+  if (s->fd >= 0)
+    close(s->fd);
+  readahead_close(s->readahead);
+  if (s->listing)
+    free_dir_listing(s->listing);
+  free(s->query);
+  free(s);
+}
+
+// the stream is finished (or reset)
+static void close_stream(h2_conn_t *c, h2_stream_t *s) {
+  h2_stream_t **p;
+
+  for (p = &c->streams; *p; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      c->streams_count--;
+      break;
+    }
+  }
+
+  if (s->job_pending) {
+    // a worker still uses it, the job frees it
+    s->conn = NULL;
+    return;
+  }
+  free_stream(s);
+}
+
+// an error response (or 405) with a short text
+static void respond_message(h2_stream_t *s, int status, const char *message) {
+  s->status = status;
+  s->message = message;
+  s->message_pos = 0;
+  s->content_type = "text/plain";
+  s->phase = STREAM_HEADERS;
+}
+
+// (in the event loop)
+static void stream_job_completed(io_job_t *job);
+
+static void submit_stream_job(h2_stream_t *s, void (*work)(io_job_t *job)) {
+  s->job.work = work;
+  s->job.complete = stream_job_completed;
+  s->job.sfd = s->conn->sfd;
+  s->job.conn_id = trace_connection_id(s->conn->sfd);
+  s->job_pending = TRUE;
+
+  if (io_pool_submit(&s->job) < 0) {
+    // (without the pool the job is done in place)
+    work(&s->job);
+    stream_job_completed(&s->job);
+  }
+}
+
+// (in a worker thread)
+static void open_stream_resource(io_job_t *job) {
+  h2_stream_t *s = (h2_stream_t *)job;
+
+  // the same lookup as for HTTP/1 requests (see open_resource() in request_handling.c)
+  s->fd = open_beneath_root(s->path, O_RDONLY | O_NONBLOCK, 0);
+  if (s->fd < 0) {
+    s->err = errno;
+    return;
+  }
+
+  if (fstat(s->fd, &s->statbuf) < 0) {
+    s->err = errno;
+    close(s->fd);
+    s->fd = -1;
+    return;
+  }
+
+  if (S_ISREG(s->statbuf.st_mode)) {
+    s->has_digest = (load_file_digest(s->fd, s->path, &s->statbuf, &s->digest) == 0);
+    s->readahead = readahead_open(s->fd, s->statbuf.st_size);
+  }
+}
+
+// (in a worker thread)
+static void fill_stream_listing(io_job_t *job) {
+  fill_dir_listing(((h2_stream_t *)job)->listing);
+}
+
+// (in the event loop) the resource is opened, the header of the response is sent next
+static void open_stream_completed(h2_stream_t *s) {
+  if (s->fd < 0) {
+#ifdef DEBUG
+    PRINT("[open_stream_completed]cannot open %s (errno=%d)\n", s->path, s->err);
+#endif
+    respond_message(s, 404, "404 file not found\n");
+    return;
+  }
+
+  if (S_ISREG(s->statbuf.st_mode)) {
+    s->status = 200;
+    s->content_type = s->mime;
+    s->phase = STREAM_HEADERS;
+  } else if (S_ISDIR(s->statbuf.st_mode)) {
+    // (the listing owns the descriptor)
+    s->listing = open_dir_listing(s->fd, s->path, s->query, s->has_accept ? s->accept : NULL, FALSE);
+    s->fd = -1;
+    if (!s->listing) {
+      respond_message(s, 500, "ERROR: server problem with a listing\n");
+      return;
+    }
+    s->status = 200;
+    s->content_type = get_listing_content_type(s->listing);
+    s->phase = STREAM_HEADERS;
+  } else {
+    close(s->fd);
+    s->fd = -1;
+    respond_message(s, 403, "file type is not supported\n");
+  }
+}
+
+static void stream_job_completed(io_job_t *job) {
+  h2_stream_t *s = (h2_stream_t *)job;
+
+  s->job_pending = FALSE;
+  if (!s->conn) {
+    // the stream was reset or the connection was closed
+    free_stream(s);
+    return;
+  }
+
+  if (s->phase == STREAM_RESOLVING)
+    open_stream_completed(s);
+
+  // the connection sends again (see send_responses() in server_work.c)
+  set_connection_events(s->conn->sfd, EPOLLIN | EPOLLOUT);
+}
+
+typedef struct h2_request {
+  char method[16];
+  char path[REQUEST_PATH_LENGTH];   // (with the query)
+  char accept[H2_ACCEPT_LENGTH];
+  int has_method;
+  int has_path;
+  int has_accept;
+  int malformed;
+} h2_request_t;
+
+static int copy_field(char *buf, size_t max, const char *value, size_t length) {
+  if (length >= max)
+    return -1;
+  memcpy(buf, value, length);
+  buf[length] = '\0';
+  return 0;
+}
+
+// (hpack_field_cb, see hpack.h)
+static void request_field(void *arg, const char *name, size_t name_length,
+                          const char *value, size_t value_length) {
+  h2_request_t *r = (h2_request_t *)arg;
+
+  if (name_length == 7 && !memcmp(name, ":method", 7)) {
+    r->has_method = TRUE;
+    if (copy_field(r->method, sizeof(r->method), value, value_length) < 0)
+      r->malformed = TRUE;
+  } else if (name_length == 5 && !memcmp(name, ":path", 5)) {
+    r->has_path = TRUE;
+    if (copy_field(r->path, sizeof(r->path), value, value_length) < 0)
+      r->malformed = TRUE;
+  } else if (name_length == 6 && !memcmp(name, "accept", 6)) {
+    // (a long Accept is cut, as in get_header_value())
+    if (value_length >= sizeof(r->accept))
+      value_length = sizeof(r->accept) - 1;
+    copy_field(r->accept, sizeof(r->accept), value, value_length);
+    r->has_accept = TRUE;
+  }
+}
+
+//
+// start the response of the request @r on stream @s
+// (GET and HEAD of files and directories, like handle_http_GET() in request_handling.c)
+//
+static void start_request(h2_stream_t *s, h2_request_t *r) {
+  char extension[16];
+  const char *mime;
+  char *query;
+  int res;
+
+  s->head = !strcmp(r->method, "HEAD");
+  if (!s->head && strcmp(r->method, "GET")) {
+    respond_message(s, 405, "405 Method Not Allowed\n");
+    return;
+  }
+
+  // (see path_resolution.c)
+  res = normalize_request_path(r->path, s->path, REQUEST_PATH_LENGTH);
+  if (res == -2) {
+    respond_message(s, 404, "404 Not Found\n");
+    return;
+  }
+  if (res < 0) {
+    respond_message(s, 400, "400 Bad Request\n");
+    return;
+  }
+  if (strcmp(s->path, "/") == 0)
+    strcpy(s->path, "/" WWWROOT_PAGE);
+
+  query = strchr(r->path, '?');
+  s->query = strdup(query ? query + 1 : "");
+  if (!s->query) {
+    respond_message(s, 500, "ERROR: server problem (out of memory)\n");
+    return;
+  }
+  if (r->has_accept) {
+    strcpy(s->accept, r->accept);
+    s->has_accept = TRUE;
+  }
+  if (get_extension(s->path, extension, sizeof(extension) - 1) == 0 &&
+      (mime = lookup_mime_type(extension)) != NULL)
+    strncpy(s->mime, mime, sizeof(s->mime) - 1);
+
+  // a missing file is rejected without a lookup on disk (see wwwroot_index.c)
+  if (wwwroot_index_lookup(s->path, NULL) == INDEX_MISSING) {
+    respond_message(s, 404, "404 file not found\n");
+    return;
+  }
+
+  submit_stream_job(s, open_stream_resource);
+}
+
+//
+// Frames of the client
+//
+
+// return 0 or an error code
+static uint32_t apply_settings(h2_conn_t *c, const unsigned char *p, size_t length) {
+  h2_stream_t *s;
+  uint32_t value;
+  size_t i;
+
+  for (i = 0; i + 6 <= length; i += 6) {
+    value = get_u32(p + i + 2);
+    switch ((p[i] << 8) | p[i + 1]) {
+      case SETTINGS_ENABLE_PUSH :
+        if (value > 1)
+          return PROTOCOL_ERROR;
+        break;
+      case SETTINGS_INITIAL_WINDOW_SIZE :
+        if (value > WINDOW_MAX)
+          return FLOW_CONTROL_ERROR;
+        // windows of open streams change by the difference
+        for (s = c->streams; s; s = s->next)
+          s->window += (long long)value - c->initial_window;
+        c->initial_window = value;
+        break;
+      case SETTINGS_MAX_FRAME_SIZE :
+        if (value < H2_FRAME_SIZE || value > 0xffffff)
+          return PROTOCOL_ERROR;
+        c->max_frame = value;
+        break;
+    }
+  }
+  return 0;
+}
+
+// decode base64url (without padding) of HTTP2-Settings
+// return number of bytes or -1
+static ssize_t base64url_decode(const char *in, unsigned char *out, size_t max) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  uint32_t bits = 0;
+  int bits_count = 0;
+  size_t n = 0;
+  const char *c;
+
+  for (; *in && *in != '='; in++) {
+    c = strchr(alphabet, *in);
+    if (!c)
+      return -1;
+    bits = (bits << 6) | (uint32_t)(c - alphabet);
+    bits_count += 6;
+    if (bits_count >= 8) {
+      bits_count -= 8;
+      if (n >= max)
+        return -1;
+      out[n++] = (unsigned char)(bits >> bits_count);
+    }
+  }
+  return (ssize_t)n;
+}
+
+// a header block is complete: a new request
+static void end_header_block(h2_conn_t *c) {
+  h2_request_t r;
+  h2_stream_t *s;
+  uint32_t id = c->block_stream;
+  int res;
+
+  memset(&r, 0, sizeof(h2_request_t));
+  // (the block is always decoded: it changes the dynamic table)
+  res = hpack_decode(&c->hpack, c->block, c->block_len, request_field, &r);
+  free(c->block);
+  c->block = NULL;
+  c->block_len = 0;
+  if (res < 0) {
+    send_goaway(c, COMPRESSION_ERROR);
+    return;
+  }
+
+  if (id <= c->last_stream_id) {
+    // trailers of a request (they are ignored)
+    return;
+  }
+  c->last_stream_id = id;
+
+  if (r.malformed || !r.has_method || !r.has_path) {
+    send_rst_stream(c, id, PROTOCOL_ERROR);
+    return;
+  }
+  if (c->streams_count >= H2_MAX_STREAMS || (s = new_stream(c, id, c->block_weight)) == NULL) {
+    send_rst_stream(c, id, REFUSED_STREAM);
+    return;
+  }
+  start_request(s, &r);
+}
+
+static void handle_headers(h2_conn_t *c, int flags, uint32_t id, const unsigned char *p, size_t length) {
+  size_t pad = 0;
+  int weight = WEIGHT_DEFAULT;
+
+  if (id == 0 || !(id & 1)) {
+    send_goaway(c, PROTOCOL_ERROR);
+    return;
+  }
+  if (flags & FLAG_PADDED) {
+    if (length < 1 || p[0] >= length) {
+      send_goaway(c, PROTOCOL_ERROR);
+      return;
+    }
+    pad = p[0];
+    p++;
+    length--;
+  }
+  if (flags & FLAG_PRIORITY) {
+    // (the dependency is ignored, only the weight is used)
+    if (length < pad + 5) {
+      send_goaway(c, PROTOCOL_ERROR);
+      return;
+    }
+    weight = p[4] + 1;
+    p += 5;
+    length -= 5;
+  }
+  length -= pad;
+
+  c->block = (unsigned char *)malloc(length ? length : 1);
+  if (!c->block) {
+    send_goaway(c, INTERNAL_ERROR);
+    return;
+  }
+  memcpy(c->block, p, length);
+  c->block_len = length;
+  c->block_stream = id;
+  c->block_flags = flags;
+  c->block_weight = weight;
+  if (flags & FLAG_END_HEADERS)
+    end_header_block(c);
+}
+
+static void handle_continuation(h2_conn_t *c, int flags, const unsigned char *p, size_t length) {
+  unsigned char *block;
+
+  if (c->block_len + length > H2_HEADER_BLOCK_MAX) {
+    send_goaway(c, PROTOCOL_ERROR);
+    return;
+  }
+  block = (unsigned char *)realloc(c->block, c->block_len + length + 1);
+  if (!block) {
+    send_goaway(c, INTERNAL_ERROR);
+    return;
+  }
+  memcpy(block + c->block_len, p, length);
+  c->block = block;
+  c->block_len += length;
+  if (flags & FLAG_END_HEADERS)
+    end_header_block(c);
+}
+
+static void handle_window_update(h2_conn_t *c, uint32_t id, const unsigned char *p, size_t length) {
+  uint32_t increment;
+  h2_stream_t *s;
+
+  if (length != 4) {
+    send_goaway(c, FRAME_SIZE_ERROR);
+    return;
+  }
+  increment = get_u32(p) & 0x7fffffff;
+
+  if (id == 0) {
+    if (increment == 0) {
+      send_goaway(c, PROTOCOL_ERROR);
+      return;
+    }
+    c->window += increment;
+    if (c->window > WINDOW_MAX)
+      send_goaway(c, FLOW_CONTROL_ERROR);
+    return;
+  }
+
+  s = find_stream(c, id);
+  if (!s)
+    return;
+  if (increment == 0 || s->window + increment > WINDOW_MAX) {
+    send_rst_stream(c, id, increment ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR);
+    close_stream(c, s);
+    return;
+  }
+  s->window += increment;
+}
+
+static void handle_frame(h2_conn_t *c, int type, int flags, uint32_t id,
+                         const unsigned char *p, size_t length) {
+  h2_stream_t *s;
+  uint32_t error;
+
+  // a header block isn't interrupted by other frames
+  if (c->block && (type != FRAME_CONTINUATION || id != c->block_stream)) {
+    send_goaway(c, PROTOCOL_ERROR);
+    return;
+  }
+
+  switch (type) {
+    case FRAME_DATA :
+      // bodies of requests aren't used, but the client may send more
+      if (id == 0) {
+        send_goaway(c, PROTOCOL_ERROR);
+        return;
+      }
+      if (length > 0) {
+        send_window_update(c, 0, length);
+        if (!(flags & FLAG_END_STREAM) && find_stream(c, id))
+          send_window_update(c, id, length);
+      }
+      break;
+
+    case FRAME_HEADERS :
+      handle_headers(c, flags, id, p, length);
+      break;
+
+    case FRAME_CONTINUATION :
+      if (!c->block) {
+        send_goaway(c, PROTOCOL_ERROR);
+        return;
+      }
+      handle_continuation(c, flags, p, length);
+      break;
+
+    case FRAME_PRIORITY :
+      if (id == 0) {
+        send_goaway(c, PROTOCOL_ERROR);
+        return;
+      }
+      if (length != 5) {
+        send_rst_stream(c, id, FRAME_SIZE_ERROR);
+        return;
+      }
+      s = find_stream(c, id);
+      if (s)
+        s->weight = p[4] + 1;
+      break;
+
+    case FRAME_RST_STREAM :
+      if (id == 0 || length != 4) {
+        send_goaway(c, (id == 0) ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+        return;
+      }
+      s = find_stream(c, id);
+      if (s)
+        close_stream(c, s);
+      break;
+
+    case FRAME_SETTINGS :
+      if (id != 0) {
+        send_goaway(c, PROTOCOL_ERROR);
+        return;
+      }
+      if (flags & FLAG_ACK) {
+        if (length != 0)
+          send_goaway(c, FRAME_SIZE_ERROR);
+        return;
+      }
+      if (length % 6) {
+        send_goaway(c, FRAME_SIZE_ERROR);
+        return;
+      }
+      error = apply_settings(c, p, length);
+      if (error) {
+        send_goaway(c, error);
+        return;
+      }
+      queue_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+      break;
+
+    case FRAME_PING :
+      if (id != 0 || length != 8) {
+        send_goaway(c, (id != 0) ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+        return;
+      }
+      if (!(flags & FLAG_ACK))
+        queue_frame(c, FRAME_PING, FLAG_ACK, 0, p, length);
+      break;
+
+    case FRAME_WINDOW_UPDATE :
+      handle_window_update(c, id, p, length);
+      break;
+
+    case FRAME_PUSH_PROMISE :
+      // (only servers push)
+      send_goaway(c, PROTOCOL_ERROR);
+      break;
+
+    case FRAME_GOAWAY :
+      // the client closes the connection after its streams
+      break;
+
+    default :
+      // unknown frames are ignored
+      break;
+  }
+}
+
+//
+// Connections
+//
+
+h2_conn_t *h2_open(int sfd, const char *settings) {
+  unsigned char payload[6];
+  unsigned char upgrade_settings[256];
+  ssize_t settings_length;
+  h2_conn_t *c;
+
+  c = (h2_conn_t *)calloc(1, sizeof(h2_conn_t));
+  if (!c)
+    return NULL;
+  c->sfd = sfd;
+  c->state = H2_PREFACE_WAIT;
+  c->max_frame = H2_FRAME_SIZE;
+  c->initial_window = H2_WINDOW_SIZE;
+  c->window = H2_WINDOW_SIZE;
+  hpack_decoder_init(&c->hpack);
+
+  // settings of Upgrade are acknowledged by 101 (RFC 7540, 3.2.1)
+  if (settings) {
+    settings_length = base64url_decode(settings, upgrade_settings, sizeof(upgrade_settings));
+    if (settings_length < 0 || settings_length % 6 ||
+        apply_settings(c, upgrade_settings, settings_length) != 0) {
+      PRINT("[h2_open]bad HTTP2-Settings on sfd=%d\n", sfd);
+      h2_close(c);
+      return NULL;
+    }
+  }
+
+  // the server preface
+  payload[0] = 0;
+  payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+  put_u32(payload + 2, H2_MAX_STREAMS);
+  queue_frame(c, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+  if (c->state == H2_BROKEN) {
+    h2_close(c);
+    return NULL;
+  }
+  return c;
+}
+
+int h2_upgrade_stream(h2_conn_t *c, int head, char *raw_path, char *accept) {
+  h2_request_t r;
+  h2_stream_t *s;
+
+  memset(&r, 0, sizeof(h2_request_t));
+  strcpy(r.method, head ? "HEAD" : "GET");
+  if (copy_field(r.path, sizeof(r.path), raw_path, strlen(raw_path)) < 0)
+    return -1;
+  if (accept) {
+    strncpy(r.accept, accept, sizeof(r.accept) - 1);
+    r.has_accept = TRUE;
+  }
+
+  c->last_stream_id = 1;
+  s = new_stream(c, 1, WEIGHT_DEFAULT);
+  if (!s)
+    return -1;
+  start_request(s, &r);
+  return 0;
+}
+
+void h2_input(h2_conn_t *c, const char *data, size_t length) {
+  unsigned char *in;
+  size_t pos = 0, frame_length;
+  int type, flags;
+  uint32_t id;
+
+  if (c->state >= H2_GOAWAY)
+    return;
+
+  if (c->in_len + length > c->in_cap) {
+    in = (unsigned char *)realloc(c->in, c->in_len + length);
+    if (!in) {
+      send_goaway(c, INTERNAL_ERROR);
+      return;
+    }
+    c->in = in;
+    c->in_cap = c->in_len + length;
+  }
+  memcpy(c->in + c->in_len, data, length);
+  c->in_len += length;
+
+  if (c->state == H2_PREFACE_WAIT) {
+    if (memcmp(c->in, H2_PREFACE, (c->in_len < H2_PREFACE_LENGTH) ? c->in_len : H2_PREFACE_LENGTH)) {
+      send_goaway(c, PROTOCOL_ERROR);
+      return;
+    }
+    if (c->in_len < H2_PREFACE_LENGTH)
+      return;
+    pos = H2_PREFACE_LENGTH;
+    c->state = H2_FRAMES;
+  }
+
+  while (c->state == H2_FRAMES && c->in_len - pos >= FRAME_HEADER_LENGTH) {
+    frame_length = ((size_t)c->in[pos] << 16) | ((size_t)c->in[pos + 1] << 8) | c->in[pos + 2];
+    type = c->in[pos + 3];
+    flags = c->in[pos + 4];
+    id = get_u32(c->in + pos + 5) & 0x7fffffff;
+
+    // (SETTINGS_MAX_FRAME_SIZE of the server is the default)
+    if (frame_length > H2_FRAME_SIZE) {
+      send_goaway(c, FRAME_SIZE_ERROR);
+      break;
+    }
+    if (c->in_len - pos < FRAME_HEADER_LENGTH + frame_length)
+      break;
+
+    handle_frame(c, type, flags, id, c->in + pos + FRAME_HEADER_LENGTH, frame_length);
+    pos += FRAME_HEADER_LENGTH + frame_length;
+  }
+
+  // the rest is a part of the next frame
+  memmove(c->in, c->in + pos, c->in_len - pos);
+  c->in_len -= pos;
+}
+
+//
+// Responses
+//
+
+//
+// encode fields of @extra ("\r\nName: value...", see format_digest_headers())
+// return number of bytes
+//
+static size_t encode_extra_headers(unsigned char *out, size_t max, const char *extra) {
+  char name[64], value[DIGEST_HEADERS_MAX];
+  const char *line = extra, *colon, *end;
+  size_t n = 0, i, length;
+
+  while ((line = strstr(line, "\r\n")) != NULL) {
+    line += 2;
+    colon = strchr(line, ':');
+    if (!colon || (size_t)(colon - line) >= sizeof(name))
+      break;
+    end = strstr(colon, "\r\n");
+    if (!end)
+      end = colon + strlen(colon);
+
+    // names of HTTP/2 fields are lowercase
+    for (i = 0; line + i < colon; i++)
+      name[i] = tolower((unsigned char)line[i]);
+    name[i] = '\0';
+    colon++;
+    while (*colon == ' ')
+      colon++;
+    length = end - colon;
+    if (length >= sizeof(value))
+      break;
+    memcpy(value, colon, length);
+    value[length] = '\0';
+
+    n += hpack_encode_field(out + n, max - n, strcmp(name, "etag") ? 0 : HPACK_ETAG,
+                            strcmp(name, "etag") ? name : NULL, value);
+    line = end;
+  }
+  return n;
+}
+
+// HEADERS of the response of @s (END_STREAM if it has no body)
+static void queue_response_headers(h2_conn_t *c, h2_stream_t *s) {
+  unsigned char block[1024];
+  char number[32];
+  char digest_headers[DIGEST_HEADERS_MAX];
+  size_t n;
+  int end_stream = s->head;
+
+  n = hpack_encode_status(block, s->status);
+  n += hpack_encode_field(block + n, sizeof(block) - n, HPACK_SERVER, NULL, "sSs");
+  if (s->content_type && *s->content_type)
+    n += hpack_encode_field(block + n, sizeof(block) - n, HPACK_CONTENT_TYPE, NULL, s->content_type);
+
+  if (s->message) {
+    snprintf(number, sizeof(number), "%zu", strlen(s->message));
+    n += hpack_encode_field(block + n, sizeof(block) - n, HPACK_CONTENT_LENGTH, NULL, number);
+  } else if (!s->listing) {
+    snprintf(number, sizeof(number), "%lld", (long long)s->statbuf.st_size);
+    n += hpack_encode_field(block + n, sizeof(block) - n, HPACK_CONTENT_LENGTH, NULL, number);
+    if (s->has_digest) {
+      format_digest_headers(&s->digest, digest_headers, sizeof(digest_headers));
+      n += encode_extra_headers(block + n, sizeof(block) - n, digest_headers);
+    }
+    if (s->statbuf.st_size == 0)
+      end_stream = TRUE;
+  }
+
+  queue_frame(c, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0), s->id, block, n);
+  if (end_stream)
+    close_stream(c, s);
+  else
+    s->phase = STREAM_BODY;
+}
+
+// the stream may send DATA now
+static int stream_has_data(h2_conn_t *c, h2_stream_t *s) {
+  if (s->phase != STREAM_BODY || s->job_pending)
+    return FALSE;
+  // (the end of a listing may have no data)
+  if (s->listing && is_listing_done(s->listing))
+    return TRUE;
+  // (the stream waits for readahead, it is woken up by EPOLLOUT)
+  if (s->readahead && s->readahead->waiting)
+    return FALSE;
+  return c->window > 0 && s->window > 0;
+}
+
+int h2_has_output(h2_conn_t *c) {
+  h2_stream_t *s;
+
+  if (c->state >= H2_GOAWAY || c->out_pos < c->out_len)
+    return TRUE;
+  for (s = c->streams; s; s = s->next) {
+    if (s->phase == STREAM_HEADERS || stream_has_data(c, s))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+//
+// queue the next DATA frame of @s (at most @quota bytes of payload)
+//
+static void queue_data(h2_conn_t *c, h2_stream_t *s, size_t quota) {
+  readahead_t *ra = s->readahead;
+  unsigned char *p;
+  char *data;
+  size_t count = DATA_FRAME_MAX, available;
+  ssize_t n;
+  int end_stream;
+
+  if (count > c->max_frame)
+    count = c->max_frame;
+  if (count > quota)
+    count = quota;
+  if ((long long)count > c->window)
+    count = c->window;
+  if ((long long)count > s->window)
+    count = s->window;
+
+  if (s->listing) {
+    available = get_listing_output(s->listing, &data);
+    if (available == 0 && !is_listing_done(s->listing)) {
+      // the next part is generated by a worker
+      submit_stream_job(s, fill_stream_listing);
+      return;
+    }
+    if (count > available)
+      count = available;
+    p = reserve_output(c, FRAME_HEADER_LENGTH + count);
+    if (!p)
+      return;
+    memcpy(p + FRAME_HEADER_LENGTH, data, count);
+    consume_listing_output(s->listing, count);
+    end_stream = is_listing_done(s->listing);
+  } else if (s->message) {
+    available = strlen(s->message) - s->message_pos;
+    if (count > available)
+      count = available;
+    p = reserve_output(c, FRAME_HEADER_LENGTH + count);
+    if (!p)
+      return;
+    memcpy(p + FRAME_HEADER_LENGTH, s->message + s->message_pos, count);
+    s->message_pos += count;
+    end_stream = (s->message_pos == strlen(s->message));
+  } else {
+    if ((off_t)count > s->statbuf.st_size - s->pos)
+      count = s->statbuf.st_size - s->pos;
+    // a big file is sent only as far as it is read ahead (see readahead.c)
+    if (ra) {
+      off_t ready = readahead_available(ra, c->sfd, s->pos);
+
+      if (ready == 0)
+        return;
+      if ((off_t)count > ready)
+        count = ready;
+    }
+    p = reserve_output(c, FRAME_HEADER_LENGTH + count);
+    if (!p)
+      return;
+    n = pread(s->fd, p + FRAME_HEADER_LENGTH, count, s->pos);
+    if (n <= 0) {
+      // the file was truncated (or it cannot be read)
+      PRINT("[queue_data]ERROR: pread %s (errno=%d)\n", s->path, errno);
+      send_rst_stream(c, s->id, INTERNAL_ERROR);
+      close_stream(c, s);
+      return;
+    }
+    count = n;
+    s->pos += n;
+    end_stream = (s->pos == s->statbuf.st_size);
+  }
+
+  put_frame_header(p, count, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, s->id);
+  c->out_len += FRAME_HEADER_LENGTH + count;
+  c->window -= count;
+  s->window -= count;
+
+  // a stream with weight W takes W/256 of the turns
+  s->pass += (count + 1) * 256 / s->weight;
+  c->pass = s->pass;
+
+  if (end_stream)
+    close_stream(c, s);
+}
+
+//
+// queue the next frame of responses: headers go first,
+// then DATA of the stream with the least pass
+// return FALSE if no stream has anything to send now
+//
+static int queue_next_frame(h2_conn_t *c, size_t quota) {
+  h2_stream_t *s, *best = NULL;
+
+  for (s = c->streams; s; s = s->next) {
+    if (s->phase == STREAM_HEADERS) {
+      queue_response_headers(c, s);
+      return TRUE;
+    }
+    if (stream_has_data(c, s) && (!best || s->pass < best->pass))
+      best = s;
+  }
+  if (!best)
+    return FALSE;
+
+  queue_data(c, best, quota);
+  return TRUE;
+}
+
+int h2_send(Node_t *node, int sfd) {
+  h2_conn_t *c = node->data.h2;
+  h2_stream_t *s;
+  ssize_t bytes_sent;
+  size_t count;
+
+  if (c->state == H2_BROKEN)
+    return 0;
+
+  while (node->data.send_quota > 0) {
+    // frames are queued up to the quota and sent at once
+    // (a small frame in its own segment would wait for ACK of the previous one, Nagle)
+    while (c->state < H2_GOAWAY && c->out_len - c->out_pos < node->data.send_quota &&
+           queue_next_frame(c, node->data.send_quota - (c->out_len - c->out_pos)))
+      ;
+
+    if (c->out_pos < c->out_len) {
+      count = c->out_len - c->out_pos;
+      if (count > node->data.send_quota)
+        count = node->data.send_quota;
+      bytes_sent = tls_send(sfd, c->out + c->out_pos, count);
+      if (bytes_sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          node->data.send_blocked = TRUE;
+          return -1;
+        }
+        PRINT("[h2_send]ERROR: cannot send to sfd=%d (errno=%d)\n", sfd, errno);
+        return 0;
+      }
+      TRACE_CONNECTION(sfd, TRACE_FIRST_BYTE);
+      c->out_pos += bytes_sent;
+      node->data.send_quota -= bytes_sent;
+      if ((size_t)bytes_sent < count) {
+        node->data.send_blocked = TRUE;
+        return -1;
+      }
+      continue;
+    }
+
+    if (c->state >= H2_GOAWAY)
+      return 0;
+    break;
+  }
+
+  if (c->state == H2_BROKEN)
+    return 0;
+
+  // nothing is sent until readahead of a stream is done
+  if (!h2_has_output(c)) {
+    for (s = c->streams; s; s = s->next) {
+      if (s->readahead && s->readahead->waiting)
+        node->data.send_waiting = TRUE;
+    }
+  }
+  return -1;
+}
+
+void h2_close(h2_conn_t *c) {
+  h2_stream_t *s, *next;
+
+  if (!c)
+    return;
+  for (s = c->streams; s; s = next) {
+    next = s->next;
+    if (s->job_pending)
+      s->conn = NULL;
+    else
+      free_stream(s);
+  }
+  hpack_decoder_free(&c->hpack);
+  free(c->in);
+  free(c->out);
+  free(c->block);
+  free(c);
+}
@@ -0,0 +1,141 @@
+#ifndef _HTTP2_H_
+#define _HTTP2_H_
+
+#include "setup.h"
+#include "ext_epoll_data.h"
+#include "hpack.h"
+#include "io_pool.h"
+#include "digest.h"
+#include "path_resolution.h"
+#include <stdint.h>
+
+//
+// HTTP/2 over cleartext TCP (h2c, RFC 9113)
+//
+// A connection becomes HTTP/2 when it begins with the client preface
+// (prior knowledge) or after "Upgrade: h2c" of a GET request, which becomes stream 1.
+// It stays in the same event loop: frames are parsed when the socket is readable
+// and responses are written when the send scheduler gives the connection its quota
+// (see send_sched.c), so an HTTP/2 connection shares the bandwidth like HTTP/1 ones.
+//
+// Each stream is a GET or HEAD request. Its resource is opened by an io_pool job,
+// files are read with pread() as far as they are read ahead (see readahead.c),
+// directories are listed by the listing generator (see html_generation_for_dir.c),
+// whose parts are generated by io_pool jobs too.
+//
+// Streams take turns by their weights (stride scheduling, the dependency tree
+// of PRIORITY is flattened), headers of responses are sent before DATA.
+// DATA obeys windows of the connection and of the stream.
+//
+
+#define H2_PREFACE            "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH     24
+#define H2_MAX_STREAMS        128           // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_FRAME_SIZE         16384         // max payload of frames (the default of the protocol)
+#define H2_WINDOW_SIZE        65535         // the initial window
+#define H2_HEADER_BLOCK_MAX   (64 * 1024)   // max header block of a request (with CONTINUATION)
+#define H2_OUTPUT_MAX         (1024 * 1024) // unsent control frames (a flooding client is closed)
+#define H2_ACCEPT_LENGTH      200
+
+struct h2_conn;
+struct dir_listing;
+struct readahead;
+
+typedef struct h2_stream {
+  io_job_t job;             // opening of the resource or generation of the listing (see io_pool.c)
+  struct h2_conn *conn;     // NULL if the connection is closed (the job frees the stream)
+  struct h2_stream *next;
+  uint32_t id;
+  int phase;                // STREAM_* (see http2.c)
+  int head;                 // HEAD request
+  int job_pending;
+  int weight;               // 1 .. 256
+  unsigned long long pass;  // (stride scheduling)
+  long long window;         // send window of the stream
+
+  // request
+  char path[REQUEST_PATH_LENGTH];   // normalised
+  char *query;
+  char accept[H2_ACCEPT_LENGTH];
+  int has_accept;
+
+  // response
+  int status;
+  const char *content_type;
+  char mime[H2_ACCEPT_LENGTH];
+  const char *message;      // body of an error response
+  size_t message_pos;
+  int fd;                   // the file
+  int err;
+  struct stat statbuf;
+  off_t pos;
+  struct readahead *readahead;
+  int has_digest;
+  file_digest_t digest;
+  struct dir_listing *listing;
+} h2_stream_t;
+
+typedef struct h2_conn {
+  int sfd;
+  int state;                // H2_* (see http2.c)
+
+  // received bytes which aren't a whole frame yet
+  unsigned char *in;
+  size_t in_len;
+  size_t in_cap;
+
+  // frames which aren't sent yet
+  unsigned char *out;
+  size_t out_pos;
+  size_t out_len;
+  size_t out_cap;
+
+  hpack_decoder_t hpack;
+
+  // a header block which is continued by CONTINUATION frames
+  unsigned char *block;
+  size_t block_len;
+  uint32_t block_stream;
+  int block_flags;
+  int block_weight;
+
+  // settings of the client
+  uint32_t max_frame;
+  long long initial_window;
+
+  long long window;         // send window of the connection
+  uint32_t last_stream_id;
+  h2_stream_t *streams;
+  int streams_count;
+  unsigned long long pass;  // pass of the last stream which sent DATA
+} h2_conn_t;
+
+// start HTTP/2 on the connection @sfd
+// @settings -- value of HTTP2-Settings (base64url SETTINGS of Upgrade) or NULL
+// return NULL on errors
+h2_conn_t *h2_open(int sfd, const char *settings);
+
+// the request of Upgrade becomes stream 1
+// @raw_path -- the path of the request line (with the query)
+// return 0 if success, else -1
+int h2_upgrade_stream(h2_conn_t *c, int head, char *raw_path, char *accept);
+
+// handle @length received bytes
+// (frames, which are answered, are queued, see h2_has_output())
+void h2_input(h2_conn_t *c, const char *data, size_t length);
+
+// send queued frames and responses of streams (at most @node->data.send_quota bytes)
+// @node->data.send_blocked is set if the socket is full
+// and @node->data.send_waiting if streams wait for the disk
+// return:
+//     -1, if the connection goes on
+//     0,  if it has to be closed (GOAWAY is sent)
+int h2_send(Node_t *node, int sfd);
+
+// TRUE if the connection has something to send now
+int h2_has_output(h2_conn_t *c);
+
+// free the connection (streams, whose jobs are in progress, are freed by the jobs)
+void h2_close(h2_conn_t *c);
+
+#endif // _HTTP2_H_
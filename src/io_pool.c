@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "io_pool.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+//
+// Pool of threads for blocking operations
+//
+// The event loop submits jobs into a queue (mutex + condition variable),
+// workers take them in FIFO order. A completed job is pushed into a lock-free
+// stack and the event loop is woken up through an eventfd; the loop takes
+// all completed jobs at once and calls their complete() functions.
+//
+// The pool starts with min_threads workers. If the average time a job waits
+// in the queue exceeds IO_POOL_GROW_LATENCY and no worker is idle,
+// a new worker is started (up to max_threads); a worker which was idle
+// for IO_IDLE_TIMEOUT of config exits (down to min_threads).
+//
+
+#define IO_POOL_QUEUE_MAX      4096
+#define IO_POOL_GROW_LATENCY   2000000LL   // ns (2 ms)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;     // new jobs or stopping
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;     // a worker exited
+
+static io_job_t *queue_head;
+static io_job_t *queue_tail;
+static int queue_length;
+
+static int threads_count;
+static int idle_threads;
+static int min_threads;
+static int max_threads;
+static long long wait_avg;          // average wait in the queue (ns)
+static int stopping;
+
+static io_job_t *completed;         // stack of completed jobs (lock-free)
+static int completion_fd = -1;
+
+static long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void push_completed(io_job_t *job) {
+  io_job_t *head = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+  uint64_t one = 1;
+
+  do {
+    job->next = head;
+  } while (!__atomic_compare_exchange_n(&completed, &head, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (write(completion_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    PRINT("[push_completed]ERROR: write to eventfd (errno=%d)\n", errno);
+}
+
+static void *worker(void *arg);
+
+static cpu_set_t threads_cpus;
+static int threads_pinned = FALSE;
+
+// threads which are started later run on @cpus (see place_worker() in workers.c)
+void io_pool_set_affinity(const cpu_set_t *cpus) {
+  threads_cpus = *cpus;
+  threads_pinned = TRUE;
+}
+
+// (pool_lock is held)
+static int spawn_worker() {
+  pthread_t thread;
+  pthread_attr_t attr;
+  int res;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (threads_pinned)
+    pthread_attr_setaffinity_np(&attr, sizeof(threads_cpus), &threads_cpus);
+  res = pthread_create(&thread, &attr, worker, NULL);
+  pthread_attr_destroy(&attr);
+  if (res != 0) {
+    PRINT("[spawn_worker]ERROR: pthread_create (%d)\n", res);
+    return -1;
+  }
+  threads_count++;
+#ifdef DEBUG
+  PRINT("[spawn_worker]DEBUG: %d io threads (average wait %lld ns)\n", threads_count, wait_avg);
+#endif
+  return 0;
+}
+
+static void *worker(void *arg) {
+  io_job_t *job;
+
+  (void)arg;
+
+  // (it is seen in traces and in top -H)
+  prctl(PR_SET_NAME, "sss-io");
+
+  pthread_mutex_lock(&pool_lock);
+  while (1) {
+    while (!queue_head && !stopping) {
+      struct timespec deadline;
+      int res;
+
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += srv_settings.io_idle_timeout;
+
+      idle_threads++;
+      res = pthread_cond_timedwait(&pool_cond, &pool_lock, &deadline);
+      idle_threads--;
+
+      if (res == ETIMEDOUT && !queue_head && threads_count > min_threads)
+        goto exit;
+    }
+    if (!queue_head)
+      goto exit;    // stopping
+
+    job = queue_head;
+    queue_head = job->next;
+    if (!queue_head)
+      queue_tail = NULL;
+    queue_length--;
+
+    // adapt the number of workers to the queue latency
+    wait_avg = (wait_avg * 7 + (now_ns() - job->submitted)) / 8;
+    if (queue_head && idle_threads == 0 && wait_avg > IO_POOL_GROW_LATENCY &&
+        threads_count < max_threads)
+      spawn_worker();
+    pthread_mutex_unlock(&pool_lock);
+
+    TRACE_JOB(job->conn_id, TRACE_JOB_BEGIN);
+    job->work(job);
+    TRACE_JOB(job->conn_id, TRACE_JOB_END);
+    push_completed(job);
+
+    pthread_mutex_lock(&pool_lock);
+  }
+
+exit:
+  threads_count--;
+  pthread_cond_broadcast(&stop_cond);
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+int io_pool_start(int min_count, int max_count) {
+  int i;
+
+  if (min_count < 1)
+    min_count = 1;
+  if (max_count < min_count)
+    max_count = min_count;
+
+  completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (completion_fd < 0) {
+    PRINT("[io_pool_start]ERROR: eventfd (errno=%d)\n", errno);
+    return -1;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  min_threads = min_count;
+  max_threads = max_count;
+  stopping = 0;
+  for (i = 0; i < min_threads; i++) {
+    if (spawn_worker() < 0)
+      break;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (i == 0) {
+    close(completion_fd);
+    completion_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+void io_pool_stop() {
+  if (completion_fd < 0)
+    return;
+
+  pthread_mutex_lock(&pool_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&pool_cond);
+  while (threads_count > 0)
+    pthread_cond_wait(&stop_cond, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+
+  close(completion_fd);
+  completion_fd = -1;
+}
+
+int io_pool_eventfd() {
+  return completion_fd;
+}
+
+int io_pool_submit(io_job_t *job) {
+  if (completion_fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&pool_lock);
+  if (queue_length >= IO_POOL_QUEUE_MAX || stopping) {
+    pthread_mutex_unlock(&pool_lock);
+    return -1;
+  }
+
+  job->submitted = now_ns();
+  job->next = NULL;
+  if (queue_tail)
+    queue_tail->next = job;
+  else
+    queue_head = job;
+  queue_tail = job;
+  queue_length++;
+
+  if (idle_threads > 0)
+    pthread_cond_signal(&pool_cond);
+  else if (threads_count < max_threads && wait_avg > IO_POOL_GROW_LATENCY)
+    spawn_worker();
+  pthread_mutex_unlock(&pool_lock);
+  return 0;
+}
+
+void io_pool_complete() {
+  io_job_t *jobs;
+  io_job_t *fifo = NULL;
+  io_job_t *next;
+  uint64_t count;
+
+  // reset the eventfd counter
+  if (read(completion_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    PRINT("[io_pool_complete]ERROR: read from eventfd (errno=%d)\n", errno);
+
+  jobs = __atomic_exchange_n(&completed, NULL, __ATOMIC_ACQUIRE);
+
+  // the stack gives the last completed job first, so reverse it
+  while (jobs) {
+    next = jobs->next;
+    jobs->next = fifo;
+    fifo = jobs;
+    jobs = next;
+  }
+
+  while (fifo) {
+    next = fifo->next;
+    fifo->complete(fifo);
+    fifo = next;
+  }
+}
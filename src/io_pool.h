@@ -0,0 +1,39 @@
+#ifndef _IO_POOL_H_
+#define _IO_POOL_H_
+
+#include "setup.h"
+
+#define IO_POOL_IDLE_TIMEOUT   10          // seconds (the default of IO_IDLE_TIMEOUT)
+
+// A blocking operation of a connection (file system access, sqlite),
+// which is done by a worker thread instead of the event loop.
+//
+// A job is usually the first member of a bigger structure with its arguments.
+// While a job of a connection is in progress, events of the connection are disabled
+// (see set_connection_events() in server_work.c).
+typedef struct io_job {
+  void (*work)(struct io_job *job);       // it is called in a worker thread
+  void (*complete)(struct io_job *job);   // it is called in the event loop after @work
+  int sfd;                                // connection of the job (-1 if it was closed)
+  unsigned long conn_id;                  // (a closed sfd may be reused by a new connection)
+  long long submitted;                    // CLOCK_MONOTONIC, ns
+  struct io_job *next;
+} io_job_t;
+
+// start @min_threads workers (the pool grows up to @max_threads
+// when jobs wait in the queue too long)
+// return 0 if success, else -1
+int io_pool_start(int min_threads, int max_threads);
+void io_pool_stop();
+
+// eventfd which becomes readable when there are completed jobs
+int io_pool_eventfd();
+
+// return 0 if the job is queued,
+// -1 if the pool isn't started or its queue is full (then do the job in place)
+int io_pool_submit(io_job_t *job);
+
+// call complete() of all completed jobs (in the event loop)
+void io_pool_complete();
+
+#endif // _IO_POOL_H_
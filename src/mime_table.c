@@ -0,0 +1,134 @@
+#include "setup.h"
+
+//
+// In-memory table of mime types
+//
+// MIME_FILE ('mime.types') is read once at startup into a hash table
+// (extension -> mime type), so a lookup doesn't read the file.
+// The table isn't changed after loading, so lookups are thread-safe.
+//
+
+#define MIME_TABLE_SIZE   4096    // power of 2, more than twice the number of extensions
+#define MIME_LINE_LENGTH  1024
+
+typedef struct mime_slot {
+  char *extension;
+  char *mime_type;      // it is shared by all extensions of one line
+  int owner;            // this slot frees @mime_type
+} mime_slot_t;
+
+static mime_slot_t mime_table[MIME_TABLE_SIZE];
+
+// FNV-1a
+static unsigned hash_extension(const char *extension) {
+  unsigned h = 2166136261u;
+
+  for ( ; *extension; extension++) {
+    h ^= (unsigned char)*extension;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// return 1 if @extension is inserted, 0 if it is known already, -1 on errors
+static int insert_mime(char *extension, char *mime_type, int owner) {
+  unsigned i = hash_extension(extension) & (MIME_TABLE_SIZE - 1);
+  unsigned probes;
+
+  for (probes = 0; probes < MIME_TABLE_SIZE; probes++) {
+    if (mime_table[i].extension == NULL) {
+      mime_table[i].extension = strdup(extension);
+      if (!mime_table[i].extension)
+        return -1;
+      mime_table[i].mime_type = mime_type;
+      mime_table[i].owner = owner;
+      return 1;
+    }
+    if (strcmp(mime_table[i].extension, extension) == 0) {
+      // the first line for this extension wins
+      return 0;
+    }
+    i = (i + 1) & (MIME_TABLE_SIZE - 1);
+  }
+
+  PRINT("[insert_mime]ERROR: mime table is full\n");
+  return -1;
+}
+
+//
+// read MIME_FILE into the table
+// return 0 if success, else -1
+//
+int load_mime_table() {
+  char line[MIME_LINE_LENGTH];
+  int count = 0;
+
+  rewind(MIME_FILE);
+  while (fgets(line, MIME_LINE_LENGTH, MIME_FILE) != NULL) {
+    char *saveptr;
+    char *mime_type;
+    char *extension;
+    char *shared_type = NULL;
+    int owner = 1;
+    int res;
+
+    if (line[0] == '#') {
+      // it is comment
+      continue;
+    }
+
+    mime_type = strtok_r(line, " \t\r\n", &saveptr);
+    if (!mime_type)
+      continue;
+
+    while ((extension = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+      if (!shared_type && (shared_type = strdup(mime_type)) == NULL)
+        return -1;
+      if ((res = insert_mime(extension, shared_type, owner)) < 0)
+        return -1;
+      if (res > 0) {
+        owner = 0;
+        count++;
+      }
+    }
+    if (shared_type && owner) {
+      // all extensions of this line are known already
+      free(shared_type);
+    }
+  }
+
+#ifdef DEBUG
+  PRINT("[load_mime_table]DEBUG: %d extensions\n", count);
+#endif
+  return 0;
+}
+
+void free_mime_table() {
+  int i;
+
+  for (i = 0; i < MIME_TABLE_SIZE; i++) {
+    free(mime_table[i].extension);
+    if (mime_table[i].owner)
+      free(mime_table[i].mime_type);
+    mime_table[i].extension = NULL;
+    mime_table[i].owner = 0;
+  }
+}
+
+//
+// return mime type for @extension (without '.') or NULL if it isn't known
+//
+const char *lookup_mime_type(const char *extension) {
+  unsigned i;
+
+  if (!extension || *extension == '\0')
+    return NULL;
+
+  i = hash_extension(extension) & (MIME_TABLE_SIZE - 1);
+  while (mime_table[i].extension != NULL) {
+    if (strcmp(mime_table[i].extension, extension) == 0)
+      return mime_table[i].mime_type;
+    i = (i + 1) & (MIME_TABLE_SIZE - 1);
+  }
+  return NULL;
+}
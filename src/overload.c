@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include "overload.h"
+#include <stdlib.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+//
+// Admission of connections (see overload.h)
+//
+// Only the event loop uses it. Admitted connections are marked in a table,
+// which is indexed by descriptors, so a connection which is closed twice
+// is counted once.
+//
+
+#define SERVICE_UNAVAILABLE_BODY   "The server is busy, retry later\n"
+
+static char *admitted;          // indexed by descriptors
+static int admitted_max;
+static int connections;
+static int max_connections;
+
+static long long memory_watermark;
+static long long memory_sampled;    // CLOCK_MONOTONIC, ns
+static int memory_shedding;
+
+static char *response;          // 503
+static int response_length;
+static unsigned long long shed;
+
+static int listener_paused;
+static int accept_failing;          // (accept() failed since the last connection)
+static long long resume_time;       // ns
+
+static long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int overload_set_limits(int max_conns, long long watermark, int retry_after) {
+  char *new_response;
+  int new_length;
+
+  new_length = asprintf(&new_response,
+                        "HTTP/1.1 503 Service Unavailable\r\n"
+                        "Retry-After: %d\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %d\r\n"
+                        "Connection: close\r\n"
+                        "\r\n"
+                        "%s",
+                        retry_after, (int)strlen(SERVICE_UNAVAILABLE_BODY),
+                        SERVICE_UNAVAILABLE_BODY);
+  if (new_length < 0) {
+    PRINT("[overload_set_limits]ERROR: out of memory\n");
+    return -1;
+  }
+  free(response);
+  response = new_response;
+  response_length = new_length;
+
+  max_connections = max_conns;
+  if (max_connections <= 0) {
+    max_connections = admitted_max - OVERLOAD_FD_RESERVE;
+    if (max_connections < 1)
+      max_connections = 1;
+  }
+  memory_watermark = watermark;
+  memory_sampled = 0;
+  return 0;
+}
+
+int overload_init(int max_conns, long long watermark, int retry_after) {
+  struct rlimit limit;
+
+  // a descriptor is less than RLIMIT_NOFILE
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+    limit.rlim_cur = 65536;
+  admitted_max = limit.rlim_cur;
+  admitted = (char *)calloc(admitted_max, sizeof(char));
+  if (!admitted) {
+    PRINT("[overload_init]ERROR: out of memory\n");
+    return -1;
+  }
+
+  if (overload_set_limits(max_conns, watermark, retry_after) < 0) {
+    free(admitted);
+    admitted = NULL;
+    return -1;
+  }
+  connections = 0;
+  shed = 0;
+  listener_paused = FALSE;
+  accept_failing = FALSE;
+  memory_shedding = FALSE;
+
+#ifdef DEBUG
+  PRINT("[overload_init]DEBUG: max_connections=%d memory_watermark=%lld\n",
+        max_connections, memory_watermark);
+#endif
+  return 0;
+}
+
+void overload_deinit() {
+  free(admitted);
+  admitted = NULL;
+  admitted_max = 0;
+  free(response);
+  response = NULL;
+}
+
+//
+// the heap is above the watermark
+// (it is sampled every OVERLOAD_MEMORY_PERIOD ms, mallinfo2() walks free lists of arenas)
+//
+static int is_memory_exhausted() {
+  struct mallinfo2 info;
+  long long now, used;
+
+  if (!memory_watermark)
+    return FALSE;
+
+  now = now_ns();
+  if (now - memory_sampled < OVERLOAD_MEMORY_PERIOD * 1000000LL)
+    return memory_shedding;
+  memory_sampled = now;
+
+  info = mallinfo2();
+  used = (long long)(info.uordblks + info.hblkhd);
+  if (!memory_shedding && used > memory_watermark) {
+    memory_shedding = TRUE;
+    PRINT("[overload]heap %lld bytes is above the watermark, new connections are refused\n", used);
+  } else if (memory_shedding && used < memory_watermark / 4 * 3) {
+    memory_shedding = FALSE;
+    PRINT("[overload]heap %lld bytes, new connections are served again (%llu were refused)\n",
+          used, shed);
+  }
+  return memory_shedding;
+}
+
+int overload_admit(int sfd) {
+  accept_failing = FALSE;
+  if (!admitted)
+    return 0;
+
+  if (connections >= max_connections || is_memory_exhausted()) {
+    // (the socket is new, the response fits into its buffer)
+    send(sfd, response, response_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shed++;
+    return -1;
+  }
+
+  if (sfd >= 0 && sfd < admitted_max && !admitted[sfd]) {
+    admitted[sfd] = TRUE;
+    connections++;
+  }
+  return 0;
+}
+
+void overload_close(int sfd) {
+  if (!admitted || sfd < 0 || sfd >= admitted_max || !admitted[sfd])
+    return;
+  admitted[sfd] = FALSE;
+  connections--;
+
+  // a descriptor is free again
+  if (listener_paused)
+    resume_time = 0;
+}
+
+int overload_accept_failed(int err) {
+  if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM)
+    return FALSE;
+
+  if (!accept_failing)
+    PRINT("[overload]accept: out of descriptors or memory (errno=%d), the listener is paused\n", err);
+  accept_failing = TRUE;
+  listener_paused = TRUE;
+  resume_time = now_ns() + OVERLOAD_PAUSE_MS * 1000000LL;
+  return TRUE;
+}
+
+int overload_resume_listener() {
+  if (!listener_paused || now_ns() < resume_time)
+    return FALSE;
+  listener_paused = FALSE;
+  return TRUE;
+}
+
+int overload_timeout() {
+  long long wait;
+
+  if (!listener_paused)
+    return -1;
+  wait = resume_time - now_ns();
+  if (wait <= 0)
+    return 0;
+  // (round up to ms)
+  return (int)((wait + 999999) / 1000000);
+}
@@ -0,0 +1,50 @@
+#ifndef _OVERLOAD_H_
+#define _OVERLOAD_H_
+
+#include "setup.h"
+
+//
+// Overload protection
+//
+// New connections are admitted while there are less than MAX_CONNECTIONS
+// of them and the heap of the allocator (mallinfo2(), all arenas) is below
+// MEMORY_WATERMARK. Otherwise a prebuilt "503 Service Unavailable" with
+// Retry-After is sent at once and the connection is closed, so connections
+// which are served keep their throughput.
+// Shedding by memory stops when the heap is below 3/4 of the watermark.
+//
+// If accept() fails because descriptors (or kernel memory) are exhausted,
+// the listener is paused (connections wait in its backlog) until
+// a connection is closed or OVERLOAD_PAUSE_MS pass.
+//
+
+#define OVERLOAD_FD_RESERVE      64      // descriptors for files and listings (MAX_CONNECTIONS 0)
+#define OVERLOAD_PAUSE_MS        100     // max pause of the listener
+#define OVERLOAD_MEMORY_PERIOD   10      // ms between samples of the heap
+#define RETRY_AFTER_DEFAULT      1       // seconds
+
+// @max_connections -- 0: RLIMIT_NOFILE - OVERLOAD_FD_RESERVE
+// @memory_watermark -- bytes (0 -- no limit)
+// @retry_after -- seconds for Retry-After of 503
+// return 0 if success, else -1
+int overload_init(int max_connections, long long memory_watermark, int retry_after);
+void overload_deinit();
+// change the limits (see overload_init())
+// return 0 if success, else -1
+int overload_set_limits(int max_connections, long long memory_watermark, int retry_after);
+
+// a connection is accepted on @sfd
+// return 0 if it is served, else -1 (503 is sent, the caller closes @sfd)
+int overload_admit(int sfd);
+// the connection on @sfd is closed
+void overload_close(int sfd);
+
+// accept() failed with @err
+// return TRUE if the listener has to be paused
+int overload_accept_failed(int err);
+// return TRUE if the paused listener has to be resumed now
+int overload_resume_listener();
+// timeout for epoll_wait(): ms until the listener is resumed or -1
+int overload_timeout();
+
+#endif // _OVERLOAD_H_
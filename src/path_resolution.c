@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include "path_resolution.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+// Resolution of request paths relative to WWWROOT
+//
+// WWWROOT is opened once (srv_settings.wwwroot_fd) and every request path
+// is opened with openat2(RESOLVE_BENEATH) relative to it,
+// so the server never calls chdir() and never concatenates WWWROOT with a path.
+// If the kernel doesn't have openat2() (Linux < 5.6), the path is walked
+// component by component with O_NOFOLLOW (it is contained in the root too).
+//
+// Descriptors of hot directories (which are looked up often)
+// are kept in a small cache, so a file in such directory
+// is opened by a single lookup of its last component.
+
+#define DIR_FD_CACHE_SIZE 64    // number of slots (directories)
+#define DIR_FD_CACHE_HOT  4     // a directory is cached after this number of lookups
+// (a cached descriptor is reopened after DIR_CACHE_TTL of config:
+//  a directory may be renamed or removed)
+
+typedef struct dir_fd_slot {
+  char *path;         // relative to WWWROOT, without leading '/' ("my_dir/another_dir")
+  int fd;             // O_PATH descriptor or -1 (the directory is not hot yet)
+  unsigned hits;      // lookups of @path (it is decreased by lookups of other directories)
+  time_t opened;      // when @fd was opened
+} dir_fd_slot_t;
+
+static dir_fd_slot_t dir_fd_cache[DIR_FD_CACHE_SIZE];
+static pthread_rwlock_t dir_fd_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// -1 -- not known yet, 0 -- openat2() isn't supported, 1 -- supported
+static int openat2_supported = -1;
+
+int open_wwwroot_dir() {
+  int i;
+
+  srv_settings.wwwroot_fd = open(WWWROOT, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (srv_settings.wwwroot_fd < 0) {
+    PRINT("[open_wwwroot_dir]ERROR: cannot open %s (errno=%d)\n", WWWROOT, errno);
+    return -1;
+  }
+
+  for (i = 0; i < DIR_FD_CACHE_SIZE; i++) {
+    dir_fd_cache[i].path = NULL;
+    dir_fd_cache[i].fd = -1;
+    dir_fd_cache[i].hits = 0;
+  }
+  return 0;
+}
+
+void close_wwwroot_dir() {
+  int i;
+
+  for (i = 0; i < DIR_FD_CACHE_SIZE; i++) {
+    if (dir_fd_cache[i].fd >= 0)
+      close(dir_fd_cache[i].fd);
+    free(dir_fd_cache[i].path);
+    dir_fd_cache[i].path = NULL;
+    dir_fd_cache[i].fd = -1;
+  }
+  if (srv_settings.wwwroot_fd >= 0)
+    close(srv_settings.wwwroot_fd);
+  srv_settings.wwwroot_fd = -1;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// see path_resolution.h
+int normalize_request_path(const char *raw_path, char *path, size_t max) {
+  const char *p = raw_path;
+  size_t len = 0;     // current length of @path
+  size_t seg;         // beginning of the current component in @path
+  size_t seg_len;
+
+  if (max < 2)
+    return -1;
+  path[len++] = '/';
+
+  while (*p != '\0' && *p != '?' && *p != '#') {
+    // 1. decode one component into @path (after the last '/')
+    seg = len;
+    while (*p != '\0' && *p != '/' && *p != '?' && *p != '#') {
+      char c = *p++;
+
+      if (c == '%') {
+        int hi = hex_value(p[0]);
+        int lo = (hi < 0) ? -1 : hex_value(p[1]);
+
+        if (lo < 0)
+          return -1;
+        c = (char)((hi << 4) | lo);
+        p += 2;
+        // an encoded '/' or '\0' cannot be a part of a file name
+        if (c == '\0' || c == '/')
+          return -1;
+      }
+      if (len + 2 >= max)
+        return -1;
+      path[len++] = c;
+    }
+    if (*p == '/')
+      p++;
+
+    // 2. "", "." and ".." components
+    seg_len = len - seg;
+    if (seg_len == 0)
+      continue;
+    if (seg_len == 1 && path[seg] == '.') {
+      len = seg;
+      continue;
+    }
+    if (seg_len == 2 && path[seg] == '.' && path[seg + 1] == '.') {
+      if (seg == 1) {
+        // it tries to leave the root
+        return -1;
+      }
+      // remove the previous component
+      len = seg - 1;
+      while (path[len - 1] != '/')
+        len--;
+      continue;
+    }
+    // (for any method: GET of them, or a PUT or POST over them, would change
+    //  digests, unfinished uploads or the store of other files)
+    if (seg_len >= strlen(SERVER_FILES_PREFIX) &&
+        !strncmp(path + seg, SERVER_FILES_PREFIX, strlen(SERVER_FILES_PREFIX)))
+      return -2;
+    path[len++] = '/';
+  }
+
+  // remove the trailing '/' (except the root "/")
+  if (len > 1 && path[len - 1] == '/')
+    len--;
+  path[len] = '\0';
+  return 0;
+}
+
+static int sys_openat2(int dirfd, const char *path, int flags, mode_t mode) {
+  struct open_how how;
+
+  memset(&how, 0, sizeof(how));
+  how.flags = flags;
+  how.mode = (flags & O_CREAT) ? mode : 0;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+  return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+// fallback for old kernels: open each directory of @path with O_NOFOLLOW
+// (@path is normalised, so there are no ".." components)
+static int walk_beneath(int dirfd, const char *path, int flags, mode_t mode) {
+  char component[NAME_MAX + 1];
+  const char *p = path;
+  const char *slash;
+  int cur = dirfd;
+  int fd;
+  int saved_errno;
+
+  while ((slash = strchr(p, '/')) != NULL) {
+    size_t len = slash - p;
+
+    if (len > NAME_MAX) {
+      errno = ENAMETOOLONG;
+      fd = -1;
+      goto close_cur;
+    }
+    memcpy(component, p, len);
+    component[len] = '\0';
+
+    fd = openat(cur, component, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (cur != dirfd)
+      close(cur);
+    if (fd < 0)
+      return -1;
+    cur = fd;
+    p = slash + 1;
+  }
+
+  fd = openat(cur, *p ? p : ".", flags | O_NOFOLLOW, mode);
+
+close_cur:
+  saved_errno = errno;
+  if (cur != dirfd)
+    close(cur);
+  errno = saved_errno;
+  return fd;
+}
+
+// open @path (without leading '/') beneath @dirfd
+static int resolve_at(int dirfd, const char *path, int flags, mode_t mode) {
+  int fd;
+
+  flags |= O_CLOEXEC;
+  if (openat2_supported != 0) {
+    fd = sys_openat2(dirfd, path, flags, mode);
+    if (fd >= 0 || errno != ENOSYS) {
+      openat2_supported = 1;
+      return fd;
+    }
+    PRINT("[resolve_at]openat2() is not supported, walk paths by components\n");
+    openat2_supported = 0;
+  }
+  return walk_beneath(dirfd, path, flags, mode);
+}
+
+// FNV-1a
+static unsigned hash_dir_path(const char *path, size_t len) {
+  unsigned h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)path[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int is_slot_path(dir_fd_slot_t *slot, const char *dir, size_t dir_len) {
+  return slot->path && strncmp(slot->path, dir, dir_len) == 0 && slot->path[dir_len] == '\0';
+}
+
+#define SLOT_KEEP     0
+#define SLOT_CLAIM    1   // the slot should be given to a new directory
+#define SLOT_PROMOTE  2   // the directory of the slot became hot (open it)
+
+// change the slot (under the write lock)
+static void update_slot(dir_fd_slot_t *slot, const char *dir, size_t dir_len, int action, time_t now) {
+  pthread_rwlock_wrlock(&dir_fd_cache_lock);
+
+  if (action == SLOT_CLAIM && slot->hits == 0) {
+    char *path = (char *)malloc(dir_len + 1);
+
+    if (path) {
+      memcpy(path, dir, dir_len);
+      path[dir_len] = '\0';
+      if (slot->fd >= 0)
+        close(slot->fd);
+      free(slot->path);
+      slot->path = path;
+      slot->fd = -1;
+      slot->hits = 1;
+    }
+  } else if (action == SLOT_PROMOTE && is_slot_path(slot, dir, dir_len)) {
+    int fd = resolve_at(srv_settings.wwwroot_fd, slot->path, O_PATH | O_DIRECTORY, 0);
+
+    if (fd >= 0) {
+      if (slot->fd >= 0)
+        close(slot->fd);
+      slot->fd = fd;
+      slot->opened = now;
+#ifdef DEBUG
+      PRINT("[update_slot]directory %s is cached\n", slot->path);
+#endif
+    }
+  }
+
+  pthread_rwlock_unlock(&dir_fd_cache_lock);
+}
+
+// see path_resolution.h
+int open_beneath_root(const char *path, int flags, mode_t mode) {
+  const char *rel = path;
+  const char *leaf;
+  dir_fd_slot_t *slot;
+  size_t dir_len;
+  time_t now;
+  int action = SLOT_KEEP;
+  int fd;
+
+  while (*rel == '/')
+    rel++;
+  if (*rel == '\0')
+    rel = ".";
+
+  leaf = strrchr(rel, '/');
+  if (!leaf) {
+    // a file in WWWROOT itself
+    return resolve_at(srv_settings.wwwroot_fd, rel, flags, mode);
+  }
+
+  dir_len = leaf - rel;
+  slot = &dir_fd_cache[hash_dir_path(rel, dir_len) % DIR_FD_CACHE_SIZE];
+  now = time(NULL);
+
+  pthread_rwlock_rdlock(&dir_fd_cache_lock);
+  if (is_slot_path(slot, rel, dir_len)) {
+    if (slot->fd >= 0 && now - slot->opened < srv_settings.dir_cache_ttl) {
+      // hot directory: lookup only the last component
+      // (the lock keeps @slot->fd open)
+      int saved_errno;
+
+      fd = resolve_at(slot->fd, leaf + 1, flags, mode);
+      saved_errno = errno;
+      pthread_rwlock_unlock(&dir_fd_cache_lock);
+      errno = saved_errno;
+      return fd;
+    }
+    if (__atomic_add_fetch(&slot->hits, 1, __ATOMIC_RELAXED) >= DIR_FD_CACHE_HOT)
+      action = SLOT_PROMOTE;
+  } else {
+    // another directory holds this slot: the new one replaces it
+    // only when the old one isn't used more often
+    unsigned hits = __atomic_load_n(&slot->hits, __ATOMIC_RELAXED);
+
+    while (hits > 0 && !__atomic_compare_exchange_n(&slot->hits, &hits, hits - 1, 0,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+    if (hits <= 1)
+      action = SLOT_CLAIM;
+  }
+  pthread_rwlock_unlock(&dir_fd_cache_lock);
+
+  if (action != SLOT_KEEP)
+    update_slot(slot, rel, dir_len, action, now);
+
+  return resolve_at(srv_settings.wwwroot_fd, rel, flags, mode);
+}
@@ -0,0 +1,39 @@
+#ifndef _PATH_RESOLUTION_H_
+#define _PATH_RESOLUTION_H_
+
+#include "setup.h"
+
+// max length of a decoded and normalised request path
+#define REQUEST_PATH_LENGTH 1024
+
+// seconds, after that a cached directory descriptor is reopened
+// (the default of DIR_CACHE_TTL, see path_resolution.c)
+#define DIR_FD_CACHE_TTL 5
+
+// open WWWROOT once as a directory descriptor (srv_settings.wwwroot_fd)
+// and prepare the cache of directory descriptors
+// return 0 if success, else -1
+int open_wwwroot_dir();
+void close_wwwroot_dir();
+
+// files of the server in WWWROOT (digests, unfinished uploads and the store of uploads,
+// see digest.c, put_request.c and dedup.c)
+// begin with it, they can't be requested
+#define SERVER_FILES_PREFIX ".sss-"
+
+// percent-decode @raw_path (it stops at '?' or '#') and normalise it:
+//    "//" and "/./" are collapsed, ".." removes the previous component
+// the result always begins with '/' and never leaves the root
+//
+// return 0 if success, -1 (bad encoding, too long or it escapes the root),
+//        -2 if a component is a file of the server (SERVER_FILES_PREFIX)
+int normalize_request_path(const char *raw_path, char *path, size_t max);
+
+// open normalised @path (see normalize_request_path()) relative to WWWROOT
+// the path is resolved beneath the root only (symlinks cannot escape it)
+//
+// @flags -- flags for open(2) (O_CREAT is allowed, then @mode is used)
+// return a new file descriptor or -1 (errno is set)
+int open_beneath_root(const char *path, int flags, mode_t mode);
+
+#endif // _PATH_RESOLUTION_H_
@@ -1,376 +1,783 @@
-
+#define _GNU_SOURCE
 #include "setup.h"
 #include "ext_epoll_data.h"
+#include "path_resolution.h"
+#include "io_pool.h"
+#include "chunked.h"
+#include "upload_writer.h"
+#include "scan.h"
+#include <fcntl.h>
+
+//
+// Uploads (POST and PUT requests)
+//
+// A body is saved while it arrives, it is never kept in memory as a whole:
+//   1. framing: Content-Length or Transfer-Encoding: chunked (see chunked.c);
+//   2. content: multipart/form-data (the first part with a file name is saved
+//      into the requested directory) or a raw body (it is saved into the requested file);
+//      a body of PUT is a segment of the requested file (see put_request.c);
+//   3. file data of each read is written by io_pool (see write_upload_data()
+//      and upload_writer.c), the reply is sent when the file is written (and synced).
+//
 
 
 extern int read_word_from_req_into_buf(char *original_req, char *buf, size_t *cur_pos, size_t max);
 extern ssize_t send_warning_msg(char *message, int socket_fd);
 
+// see request_handling.c
+extern char *get_header_value(char *request, const char *name, char *value, size_t max);
+
 #define MEM_ZERO(ptr, size) memset(ptr, '\0', sizeof(char) * size)
 
+#define UPLOAD_LENGTH    0    // the body has Content-Length
+#define UPLOAD_CHUNKED   1    // Transfer-Encoding: chunked
+
+// states of multipart/form-data parser
+#define PART_PREAMBLE    0    // before the first delimiter
+#define PART_BOUNDARY    1    // after a delimiter: "--" (the end of the body) or CRLF
+#define PART_HEADERS     2
+#define PART_DATA        3
+#define PART_EPILOGUE    4
+
+#define BOUNDARY_LENGTH     128
+#define PART_HEADERS_MAX    4096
+#define UPLOAD_NAME_LENGTH  256
+#define HEADER_VALUE_LENGTH 256
+#define RESPONSE_LENGTH     4096
+
+struct segmented_upload;
+
+// see put_request.c
+extern struct segmented_upload *open_segmented_upload(char *path, long long total);
+extern void hold_segmented_upload(struct segmented_upload *s);
+extern void release_segmented_upload(struct segmented_upload *s);
+extern int check_segment(long long first, long long last, long long total);
+extern int is_segmented_upload_complete(struct segmented_upload *s);
+extern upload_writer_t *open_segment_writer(struct segmented_upload *s, long long offset, long long length);
+extern int write_segment(struct segmented_upload *s, upload_writer_t *w, const char *data, size_t length, int last);
+extern size_t format_received_ranges(struct segmented_upload *s, char *buf, size_t max);
+
+typedef struct upload {
+  int framing;                // UPLOAD_LENGTH, UPLOAD_CHUNKED
+  long long remaining;        // bytes of the body which are not received yet (UPLOAD_LENGTH)
+  chunked_decoder_t chunked;
+  int body_done;              // the whole body is received
+
+  int multipart;
+  int part_state;
+  char delimiter[BOUNDARY_LENGTH + 4];    // CRLF "--" boundary
+  size_t delimiter_len;
+  int saving;                 // data of the current part is a file
+  int file_saved;             // the file part is read already
+  int dir_fd;                 // the requested directory (for multipart)
+  upload_writer_t *writer;    // the file (NULL while a write job has it)
+
+  // PUT: the body is a segment [@offset, @segment_end) of the file
+  int put;
+  struct segmented_upload *segments;
+  long long offset;
+  long long segment_end;      // -1 -- up to the end of the body
+
+  // body bytes which are not parsed yet
+  // (they may be a beginning of a delimiter or of part headers)
+  char *buf;
+  size_t buf_len;
+  size_t buf_cap;
+} upload_t;
+
 
 //
+// copy boundary parameter of multipart Content-Type (@content_type) into @boundary
+// return 0 if success, else -1
+static int get_boundary_value(char *content_type, char *boundary) {
+  char *p;
+  size_t i;
+
+#define BOUNDARY_SIGN "boundary="
+
+  p = strstr(content_type, BOUNDARY_SIGN);
+  if (!p)
+    return -1;
+  p += strlen(BOUNDARY_SIGN);
+
+  if (*p == '"') {
+    // quoted value
+    p++;
+    for (i = 0; i < BOUNDARY_LENGTH - 1 && p[i] && p[i] != '"'; i++)
+      boundary[i] = p[i];
+  } else {
+    for (i = 0; i < BOUNDARY_LENGTH - 1 && p[i] && p[i] != ';' && p[i] != ' ' && p[i] != '\t'; i++)
+      boundary[i] = p[i];
+  }
+  boundary[i] = '\0';
+
+#undef BOUNDARY_SIGN
+
+  return (i > 0) ? 0 : -1;
+}
+
 //
-static char *get_value_from_req(int sfd, char *header, char *value_type, size_t value_length) {
-  char *value_ptr;
-  char *value;
+// read the normalised path of the request into @path
+// return 0 if success, else -1
+static int get_request_path(char *header, char *path) {
+  char raw_path[REQUEST_PATH_LENGTH];
   size_t cur_pos = 0;
 
-  value_ptr = strstr(header, value_type);
-  if (!value_ptr) {
-    send_warning_msg("incorrect post request\n", sfd);
-    return NULL;
+  // the method and the path
+  if (read_word_from_req_into_buf(header, raw_path, &cur_pos, REQUEST_PATH_LENGTH) < 0 ||
+      read_word_from_req_into_buf(header, raw_path, &cur_pos, REQUEST_PATH_LENGTH) < 0) {
+#ifdef DEBUG
+    PRINT("[get_request_path]ERROR: get path\n");
+#endif
+    return -1;
   }
 
-  // now get the value 
-  value_ptr += strlen(value_type);
-  value = (char *) malloc(sizeof(char) * value_length);
-  if (!value) {
+  // if path is only "/"
+  // it will mean that we should create a file in WWWROOT directory
+  if (normalize_request_path(raw_path, path, REQUEST_PATH_LENGTH) < 0) {
 #ifdef DEBUG
-    PRINT("[get_boundary_value]OUT of memory\n");
+    PRINT("[get_request_path]bad path %s\n", raw_path);
 #endif
-    send_warning_msg("please, try later\n", sfd);
-    return NULL;
+    return -1;
   }
+  return 0;
+}
 
-  MEM_ZERO(value, value_length);
+//
+// open a directory @path (relative to WWWROOT, see path_resolution.c)
+// return its descriptor or -1
+static int open_resource_dir(char *path) {
+  int dir_fd;
 
-  if (read_word_from_req_into_buf(value_ptr, value, &cur_pos, value_length) < 0) {
-    free(value);
+  dir_fd = open_beneath_root(path, O_RDONLY | O_DIRECTORY, 0);
+  if (dir_fd < 0) {
 #ifdef DEBUG
-    PRINT("[get_boundary_value]read_word_from_req_into_buf\n");
+    PRINT("[open_resource_dir]cannot open %s (errno=%d)\n", path, errno);
 #endif
-    send_warning_msg("please, try later\n", sfd);
-    return NULL;
   }
-
-  return value;
+  return dir_fd;
 }
 
+//
+// get filename from headers of a part (it is placed after filename=")
+// return 0 if success, else -1
+static int get_filename(char *part_headers, char *filename) {
+  char *p;
+  size_t i;
 
+#define FILENAME_SIGN "filename=\""
 
-//
-//
-static char *get_boundary_value(int sfd, char *header) {
+  p = strstr(part_headers, FILENAME_SIGN);
+  if (!p)
+    return -1;
+  p += strlen(FILENAME_SIGN);
 
-#define BOUNDARY_LENGTH 128
-#define BOUNDARY_SIGN "boundary="
+  // copy the name up to the closing '"'
+  for (i = 0; i < UPLOAD_NAME_LENGTH - 1 && p[i] && p[i] != '"' && p[i] != '\r'; i++)
+    filename[i] = p[i];
+  filename[i] = '\0';
 
-  return get_value_from_req(sfd, header, BOUNDARY_SIGN, BOUNDARY_LENGTH);
+#undef FILENAME_SIGN
 
-#undef BOUNDARY_LENGTH
-#undef BOUNDARY_SIGN
+  return 0;
 }
 
 //
-//
-static size_t get_content_length(int sfd, char *header) {
-  char *cont_len;
-  long long length;
-
-#define CONTENT_LENGTH 64
-#define CONTENT_LENGTH_SIGN "Content-Length: "
-
-  cont_len = get_value_from_req(sfd, header, CONTENT_LENGTH_SIGN, CONTENT_LENGTH);
-  if (!cont_len) {
-    return -1;
+// create (or open to append) a file @filename in @dir_fd
+// return the file or NULL
+static upload_writer_t *open_upload_file(int dir_fd, char *filename, int sfd) {
+  upload_writer_t *w;
+
+  // a file name from a client cannot contain a path (or be a file of the server)
+  if (strchr(filename, '/') || !strcmp(filename, "") ||
+      !strcmp(filename, ".") || !strcmp(filename, "..") ||
+      !strncmp(filename, SERVER_FILES_PREFIX, strlen(SERVER_FILES_PREFIX))) {
+    send_warning_msg("Incorrect file name\n", sfd);
+    return NULL;
   }
-  length = strtoll(cont_len, NULL, 0);
-
-  free(cont_len);
 
-#undef CONTENT_LENGTH
-#undef CONTENT_LENGTH_SIGN
+  // open a file (create if it doesn't exist yet)
+  // the data is written at the end of the file
+  w = upload_writer_open(dir_fd, filename, O_CREAT, -1);
+  if (!w) {
+    send_warning_msg("Cannot save a file\n", sfd);
+    return NULL;
+  }
+  // digests of a new file
+  if (w->written == 0)
+    upload_writer_digest(w, dir_fd, filename);
+  // the content is shared with the same uploads (see dedup.c)
+  if (srv_settings.dedup)
+    upload_writer_dedup(w, dir_fd, filename);
+  return w;
+}
 
-  return length;
+void free_upload(upload_t *u) {
+  if (!u)
+    return;
+  if (u->dir_fd >= 0)
+    close(u->dir_fd);
+  upload_writer_close(u->writer);
+  release_segmented_upload(u->segments);
+  free(u->buf);
+  free(u);
 }
 
+// see server_work.c
+extern int set_connection_events(int sfd, uint32_t events);
 
 //
-//
-static int restore_cur_dir(char *cur_dir_path) {
-  if (chdir(cur_dir_path) < 0) {
-#ifdef DEBUG
-    PRINT("[restore_cur_dir]ERROR on chdir %s (errno=%d)\n", cur_dir_path, errno);
-#endif
-    return -1;
+// send the result of the upload
+// (POST gets @message only, PUT gets a response with @status,
+//  308 has received ranges of the file)
+static void send_upload_response(upload_t *u, int sfd, char *status, char *message) {
+  char response[RESPONSE_LENGTH];
+  char range[RESPONSE_LENGTH / 2];
+
+  if (!u || !u->put) {
+    send_warning_msg(message, sfd);
+    return;
   }
-  return 0;
+
+  range[0] = '\0';
+  if (!strncmp(status, "308", 3) && u->segments &&
+      format_received_ranges(u->segments, range + strlen("Range: "), sizeof(range) - strlen("Range: \r\n")) > 0) {
+    memcpy(range, "Range: ", strlen("Range: "));
+    strcat(range, "\r\n");
+  }
+
+  snprintf(response, sizeof(response), "HTTP/1.1 %s\r\nServer: sSs\r\nContent-Type: text/plain\r\n"
+           "Content-Length: %zu\r\n%s\r\n%s", status, strlen(message), range, message);
+  send_warning_msg(response, sfd);
 }
 
-//
-// change current directory to one, which is specified in POST request
-// and return current dir (to restore dir later)
-static char *ch_resource_dir(int sfd, char *header) {
-  char *dir_path;  // where to store a file
-  char *cwd;
+// the upload is finished (or failed): send the result and close the file
+// (the connection will be closed)
+static void finish_upload(Node_t *node, int sfd, char *status, char *message) {
+  send_upload_response(node->data.upload, sfd, status, message);
+  set_connection_events(sfd, EPOLLIN | EPOLLOUT);
+  free_upload(node->data.upload);
+  node->data.upload = NULL;
+  node->data.status = REQUEST_COMPLETED;
+}
 
-#define DIR_PATH_LENGTH 1024
-#define DIR_PATH_SIGN "POST "
+// the whole body is received and written
+static void finish_received_upload(Node_t *node, int sfd) {
+  upload_t *u = node->data.upload;
 
-  dir_path = get_value_from_req(sfd, header, DIR_PATH_SIGN, DIR_PATH_LENGTH);
-  if (!dir_path) {
-#ifdef DEBUG
-    PRINT("[open_file]ERROR: get dir_path\n");
-#endif
-    return NULL;
-  }
+  if (u->multipart && !u->file_saved)
+    finish_upload(node, sfd, "400 Bad Request", "Incorrect post request (there is no file)\n");
+  else if (u->segments && !is_segmented_upload_complete(u->segments))
+    finish_upload(node, sfd, "308 Resume Incomplete", "");
+  else
+    finish_upload(node, sfd, "201 Created", "File added successfully.");
+}
 
+// the connection waits for the next part of the body
+// (EPOLLOUT is not monitored, it would be reported all the time)
+static int wait_body(int sfd) {
+  set_connection_events(sfd, EPOLLIN);
+  return -1;
+}
 
-#define CUR_DIR_LENGTH 1024
-  cwd = (char *) malloc(sizeof(char) * CUR_DIR_LENGTH);
-  if (!cwd) {
-#ifdef DEBUG
-    PRINT("[open_file]ERROR: out of memory for cwd\n");
-#endif
-    goto free_dir_path;
-  }
-  MEM_ZERO(cwd, CUR_DIR_LENGTH);
 
-  // 1. get current directory
-  if (getcwd(cwd, CUR_DIR_LENGTH) == NULL) {
-    PRINT("[open_file]ERROR: current working dir\n");
-    goto free_dir_path;
+// see server_work.c
+extern void submit_connection_job(Node_t *node, io_job_t *job);
+extern Node_t *finish_connection_job(io_job_t *job);
+
+// data of an upload is written by a worker thread
+// (the connection doesn't read new data until it is written)
+typedef struct write_job {
+  io_job_t job;
+  upload_writer_t *writer;              // (the job owns it until it is completed)
+  struct segmented_upload *segments;    // PUT: @data is a part of a segment
+  int last;                             // the body ends with @data
+  char *data;
+  size_t length;
+  int failed;
+} write_job_t;
+
+// (in a worker thread)
+static void write_upload_data(io_job_t *job) {
+  write_job_t *w = (write_job_t *)job;
+
+  if (w->segments)
+    w->failed = (write_segment(w->segments, w->writer, w->data, w->length, w->last) < 0);
+  else
+    w->failed = (upload_writer_write(w->writer, w->data, w->length) < 0 ||
+                 (w->last && upload_writer_commit(w->writer) < 0));
+}
+
+// (in the event loop)
+static void write_upload_completed(io_job_t *job) {
+  write_job_t *w = (write_job_t *)job;
+  Node_t *node = finish_connection_job(job);
+
+  if (!node || !node->data.upload) {
+    // the connection was closed
+    upload_writer_close(w->writer);
+    goto free_job;
   }
+  node->data.upload->writer = w->writer;
 
-  // 2. change dir
-  if (chdir(WWWROOT) < 0) {
+  if (w->failed) {
 #ifdef DEBUG
-    PRINT("[ch_resource_dir]chdir WWWROOT\n");
+    PRINT("[write_upload_completed]ERROR: cannot write into a file\n");
 #endif
-    free(cwd);
-    cwd = NULL;
-    goto free_dir_path;
+    finish_upload(node, job->sfd, "500 Internal Server Error", "Cannot save a file\n");
+  } else if (node->data.upload && node->data.upload->body_done) {
+    // the last data of the request is written
+    finish_received_upload(node, job->sfd);
+  } else if (node->data.upload) {
+    wait_body(job->sfd);
   }
 
-  // if path is only "/"
-  // it will mean that we should create a file in WWWROOT directory
-  if (strcmp(dir_path, "/") != 0) {
-    // all resource pathes begin with '/'
-    // so we must ignore first '/' symbol
-    if (chdir(dir_path + 1) < 0) {
-#ifdef DEBUG
-      PRINT("[ch_resource_dir]chdir %s\n", dir_path + 1);
-#endif
-      // restore
-      if (restore_cur_dir(cwd) < 0) {
-        send_warning_msg("Please, try later\n", sfd);
-      }
-      free(cwd);
-      cwd = NULL;
-      goto free_dir_path;
-    }
+free_job:
+  release_segmented_upload(w->segments);
+  free(w->data);
+  free(w);
+}
+
+//
+// write @length bytes of @data into the file of @node by io_pool
+// (this function owns @data)
+// return 0 if success, else -1
+static int save_upload_data(Node_t *node, char *data, size_t length) {
+  upload_t *u = node->data.upload;
+  write_job_t *w;
+
+  w = (write_job_t *)calloc(1, sizeof(write_job_t));
+  if (!w) {
+    free(data);
+    return -1;
+  }
+  w->data = data;
+  w->length = length;
+  w->last = u->body_done;
+  w->writer = u->writer;
+  u->writer = NULL;
+  if (u->segments) {
+    // the job keeps the upload, even if the connection is closed
+    w->segments = u->segments;
+    hold_segmented_upload(w->segments);
+    u->offset += length;
   }
+  w->job.work = write_upload_data;
+  w->job.complete = write_upload_completed;
 
-free_dir_path:
-  if (dir_path)
-    free(dir_path);
-  return cwd;
+  // the file is closed by the job if the connection is closed
+  submit_connection_job(node, &w->job);
+  return 0;
+}
 
-#undef DIR_PATH_LENGTH
-#undef DIR_PATH_SIGN
-#undef CUR_DIR_LENGTH
+// add @length bytes of the body to u->buf
+static int add_body_data(upload_t *u, char *data, size_t length) {
+  if (u->buf_len + length > u->buf_cap) {
+    size_t cap = u->buf_len + length;
+    char *buf = (char *)realloc(u->buf, cap);
+
+    if (!buf)
+      return -1;
+    u->buf = buf;
+    u->buf_cap = cap;
+  }
+  memcpy(u->buf + u->buf_len, data, length);
+  u->buf_len += length;
+  return 0;
 }
 
 //
-// get filename from @request (it is placed after filename)
-static char *get_filename(char *request, int sfd) {
-  char *filename = NULL;
-  char *ptr;    // pointer to " symbol at the end of @filename
+// parse multipart/form-data body in u->buf
+// data of the file part is copied into @out (@out_len)
+// (the bytes, which may be a beginning of a delimiter, stay in u->buf)
+//
+// return 0 if success, -1 if the body is incorrect or the file cannot be opened
+static int parse_multipart(upload_t *u, int sfd, char *out, size_t *out_len) {
+  char filename[UPLOAD_NAME_LENGTH];
+  size_t pos = 0;
+  char *p;
+
+  while (pos < u->buf_len) {
+    char *data = u->buf + pos;
+    size_t avail = u->buf_len - pos;
+
+    switch (u->part_state) {
+      case PART_PREAMBLE :
+      case PART_DATA :
+        p = (char *)scan_find(data, avail, u->delimiter, u->delimiter_len);
+        if (!p) {
+          // the end of the data may be a beginning of the delimiter
+          size_t keep = (avail < u->delimiter_len - 1) ? avail : u->delimiter_len - 1;
+
+          if (u->part_state == PART_DATA && u->saving) {
+            memcpy(out + *out_len, data, avail - keep);
+            *out_len += avail - keep;
+          }
+          pos += avail - keep;
+          goto need_data;
+        }
+        if (u->part_state == PART_DATA && u->saving) {
+          memcpy(out + *out_len, data, p - data);
+          *out_len += p - data;
+          u->saving = FALSE;
+          u->file_saved = TRUE;
+        }
+        pos += (p - data) + u->delimiter_len;
+        u->part_state = PART_BOUNDARY;
+        break;
+
+      case PART_BOUNDARY :
+        if (avail < 2)
+          goto need_data;
+        if (data[0] == '-' && data[1] == '-') {
+          u->part_state = PART_EPILOGUE;
+        } else if (data[0] == '\r' && data[1] == '\n') {
+          u->part_state = PART_HEADERS;
+          pos += 2;
+        } else {
+          return -1;
+        }
+        break;
+
+      case PART_HEADERS :
+        if (avail >= 2 && data[0] == '\r' && data[1] == '\n') {
+          // a part without headers
+          p = data - 2;
+        } else {
+          p = (char *)scan_find(data, avail, "\r\n\r\n", 4);
+          if (!p) {
+            if (avail > PART_HEADERS_MAX)
+              return -1;
+            goto need_data;
+          }
+          *p = '\0';
+        }
+
+        if (!u->file_saved && p > data && get_filename(data, filename) == 0) {
+          u->writer = open_upload_file(u->dir_fd, filename, sfd);
+          if (!u->writer)
+            return -1;
+          u->saving = TRUE;
+        }
+        pos += (p - data) + 4;
+        u->part_state = PART_DATA;
+        break;
+
+      case PART_EPILOGUE :
+        pos = u->buf_len;
+        break;
+    }
+  }
 
-#define FILENAME_LENGTH 128
-#define FILENAME_SIGN "filename=\""
+need_data:
+  memmove(u->buf, u->buf + pos, u->buf_len - pos);
+  u->buf_len -= pos;
+  return 0;
+}
 
-  filename = get_value_from_req(sfd, request, FILENAME_SIGN, FILENAME_LENGTH);
-  if (!filename) {
-#ifdef DEBUG
-    PRINT("[get_filename] ERROR: out of memory for filename\n");
-#endif
-    return NULL;
+//
+// take @length bytes of the request (after the header)
+// and save data of the file
+//
+// return 0 if the request is completed (the connection will be closed)
+//        -1 if the connection is kept open yet
+static int process_body(Node_t *node, char *request, size_t length, int sfd) {
+  upload_t *u = node->data.upload;
+  size_t body_length = length;
+  char *out;
+  size_t out_len = 0;
+
+  // 1. remove framing of the body
+  if (u->framing == UPLOAD_CHUNKED) {
+    ssize_t used = chunked_decode(&u->chunked, request, length, request, &body_length);
+
+    if (used < 0) {
+      finish_upload(node, sfd, "400 Bad Request", "Incorrect chunked body\n");
+      return 0;
+    }
+    u->body_done = chunked_done(&u->chunked);
+  } else {
+    if ((long long)body_length > u->remaining)
+      body_length = (size_t)u->remaining;
+    u->remaining -= body_length;
+    u->body_done = (u->remaining == 0);
   }
 
-  // we should remove ' " ' symbol at the end
-  if ((ptr = strstr(filename, "\"")) != NULL) {
-    *ptr = '\0';
+  // 2. find data of the file
+  if (u->multipart) {
+    if (add_body_data(u, request, body_length) < 0) {
+      finish_upload(node, sfd, "500 Internal Server Error", "Cannot save a file (please, try later)\n");
+      return 0;
+    }
+    out = (char *)malloc(u->buf_len + 1);
+    if (!out || parse_multipart(u, sfd, out, &out_len) < 0) {
+      free(out);
+      finish_upload(node, sfd, "400 Bad Request", "Incorrect post request (or try later, please)\n");
+      return 0;
+    }
+  } else {
+    // (bytes after the end of a segment are ignored)
+    if (u->segment_end >= 0 && (long long)body_length > u->segment_end - u->offset)
+      body_length = (size_t)(u->segment_end - u->offset);
+    out = (char *)malloc(body_length + 1);
+    if (!out) {
+      finish_upload(node, sfd, "500 Internal Server Error", "Cannot save a file (please, try later)\n");
+      return 0;
+    }
+    memcpy(out, request, body_length);
+    out_len = body_length;
   }
 
-#undef FILENAME_LENGTH
-#undef FILENAME_SIGN
+  // 3. save it (the last part is acknowledged in write_upload_completed())
+  // (the end of the body is written even if it is empty: the file is flushed and synced then)
+  if (u->writer && (out_len > 0 || u->body_done)) {
+    if (save_upload_data(node, out, out_len) < 0) {
+      finish_upload(node, sfd, "500 Internal Server Error", "Cannot save a file\n");
+      return 0;
+    }
+    if (node->data.status == REQUEST_COMPLETED)
+      return 0;
+    if (node->data.io_job != NULL)
+      return -1;
+  } else {
+    free(out);
+  }
 
-  return filename;
+  if (u->body_done) {
+    finish_received_upload(node, sfd);
+    return 0;
+  }
+  return wait_body(sfd);
 }
 
-#define CRLFCRLF "\r\n\r\n"
-
-static FILE *save_data(char *request, char *boundary, int sfd, Node_t *node) {
-  FILE *fp = NULL;
-  char *start;      // the beginning of the file
+//
+// parse "Content-Range: bytes first-last/total" (or "bytes */total", then @first is -1)
+// return 0 if success, else -1
+static int get_content_range(char *value, long long *first, long long *last, long long *total) {
   char *end;
-  size_t data_length;
-  size_t i;
 
-  if (node->data.fp == NULL) {
-    char *filename;
+  if (strncasecmp(value, "bytes ", strlen("bytes ")) != 0)
+    return -1;
+  value += strlen("bytes ");
+
+  if (*value == '*') {
+    *first = *last = -1;
+    value++;
+  } else {
+    *first = strtoll(value, &end, 10);
+    if (end == value || *end != '-')
+      return -1;
+    value = end + 1;
+    *last = strtoll(value, &end, 10);
+    if (end == value)
+      return -1;
+    value = end;
+  }
+  if (*value != '/')
+    return -1;
+  value++;
+  *total = strtoll(value, &end, 10);
+  if (end == value || *total < 0)
+    return -1;
+  return 0;
+}
 
-    filename = get_filename(request, sfd);
-    if (!filename) {
-      send_warning_msg("Incorrect post request (or try later, please)\n", sfd);
-      return NULL;
+//
+// PUT: start (or continue) a segmented upload of the requested file
+// (the body is a segment of the file, see put_request.c)
+//
+// return 0 if success,
+//        -1 if the request is completed (a response is sent)
+static int start_put(Node_t *node, int sfd, char *path, int has_length) {
+  char value[HEADER_VALUE_LENGTH];
+  long long first = 0, last = -1, total = -1;
+  upload_t *u = node->data.upload;
+
+  if (get_header_value(node->data.header, "Content-Range", value, sizeof(value))) {
+    if (get_content_range(value, &first, &last, &total) < 0) {
+      finish_upload(node, sfd, "400 Bad Request", "Incorrect Content-Range\n");
+      return -1;
+    }
+    if (first >= 0 && check_segment(first, last, total) < 0) {
+      finish_upload(node, sfd, "416 Range Not Satisfiable", "A segment must be aligned to 65536 bytes\n");
+      return -1;
+    }
+    if (first >= 0 && has_length && u->remaining != last - first + 1) {
+      finish_upload(node, sfd, "400 Bad Request", "Content-Length does not match Content-Range\n");
+      return -1;
     }
-    // for the first time, so
-    // open a file (create if it doesn't exist yet)
-    // mode "a" to write at the end of the file
-    fp = fopen(filename, "a");
+  } else if (has_length) {
+    // the whole file
+    total = u->remaining;
+    last = total - 1;
   }
 
-  // find beginning of the data
-  if ((start = strstr(request, CRLFCRLF)) == NULL) {
-    goto error_so_close;
-  }
-  if ((end = strstr(start, boundary)) == NULL) {
-    goto error_so_close;
+  u->segments = open_segmented_upload(path, total);
+  if (!u->segments) {
+    if (errno == EBUSY)
+      finish_upload(node, sfd, "409 Conflict", "The file is being uploaded with other length\n");
+    else if (errno == EINVAL)
+      finish_upload(node, sfd, "400 Bad Request", "Incorrect file name\n");
+    else if (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)
+      finish_upload(node, sfd, "507 Insufficient Storage", "There is no space for the file\n");
+    else
+      finish_upload(node, sfd, "404 Not Found", "Cannot find this directory\n");
+    return -1;
   }
-  end -= (strlen("--") + strlen(CRLFCRLF) + 1);
 
-  data_length = (size_t)(end - start);
-  // save a file
-  if (fwrite(start, sizeof(char), data_length, fp) < 0) {
+  if (first < 0) {
+    // "bytes */total": which segments are received
+    finish_upload(node, sfd, is_segmented_upload_complete(u->segments) ? "201 Created" : "308 Resume Incomplete", "");
+    return -1;
+  }
+  u->offset = first;
+  u->segment_end = (total >= 0) ? last + 1 : -1;
+  u->writer = open_segment_writer(u->segments, first, last - first + 1);
+  if (!u->writer) {
+    finish_upload(node, sfd, "500 Internal Server Error", "Cannot save a file\n");
+    return -1;
+  }
 #ifdef DEBUG
-    PRINT("[] ERROR \n");
+  PRINT("[start_put]%s: bytes %lld-%lld/%lld\n", path, first, last, total);
 #endif
-    send_warning_msg("Cannot save a file\n", sfd);
-    goto error_so_close;
-  }
-
-  //
-  return fp;
-
-error_so_close:
-  fclose(fp);
-  return NULL;
+  return 0;
 }
 
-#undef CRLFCRLF
-
 //
-// return NULL, to close connection
-static FILE *open_file_and_save_data(char *request, char *boundary, int sfd, Node_t *node) {
-  char *cur_dir = NULL;
-  FILE *fp = NULL;
-
-  if (node->data.fp != NULL) {
-    // it means that a file is open yet
-    // in previous cases
-    // so we don't need to change dir
-    goto save_file;
+// prepare an upload for POST or PUT request (node->data.header)
+// and save the beginning of the body (it is read with the header)
+//
+// return 0 if the request is completed (the connection will be closed)
+//        -1 if the connection is kept open yet
+int start_upload(Node_t *node, int sfd) {
+  char value[HEADER_VALUE_LENGTH];
+  char boundary[BOUNDARY_LENGTH];
+  char path[REQUEST_PATH_LENGTH];
+  char *header = node->data.header;
+  char *body;
+  upload_t *u;
+  int has_length = FALSE;
+
+  u = (upload_t *)calloc(1, sizeof(upload_t));
+  if (!u) {
+    send_warning_msg("please, try later\n", sfd);
+    return 0;
   }
-  // open dir
-  cur_dir = ch_resource_dir(sfd, node->data.header);
-  if (cur_dir == NULL) {
-    send_warning_msg("Cannot find this directory (please, try later)\n", sfd);
-    return NULL;
+  u->dir_fd = -1;
+  u->segment_end = -1;
+  u->put = (strncmp(header, "PUT ", strlen("PUT ")) == 0);
+  node->data.upload = u;
+
+  // 1. framing of the body
+  if (get_header_value(header, "Transfer-Encoding", value, sizeof(value)) &&
+      strstr(value, "chunked")) {
+    u->framing = UPLOAD_CHUNKED;
+    chunked_decoder_init(&u->chunked);
+  } else if (get_header_value(header, "Content-Length", value, sizeof(value))) {
+    u->framing = UPLOAD_LENGTH;
+    u->remaining = strtoll(value, NULL, 10);
+    has_length = TRUE;
+    if (u->remaining < 0) {
+      finish_upload(node, sfd, "400 Bad Request", "incorrect post request\n");
+      return 0;
+    }
+  } else if (u->put && get_header_value(header, "Content-Range", value, sizeof(value))) {
+    // a status query has no body
+    u->framing = UPLOAD_LENGTH;
+    u->remaining = 0;
+  } else {
+    finish_upload(node, sfd, "411 Length Required", "411 Length Required\n");
+    return 0;
   }
 
-save_file:
-  // save file data
-  if ( (fp = save_data(request, boundary, sfd, node)) == NULL ) {
-    send_warning_msg("Incorrect post request (or try later, please)\n", sfd);
-    return NULL;
-  }
+#ifdef DEBUG
+  PRINT("[start_upload]%s body\n", (u->framing == UPLOAD_CHUNKED) ? "chunked" : "Content-Length");
+#endif
 
-  if (cur_dir == NULL) {
-    // it means that we don't change dir, so goto to return_fp
-    goto return_fp;
+  // 2. where to save the file
+  if (get_request_path(header, path) < 0) {
+    finish_upload(node, sfd, "404 Not Found", "Cannot find this directory (please, try later)\n");
+    return 0;
   }
 
-
-  // if we had changed dir, then we should restore it
-restore_dir:
-  if (restore_cur_dir(cur_dir) < 0) {
-    send_warning_msg("ERROR on the server: cannot restore current directory\n", sfd);
-    return NULL;
+  if (u->put) {
+    if (start_put(node, sfd, path, has_length) < 0)
+      return 0;
+  } else if (get_header_value(header, "Content-Type", value, sizeof(value)) &&
+             strncasecmp(value, "multipart/form-data", strlen("multipart/form-data")) == 0) {
+    // the file is saved into the requested directory
+    if (get_boundary_value(value, boundary) < 0) {
+      finish_upload(node, sfd, "400 Bad Request", "incorrect post request\n");
+      return 0;
+    }
+    u->multipart = TRUE;
+    u->delimiter_len = sprintf(u->delimiter, "\r\n--%s", boundary);
+    u->dir_fd = open_resource_dir(path);
+    if (u->dir_fd < 0) {
+      finish_upload(node, sfd, "404 Not Found", "Cannot find this directory (please, try later)\n");
+      return 0;
+    }
+    // the first delimiter isn't preceded by CRLF
+    if (add_body_data(u, "\r\n", 2) < 0) {
+      finish_upload(node, sfd, "500 Internal Server Error", "please, try later\n");
+      return 0;
+    }
+  } else {
+    // a raw body is saved into the requested file
+    char *name = strrchr(path, '/');
+    int dir_fd;
+
+    *name++ = '\0';
+    dir_fd = open_resource_dir(path);
+    if (dir_fd < 0) {
+      finish_upload(node, sfd, "404 Not Found", "Cannot find this directory (please, try later)\n");
+      return 0;
+    }
+    u->writer = open_upload_file(dir_fd, name, sfd);
+    close(dir_fd);
+    if (!u->writer) {
+      finish_upload(node, sfd, "400 Bad Request", "Incorrect post request (or try later, please)\n");
+      return 0;
+    }
+    // the length of the file is known
+    // (a file of the store isn't changed until it leaves the store, see upload_writer_dedup())
+    if (u->framing == UPLOAD_LENGTH && !u->writer->detach_name &&
+        upload_preallocate(u->writer->fd, u->writer->written, u->remaining) < 0) {
+      finish_upload(node, sfd, "507 Insufficient Storage", "There is no space for the file\n");
+      return 0;
+    }
   }
 
-return_fp:
-  if (node->data.fp == NULL) {
-    node->data.fp = fp;
-  }
-  return node->data.fp;
-}
+  // 3. a client waits for it before sending the body
+  if (get_header_value(header, "Expect", value, sizeof(value)) &&
+      strcasecmp(value, "100-continue") == 0)
+    send_warning_msg("HTTP/1.1 100 Continue\r\n\r\n", sfd);
 
+  // 4. the beginning of the body may be read with the header
+  body = header + node->data.header_end;
+  return process_body(node, body, node->data.header_length - (body - header), sfd);
+}
 
 //
-// @request           -- data of file
+// @request           -- next part of the body (@length bytes)
 // @node->data.header -- header of POST request (it is filled for the first time in handle())
 //
 // if this function returns 0, the connection will be closed
 // -1 => the connection will be kept open yet
-int recv_file(char *request, int sfd, Node_t *node) {
-  char *boundary;
-  long long content_length;
-  int res = -1;
-  FILE *fp;
-
-  if (node->data.status == REQUEST_COMPLETED) {
+int recv_file(char *request, size_t length, int sfd, Node_t *node) {
+  if (node->data.status == REQUEST_COMPLETED || !node->data.upload) {
     return 0;
   }
 
   if (!request) {
-    // 
+    //
     return -1;
   }
-
-  boundary = get_boundary_value(sfd, node->data.header);
-  if (!boundary) {
+  if (length == 0) {
+    // the client has closed the connection before the end of the body
+    finish_upload(node, sfd, "400 Bad Request", "Incomplete post request\n");
     return 0;
   }
-  content_length = get_content_length(sfd, node->data.header);
-  if (content_length < 0) {
-    res = 0;
-    goto free_boundary;
-  }
 
-#ifdef DEBUG
-  PRINT("[recv_file]start of handling\n");
-  PRINT("Boundary=%s\n", boundary);
-  PRINT("Content-Length=%lld\n", content_length);
-  PRINT("[recv_file]end of handling\n");
-#endif
-  
-
-  if ((fp = open_file_and_save_data(request, boundary, sfd, node)) == NULL) {
-    // to close connection
-    res = 0;
-    goto free_boundary;
-  }
-  node->data.fp = fp;
-  
-  // check is it end of request
-  if (node->data.content_length == 0) {
-    // for the first time
-    node->data.content_length += strlen(node->data.header);
-  }
-  node->data.content_length += strlen(request);
-
-  if (node->data.content_length >= content_length) {
-    // it means that we save all data
-    // so we can close connection
-    res = 0;
-#ifdef DEBUG
-    PRINT("[recv_file]DEBUG: end of file");
-#endif
-  }
-  
-free_boundary:
-  if (boundary)
-    free(boundary);
-  if (res == 0) {
-    send_warning_msg("File added successfully.", sfd );
-    if (node->data.fp != NULL) {
-      fclose(node->data.fp);
-    }
-    return 0;
-  }
-
-  return -1;
+  return process_body(node, request, length, sfd);
 }
@@ -0,0 +1,874 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "path_resolution.h"
+#include "io_pool.h"
+#include "digest.h"
+#include "chunked.h"
+#include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/xattr.h>
+
+//
+// Pull-through cache (see proxy.h)
+//
+// A fetch is kept in @fetches while it is in progress. Its connections
+// (waiters) are waiting for the header of the upstream, or they are sent
+// the temporary file (each one reads it by its own descriptor). The buffer
+// of received data is written by an io worker, the upstream isn't read
+// until it is written, so a slow disk slows the upstream down.
+// A finished fetch lives while its connections send the file.
+//
+
+// see server_work.c
+extern List_t *list;
+extern int set_connection_events(int sfd, uint32_t events);
+
+// see request_handling.c
+extern ssize_t send_warning_msg(char *message, int socket_fd);
+extern void send_proxied_file(Node_t *node, int fd, off_t size, char *content_type);
+
+#define PROXY_CONNECTING   0    // connect() is in progress
+#define PROXY_REQUEST      1    // the request is being sent
+#define PROXY_HEADER       2    // the header of the response is being received
+#define PROXY_BODY         3
+#define PROXY_DONE         4    // the file is in the cache
+#define PROXY_FAILED       5
+
+#define BODY_LENGTH        0    // Content-Length
+#define BODY_CHUNKED       1    // Transfer-Encoding: chunked
+#define BODY_CLOSE         2    // up to the close of the connection
+
+#define TMP_PREFIX         ".tmp."
+#define BAD_GATEWAY        "502 Bad Gateway"
+#define NOT_FOUND          "404 file not found"
+
+typedef struct proxy_waiter {
+  int sfd;
+  int streaming;            // the response is being sent
+  int waiting;              // ... it waits for data (EPOLLOUT is enabled when it is written)
+} proxy_waiter_t;
+
+typedef struct proxy_fetch {
+  io_job_t job;             // writing of @buf (see io_pool.c)
+  char path[REQUEST_PATH_LENGTH];
+  char name[SHA256_LENGTH * 2 + 1];   // of the cached file
+  char tmp_name[64];
+  char content_type[PROXY_TYPE_LENGTH];
+  int state;                // PROXY_*
+  int sfd;                  // socket of the upstream (-1 -- closed)
+  char request[REQUEST_PATH_LENGTH * 3 + 512];
+  size_t request_length;
+  size_t request_sent;
+  char header[PROXY_HEADER_MAX];
+  size_t header_length;
+  int body;                 // BODY_*
+  chunked_decoder_t chunked;
+  int fd;                   // the temporary file (-1 -- it isn't created)
+  char *buf;                // received data which isn't written yet
+  size_t buf_length;
+  off_t length;             // of the body (-1 -- it isn't known yet)
+  off_t received;
+  off_t written;            // [0, @written) is in the file
+  int complete;             // the whole body is received
+  int pending;              // the job is in progress
+  int finishing;            // ... and it renames the file
+  int error;                // errno of the job
+  long long deadline;       // CLOCK_MONOTONIC, ms (the fetch fails then)
+  proxy_waiter_t *waiters;
+  int waiters_count;
+  int waiters_max;
+  struct proxy_fetch *next;
+} proxy_fetch_t;
+
+static int proxy_efd = -1;
+static int cache_fd = -1;
+static struct sockaddr_storage upstream_addr;
+static socklen_t upstream_addr_length;
+static proxy_fetch_t *fetches;
+static unsigned int tmp_counter;
+
+// 404s of the upstream (a ring)
+static uint64_t missing_keys[PROXY_MISSING_MAX];
+static long long missing_until[PROXY_MISSING_MAX];   // ms
+static int missing_next;
+
+static void fail_fetch(proxy_fetch_t *f, char *message);
+
+static long long now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//
+// the cached file of @path is called by the hex of SHA-256 of the path
+// @key -- the first 8 bytes of the digest (or NULL)
+//
+static void cache_name(const char *path, char *name, uint64_t *key) {
+  static const char hex[] = "0123456789abcdef";
+  unsigned char digest[SHA256_LENGTH];
+  sha256_ctx_t ctx;
+  int i;
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, path, strlen(path));
+  sha256_final(&ctx, digest);
+  for (i = 0; i < SHA256_LENGTH; i++) {
+    name[2 * i] = hex[digest[i] >> 4];
+    name[2 * i + 1] = hex[digest[i] & 0xf];
+  }
+  name[2 * SHA256_LENGTH] = '\0';
+  if (key)
+    memcpy(key, digest, sizeof(*key));
+}
+
+// temporary files of fetches which were interrupted (by a crash)
+// (files of other workers are written now, their mtime is recent)
+static void remove_stale_files() {
+  struct dirent *entry;
+  struct stat st;
+  DIR *dir;
+  int fd;
+
+  fd = dup(cache_fd);
+  if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, TMP_PREFIX, strlen(TMP_PREFIX)))
+      continue;
+    if (fstatat(cache_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        time(NULL) - st.st_mtime > 2 * PROXY_TIMEOUT)
+      unlinkat(cache_fd, entry->d_name, 0);
+  }
+  closedir(dir);
+}
+
+int proxy_init(int efd) {
+  struct addrinfo hints, *res;
+  char host[256];
+  const char *colon;
+  int status;
+
+  // "host:port"
+  colon = strrchr(srv_settings.upstream, ':');
+  if (!colon || colon == srv_settings.upstream || colon - srv_settings.upstream >= (int)sizeof(host)) {
+    PRINT("[proxy_init]ERROR: UPSTREAM %s is not host:port\n", srv_settings.upstream);
+    return -1;
+  }
+  memcpy(host, srv_settings.upstream, colon - srv_settings.upstream);
+  host[colon - srv_settings.upstream] = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  status = getaddrinfo(host, colon + 1, &hints, &res);
+  if (status != 0) {
+    PRINT("[proxy_init]ERROR: cannot resolve %s: %s\n", srv_settings.upstream, gai_strerror(status));
+    return -1;
+  }
+  memcpy(&upstream_addr, res->ai_addr, res->ai_addrlen);
+  upstream_addr_length = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  cache_fd = open(srv_settings.proxy_cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cache_fd < 0) {
+    PRINT("[proxy_init]ERROR: cannot open PROXY_CACHE_DIR %s (errno=%d)\n", srv_settings.proxy_cache_dir, errno);
+    return -1;
+  }
+  remove_stale_files();
+  proxy_efd = efd;
+  return 0;
+}
+
+void proxy_deinit() {
+  proxy_fetch_t *f, *next;
+
+  // (io workers are stopped, so there are no jobs)
+  for (f = fetches; f; f = next) {
+    next = f->next;
+    if (!f->pending)
+      fail_fetch(f, BAD_GATEWAY);
+  }
+  if (cache_fd >= 0)
+    close(cache_fd);
+  cache_fd = -1;
+}
+
+int proxy_enabled() {
+  return cache_fd >= 0;
+}
+
+static proxy_fetch_t *find_fetch(int sfd) {
+  proxy_fetch_t *f;
+
+  for (f = fetches; f; f = f->next) {
+    if (f->sfd == sfd)
+      return f;
+  }
+  return NULL;
+}
+
+int proxy_owns(int fd) {
+  return fetches && find_fetch(fd) != NULL;
+}
+
+int proxy_is_missing(const char *path) {
+  char name[SHA256_LENGTH * 2 + 1];
+  long long now = now_ms();
+  uint64_t key;
+  int i;
+
+  cache_name(path, name, &key);
+  for (i = 0; i < PROXY_MISSING_MAX; i++) {
+    if (missing_keys[i] == key && missing_until[i] > now)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static void remember_missing(const char *path) {
+  char name[SHA256_LENGTH * 2 + 1];
+
+  cache_name(path, name, &missing_keys[missing_next]);
+  missing_until[missing_next] = now_ms() + srv_settings.proxy_negative_ttl * 1000LL;
+  missing_next = (missing_next + 1) % PROXY_MISSING_MAX;
+}
+
+// (in a worker thread)
+int proxy_open_cached(const char *path, char *content_type, size_t max) {
+  char name[SHA256_LENGTH * 2 + 1];
+  struct stat st;
+  ssize_t length;
+  int fd;
+
+  cache_name(path, name, NULL);
+  fd = openat(cache_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    goto miss;
+  // (the mtime is the time of the fetch)
+  if (srv_settings.proxy_ttl > 0 && time(NULL) - st.st_mtime >= srv_settings.proxy_ttl)
+    goto miss;
+
+  length = fgetxattr(fd, PROXY_TYPE_XATTR, content_type, max - 1);
+  if (length > 0)
+    content_type[length] = '\0';
+  return fd;
+
+miss:
+  close(fd);
+  errno = ENOENT;
+  return -1;
+}
+
+static void remove_waiter(proxy_fetch_t *f, int i) {
+  f->waiters[i] = f->waiters[--f->waiters_count];
+}
+
+static int find_waiter(proxy_fetch_t *f, int sfd) {
+  int i;
+
+  for (i = 0; i < f->waiters_count; i++) {
+    if (f->waiters[i].sfd == sfd)
+      return i;
+  }
+  return -1;
+}
+
+static void unlink_fetch(proxy_fetch_t *f) {
+  proxy_fetch_t **p;
+
+  for (p = &fetches; *p; p = &(*p)->next) {
+    if (*p == f) {
+      *p = f->next;
+      return;
+    }
+  }
+}
+
+// a finished fetch is freed when its connections have sent the file
+static void free_if_unused(proxy_fetch_t *f) {
+  if (f->waiters_count > 0 || f->pending || (f->state != PROXY_DONE && f->state != PROXY_FAILED))
+    return;
+  free(f->waiters);
+  free(f->buf);
+  free(f);
+}
+
+static void close_upstream(proxy_fetch_t *f) {
+  if (f->sfd < 0)
+    return;
+  // (closing removes it from epoll)
+  close(f->sfd);
+  f->sfd = -1;
+}
+
+static void watch_upstream(proxy_fetch_t *f, int op, uint32_t events) {
+  struct epoll_event event;
+
+  event.data.fd = f->sfd;
+  event.events = events;
+  if (epoll_ctl(proxy_efd, op, f->sfd, &event) < 0)
+    PRINT("[proxy]ERROR: epoll_ctl sfd=%d (errno=%d)\n", f->sfd, errno);
+}
+
+//
+// waiter @i begins to send the temporary file
+// (it is removed if the response cannot be started)
+//
+static void start_response(proxy_fetch_t *f, int i) {
+  proxy_waiter_t *w = &f->waiters[i];
+  char path[64];
+  Node_t *node;
+  int fd;
+
+  node = find_node(list, w->sfd);
+  if (!node) {
+    remove_waiter(f, i);
+    return;
+  }
+
+  // (its own offset in the file)
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", f->fd);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    send_warning_msg(BAD_GATEWAY, w->sfd);
+  else
+    send_proxied_file(node, fd, f->length, f->content_type);
+
+  set_connection_events(w->sfd, EPOLLIN | EPOLLOUT);
+  if (!node->data.fp) {
+    // the connection is closed on EPOLLOUT
+    node->data.proxy = NULL;
+    remove_waiter(f, i);
+    return;
+  }
+  w->streaming = TRUE;
+}
+
+static void start_responses(proxy_fetch_t *f) {
+  int i;
+
+  for (i = f->waiters_count - 1; i >= 0; i--) {
+    if (!f->waiters[i].streaming)
+      start_response(f, i);
+  }
+}
+
+static void wake_waiters(proxy_fetch_t *f) {
+  int i;
+
+  for (i = 0; i < f->waiters_count; i++) {
+    if (f->waiters[i].waiting) {
+      // the connection sends again (see send_responses() in server_work.c)
+      f->waiters[i].waiting = FALSE;
+      set_connection_events(f->waiters[i].sfd, EPOLLIN | EPOLLOUT);
+    }
+  }
+}
+
+//
+// the fetch is finished without the file: connections which wait for the header
+// are answered with @message, ones which send the file are closed (see proxy_available())
+//
+static void fail_fetch(proxy_fetch_t *f, char *message) {
+  proxy_waiter_t *w;
+  Node_t *node;
+  int i;
+
+  close_upstream(f);
+  if (f->fd >= 0) {
+    close(f->fd);
+    unlinkat(cache_fd, f->tmp_name, 0);
+    f->fd = -1;
+  }
+  f->state = PROXY_FAILED;
+  unlink_fetch(f);
+
+  for (i = f->waiters_count - 1; i >= 0; i--) {
+    w = &f->waiters[i];
+    if (w->streaming) {
+      w->waiting = FALSE;
+      set_connection_events(w->sfd, EPOLLIN | EPOLLOUT);
+      continue;
+    }
+    node = find_node(list, w->sfd);
+    if (node)
+      node->data.proxy = NULL;
+    send_warning_msg(message, w->sfd);
+    // (the connection is closed on EPOLLOUT)
+    set_connection_events(w->sfd, EPOLLIN | EPOLLOUT);
+    remove_waiter(f, i);
+  }
+  free_if_unused(f);
+}
+
+static void not_found(proxy_fetch_t *f) {
+#ifdef DEBUG
+  PRINT("[proxy]DEBUG: %s is not found upstream\n", f->path);
+#endif
+  remember_missing(f->path);
+  fail_fetch(f, NOT_FOUND);
+}
+
+//
+// the whole body is in the file: connections which wait for it
+// (the length wasn't known) begin to send it
+//
+static void finish_fetch(proxy_fetch_t *f) {
+#ifdef DEBUG
+  PRINT("[proxy]DEBUG: %s is cached (%lld bytes)\n", f->path, (long long)f->written);
+#endif
+  f->state = PROXY_DONE;
+  f->length = f->written;
+  // new requests open the cached file
+  unlink_fetch(f);
+  start_responses(f);
+  wake_waiters(f);
+  close(f->fd);
+  f->fd = -1;
+  free_if_unused(f);
+}
+
+// (in a worker thread)
+static void write_buffer(io_job_t *job) {
+  proxy_fetch_t *f = (proxy_fetch_t *)job;
+  size_t done = 0;
+  ssize_t count;
+
+  while (done < f->buf_length) {
+    count = pwrite(f->fd, f->buf + done, f->buf_length - done, f->written + done);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      f->error = errno;
+      return;
+    }
+    done += count;
+  }
+
+  if (f->finishing) {
+    // (no user xattrs -- the Content-Type of hits is given by the extension)
+    fsetxattr(f->fd, PROXY_TYPE_XATTR, f->content_type, strlen(f->content_type), 0);
+    if (renameat(cache_fd, f->tmp_name, cache_fd, f->name) < 0)
+      f->error = errno;
+  }
+}
+
+// (in the event loop)
+static void buffer_written(io_job_t *job) {
+  proxy_fetch_t *f = (proxy_fetch_t *)job;
+
+  f->pending = FALSE;
+  if (f->error) {
+    PRINT("[proxy]ERROR: cannot write %s into the cache (errno=%d)\n", f->path, f->error);
+    fail_fetch(f, BAD_GATEWAY);
+    return;
+  }
+  f->written += f->buf_length;
+  f->buf_length = 0;
+  if (f->finishing) {
+    finish_fetch(f);
+    return;
+  }
+
+  wake_waiters(f);
+  f->deadline = now_ms() + PROXY_TIMEOUT * 1000LL;
+  watch_upstream(f, EPOLL_CTL_ADD, EPOLLIN);
+}
+
+// the received data is written by an io worker
+// (the upstream isn't watched until it is written)
+static void submit_buffer(proxy_fetch_t *f) {
+  if (f->complete)
+    close_upstream(f);
+  else
+    epoll_ctl(proxy_efd, EPOLL_CTL_DEL, f->sfd, NULL);
+
+  f->finishing = f->complete;
+  f->pending = TRUE;
+  f->job.work = write_buffer;
+  f->job.complete = buffer_written;
+  f->job.sfd = -1;
+  f->job.conn_id = 0;
+  if (io_pool_submit(&f->job) < 0) {
+    write_buffer(&f->job);
+    buffer_written(&f->job);
+  }
+}
+
+//
+// append @count bytes of the body at @data to the buffer
+// (@data may be at the end of the buffer)
+// return 0 if success, -1 if the chunked coding is broken
+//
+static int add_body(proxy_fetch_t *f, char *data, size_t count) {
+  char *out = f->buf + f->buf_length;
+  size_t decoded;
+
+  if (f->body == BODY_CHUNKED) {
+    if (chunked_decode(&f->chunked, data, count, out, &decoded) < 0)
+      return -1;
+    count = decoded;
+    f->complete = chunked_done(&f->chunked);
+  } else {
+    // (bytes after Content-Length are ignored)
+    if (f->body == BODY_LENGTH && (off_t)count > f->length - f->received)
+      count = f->length - f->received;
+    if (out != data)
+      memmove(out, data, count);
+  }
+  f->buf_length += count;
+  f->received += count;
+  if (f->body == BODY_LENGTH && f->received == f->length)
+    f->complete = TRUE;
+  return 0;
+}
+
+//
+// parse the header of the response when it is received
+// return 0 if success (or the header isn't full yet), -1 if the fetch is finished
+//
+static int parse_header(proxy_fetch_t *f) {
+  char *end, *end2, *body, *line, *next, *value;
+  long long length = -1;
+  int chunked = FALSE;
+  int status;
+
+  f->header[f->header_length] = '\0';
+  // (sSs ends its header by "\r\n\n")
+  end = strstr(f->header, "\n\r\n");
+  end2 = strstr(f->header, "\n\n");
+  if (!end || (end2 && end2 < end))
+    end = end2;
+  if (!end) {
+    if (f->header_length < PROXY_HEADER_MAX - 1)
+      return 0;
+    PRINT("[proxy]ERROR: the header of %s is too long\n", f->path);
+    fail_fetch(f, BAD_GATEWAY);
+    return -1;
+  }
+  body = end + ((end[1] == '\r') ? 3 : 2);
+  *end = '\0';
+
+  if (sscanf(f->header, "HTTP/%*d.%*d %d", &status) != 1) {
+    PRINT("[proxy]ERROR: a wrong response of %s for %s\n", srv_settings.upstream, f->path);
+    fail_fetch(f, BAD_GATEWAY);
+    return -1;
+  }
+  if (status == 404) {
+    not_found(f);
+    return -1;
+  }
+  if (status != 200) {
+    PRINT("[proxy]ERROR: %s answers %d for %s\n", srv_settings.upstream, status, f->path);
+    fail_fetch(f, BAD_GATEWAY);
+    return -1;
+  }
+
+  for (line = strchr(f->header, '\n'); line; line = next) {
+    line++;
+    next = strchr(line, '\n');
+    if (next)
+      *next = '\0';
+    line[strcspn(line, "\r")] = '\0';
+    value = strchr(line, ':');
+    if (!value)
+      continue;
+    for (value++; *value == ' ' || *value == '\t'; value++)
+      ;
+    if (!strncasecmp(line, "Content-Length:", 15))
+      length = atoll(value);
+    else if (!strncasecmp(line, "Content-Type:", 13) && *value)
+      snprintf(f->content_type, sizeof(f->content_type), "%s", value);
+    else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(value, "chunked"))
+      chunked = TRUE;
+  }
+
+  snprintf(f->tmp_name, sizeof(f->tmp_name), TMP_PREFIX "%d.%u", (int)getpid(), ++tmp_counter);
+  f->fd = openat(cache_fd, f->tmp_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (f->fd < 0) {
+    PRINT("[proxy]ERROR: cannot create a file in %s (errno=%d)\n", srv_settings.proxy_cache_dir, errno);
+    fail_fetch(f, BAD_GATEWAY);
+    return -1;
+  }
+  f->state = PROXY_BODY;
+
+  if (chunked) {
+    f->body = BODY_CHUNKED;
+    chunked_decoder_init(&f->chunked);
+  } else if (length >= 0) {
+    f->body = BODY_LENGTH;
+    f->length = length;
+  } else {
+    f->body = BODY_CLOSE;
+  }
+
+  if (add_body(f, body, f->header + f->header_length - body) < 0) {
+    PRINT("[proxy]ERROR: broken chunked body of %s\n", f->path);
+    fail_fetch(f, BAD_GATEWAY);
+    return -1;
+  }
+  // the length is known: the file is sent while it is written
+  if (f->body == BODY_LENGTH)
+    start_responses(f);
+  return 0;
+}
+
+// connect() is completed, the request is sent
+static void send_request(proxy_fetch_t *f) {
+  socklen_t length = sizeof(int);
+  ssize_t count;
+  int err = 0;
+
+  if (f->state == PROXY_CONNECTING) {
+    if (getsockopt(f->sfd, SOL_SOCKET, SO_ERROR, &err, &length) < 0 || err) {
+      PRINT("[proxy]ERROR: cannot connect to %s (errno=%d)\n", srv_settings.upstream, err);
+      fail_fetch(f, BAD_GATEWAY);
+      return;
+    }
+    f->state = PROXY_REQUEST;
+  }
+
+  while (f->request_sent < f->request_length) {
+    count = send(f->sfd, f->request + f->request_sent, f->request_length - f->request_sent, MSG_NOSIGNAL);
+    if (count < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      PRINT("[proxy]ERROR: send to %s (errno=%d)\n", srv_settings.upstream, errno);
+      fail_fetch(f, BAD_GATEWAY);
+      return;
+    }
+    f->request_sent += count;
+  }
+  f->state = PROXY_HEADER;
+  watch_upstream(f, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+// read the response (up to a full buffer), the data is written by an io worker
+static void receive_response(proxy_fetch_t *f) {
+  ssize_t count;
+
+  while (!f->complete && f->buf_length < PROXY_BUFFER_SIZE) {
+    if (f->state == PROXY_HEADER)
+      count = recv(f->sfd, f->header + f->header_length, PROXY_HEADER_MAX - 1 - f->header_length, 0);
+    else
+      count = recv(f->sfd, f->buf + f->buf_length, PROXY_BUFFER_SIZE - f->buf_length, 0);
+    if (count < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      PRINT("[proxy]ERROR: recv from %s (errno=%d)\n", srv_settings.upstream, errno);
+      fail_fetch(f, BAD_GATEWAY);
+      return;
+    }
+    f->deadline = now_ms() + PROXY_TIMEOUT * 1000LL;
+
+    if (count == 0) {
+      // the upstream has closed the connection
+      if (f->state == PROXY_BODY && f->body == BODY_CLOSE) {
+        f->complete = TRUE;
+        break;
+      }
+      // (sSs answers a missing file by a bare line, see send_warning_msg())
+      if (f->state == PROXY_HEADER && !strncmp(f->header, "404 ", 4)) {
+        not_found(f);
+        return;
+      }
+      PRINT("[proxy]ERROR: %s has closed the connection for %s\n", srv_settings.upstream, f->path);
+      fail_fetch(f, BAD_GATEWAY);
+      return;
+    }
+
+    if (f->state == PROXY_HEADER) {
+      f->header_length += count;
+      if (parse_header(f) < 0)
+        return;
+    } else if (add_body(f, f->buf + f->buf_length, count) < 0) {
+      PRINT("[proxy]ERROR: broken chunked body of %s\n", f->path);
+      fail_fetch(f, BAD_GATEWAY);
+      return;
+    }
+  }
+
+  if (f->state == PROXY_BODY && (f->complete || f->buf_length > 0))
+    submit_buffer(f);
+}
+
+void proxy_handle(int fd, uint32_t events) {
+  proxy_fetch_t *f = find_fetch(fd);
+
+  (void)events;
+  if (!f)
+    return;
+  if (f->state == PROXY_CONNECTING || f->state == PROXY_REQUEST)
+    send_request(f);
+  else
+    receive_response(f);
+}
+
+int proxy_timeout() {
+  proxy_fetch_t *f;
+  long long now, timeout = -1;
+
+  if (!fetches)
+    return -1;
+  now = now_ms();
+  for (f = fetches; f; f = f->next) {
+    if (f->pending)
+      continue;
+    if (timeout < 0 || f->deadline - now < timeout)
+      timeout = (f->deadline > now) ? f->deadline - now : 0;
+  }
+  return (int)timeout;
+}
+
+void proxy_expire() {
+  proxy_fetch_t *f, *next;
+  long long now;
+
+  if (!fetches)
+    return;
+  now = now_ms();
+  for (f = fetches; f; f = next) {
+    next = f->next;
+    if (!f->pending && f->deadline <= now) {
+      PRINT("[proxy]ERROR: %s doesn't answer for %s\n", srv_settings.upstream, f->path);
+      fail_fetch(f, BAD_GATEWAY);
+    }
+  }
+}
+
+// "%XX" of bytes which aren't allowed in a path
+static void encode_path(const char *path, char *out) {
+  static const char hex[] = "0123456789ABCDEF";
+  unsigned char c;
+
+  for (; *path; path++) {
+    c = (unsigned char)*path;
+    if (isalnum(c) || strchr("/-._~", c)) {
+      *out++ = c;
+    } else {
+      *out++ = '%';
+      *out++ = hex[c >> 4];
+      *out++ = hex[c & 0xf];
+    }
+  }
+  *out = '\0';
+}
+
+static proxy_fetch_t *start_fetch(const char *path, const char *content_type) {
+  char encoded[REQUEST_PATH_LENGTH * 3];
+  proxy_fetch_t *f;
+  int length;
+
+  f = (proxy_fetch_t *)calloc(1, sizeof(proxy_fetch_t));
+  if (!f)
+    return NULL;
+  f->sfd = -1;
+  f->buf = (char *)malloc(PROXY_BUFFER_SIZE);
+  if (!f->buf)
+    goto error;
+  snprintf(f->path, sizeof(f->path), "%s", path);
+  snprintf(f->content_type, sizeof(f->content_type), "%s", content_type);
+  cache_name(path, f->name, NULL);
+  f->fd = -1;
+  f->length = -1;
+
+  encode_path(path, encoded);
+  length = snprintf(f->request, sizeof(f->request),
+                    "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: sSs\r\nAccept-Encoding: identity\r\n\r\n",
+                    encoded, srv_settings.upstream);
+  if (length < 0 || length >= (int)sizeof(f->request))
+    goto error;
+  f->request_length = length;
+
+  f->sfd = socket(upstream_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (f->sfd < 0)
+    goto error;
+  if (connect(f->sfd, (struct sockaddr *)&upstream_addr, upstream_addr_length) < 0 && errno != EINPROGRESS) {
+    PRINT("[proxy]ERROR: cannot connect to %s (errno=%d)\n", srv_settings.upstream, errno);
+    goto error;
+  }
+  f->state = PROXY_CONNECTING;
+  watch_upstream(f, EPOLL_CTL_ADD, EPOLLOUT);
+  f->deadline = now_ms() + PROXY_TIMEOUT * 1000LL;
+
+  f->next = fetches;
+  fetches = f;
+#ifdef DEBUG
+  PRINT("[proxy]DEBUG: fetch %s\n", path);
+#endif
+  return f;
+
+error:
+  if (f->sfd >= 0)
+    close(f->sfd);
+  free(f->buf);
+  free(f);
+  return NULL;
+}
+
+int proxy_fetch(Node_t *node, const char *path, const char *content_type) {
+  proxy_waiter_t *waiters;
+  proxy_fetch_t *f;
+  int max;
+
+  // a request of the path which is being fetched joins the fetch
+  for (f = fetches; f && strcmp(f->path, path); f = f->next)
+    ;
+  if (!f && (f = start_fetch(path, content_type)) == NULL)
+    return -1;
+
+  if (f->waiters_count == f->waiters_max) {
+    max = f->waiters_max ? 2 * f->waiters_max : 4;
+    waiters = (proxy_waiter_t *)realloc(f->waiters, max * sizeof(proxy_waiter_t));
+    if (!waiters)
+      return -1;
+    f->waiters = waiters;
+    f->waiters_max = max;
+  }
+  memset(&f->waiters[f->waiters_count], 0, sizeof(proxy_waiter_t));
+  f->waiters[f->waiters_count++].sfd = node->data.sfd;
+  node->data.proxy = f;
+
+  if (f->state == PROXY_BODY && f->length >= 0)
+    start_response(f, f->waiters_count - 1);
+  else
+    set_connection_events(node->data.sfd, 0);
+  return 0;
+}
+
+off_t proxy_available(struct proxy_fetch *f, int sfd, off_t left) {
+  off_t pos = f->length - left;
+  int i;
+
+  if (f->state == PROXY_FAILED)
+    return -1;
+  if (f->written > pos)
+    return f->written - pos;
+  i = find_waiter(f, sfd);
+  if (i >= 0)
+    f->waiters[i].waiting = TRUE;
+  return 0;
+}
+
+void proxy_release(struct proxy_fetch *f, int sfd) {
+  int i;
+
+  if (!f)
+    return;
+  i = find_waiter(f, sfd);
+  if (i >= 0)
+    remove_waiter(f, i);
+  free_if_unused(f);
+}
@@ -0,0 +1,75 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include "setup.h"
+#include "ext_epoll_data.h"
+#include <stdint.h>
+
+//
+// Pull-through cache of an upstream server (UPSTREAM host:port in config)
+//
+// GET of a path is served from PROXY_CACHE_DIR, where files of the upstream
+// are kept by the SHA-256 of their paths. A missing (or expired) file is
+// fetched by a non-blocking HTTP/1.0 client of the event loop into a temporary
+// file of the cache, which is renamed when it is complete. Io workers write
+// the fetched data, and clients are sent the temporary file as far as it is
+// written, so the first client streams the response while it is cached.
+//
+// Requests of a path which is being fetched join the fetch (one request goes
+// to the upstream). Files are fresh for PROXY_TTL seconds (their mtime is the
+// time of the fetch), 404 of the upstream is remembered for PROXY_NEGATIVE_TTL.
+// A response without Content-Length (chunked or up to the close) is sent when
+// it is complete. Other statuses of the upstream are answered with 502.
+//
+
+#define PROXY_TTL_DEFAULT           3600      // seconds (0 -- files never expire)
+#define PROXY_NEGATIVE_TTL_DEFAULT  10        // seconds
+#define PROXY_BUFFER_SIZE           (256 * 1024)  // data of one write by an io worker
+#define PROXY_HEADER_MAX            (16 * 1024)
+#define PROXY_TIMEOUT               30        // seconds without data from the upstream
+#define PROXY_MISSING_MAX           1024      // remembered 404s
+#define PROXY_TYPE_LENGTH           128
+#define PROXY_TYPE_XATTR            "user.sss.type"   // Content-Type of a cached file
+
+struct proxy_fetch;
+
+// resolve UPSTREAM and open PROXY_CACHE_DIR, sockets of the upstream are added to @efd
+// return 0 if success, else -1
+int proxy_init(int efd);
+void proxy_deinit();
+
+// TRUE if requests are proxied
+int proxy_enabled();
+
+// TRUE if @fd is a socket of the upstream
+int proxy_owns(int fd);
+// handle @events of @fd (see proxy_owns())
+void proxy_handle(int fd, uint32_t events);
+
+// timeout for epoll_wait(): ms until the first fetch times out or -1
+int proxy_timeout();
+// fail the fetches which wait for the upstream too long
+void proxy_expire();
+
+// TRUE if the upstream has answered 404 for @path recently
+int proxy_is_missing(const char *path);
+
+// (in a worker thread) open the cached file of @path if it is fresh,
+// its Content-Type is copied into @content_type (if it is known)
+// return the descriptor or -1 (errno is set, ENOENT if the file isn't cached or it has expired)
+int proxy_open_cached(const char *path, char *content_type, size_t max);
+
+// the connection @node waits for @path from the upstream (its events are disabled
+// until the response begins, @content_type is used if the upstream doesn't send one)
+// return 0 if success, else -1
+int proxy_fetch(Node_t *node, const char *path, const char *content_type);
+
+// (send_file()) how many bytes of the response may be sent when @left bytes aren't sent yet
+// return 0 if the connection has to wait (EPOLLOUT is enabled when more is written),
+// -1 if the fetch failed
+off_t proxy_available(struct proxy_fetch *f, int sfd, off_t left);
+
+// the connection on @sfd doesn't wait for @f any more (it is finished or closed)
+void proxy_release(struct proxy_fetch *f, int sfd);
+
+#endif // _PROXY_H_
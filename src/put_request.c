@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+#include "setup.h"
+#include "path_resolution.h"
+#include "upload_writer.h"
+#include "dedup.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+
+//
+// Segmented uploads (PUT with Content-Range)
+//
+// A file is uploaded into a temporary file UPLOAD_TMP_PREFIX<name> in its directory.
+// Each segment ("Content-Range: bytes first-last/total") is written at its offset
+// with pwrite(), so several connections may upload different segments of one file
+// at the same time. Received blocks (UPLOAD_BLOCK_SIZE) are marked in a bitmap,
+// which is kept in UPLOAD_TMP_PREFIX<name>.map, so an upload is resumed after
+// a dropped connection (or a restart of the server): "Content-Range: bytes */total"
+// without a body returns the received ranges. When all blocks are received,
+// the file is renamed into place.
+//
+// A segment starts at a multiple of UPLOAD_BLOCK_SIZE and ends at a multiple of it
+// (or at the end of the file), so a block is always written by one segment.
+// A PUT without Content-Range is one segment with the whole file (its length may be unknown,
+// if it is chunked; then the file is renamed when the body ends).
+//
+// Uploads are looked up and released in the event loop only, the data is written
+// by io_pool workers (write_segment()). Segments of one file may come to different
+// worker processes (WORKERS, see workers.c), so the map is the only bitmap of an upload:
+// it is read and changed under its flock() (and a mutex for threads of a process), and
+// the process which marks the last block renames the file. Uploads of the file with the
+// same length hold a shared flock() of the temporary file, an upload of unknown length
+// an exclusive one, so an upload never truncates a file which another one still writes.
+// Each connection writes its segment with its own upload_writer_t (see upload_writer.c);
+// if UPLOAD_FSYNC isn't none, the map is updated when the data of a segment is synced.
+//
+
+#define UPLOAD_BLOCK_SIZE   (64 * 1024)
+#define UPLOAD_TMP_PREFIX   SERVER_FILES_PREFIX "upload."
+#define UPLOAD_MAP_SUFFIX   ".map"
+#define UPLOAD_MAP_MAGIC    "SSSMAP2"
+#define UPLOAD_NAME_LENGTH  256
+
+// the beginning of a map file (the bitmap follows it)
+typedef struct map_header {
+  char magic[8];
+  long long total;
+  long long block_size;
+  long long received;         // number of blocks which are set in the bitmap
+} map_header_t;
+
+typedef struct segmented_upload {
+  char *path;                 // normalised path of the file
+  char name[UPLOAD_NAME_LENGTH];
+  char tmp_name[UPLOAD_NAME_LENGTH + sizeof(UPLOAD_TMP_PREFIX)];
+  char map_name[UPLOAD_NAME_LENGTH + sizeof(UPLOAD_TMP_PREFIX) + sizeof(UPLOAD_MAP_SUFFIX)];
+  int dir_fd;
+  int fd;                     // the temporary file
+  int map_fd;                 // -1 if the length of the file is unknown
+  long long total;            // length of the file (-1 -- unknown)
+  long long blocks;
+  unsigned char *bitmap;      // (a copy of the map, see lock_upload_map())
+  long long received;         // number of received blocks (when the map was read last)
+  pthread_mutex_t lock;       // threads of the process, which read or change the map
+  int complete;               // the file is renamed into place
+  int refs;                   // connections and jobs which use the upload
+  struct segmented_upload *next;
+} segmented_upload_t;
+
+static segmented_upload_t *uploads;
+
+static void unlink_upload(segmented_upload_t *s) {
+  segmented_upload_t **p;
+
+  for (p = &uploads; *p; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      return;
+    }
+  }
+}
+
+static void free_segmented_upload(segmented_upload_t *s) {
+  if (s->fd >= 0)
+    close(s->fd);
+  if (s->map_fd >= 0)
+    close(s->map_fd);
+  if (s->dir_fd >= 0)
+    close(s->dir_fd);
+  pthread_mutex_destroy(&s->lock);
+  free(s->bitmap);
+  free(s->path);
+  free(s);
+}
+
+// (@operation -- LOCK_EX or LOCK_SH)
+static void lock_upload_map(segmented_upload_t *s, int operation) {
+  pthread_mutex_lock(&s->lock);
+  while (flock(s->map_fd, operation) < 0 && errno == EINTR)
+    ;
+}
+
+static void unlock_upload_map(segmented_upload_t *s) {
+  flock(s->map_fd, LOCK_UN);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// the upload was completed (by any process): its map is removed
+static int is_upload_map_removed(segmented_upload_t *s) {
+  struct stat st;
+
+  return s->map_fd >= 0 && fstat(s->map_fd, &st) == 0 && st.st_nlink == 0;
+}
+
+// count bits of the bitmap
+static long long count_blocks(segmented_upload_t *s) {
+  long long i, count = 0;
+
+  for (i = 0; i < s->blocks; i++) {
+    if (s->bitmap[i / 8] & (1 << (i % 8)))
+      count++;
+  }
+  return count;
+}
+
+//
+// open the map of a previous upload of the same file (another process may still
+// write it) or start a new one, and open the temporary file
+// (the map is locked meanwhile)
+//
+// return TRUE if the previous upload is continued, FALSE if a new one is started,
+//        -1 if error (errno is EBUSY if the file is uploaded with another length)
+static int open_upload_files(segmented_upload_t *s) {
+  map_header_t header;
+  size_t bitmap_size = (s->blocks + 7) / 8;
+  int resumed;
+
+  // (the map may be removed by a process which has just completed the upload)
+  do {
+    if (s->map_fd >= 0)
+      close(s->map_fd);
+    s->map_fd = openat(s->dir_fd, s->map_name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (s->map_fd < 0)
+      return -1;
+    lock_upload_map(s, LOCK_EX);
+    if (is_upload_map_removed(s))
+      unlock_upload_map(s);
+    else
+      break;
+  } while (1);
+
+  resumed = (pread(s->map_fd, &header, sizeof(header), 0) == sizeof(header) &&
+             !memcmp(header.magic, UPLOAD_MAP_MAGIC, sizeof(header.magic)) &&
+             header.total == s->total && header.block_size == UPLOAD_BLOCK_SIZE &&
+             pread(s->map_fd, s->bitmap, bitmap_size, sizeof(header)) == (ssize_t)bitmap_size &&
+             faccessat(s->dir_fd, s->tmp_name, F_OK, AT_SYMLINK_NOFOLLOW) == 0);
+
+  s->fd = openat(s->dir_fd, s->tmp_name, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (s->fd < 0)
+    goto error;
+  // a new upload mustn't truncate the file while other processes write it
+  if (flock(s->fd, (resumed ? LOCK_SH : LOCK_EX) | LOCK_NB) < 0) {
+    if (errno == EWOULDBLOCK)
+      errno = EBUSY;
+    goto error;
+  }
+
+  if (resumed) {
+    // (a process may have been killed while it changed the map)
+    s->received = count_blocks(s);
+  } else {
+    // the space of the whole file is reserved at once
+    memset(s->bitmap, 0, bitmap_size);
+    s->received = 0;
+    if (ftruncate(s->fd, 0) < 0 || upload_preallocate(s->fd, 0, s->total) < 0 ||
+        ftruncate(s->map_fd, 0) < 0) {
+      int err = errno;
+
+      unlinkat(s->dir_fd, s->tmp_name, 0);
+      unlinkat(s->dir_fd, s->map_name, 0);
+      errno = err;
+      goto error;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UPLOAD_MAP_MAGIC, sizeof(header.magic));
+    header.total = s->total;
+    header.block_size = UPLOAD_BLOCK_SIZE;
+    if (pwrite(s->map_fd, s->bitmap, bitmap_size, sizeof(header)) != (ssize_t)bitmap_size)
+      PRINT("[open_upload_files]ERROR: cannot write %s (errno=%d)\n", s->map_name, errno);
+    // (uploads of other processes may continue it)
+    flock(s->fd, LOCK_SH);
+  }
+  header.received = s->received;
+  if (pwrite(s->map_fd, &header, sizeof(header), 0) != sizeof(header))
+    PRINT("[open_upload_files]ERROR: cannot write %s (errno=%d)\n", s->map_name, errno);
+
+  unlock_upload_map(s);
+  return resumed;
+
+error:
+  unlock_upload_map(s);
+  return -1;
+}
+
+//
+// find an upload of @path (normalised) with length @total (-1 -- unknown)
+// or start a new one
+//
+// return the upload or NULL (errno is EBUSY if another upload of this file
+// has other length or the length is unknown)
+segmented_upload_t *open_segmented_upload(char *path, long long total) {
+  segmented_upload_t *s;
+  char dir[REQUEST_PATH_LENGTH];
+  char *name;
+  int resumed = FALSE;
+  int err;
+
+  for (s = uploads; s; s = s->next) {
+    if (strcmp(s->path, path) != 0)
+      continue;
+    if (__atomic_load_n(&s->complete, __ATOMIC_ACQUIRE) || is_upload_map_removed(s)) {
+      // the next upload of this file
+      // (this one was completed by this process or by another one)
+      unlink_upload(s);
+      break;
+    }
+    if (s->total < 0 || s->total != total) {
+      errno = EBUSY;
+      return NULL;
+    }
+    s->refs++;
+    return s;
+  }
+
+  // a file name from a client cannot be a directory
+  strncpy(dir, path, REQUEST_PATH_LENGTH - 1);
+  dir[REQUEST_PATH_LENGTH - 1] = '\0';
+  name = strrchr(dir, '/');
+  *name++ = '\0';
+  if (*name == '\0' || strlen(name) >= UPLOAD_NAME_LENGTH) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  s = (segmented_upload_t *)calloc(1, sizeof(segmented_upload_t));
+  if (!s)
+    return NULL;
+  s->fd = s->map_fd = -1;
+  s->total = total;
+  s->refs = 1;
+  pthread_mutex_init(&s->lock, NULL);
+  strcpy(s->name, name);
+  sprintf(s->tmp_name, UPLOAD_TMP_PREFIX "%s", name);
+  sprintf(s->map_name, UPLOAD_TMP_PREFIX "%s" UPLOAD_MAP_SUFFIX, name);
+
+  s->path = strdup(path);
+  s->dir_fd = open_beneath_root(dir, O_RDONLY | O_DIRECTORY, 0);
+  if (!s->path || s->dir_fd < 0)
+    goto error;
+
+  if (total >= 0) {
+    s->blocks = (total + UPLOAD_BLOCK_SIZE - 1) / UPLOAD_BLOCK_SIZE;
+    s->bitmap = (unsigned char *)calloc((s->blocks + 7) / 8 + 1, 1);
+    if (!s->bitmap || (resumed = open_upload_files(s)) < 0)
+      goto error;
+  } else {
+    // the length is known when the body ends, only this upload writes the file
+    s->fd = openat(s->dir_fd, s->tmp_name, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (s->fd < 0)
+      goto error;
+    if (flock(s->fd, LOCK_EX | LOCK_NB) < 0) {
+      if (errno == EWOULDBLOCK)
+        errno = EBUSY;
+      goto error;
+    }
+    if (ftruncate(s->fd, 0) < 0)
+      goto error;
+  }
+
+#ifdef DEBUG
+  PRINT("[open_segmented_upload]%s %s (%lld of %lld blocks)\n", resumed ? "resume" : "start",
+        path, s->received, s->blocks);
+#endif
+  s->next = uploads;
+  uploads = s;
+  return s;
+
+error:
+  err = errno;
+  PRINT("[open_segmented_upload]ERROR: cannot start an upload of %s (errno=%d)\n", path, errno);
+  free_segmented_upload(s);
+  errno = err;
+  return NULL;
+}
+
+// a connection or a job takes one more reference
+void hold_segmented_upload(segmented_upload_t *s) {
+  s->refs++;
+}
+
+void release_segmented_upload(segmented_upload_t *s) {
+  if (!s || --s->refs > 0)
+    return;
+  unlink_upload(s);
+  free_segmented_upload(s);
+}
+
+// check that a segment [@first, @last] is aligned to blocks
+// return 0 if success, else -1
+int check_segment(long long first, long long last, long long total) {
+  if (first < 0 || first > last || last >= total)
+    return -1;
+  if (first % UPLOAD_BLOCK_SIZE != 0)
+    return -1;
+  if ((last + 1) % UPLOAD_BLOCK_SIZE != 0 && last != total - 1)
+    return -1;
+  return 0;
+}
+
+int is_segmented_upload_complete(segmented_upload_t *s) {
+  return __atomic_load_n(&s->complete, __ATOMIC_ACQUIRE);
+}
+
+// a writer of a segment, which begins at @offset
+// (digests are computed if the segment is the whole file)
+upload_writer_t *open_segment_writer(segmented_upload_t *s, long long offset, long long length) {
+  upload_writer_t *w = upload_writer_open(s->dir_fd, s->tmp_name, 0, offset);
+
+  if (w && offset == 0 && (s->total < 0 || length == s->total))
+    upload_writer_digest(w, s->dir_fd, s->name);
+  return w;
+}
+
+// all data is received: rename the file into place
+// (the data is synced before it, the directory after it)
+static int finish_segmented_upload(segmented_upload_t *s) {
+  if (upload_sync(s->fd) < 0)
+    return -1;
+  // (the replaced file may refer to the store)
+  if (srv_settings.dedup)
+    dedup_release(s->dir_fd, s->name);
+  if (renameat(s->dir_fd, s->tmp_name, s->dir_fd, s->name) < 0) {
+    PRINT("[finish_segmented_upload]ERROR: cannot rename %s (errno=%d)\n", s->tmp_name, errno);
+    return -1;
+  }
+  if (s->map_fd >= 0)
+    unlinkat(s->dir_fd, s->map_name, 0);
+  if (upload_sync(s->dir_fd) < 0)
+    return -1;
+  __atomic_store_n(&s->complete, TRUE, __ATOMIC_RELEASE);
+#ifdef DEBUG
+  PRINT("[finish_segmented_upload]%s is uploaded\n", s->path);
+#endif
+  return 0;
+}
+
+//
+// (in a worker thread)
+// mark blocks [@first, @end) in the map, which has blocks of all processes
+// the process, which marks the last block, renames the file
+//
+// return 0 if success, else -1
+static int mark_received_blocks(segmented_upload_t *s, long long first, long long end) {
+  map_header_t header;
+  long long from = first / 8, to = (end - 1) / 8 + 1;
+  long long i, newly = 0;
+  int res = 0;
+
+  lock_upload_map(s, LOCK_EX);
+  if (pread(s->map_fd, &header, sizeof(header), 0) != sizeof(header) ||
+      pread(s->map_fd, s->bitmap + from, to - from, sizeof(header) + from) != to - from) {
+    PRINT("[mark_received_blocks]ERROR: cannot read %s (errno=%d)\n", s->map_name, errno);
+    res = -1;
+    goto unlock;
+  }
+  for (i = first; i < end; i++) {
+    if (!(s->bitmap[i / 8] & (1 << (i % 8)))) {
+      s->bitmap[i / 8] |= 1 << (i % 8);
+      newly++;
+    }
+  }
+
+  if (newly > 0) {
+    header.received += newly;
+    if (pwrite(s->map_fd, s->bitmap + from, to - from, sizeof(header) + from) != to - from ||
+        pwrite(s->map_fd, &header, sizeof(header), 0) != sizeof(header))
+      PRINT("[mark_received_blocks]ERROR: cannot update %s (errno=%d)\n", s->map_name, errno);
+    else if (srv_settings.upload_fsync != UPLOAD_FSYNC_NONE)
+      upload_sync(s->map_fd);
+  }
+  s->received = header.received;
+
+  if (newly > 0 && s->received == s->blocks)
+    res = finish_segmented_upload(s);
+  else if (s->received == s->blocks && is_upload_map_removed(s))
+    // (another process has renamed the file)
+    __atomic_store_n(&s->complete, TRUE, __ATOMIC_RELEASE);
+
+unlock:
+  unlock_upload_map(s);
+  return res;
+}
+
+//
+// (in a worker thread)
+// write @length bytes of @data by writer @w of a segment of the upload
+// (the segment began at a block boundary)
+// @last -- the body of the request ended
+//
+// return 0 if success, else -1
+int write_segment(segmented_upload_t *s, upload_writer_t *w, const char *data, size_t length, int last) {
+  long long offset = w->written;
+  long long first, end;
+
+  if (upload_writer_write(w, data, length) < 0 || (last && upload_writer_commit(w) < 0)) {
+    PRINT("[write_segment]ERROR: cannot write %s\n", s->tmp_name);
+    return -1;
+  }
+
+  if (s->total <= 0) {
+    // the length is known only when the body ends (or the file is empty)
+    return last ? finish_segmented_upload(s) : 0;
+  }
+
+  // mark blocks which are written completely
+  // (O_DIRECT writer may keep the end of the data in its buffer)
+  // if UPLOAD_FSYNC isn't none, all blocks of the segment are marked when they are synced
+  // by upload_writer_commit(), so the map never has blocks which aren't on the disk yet
+  if (srv_settings.upload_fsync == UPLOAD_FSYNC_NONE)
+    first = offset / UPLOAD_BLOCK_SIZE;
+  else if (last)
+    first = w->start / UPLOAD_BLOCK_SIZE;
+  else
+    return 0;
+  end = (w->written == s->total) ? s->blocks : w->written / UPLOAD_BLOCK_SIZE;
+  if (first >= end)
+    return 0;
+  return mark_received_blocks(s, first, end);
+}
+
+//
+// write received ranges as a value of Range header ("bytes=0-65535,131072-196607")
+// into @buf (it is cut if it is too long)
+// return its length (0 if nothing is received)
+size_t format_received_ranges(segmented_upload_t *s, char *buf, size_t max) {
+  size_t len = 0;
+  long long i = 0;
+  int res;
+
+  if (s->total < 0)
+    return 0;
+
+  // (with blocks of other processes)
+  lock_upload_map(s, LOCK_SH);
+  if (pread(s->map_fd, s->bitmap, (s->blocks + 7) / 8, sizeof(map_header_t)) != (s->blocks + 7) / 8)
+    PRINT("[format_received_ranges]ERROR: cannot read %s (errno=%d)\n", s->map_name, errno);
+
+  while (i < s->blocks) {
+    long long start;
+
+    if (!(s->bitmap[i / 8] & (1 << (i % 8)))) {
+      i++;
+      continue;
+    }
+    start = i;
+    while (i < s->blocks && (s->bitmap[i / 8] & (1 << (i % 8))))
+      i++;
+
+    res = snprintf(buf + len, max - len, "%s%lld-%lld", len ? "," : "bytes=",
+                   start * UPLOAD_BLOCK_SIZE,
+                   (i == s->blocks) ? s->total - 1 : i * UPLOAD_BLOCK_SIZE - 1);
+    if (res < 0 || (size_t)res >= max - len) {
+      // the rest is reported later
+      break;
+    }
+    len += res;
+  }
+  unlock_upload_map(s);
+  buf[len] = '\0';
+  return len;
+}
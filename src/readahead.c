@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include "readahead.h"
+#include "trace.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+
+#define TOUCH_STEP   (128 * 1024)   // a byte of each step is read to wait for readahead()
+
+// see server_work.c
+extern int set_connection_events(int sfd, uint32_t events);
+
+static long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static off_t ram_size() {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  if (pages <= 0 || page_size <= 0)
+    return 0;
+  return (off_t)pages * page_size;
+}
+
+//
+// read [@start, @end) of the file into the page cache
+// (readahead() only starts reading, so the function waits until a byte of
+//  each step is read)
+//
+static void read_window(int fd, off_t start, off_t end) {
+  char byte;
+  off_t offset;
+
+  if (end <= start)
+    return;
+  if (readahead(fd, start, end - start) < 0) {
+#ifdef DEBUG
+    PRINT("[read_window]readahead fd=%d (errno=%d)\n", fd, errno);
+#endif
+  }
+  for (offset = start; offset < end; offset += TOUCH_STEP)
+    pread(fd, &byte, 1, offset);
+  pread(fd, &byte, 1, end - 1);
+}
+
+readahead_t *readahead_open(int fd, off_t size) {
+  readahead_t *ra;
+  off_t ram;
+
+  if (size < READAHEAD_MIN_SIZE)
+    return NULL;
+
+  ra = (readahead_t *)calloc(1, sizeof(readahead_t));
+  if (!ra)
+    return NULL;
+  ra->fd = dup(fd);
+  if (ra->fd < 0) {
+    free(ra);
+    return NULL;
+  }
+  ra->size = size;
+  ram = ram_size();
+  ra->drop_behind = (ram > 0 && size > ram);
+
+  // the kernel reads ahead more for sequential files
+  posix_fadvise(ra->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // the first window (this function is called by a worker)
+  ra->window = READAHEAD_WINDOW_MIN;
+  ra->ready = (ra->window < size) ? ra->window : size;
+  read_window(ra->fd, 0, ra->ready);
+  ra->window_time = now_ns();
+  return ra;
+}
+
+static void free_readahead(readahead_t *ra) {
+  close(ra->fd);
+  free(ra);
+}
+
+// (in a worker thread)
+static void read_next_window(io_job_t *job) {
+  readahead_t *ra = (readahead_t *)job;
+
+  if (ra->drop_end > ra->dropped)
+    posix_fadvise(ra->fd, ra->dropped, ra->drop_end - ra->dropped, POSIX_FADV_DONTNEED);
+  read_window(ra->fd, ra->ready, ra->job_end);
+}
+
+// (in the event loop)
+static void next_window_completed(io_job_t *job) {
+  readahead_t *ra = (readahead_t *)job;
+
+  ra->pending = FALSE;
+  if (ra->closed) {
+    free_readahead(ra);
+    return;
+  }
+
+  ra->ready = ra->job_end;
+  if (ra->drop_end > ra->dropped)
+    ra->dropped = ra->drop_end;
+  if (ra->waiting) {
+    // the connection sends again (see send_responses() in server_work.c)
+    ra->waiting = FALSE;
+    set_connection_events(ra->job.sfd, EPOLLIN | EPOLLOUT);
+  }
+}
+
+// [@start, @end) is in the page cache already (the file was read recently)
+// (the first and the last bytes are checked without a wait for the disk)
+static int is_cached(readahead_t *ra, off_t start, off_t end) {
+  char byte;
+  struct iovec iov = { &byte, 1 };
+
+  return preadv2(ra->fd, &iov, 1, start, RWF_NOWAIT) == 1 &&
+         preadv2(ra->fd, &iov, 1, end - 1, RWF_NOWAIT) == 1;
+}
+
+// the window is READAHEAD_TIME of the rate at which the client takes data since
+// the last window (it is doubled if the sender waited for the last window)
+static void resize_window(readahead_t *ra, off_t pos) {
+  long long now = now_ns();
+  long long elapsed = now - ra->window_time;
+
+  if (elapsed > 0 && pos > ra->window_pos)
+    ra->window = (off_t)((double)(pos - ra->window_pos) * 1e9 / elapsed * READAHEAD_TIME / 1000);
+  if (ra->stalled)
+    ra->window *= 2;
+  ra->stalled = FALSE;
+
+  if (ra->window < READAHEAD_WINDOW_MIN)
+    ra->window = READAHEAD_WINDOW_MIN;
+  if (ra->window > srv_settings.readahead_max)
+    ra->window = srv_settings.readahead_max;
+  ra->window_pos = pos;
+  ra->window_time = now;
+}
+
+//
+// request the next window [@ra->ready, ...) by an io_pool job
+// (the connection on @sfd is woken up when it is read if it waits)
+static void request_next_window(readahead_t *ra, int sfd, off_t pos) {
+  off_t end;
+
+  resize_window(ra, pos);
+  end = ra->ready + ra->window;
+  if (end > ra->size)
+    end = ra->size;
+
+  if (is_cached(ra, ra->ready, end)) {
+    ra->ready = end;
+    return;
+  }
+
+  ra->job_end = end;
+  ra->drop_end = ra->dropped;
+  if (ra->drop_behind && pos - READAHEAD_DROP_LAG > ra->dropped)
+    ra->drop_end = (pos - READAHEAD_DROP_LAG) & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+
+  ra->job.work = read_next_window;
+  ra->job.complete = next_window_completed;
+  ra->job.sfd = sfd;
+  ra->job.conn_id = trace_connection_id(sfd);
+  ra->pending = TRUE;
+  if (io_pool_submit(&ra->job) < 0) {
+    // (without the pool the window is read in place)
+    read_next_window(&ra->job);
+    next_window_completed(&ra->job);
+  }
+}
+
+off_t readahead_available(readahead_t *ra, int sfd, off_t pos) {
+  // the next window is requested when less than a half of the current one is left
+  if (!ra->pending && ra->ready < ra->size && ra->ready - pos < ra->window / 2)
+    request_next_window(ra, sfd, pos);
+
+  if (pos < ra->ready)
+    return ra->ready - pos;
+
+  // the sender waits for the job (then the next window is bigger)
+  ra->waiting = TRUE;
+  ra->stalled = TRUE;
+  return 0;
+}
+
+void readahead_close(readahead_t *ra) {
+  if (!ra)
+    return;
+  if (ra->pending) {
+    // the worker still uses it
+    ra->closed = TRUE;
+    return;
+  }
+  free_readahead(ra);
+}
@@ -0,0 +1,59 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include "setup.h"
+#include "io_pool.h"
+
+//
+// Readahead of big files which are downloaded
+//
+// A file of READAHEAD_MIN_SIZE bytes or more is opened with
+// POSIX_FADV_SEQUENTIAL and its first window is read by the worker which
+// opens it. Then, while the client drains the file, the next window is read
+// by an io_pool job when less than a half of the current one is left, so
+// send_file() doesn't wait for the disk (and doesn't block the event loop
+// in sendfile()). The window grows with the rate at which the client takes
+// the data (READAHEAD_TIME of it) and doubles when the sender waits for it.
+//
+// Parts of a file bigger than RAM are dropped from the page cache
+// (POSIX_FADV_DONTNEED) behind the cursor, so one download doesn't evict
+// other files.
+//
+
+#define READAHEAD_MIN_SIZE      (1024 * 1024)
+#define READAHEAD_WINDOW_MIN    (256 * 1024)
+#define READAHEAD_WINDOW_MAX    (32 * 1024 * 1024)   // (the default of READAHEAD_MAX)
+#define READAHEAD_TIME          500                   // ms of data ahead of the cursor
+#define READAHEAD_DROP_LAG      (8 * 1024 * 1024)     // bytes behind the cursor which are kept
+
+typedef struct readahead {
+  io_job_t job;             // reading of the next window (see io_pool.c)
+  int fd;                   // (a duplicate, the worker may use it after the file is closed)
+  off_t size;
+  off_t ready;              // [0, @ready) is in the page cache
+  off_t window;
+  off_t job_end;            // the job reads [@ready, @job_end)
+  off_t dropped;            // [0, @dropped) is dropped from the page cache
+  off_t drop_end;           // the job drops [@dropped, @drop_end)
+  off_t window_pos;         // the cursor when the last window was requested
+  long long window_time;    // ... and the time (CLOCK_MONOTONIC, ns)
+  int drop_behind;          // the file is bigger than RAM
+  int pending;              // the job is in progress
+  int waiting;              // the connection waits for the job (it is woken up by EPOLLOUT)
+  int stalled;              // ... it waited for the last window
+  int closed;               // the download is finished (the job frees it)
+} readahead_t;
+
+// (in a worker) start readahead of the regular file @fd with @size
+// return NULL if the file is small (or on errors)
+readahead_t *readahead_open(int fd, off_t size);
+
+// (in the event loop) how many bytes from @pos may be sent without a wait for the disk,
+// the next window is requested if it is needed
+// return 0 if the connection on @sfd has to wait (EPOLLOUT is enabled when the data is read)
+off_t readahead_available(readahead_t *ra, int sfd, off_t pos);
+
+// the download is finished or the connection is closed
+void readahead_close(readahead_t *ra);
+
+#endif // _READAHEAD_H_
@@ -1,18 +1,33 @@
 
 #include "request_handling.h"
+#include "path_resolution.h"
+#include "io_pool.h"
+#include "digest.h"
+#include "scan.h"
+#include "trace.h"
+#include "wwwroot_index.h"
+#include "readahead.h"
+#include "http2.h"
+#include "proxy.h"
+#include "tls.h"
+#include "archive.h"
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 
 
 #define GET_REQUEST      0
 #define HEAD_REQUEST     1
 #define POST_REQUEST     2
+#define PUT_REQUEST      3
 #define UNKNOWN_REQUEST -1
 
 #define MEM_ZERO(ptr, size) memset((ptr), '\0', size * sizeof(char));
 
 static int handle_http_GET(char *request, size_t *cur_pos, int sfd, Node_t *node);
 static int handle_http_POST(char *request, size_t *cur_pos, int sfd, Node_t *node);
-static int send_file(FILE *fp, int sfd);
+static int send_file(Node_t *node, int sfd);
+static int drop_body(Node_t *node, int sfd);
 
 // this function reads word, skipping '\t', ' ', '\n', '\r' 
 // @original_req -- a pointer to original request string
@@ -27,34 +42,28 @@ static int send_file(FILE *fp, int sfd);
 //    else
 //      -1
 int read_word_from_req_into_buf(char *original_req, char *buf, size_t *cur_pos, size_t max) {
-  size_t read_chars_count = 0;
-  size_t i;
-  size_t original_req_len = strlen(original_req);
+  const char *word = original_req + *cur_pos;
+  const char *end;
+  size_t read_chars_count;
 
-  if (*cur_pos >= original_req_len) {
+  if (*word == '\0') {
     //PRINT("[analyze_and_copy_request]start >= length of original_req string\n");
     return -1;
   }
 
-  for (i = *cur_pos; i < original_req_len; i++) {
-    if (original_req[i] != '\t' && original_req[i] != ' ' && original_req[i] != '\n' && original_req[i] != '\r') {
-      if (read_chars_count < max - 1) {
-        buf[read_chars_count++] = original_req[i];
-      }
-    }
-    else
-      break;
-  }
+  // (see scan.c)
+  end = scan_word_end(word);
+  read_chars_count = end - word;
+  if (read_chars_count > max - 1)
+    read_chars_count = max - 1;
+  memcpy(buf, word, read_chars_count);
   buf[read_chars_count] = '\0';
 
   // find next word beginning
-  i++;
-  for ( ; i < original_req_len; i++) {
-    if ( original_req[i] != '\t' && original_req[i] != ' ' && original_req[i] != '\n' && original_req[i] != '\r')
-      break;
-  }
+  if (*end != '\0')
+    end = scan_word_start(end + 1);
 
-  *cur_pos = i;
+  *cur_pos = end - original_req;
   return 0;
 }
 
@@ -88,6 +97,9 @@ static int get_request_type(char *request, size_t *cur_pos) {
   } 
   else if (strcmp("POST", requestMethodType) == 0) {
     return POST_REQUEST;
+  }
+  else if (strcmp("PUT", requestMethodType) == 0) {
+    return PUT_REQUEST;
   } else {
     return UNKNOWN_REQUEST;
   }
@@ -98,9 +110,9 @@ static int get_request_type(char *request, size_t *cur_pos) {
 
 // This function is used in cases 
 // when a request comes in parts
-static char *add_new_part_to_old_request(Node_t *node, char *next_part_of_request) {
-  size_t new_part_length;
-  size_t len;
+// (@length bytes of @next_part_of_request are added to the header, it stays null-terminated)
+static char *add_new_part_to_old_request(Node_t *node, char *next_part_of_request, size_t length) {
+  char *header;
 
   if (next_part_of_request == NULL) {
 #ifdef DEBUG
@@ -116,53 +128,134 @@ static char *add_new_part_to_old_request(Node_t *node, char *next_part_of_reques
     return NULL;
   }
 
-  new_part_length = strlen(next_part_of_request);
-  if (node->data.header == NULL) {
-    len = 0;
-  } else {
-    len = strlen(node->data.header);
-  }
-
-  node->data.header = (char *)realloc(node->data.header, new_part_length + 1);
-  if (!node->data.header) {
+  header = (char *)realloc(node->data.header, node->data.header_length + length + 1);
+  if (!header) {
     // out of memory
     return NULL;
   }
 
-  // memset
-  memset(node->data.header + len, '\0', new_part_length + 1);
-
-  // add null-terminated byte at the end
-  node->data.header = strncat(node->data.header, next_part_of_request, new_part_length);
+  memcpy(header + node->data.header_length, next_part_of_request, length);
+  node->data.header_length += length;
+  header[node->data.header_length] = '\0';
+  node->data.header = header;
+  TRACE_CONNECTION(node->data.sfd, TRACE_HEADER_PART);
   return node->data.header;
 }
 
 
 //
-// define end of a header (in @request)
+// define end of a header of @node (it is found once, see node->data.header_end)
 //
 // return NULL if header is NOT FULL
 //
-static char * is_header_full(char *request) {
+static char * is_header_full(Node_t *node) {
 #define CRLFCRLF "\r\n\r\n"
-  return strstr(request, CRLFCRLF);
+  const char *end;
+
+  if (node->data.header_end)
+    return node->data.header + node->data.header_end - strlen(CRLFCRLF);
+  if (!node->data.header)
+    return NULL;
+
+  end = scan_find(node->data.header, node->data.header_length, CRLFCRLF, strlen(CRLFCRLF));
+  if (end) {
+    node->data.header_end = end - node->data.header + strlen(CRLFCRLF);
+    TRACE_CONNECTION(node->data.sfd, TRACE_HEADER_COMPLETE);
+  }
+  return (char *)end;
 #undef CRLFCRLF
 }
 
 ssize_t send_warning_msg(char *message, int socket_fd);
 
 // see in post_request.c
-extern int recv_file(char *request, int sfd, Node_t *node);
+extern int start_upload(Node_t *node, int sfd);
+extern int recv_file(char *request, size_t length, int sfd, Node_t *node);
+extern void free_upload(struct upload *u);
+
+// see in html_generation_for_dir.c
+extern int send_listing(Node_t *node, int sfd);
+
+// see server_work.c
+extern int set_connection_events(int sfd, uint32_t events);
+
+static int upgrade_to_h2(char *request, size_t *cur_pos, int sfd, Node_t *node);
+
+//
+// a request on an HTTP/2 connection (see http2.c)
+//
+// @request -- received frames (NULL if the connection may send)
+//
+// return -1 or 0 (the connection is closed), like handle()
+static int handle_h2(char *request, size_t length, int sfd, Node_t *node, List_t *list) {
+  h2_conn_t *c = node->data.h2;
+
+  if (request) {
+    if (length == 0) {
+      // the client has closed the connection
+      goto close;
+    }
+    h2_input(c, request, length);
+    // responses (or answers to frames) are sent on EPOLLOUT
+    if (h2_has_output(c))
+      set_connection_events(sfd, EPOLLIN | EPOLLOUT);
+    return -1;
+  }
+
+  if (h2_send(node, sfd) < 0)
+    return -1;
+
+close:
+  h2_close(c);
+  node->data.h2 = NULL;
+  if (node->data.header)
+    free(node->data.header);
+  remove_node(list, sfd);
+  return 0;
+}
+
+//
+// the connection begins with the preface of HTTP/2 (prior knowledge)
+//
+// return:
+//     TRUE,  if the connection becomes HTTP/2
+//     -1,    if a part of the preface is received only
+//     FALSE, else
+static int start_h2(Node_t *node, size_t length, int sfd) {
+  size_t header_length = node->data.header_length;
+  h2_conn_t *c;
+
+  if (memcmp(node->data.header, H2_PREFACE,
+             (header_length < H2_PREFACE_LENGTH) ? header_length : H2_PREFACE_LENGTH))
+    return FALSE;
+  if (header_length < H2_PREFACE_LENGTH)
+    return (length > 0) ? -1 : FALSE;
+
+  c = h2_open(sfd, NULL);
+  if (!c)
+    return FALSE;
+  node->data.h2 = c;
+  // (the header is frames now)
+  h2_input(c, node->data.header, header_length);
+  free(node->data.header);
+  node->data.header = NULL;
+  node->data.header_length = 0;
+  node->data.header_end = 0;
+  set_connection_events(sfd, EPOLLIN | EPOLLOUT);
+  return TRUE;
+}
 
 //
 // This function processes @request
 //
 // For each connection the server keeps (create if it needs) a structure (struct Node; see in ext_epoll_data.h)
 //
+// @length -- number of bytes in @request
+//
 // return:
 //     -1, if the request was not completed yet (so connections will not be closed yet)
 //     0,  if the request was completed (and connection should be closed)
-int handle(char *request, int sfd, List_t *list) {
+int handle(char *request, size_t length, int sfd, List_t *list) {
   Node_t *node;
   int request_type;
   int res;
@@ -171,34 +264,44 @@ int handle(char *request, int sfd, List_t *list) {
 
   // find possible element of ext_data_t
   node = find_node(list, sfd);
+  if (node && node->data.h2)
+    return handle_h2(request, length, sfd, node, list);
   if (node) {
     if (node->data.status == REQUEST_COMPLETED) {
       if (node->data.header)
         free(node->data.header);
+      free_upload(node->data.upload);
       // close connection
       remove_node(list, sfd);
       return 0;
     }
 
-    if (is_header_full(node->data.header)) {
+    if (is_header_full(node)) {
       if (node->data.type == GET_TYPE) {
         // header is full, so we send it earlier
         // and it needs only to send a requested resource
         // for GET requestes
-        res = send_file(node->data.fp, sfd);
+        // (a directory listing is generated while it is sent)
+        if (node->data.head)
+          res = drop_body(node, sfd);
+        else if (node->data.listing)
+          res = send_listing(node, sfd);
+        else if (node->data.archive)
+          res = send_archive(node, sfd);
+        else
+          res = send_file(node, sfd);
         goto check_res;
       } else if (node->data.type == POST_TYPE) {
         // see in request_handling.c
         // moreover, this function send to client acknowledgment of received data
-        res = recv_file(request, sfd, node);
+        res = recv_file(request, length, sfd, node);
 
         goto check_res;
       }
     }
 
     // else (header is NOT FULL yet)
-    node->data.header = add_new_part_to_old_request(node, request);
-    if (node->data.header == NULL) {
+    if (add_new_part_to_old_request(node, request, length) == NULL) {
       PRINT("[handle]ERROR: out of memory for request\n");
       // TODO:
       // send_warning_msg();
@@ -223,16 +326,20 @@ int handle(char *request, int sfd, List_t *list) {
       // return 0;
     }
     node = find_node(list, sfd);
-    node->data.header = add_new_part_to_old_request(node, request);
+    add_new_part_to_old_request(node, request, length);
     request = node->data.header;
   }
 
-  if (!is_header_full(request)) {
+  if (node->data.header_length > 0 && (res = start_h2(node, length, sfd)) != FALSE)
+    return -1;
+
+  if (!is_header_full(node)) {
 #ifdef DEBUG
     PRINT("header is not full yet\n");
 #endif
     send_warning_msg("header is not correct\n", sfd);
     node->data.status = REQUEST_COMPLETED;
+    TRACE_CONNECTION(sfd, TRACE_LAST_BYTE);
     return -1;
   }
 
@@ -247,10 +354,20 @@ int handle(char *request, int sfd, List_t *list) {
 
   switch(request_type) {
 
+    case HEAD_REQUEST :
+#ifdef DEBUG
+      PRINT("HEAD request on sfd=%d\n", sfd);
+#endif
+      // it is handled as GET, but only the header of the response is sent (see drop_body())
+      node->data.head = TRUE;
+      // fallthrough
     case GET_REQUEST :
 #ifdef DEBUG
-      PRINT("GET request on sfd=%d\n", sfd);
+      if (!node->data.head)
+        PRINT("GET request on sfd=%d\n", sfd);
 #endif
+      if (!node->data.head && upgrade_to_h2(request, &cur_pos, sfd, node) == 0)
+        return -1;
       res = handle_http_GET(request, &cur_pos, sfd, node);
       if (res < 0) {
         return 0;
@@ -258,30 +375,22 @@ int handle(char *request, int sfd, List_t *list) {
       node->data.type = GET_TYPE;
       // now we should send a file, so
       return -1;
-    case HEAD_REQUEST :
-#ifdef DEBUG
-      PRINT("HEAD request on sfd=%d\n", sfd);
-#endif
-      ;
-      break;
     case POST_REQUEST :
+    case PUT_REQUEST :
 #ifdef DEBUG
-      PRINT("POST request on sfd=%d\n", sfd);
+      PRINT("%s request on sfd=%d\n", (request_type == PUT_REQUEST) ? "PUT" : "POST", sfd);
 #endif
-      // but it is not implemented
-      res = handle_http_POST(request, &cur_pos, sfd, node);
+      // the body (the part after the header and next ones) is saved by recv_file()
       node->data.type = POST_TYPE;
-      if (res < 0) {
-        return -1;
-      }
-      break;
+      res = handle_http_POST(request, &cur_pos, sfd, node);
+      goto check_res;
 
     default :
 #ifdef DEBUG
       PRINT("UNKNOWN_REQUEST\n");
 #endif
       // 
-      if ( is_header_full(request) ) {
+      if ( is_header_full(node) ) {
 #ifdef DEBUG
         PRINT("Header is full, but request type is not known\n" );
 #endif
@@ -305,6 +414,7 @@ check_res:
       return 0;
 
     node->data.status = REQUEST_COMPLETED;
+    TRACE_CONNECTION(sfd, TRACE_LAST_BYTE);
   }
   //
   return -1;
@@ -329,9 +439,12 @@ static int get_http_version(char *request, size_t *cur_pos) {
   char *http_version = (char *)malloc(HTTP_VERSION_LENGTH * sizeof(char));
   int version_type = -1;
 
+  if (!http_version)
+    return -1;
   MEM_ZERO(http_version, HTTP_VERSION_LENGTH);
-  if (read_word_from_req_into_buf(request, http_version, cur_pos, FILE_NAME_LENGTH) < 0) {
+  if (read_word_from_req_into_buf(request, http_version, cur_pos, HTTP_VERSION_LENGTH) < 0) {
     PRINT("ERROR: [get_http_version]couldn't read http version\n");
+    free(http_version);
     return -1;
   }
 
@@ -351,6 +464,35 @@ static int get_http_version(char *request, size_t *cur_pos) {
   return version_type;
 }
 
+//
+// find header @name (case-insensitive) in @request and copy its value into @value
+// return @value or NULL if there is no such header
+//
+char *get_header_value(char *request, const char *name, char *value, size_t max) {
+  size_t name_length = strlen(name);
+  const char *line = scan_crlf(request);
+  const char *next;
+  size_t i;
+
+  while (line && line[2] != '\r' && line[2] != '\0') {
+    line += 2;
+    next = scan_crlf(line);
+    // a name of a header is a token (see scan.c)
+    if (scan_token(line, next ? (size_t)(next - line) : strlen(line)) == name_length &&
+        line[name_length] == ':' && strncasecmp(line, name, name_length) == 0) {
+      line += name_length + 1;
+      while (*line == ' ' || *line == '\t')
+        line++;
+      for (i = 0; i < max - 1 && line[i] != '\r' && line[i] != '\n' && line[i] != '\0'; i++)
+        value[i] = line[i];
+      value[i] = '\0';
+      return value;
+    }
+    line = next;
+  }
+  return NULL;
+}
+
 // if file extension is represented in @filename, 
 // this function will read it and save it into @extension
 // return:
@@ -396,31 +538,14 @@ NOT_extension:
   return -1;
 }
 
-// offset относительно position
-// position can be
-//   SEEK_SET (beginning of a file)
-//   SEEK_CUR (current file position indicator)
-//   SEEK_END (end of file)
-#define SET_FILE_POSITION(filestream, offset, position)   \
-  do {                                                    \
-    if (fseek((filestream), (offset), (position)) < 0) {  \
-      PRINT("ERROR: in fseek \n");                        \
-    }                                                     \
-  } while(0)
+// see mime_table.c
+extern const char *lookup_mime_type(const char *extension);
 
 // check if @extension is supported
 // if it is supported, @mime_type will be filled by its mime type and return 0
 // else return -1
 static int check_mime_support(char *extension, char *mime_type) {
-
-  // TODO: this function should use mmaped file pointer
-  // also see TODO in setup.c (function fopen_mime_file)
-
-#define FILE_LINE_LENGTH (MIME_LENGTH + EXTENSION_LENGTH)
-  char *line; // TODO: if mmaped file pointer is used, this var will not be needed
-  char *mimetype;
-  char *ext;
-  int support = -1; // -1 means "not supported", 0 means "supported"
+  const char *mimetype;
 
   if (strcmp(extension, "") == 0) {
     #ifdef DEBUG
@@ -430,56 +555,15 @@ static int check_mime_support(char *extension, char *mime_type) {
     return -1;
   }
 
-  line = (char *)malloc( (FILE_LINE_LENGTH) * sizeof(char)); // TODO: if mmaped file pointer is used, this var will not be needed
-  mimetype = (char *)malloc(MIME_LENGTH * sizeof(char));
-  ext = (char *)malloc(EXTENSION_LENGTH * sizeof(char));
-
-
-  memset(line, '\0', FILE_LINE_LENGTH );
-  memset(mimetype,'\0',MIME_LENGTH);
-  memset(ext, '\0', EXTENSION_LENGTH);
-
-  // see MIME_FILE in setup.h
-  SET_FILE_POSITION(MIME_FILE, 0, SEEK_SET);
-  while (fgets(line, FILE_LINE_LENGTH, MIME_FILE) != NULL) {
-    size_t cur_pos = 0;   // read 'mime.types' file from beginning
-
-    if ( line[0] == '#' ) {
-      // it is comment
-      memset(line, '\0', FILE_LINE_LENGTH );
-      continue;
-    }
-
-    // read mimetype from 'mime.types' one line
-    // and store it into @mimetype
-    // also after this function @cur_pos stores a start position of extension in @line
-    read_word_from_req_into_buf(line, mimetype, &cur_pos, MIME_LENGTH);
-
-    // read extension into @ext
-    if (read_word_from_req_into_buf(line, ext, &cur_pos, EXTENSION_LENGTH) < 0) {
-      // it means that an extension is not presented in 'mime.types' file
-      continue;
-    }
-
-    if ( strcmp(ext, extension) == 0 ) {
-      // mimetype contains  'application/andrew-inset', for example
-      memcpy(mime_type, mimetype, strlen(mimetype));
-      support = 0;
-      break;
-    }
-
-    memset(line, '\0', FILE_LINE_LENGTH );
-    memset(mimetype,'\0',MIME_LENGTH);
-    memset(ext, '\0', EXTENSION_LENGTH);
-  }
-
-#undef FILE_LINE_LENGTH
+  // see mime_table.c ('mime.types' is loaded into memory at startup)
+  mimetype = lookup_mime_type(extension);
+  if (!mimetype)
+    return -1;
 
-  free(line);
-  free(mimetype);
-  free(ext);
+  // mimetype contains  'application/andrew-inset', for example
+  strncpy(mime_type, mimetype, MIME_LENGTH - 1);
   PRINT("[check_mime_support]%s\n", mime_type);
-  return support;
+  return 0;
 }
 
 // send @bytes with @length
@@ -487,16 +571,19 @@ static int check_mime_support(char *extension, char *mime_type) {
 static ssize_t send_bytes(char *bytes, size_t length, int socket_fd) {
   ssize_t bytes_sent;
 
-  // flags is MSG_NOSIGNAL
+  // send() with flags MSG_NOSIGNAL
   //    not to send SIGPIPE on errors on stream oriented sockets
   //    when the other end BREAKS the connection
-  bytes_sent = send(socket_fd, bytes, length, MSG_NOSIGNAL);
+  // (or records of a TLS connection, see tls.c)
+  bytes_sent = tls_send(socket_fd, bytes, length);
 
   if (bytes_sent == -1) {
     if (errno == ECONNRESET) {
       PRINT("Connection reset by peer\n");
     }
     PRINT("[send_bytes]ERROR: cannot send a reply to client with sfd=%d (errno=%d )\n", socket_fd, errno);
+  } else if (bytes_sent > 0) {
+    TRACE_CONNECTION(socket_fd, TRACE_FIRST_BYTE);
   }
 
   //PRINT("[send_bytes]bytes_sent=%zu\n", bytes_sent);
@@ -513,28 +600,28 @@ ssize_t send_warning_msg(char *message, int socket_fd) {
 }
 
 //
-// form header and send it to client
+// form header (see send_header())
+// return the header (it must be freed) or NULL
 //
-// @status_code -- 200 if resource is available
-//              -- 404 if resource is NOT found
-// 
-// 
-static ssize_t send_header(char *http_version, char *status_code, char *content_type, long content_length, int socket) {
+static char *format_header(char *http_version, char *status_code, char *content_type, long content_length,
+                           char *extra_headers) {
   char *content_head = "\r\nContent-Type: ";
   char *server_head = "\r\nServer: sSs";
-  char *length_head = "\r\nContent-Length: ";
+  char *length_head = (content_length < 0) ? "\r\nTransfer-Encoding: " : "\r\nContent-Length: ";
   //char *date_head = "\r\nDate: ";
   char contentLength[64];
   
   char *header_end = "\r\n\n";  // 
   char *message;
-  ssize_t res;
 
   //time_t rawtime;
 
   //time ( &rawtime );
 
-  sprintf(contentLength, "%ld", content_length);
+  if (content_length < 0)
+    strcpy(contentLength, "chunked");
+  else
+    sprintf(contentLength, "%ld", content_length);
 
   message = (char *)malloc( (
     strlen(http_version) + 1 +  // "+1" means a ' ' space after @http_version (for example, "HTTP/1.1 ")
@@ -544,12 +631,13 @@ static ssize_t send_header(char *http_version, char *status_code, char *content_
     strlen(status_code) +
     strlen(content_type) +
     strlen(contentLength) +
-    strlen(header_end)) * sizeof(char) );
+    (extra_headers ? strlen(extra_headers) : 0) +
+    strlen(header_end) + 1) * sizeof(char) );
 
 
   if (!message) {
-    PRINT("[send_header]ERROR: out of memory for message header\n");
-    return -1;
+    PRINT("[format_header]ERROR: out of memory for message header\n");
+    return NULL;
   }
 
   strcpy(message, http_version);
@@ -562,7 +650,28 @@ static ssize_t send_header(char *http_version, char *status_code, char *content_
   strcat(message, server_head);
   strcat(message, length_head);
   strcat(message, contentLength);
+  if (extra_headers)
+    strcat(message, extra_headers);
   strcat(message, header_end);
+  return message;
+}
+
+//
+// form header and send it to client
+//
+// @status_code -- 200 if resource is available
+//              -- 404 if resource is NOT found
+// @content_length -- -1 if the body is sent with chunked transfer encoding
+// @extra_headers  -- "\r\nName: value..." or NULL
+// 
+static ssize_t send_header(char *http_version, char *status_code, char *content_type, long content_length,
+                           char *extra_headers, int socket) {
+  char *message;
+  ssize_t res;
+
+  message = format_header(http_version, status_code, content_type, content_length, extra_headers);
+  if (!message)
+    return -1;
 
   res = send_bytes(message, strlen(message), socket);
   PRINT("\nHEADER:\n%s", message);
@@ -572,256 +681,471 @@ static ssize_t send_header(char *http_version, char *status_code, char *content_
 }
 
 //
+// a local client (UNIX_SOCKET) which has sent "X-Pass-Fd: 1" gets the descriptor
+// of a requested file instead of its bytes (see send_file_descriptor())
 //
-//
-static int send_file(FILE *fp, int sfd) {
-
-#define CHUNK_SIZE 1024
-
-  char buf[CHUNK_SIZE];
-  ssize_t bytes_sent;
-  ssize_t bytes_read;
-  int res = -1;
-
-  memset(buf, '\0', CHUNK_SIZE);
+static int wants_file_descriptor(char *request, int sfd) {
+  char value[8];
+  int domain;
+  socklen_t length = sizeof(domain);
+
+  if (!srv_settings.unix_socket ||
+      !get_header_value(request, "X-Pass-Fd", value, sizeof(value)) || strcmp(value, "1"))
+    return FALSE;
+  return getsockopt(sfd, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 && domain == AF_UNIX;
+}
 
-  // 
-  bytes_read = fread(buf, sizeof(char), CHUNK_SIZE, fp);
-  
-#ifdef DEBUG
-  PRINT("SEND_FILE: bytes_read=%zu\n", bytes_read);
-#endif
+//
+// send the header with file @fd attached (SCM_RIGHTS), the body is empty:
+// X-Fd-Length is the size of the file, the client reads it with pread()
+// (no byte of the file passes through the socket)
+//
+// @fd -- opened regular file (this function owns it)
+// @digest_headers -- ETag and Digest of the file (or NULL)
+static void send_file_descriptor(int fd, off_t size, char *http_version, char *content_type,
+                                 char *digest_headers, int socket_fd) {
+  char extra_headers[DIGEST_HEADERS_MAX + 64];
+  char control[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  char *message;
+  ssize_t res;
 
-  if (bytes_read < CHUNK_SIZE) {
-    if ( feof(fp) != 0 ) {
-      // end of file
-      // we send the whole file
-      if (fclose(fp) != 0) {
-#ifdef DEBUG
-        PRINT("[send_file]ERROR: fclose (errno=%d) \n", errno);
-#endif
-      }
-      fp = NULL;
-      res = 0;
-    }
-  }
-  bytes_sent = send_bytes(buf, bytes_read, sfd);
-  if (bytes_sent == -1) {
-    PRINT("[send_file]ERROR: send_bytes return -1 (errno=%d)\n", errno);
-    // to close connection
-    return 0;
+  snprintf(extra_headers, sizeof(extra_headers), "\r\nX-Fd-Length: %lld%s",
+           (long long)size, digest_headers ? digest_headers : "");
+  message = format_header(http_version, "200 OK", content_type, 0, extra_headers);
+  if (!message) {
+    close(fd);
+    send_warning_msg("ERROR: server problem (out of memory)\n", socket_fd);
+    return;
   }
-  
-#ifdef DEBUG
-  PRINT("bytes sent = %zu\n", bytes_sent);
-#endif
 
-  // continue to send
-  return res;
+  iov.iov_base = message;
+  iov.iov_len = strlen(message);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  // (the descriptor comes with the first byte of the header)
+  res = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+  if (res < 0)
+    PRINT("[send_file_descriptor]ERROR: sendmsg to sfd=%d (errno=%d)\n", socket_fd, errno);
+  else
+    TRACE_CONNECTION(socket_fd, TRACE_FIRST_BYTE);
+  free(message);
+  // the client has its own reference
+  close(fd);
 }
 
 //
-// find out file (@fp) size, set file position indicator to the beginning of @fp stream
-// and return it
+// send the next part of the file with sendfile()
+// (at most @node->data.send_quota bytes, the send scheduler chooses
+//  connections and their quotas, see send_sched.c)
+//
+// @node->data.send_blocked is set if the socket doesn't accept more
 //
-long get_file_size(FILE *fp) {
-  long filesize = 0;
+static int send_file(Node_t *node, int sfd) {
+  FILE *fp = node->data.fp;
+  ssize_t bytes_sent;
+  size_t count;
 
-  SET_FILE_POSITION(fp, 0, SEEK_END);
-  filesize = ftell(fp);
+  if (fp == NULL) {
+    // nothing to send (for example, 404 was sent instead of the resource)
+    return 0;
+  }
 
-  rewind(fp); // set file position indicator to the beginning of @fp
+  while (node->data.file_left > 0 && node->data.send_quota > 0) {
+    count = node->data.send_quota;
+    if ((off_t)count > node->data.file_left)
+      count = node->data.file_left;
 
-  return filesize;
-}
+    // a file of the upstream is sent only as far as it is fetched (see proxy.c)
+    if (node->data.proxy) {
+      off_t available = proxy_available(node->data.proxy, sfd, node->data.file_left);
 
-#define REGULAR_FILE      1
-#define DIRECTORY         2
-#define UNKOWN_FILE_TYPE  3
+      if (available < 0)
+        goto close_file;
+      if (available == 0) {
+        node->data.send_waiting = TRUE;
+        return -1;
+      }
+      if ((off_t)count > available)
+        count = available;
+    }
 
-//
-//
-//
-static int get_type_of_file(const char *path) {
-  struct stat statbuf;
+    // a big file is sent only as far as it is read ahead (see readahead.c)
+    if (node->data.readahead) {
+      readahead_t *ra = node->data.readahead;
+      off_t available = readahead_available(ra, sfd, ra->size - node->data.file_left);
 
-  if (access(path, F_OK) == -1) {
-    // file doesn't exists
-    return -1;
+      if (available == 0) {
+        node->data.send_waiting = TRUE;
+        return -1;
+      }
+      if ((off_t)count > available)
+        count = available;
+    }
+
+    // the file offset is advanced by sendfile()
+    // (TLS without kTLS reads it into records, see tls.c)
+    bytes_sent = tls_sendfile(sfd, fileno(fp), count);
+    if (bytes_sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        node->data.send_blocked = TRUE;
+        return -1;
+      }
+      PRINT("[send_file]ERROR: sendfile to sfd=%d (errno=%d)\n", sfd, errno);
+      // to close connection
+      goto close_file;
+    }
+    if (bytes_sent == 0) {
+      // the file was truncated
+      node->data.file_left = 0;
+      break;
+    }
+
+#ifdef DEBUG
+    PRINT("bytes sent = %zd\n", bytes_sent);
+#endif
+    node->data.file_left -= bytes_sent;
+    node->data.send_quota -= bytes_sent;
+    if ((size_t)bytes_sent < count) {
+      node->data.send_blocked = TRUE;
+      break;
+    }
   }
 
-  if (stat(path, &statbuf) < 0) {
-    // some errors
-    // for example, EACCES (permission denied)
+  if (node->data.file_left > 0) {
+    // continue to send
     return -1;
   }
 
-  if (S_ISREG(statbuf.st_mode))
-    return REGULAR_FILE;
-  if (S_ISDIR(statbuf.st_mode))
-    return DIRECTORY;
-  return UNKOWN_FILE_TYPE;
+close_file:
+  // end of file, we send the whole file
+  readahead_close(node->data.readahead);
+  node->data.readahead = NULL;
+  proxy_release(node->data.proxy, sfd);
+  node->data.proxy = NULL;
+  if (fclose(fp) != 0) {
+#ifdef DEBUG
+    PRINT("[send_file]ERROR: fclose (errno=%d) \n", errno);
+#endif
+  }
+  node->data.fp = NULL;
+  return 0;
 }
 
 //
-//
-static void send_response_for_reg_file(char *file_path, char *http_version, char *content_type, int socket_fd, Node_t *node) {
+// @fd   -- opened regular file (this function owns it)
+// @size -- its size (from fstat())
+// @ra   -- its readahead (see readahead.c) or NULL (this function owns it)
+// @digest_headers -- ETag and Digest of the file (or NULL)
+static void send_response_for_reg_file(int fd, off_t size, readahead_t *ra, char *http_version, char *content_type,
+                                       char *digest_headers, int socket_fd, Node_t *node) {
   FILE *fp;
-  long content_length;
 
-  fp = fopen(file_path, "rb");
+  fp = fdopen(fd, "rb");
   if ( fp == NULL ) {
-    PRINT("Unable to open file %s\n", file_path);
-    // TODO: send header with code 404
+    PRINT("Unable to open file (fd=%d)\n", fd);
+    close(fd);
+    readahead_close(ra);
     send_warning_msg("404 file not found", socket_fd);
     return;
   }
 
-
-  // 2. content-length
-  content_length = get_file_size(fp);
-  if (content_length < 0) {
-    PRINT("[get_file_size]ERROR: ftell returned -1");
-    send_warning_msg("ERROR: File size is zero\n", socket_fd);
-    goto close_file;
-  }
-
-  // 3. send header
+  // 2. send header
   // content_type = "application/octet-stream" for usual strings
-  if (send_header(http_version, "200 OK", content_type, content_length, socket_fd) == -1) {
+  if (send_header(http_version, "200 OK", content_type, (long)size, digest_headers, socket_fd) == -1) {
     send_warning_msg("ERROR: server problem with sending header\n", socket_fd);
     goto close_file;
   }
 
-  // 4. read file and send it
+  // 3. the file is sent by send_file()
 
   node->data.fp = fp;
+  node->data.file_left = size;
+  node->data.readahead = ra;
 
   return;
 
 close_file:
+  readahead_close(ra);
   fclose(fp);
 
 }
 
+//
+// (see proxy.c) the response of @node is file @fd with @size bytes, which may be
+// still written by the fetch (this function owns @fd)
+//
+void send_proxied_file(Node_t *node, int fd, off_t size, char *content_type) {
+  send_response_for_reg_file(fd, size, NULL, "HTTP/1.1", content_type, NULL, node->data.sfd, node);
+}
+
 
 // see html_generation_for_dir.c
-extern int need_to_generate_html_for_dir(char *dir_path, char *generated_html_name);
-extern int generate_html_for_dir(char *dir_path, char *generated_html_name, char *dir_name);
-extern char *generate_html_name(char *dir_name);
+extern int start_dir_listing(Node_t *node, int dir_fd, char *dir_name, char *query, char *accept);
+extern void free_dir_listing(struct dir_listing *l);
+extern char *get_listing_content_type(struct dir_listing *l);
 
 //
 // this function send response to requests for directories
+// (the listing is generated while it is sent, see send_listing())
 //
-// @dir_path -- directory path (relative to WWWROOT dir)
-// @dir_name -- directory name
-static void send_response_for_dir(char *dir_path, char *dir_name, char *http_version, int socket_fd, Node_t *node) {
-  char *generated_html_name;
-
-  // see in html_generation_for_dir.c
-  // if success returns pointer to file name
-  // else NULL
-  generated_html_name = generate_html_name(dir_name);
-  if (!generated_html_name) {
-    send_warning_msg("Error on the server. Try later, please\n", socket_fd);
+// @dir_fd   -- opened directory (this function owns it)
+// @dir_name -- directory path (relative to WWWROOT dir)
+// @query    -- query of the request (sort, offset, limit, format, archive)
+// @accept   -- value of Accept header (html, JSON or CBOR listing)
+static void send_response_for_dir(int dir_fd, char *dir_name, char *query, char *accept, char *http_version, int socket_fd, Node_t *node) {
+  int format = archive_format(query);
+
+  // ?archive=tar|zip: the whole directory as one file (see archive.c)
+  if (format) {
+    char disposition[ARCHIVE_PATH_MAX];
+
+    if (start_dir_archive(node, dir_fd, dir_name, format) < 0) {
+      send_warning_msg("ERROR with dir ", socket_fd);
+      send_warning_msg(dir_name, socket_fd);
+      return;
+    }
+    format_archive_headers(node->data.archive, disposition, sizeof(disposition));
+    if (send_header(http_version, "200 OK", get_archive_content_type(node->data.archive), -1, disposition, socket_fd) == -1) {
+      free_dir_archive(node->data.archive);
+      node->data.archive = NULL;
+    }
     return;
   }
 
-#ifdef DEBUG
-  PRINT("generated_html_name=%s\n", generated_html_name);
-#endif
-
-  // 1. check if 
-  if (need_to_generate_html_for_dir(dir_path, generated_html_name) == 0)
-    goto send_html_file;
-
-  // 2.
-  if (generate_html_for_dir(dir_path, generated_html_name, dir_name) < 0) {
+  if (start_dir_listing(node, dir_fd, dir_name, query, accept) < 0) {
     send_warning_msg("ERROR with dir ", socket_fd);
     send_warning_msg(dir_name, socket_fd);
-    goto free_name;
+    return;
   }
 
-  // 3. send it
-send_html_file:
-  send_response_for_reg_file(generated_html_name, http_version, "text/html", socket_fd, node);
-
-free_name:
-  free(generated_html_name);
+  // the length of the listing isn't known, so it is sent by chunks
+  if (send_header(http_version, "200 OK", get_listing_content_type(node->data.listing), -1, NULL, socket_fd) == -1) {
+    free_dir_listing(node->data.listing);
+    node->data.listing = NULL;
+  }
 }
 
 
 //
+// HEAD request: the header is sent, the file, the listing or the archive is closed unsent
 //
-static void send_response(char *http_version, char *filename, char *content_type, int socket_fd, Node_t *node) {
-  char *full_file_path; // not full; relative to WWWROOT
-  
-  int file_type;
+// return 0 if the response is finished, -1 while a worker thread still prepares its part
+// (it is dropped on the next call)
+static int drop_body(Node_t *node, int sfd) {
+  if (node->data.io_job)
+    return -1;
 
-#ifdef DEBUG
-  PRINT("[send_response] filename=%s\n", filename);
-#endif
+  free_dir_listing(node->data.listing);
+  node->data.listing = NULL;
+  free_dir_archive(node->data.archive);
+  node->data.archive = NULL;
+  node->data.file_left = 0;
+  return send_file(node, sfd);
+}
 
-#define FULL_FILE_PATH_LENGTH (FILE_NAME_LENGTH + strlen(WWWROOT) + 1)
-  full_file_path = (char *)malloc(FULL_FILE_PATH_LENGTH * sizeof(char));
-  if (!full_file_path) {
-    PRINT("[send_response]full_file_path is NULL\n");
+
+// see server_work.c
+extern void submit_connection_job(Node_t *node, io_job_t *job);
+extern Node_t *finish_connection_job(io_job_t *job);
+
+// the requested resource is opened by a worker thread
+// (a lookup on cold storage may block the event loop for a long time)
+typedef struct open_job {
+  io_job_t job;
+  char *http_version;
+  char filename[REQUEST_PATH_LENGTH];
+  char *query;
+  char accept[MIME_LENGTH];
+  int has_accept;
+  char content_type[MIME_LENGTH];
+  int pass_fd;              // the client gets the descriptor of a file (see send_file_descriptor())
+  int head;                 // HEAD request (the file isn't read)
+
+  // results
+  int fd;
+  int err;
+  struct stat statbuf;
+  int has_digest;
+  file_digest_t digest;     // stored digests of an uploaded file (see digest.c)
+  readahead_t *readahead;   // (a big file, see readahead.c)
+} open_job_t;
+
+// (in a worker thread)
+static void open_resource(io_job_t *job) {
+  open_job_t *o = (open_job_t *)job;
+
+  // one lookup beneath WWWROOT for files and directories
+  // (O_NONBLOCK: don't hang on FIFOs)
+  // or the cached file of the upstream (a miss is fetched, see open_resource_completed())
+  if (proxy_enabled())
+    o->fd = proxy_open_cached(o->filename, o->content_type, MIME_LENGTH);
+  else
+    o->fd = open_beneath_root(o->filename, O_RDONLY | O_NONBLOCK, 0);
+  if (o->fd < 0) {
+    o->err = errno;
     return;
   }
 
-  memset(full_file_path, 0, FULL_FILE_PATH_LENGTH);
-  full_file_path = strncat(full_file_path, WWWROOT, FULL_FILE_PATH_LENGTH);
-  if ( filename[0] != '/' && strcmp(filename, "/") != 0 ) {
-    full_file_path = strncat(full_file_path, "/", 1);
+  if (fstat(o->fd, &o->statbuf) < 0) {
+    o->err = errno;
+    close(o->fd);
+    o->fd = -1;
+    return;
+  }
+
+  if (S_ISREG(o->statbuf.st_mode)) {
+    if (!proxy_enabled())
+      o->has_digest = (load_file_digest(o->fd, o->filename, &o->statbuf, &o->digest) == 0);
+    // the first window of a big file is read here
+    // (unless the client reads it itself)
+    if (!o->pass_fd && !o->head)
+      o->readahead = readahead_open(o->fd, o->statbuf.st_size);
+  }
+}
+
+// (in the event loop)
+static void open_resource_completed(io_job_t *job) {
+  open_job_t *o = (open_job_t *)job;
+  Node_t *node = finish_connection_job(job);
+  int socket_fd = job->sfd;
+
+  if (!node) {
+    // the connection was closed
+    if (o->fd >= 0)
+      close(o->fd);
+    readahead_close(o->readahead);
+    goto free_job;
   }
-  full_file_path = strncat(full_file_path, filename, FILE_NAME_LENGTH);
+  TRACE_CONNECTION(socket_fd, TRACE_RESOLVED);
 
+  if (o->fd < 0 && proxy_enabled()) {
+    // the response is sent when the upstream answers
+    if (proxy_fetch(node, o->filename, o->content_type) < 0)
+      send_warning_msg("502 Bad Gateway", socket_fd);
+    goto free_job;
+  }
+  if (o->fd < 0) {
 #ifdef DEBUG
-  PRINT("[send_response] full_filename_path=%s\n", full_file_path);
+    PRINT("[send_response]cannot open %s (errno=%d)\n", o->filename, o->err);
 #endif
+    send_warning_msg("404 file not found", socket_fd);
+    goto free_job;
+  }
 
-  // define @filename type (by using full_file_path)
-  file_type = get_type_of_file(full_file_path);
+  if (S_ISREG(o->statbuf.st_mode)) {
+    char digest_headers[DIGEST_HEADERS_MAX];
 
-  switch (file_type) {
-    case REGULAR_FILE :
-      send_response_for_reg_file(full_file_path, http_version, content_type, socket_fd, node);
-      break;
-    case DIRECTORY :
-      send_response_for_dir(full_file_path, filename, http_version, socket_fd, node);
-      break;
-    case UNKOWN_FILE_TYPE:
-      send_warning_msg("file type is not supported\n", socket_fd);
-      break;
-    default :
-      // couldn't define file type or 
-      send_warning_msg("404 file not found", socket_fd);
+    if (o->has_digest)
+      format_digest_headers(&o->digest, digest_headers, sizeof(digest_headers));
+    if (o->pass_fd)
+      send_file_descriptor(o->fd, o->statbuf.st_size, o->http_version, o->content_type,
+                           o->has_digest ? digest_headers : NULL, socket_fd);
+    else
+      send_response_for_reg_file(o->fd, o->statbuf.st_size, o->readahead, o->http_version, o->content_type,
+                               o->has_digest ? digest_headers : NULL, socket_fd, node);
+  } else if (S_ISDIR(o->statbuf.st_mode)) {
+    send_response_for_dir(o->fd, o->filename, o->query, o->has_accept ? o->accept : NULL,
+                          o->http_version, socket_fd, node);
+  } else {
+    close(o->fd);
+    send_warning_msg("file type is not supported\n", socket_fd);
   }
-  
-  free(full_file_path);
+
+free_job:
+  free(o->query);
+  free(o);
+}
+
+//
+// @filename -- normalised path (see normalize_request_path() in path_resolution.c)
+// @query    -- query of the request (without '?')
+// @accept   -- value of Accept header or NULL
+// @pass_fd  -- a file is sent as its descriptor (see wants_file_descriptor())
+//
+// the resource is opened by io_pool, the header is sent when it is opened
+// (see open_resource_completed())
+static void send_response(char *http_version, char *filename, char *query, char *accept, char *content_type,
+                          int pass_fd, int socket_fd, Node_t *node) {
+  open_job_t *o;
+
+#ifdef DEBUG
+  PRINT("[send_response] filename=%s\n", filename);
+#endif
+
+  o = (open_job_t *)calloc(1, sizeof(open_job_t));
+  if (!o || (o->query = strdup(query)) == NULL) {
+    free(o);
+    send_warning_msg("ERROR: server problem (out of memory)\n", socket_fd);
+    return;
+  }
+  o->job.work = open_resource;
+  o->job.complete = open_resource_completed;
+  o->http_version = http_version;
+  strncpy(o->filename, filename, REQUEST_PATH_LENGTH - 1);
+  strncpy(o->content_type, content_type, MIME_LENGTH - 1);
+  o->pass_fd = pass_fd;
+  o->head = node->data.head;
+  if (accept) {
+    strncpy(o->accept, accept, MIME_LENGTH - 1);
+    o->has_accept = TRUE;
+  }
+
+  submit_connection_job(node, &o->job);
 }
 
 
 static int handle_http_GET(char *request, size_t *cur_pos, int sfd, Node_t *node) {
-  char *filename = (char *)malloc(FILE_NAME_LENGTH * sizeof(char));
+  char *raw_filename = (char *)malloc(REQUEST_PATH_LENGTH * sizeof(char));
+  char *filename = (char *)malloc(REQUEST_PATH_LENGTH * sizeof(char));
 
   char *extension = (char *)malloc(EXTENSION_LENGTH * sizeof(char));
   char *mime = (char *)malloc(MIME_LENGTH * sizeof(char));
+  char *query;
+  char accept_buf[MIME_LENGTH];
+  char *accept;
 
   int http_version;
+  int res;
 
 
-  MEM_ZERO(filename, FILE_NAME_LENGTH);
+  MEM_ZERO(raw_filename, REQUEST_PATH_LENGTH);
+  MEM_ZERO(filename, REQUEST_PATH_LENGTH);
 
   MEM_ZERO(extension, EXTENSION_LENGTH);
   MEM_ZERO(mime, MIME_LENGTH);
   
 
-  if ( read_word_from_req_into_buf(request, filename, cur_pos, FILE_NAME_LENGTH) < 0 ) {
+  if ( read_word_from_req_into_buf(request, raw_filename, cur_pos, REQUEST_PATH_LENGTH) < 0 ) {
     PRINT("[handle_http_GET]couldn't read filename in request\n");
     return -1;
   }
 
+  // decode and normalise the path once
+  // (see path_resolution.c)
+  res = normalize_request_path(raw_filename, filename, REQUEST_PATH_LENGTH);
+  if (res < 0) {
+    PRINT("[handle_http_GET]bad path %s\n", raw_filename);
+    // (files of the server are never found)
+    send_warning_msg((res == -2) ? "404 file not found" : "400 Bad Request", sfd);
+    free(raw_filename);
+    free(filename);
+    free(mime);
+    free(extension);
+    return 0;
+  }
+
   // 
   if ( (http_version = get_http_version(request, cur_pos)) < 0 ) {
     send_warning_msg("501 Not Implemented", sfd);
@@ -830,7 +1154,7 @@ static int handle_http_GET(char *request, size_t *cur_pos, int sfd, Node_t *node
   }
 
   if (strcmp(filename, "/") == 0) {
-    strcpy(filename, WWWROOT_PAGE);
+    strcpy(filename, "/" WWWROOT_PAGE);
   }
   
   if ( get_extension(filename, extension, EXTENSION_LENGTH) < 0 ) {
@@ -844,11 +1168,24 @@ static int handle_http_GET(char *request, size_t *cur_pos, int sfd, Node_t *node
     //return 0;
   }
 
-send_response:
-  send_response("HTTP/1.1", filename, mime, sfd, node);
+  // a missing file is rejected without a lookup on disk (see wwwroot_index.c)
+  // (or without a request to the upstream, see proxy.c)
+  if (proxy_enabled() ? proxy_is_missing(filename) : wwwroot_index_lookup(filename, NULL) == INDEX_MISSING) {
+#ifdef DEBUG
+    PRINT("[handle_http_GET]%s is not in the index\n", filename);
+#endif
+    send_warning_msg("404 file not found", sfd);
+    goto free_buffers;
+  }
+
+  query = strchr(raw_filename, '?');
+  accept = get_header_value(request, "Accept", accept_buf, sizeof(accept_buf));
+  send_response("HTTP/1.1", filename, query ? query + 1 : "", accept, mime,
+                !node->data.head && wants_file_descriptor(request, sfd), sfd, node);
 
 
 free_buffers:
+  free(raw_filename);
   free(filename);
   free(mime);
   free(extension);
@@ -856,9 +1193,46 @@ free_buffers:
 }
 
 //
+// "Upgrade: h2c" (RFC 7540, 3.2): 101 Switching Protocols is sent
+// and the request becomes stream 1 of an HTTP/2 connection (see http2.c)
 //
+// return 0 if the connection is upgraded, else -1 (the request is handled by HTTP/1.1)
+static int upgrade_to_h2(char *request, size_t *cur_pos, int sfd, Node_t *node) {
+  char upgrade[64];
+  char settings[256];
+  char raw_filename[REQUEST_PATH_LENGTH];
+  char accept_buf[MIME_LENGTH];
+  size_t pos = *cur_pos;
+  h2_conn_t *c;
+
+  if (!get_header_value(request, "Upgrade", upgrade, sizeof(upgrade)) || !strstr(upgrade, "h2c") ||
+      !get_header_value(request, "HTTP2-Settings", settings, sizeof(settings)))
+    return -1;
+  if (read_word_from_req_into_buf(request, raw_filename, &pos, REQUEST_PATH_LENGTH) < 0)
+    return -1;
+
+  c = h2_open(sfd, settings);
+  if (!c)
+    return -1;
+  if (h2_upgrade_stream(c, FALSE, raw_filename,
+                        get_header_value(request, "Accept", accept_buf, sizeof(accept_buf))) < 0) {
+    h2_close(c);
+    return -1;
+  }
+  send_warning_msg("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n", sfd);
+  node->data.h2 = c;
+
+  // bytes after the header are frames (the client preface)
+  if (node->data.header_length > node->data.header_end)
+    h2_input(c, node->data.header + node->data.header_end, node->data.header_length - node->data.header_end);
+  set_connection_events(sfd, EPOLLIN | EPOLLOUT);
+  return 0;
+}
+
+//
+// POST and PUT requests, see post_request.c
 static int handle_http_POST(char *request, size_t *cur_pos, int sfd, Node_t *node) {
-  return -1;
+  return start_upload(node, sfd);
 }
 
 #undef FILE_NAME_LENGTH
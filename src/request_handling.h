@@ -6,7 +6,8 @@
 #include "ext_epoll_data.h"
 
 // handle a request from a client
-int handle(char *request, int sfd, List_t *list);
+// @length -- number of bytes in @request (a body may contain '\0' bytes)
+int handle(char *request, size_t length, int sfd, List_t *list);
 
 
 #endif // _REQUEST_HANDLING_H_
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include "scan.h"
+#include <stdint.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+static const char word_delimiters[4] = {' ', '\t', '\r', '\n'};
+static const char cr[4] = {'\r', '\r', '\r', '\r'};
+
+// token characters: "!#$%&'*+-.^_`|~", digits and letters
+static const unsigned char token_chars[256] = {
+  ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+  ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+  ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+  ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+  ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+  ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+  ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1,
+  ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+  ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1
+};
+
+//
+// portable kernels
+//
+
+// the first character of @s which is one of @set (or NUL),
+// if @skip -- the first character which isn't one of @set
+static const char *scan_set_scalar(const char *s, const char *set, int skip) {
+  for ( ; *s; s++) {
+    int in_set = (*s == set[0] || *s == set[1] || *s == set[2] || *s == set[3]);
+
+    if (in_set != skip)
+      break;
+  }
+  return s;
+}
+
+static const char *scan_find_scalar(const char *buf, size_t length, const char *needle, size_t needle_length) {
+  return (const char *)memmem(buf, length, needle, needle_length);
+}
+
+static size_t scan_token_scalar(const char *s, size_t length) {
+  size_t i;
+
+  for (i = 0; i < length && token_chars[(unsigned char)s[i]]; i++)
+    ;
+  return i;
+}
+
+#ifdef __SSE2__
+
+//
+// SSE2 kernels
+//
+
+__attribute__((no_sanitize_address))
+static const char *scan_set_sse2(const char *s, const char *set, int skip) {
+  size_t offset = (uintptr_t)s & 15;
+  const __m128i *p = (const __m128i *)(s - offset);
+  const __m128i c0 = _mm_set1_epi8(set[0]), c1 = _mm_set1_epi8(set[1]);
+  const __m128i c2 = _mm_set1_epi8(set[2]), c3 = _mm_set1_epi8(set[3]);
+  const __m128i zero = _mm_setzero_si128();
+  unsigned int mask = ~0u << offset;    // bytes before @s are ignored
+
+  while (1) {
+    __m128i v = _mm_load_si128(p);
+    __m128i in_set = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)));
+    unsigned int found;
+
+    if (skip)
+      found = ~_mm_movemask_epi8(in_set) & 0xffff;    // (NUL isn't in @set)
+    else
+      found = _mm_movemask_epi8(_mm_or_si128(in_set, _mm_cmpeq_epi8(v, zero)));
+    found &= mask;
+    if (found)
+      return (const char *)p + __builtin_ctz(found);
+    mask = ~0u;
+    p++;
+  }
+}
+
+// the first and the last bytes of @needle are compared at once,
+// candidates are checked by memcmp()
+static const char *scan_find_sse2(const char *buf, size_t length, const char *needle, size_t needle_length) {
+  size_t i = 0;
+
+  if (needle_length < 2)
+    return scan_find_scalar(buf, length, needle, needle_length);
+
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+
+  for ( ; i + needle_length - 1 + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + needle_length - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+    while (mask) {
+      size_t j = i + __builtin_ctz(mask);
+
+      if (!memcmp(buf + j + 1, needle + 1, needle_length - 2))
+        return buf + j;
+      mask &= mask - 1;
+    }
+  }
+  return scan_find_scalar(buf + i, length - i, needle, needle_length);
+}
+
+// (signed comparisons: bytes >= 0x80 are negative, they aren't token characters)
+#define IN_RANGE_SSE2(v, a, b) \
+  _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((a) - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8((b) + 1)))
+
+static size_t scan_token_sse2(const char *s, size_t length) {
+  size_t i = 0;
+
+  for ( ; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    // visible characters except separators "(),/:;<=>?@[\]{}
+    __m128i bad = _mm_or_si128(_mm_or_si128(IN_RANGE_SSE2(v, 0x28, 0x29), IN_RANGE_SSE2(v, 0x3a, 0x40)),
+                               _mm_or_si128(IN_RANGE_SSE2(v, 0x5b, 0x5d), _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))));
+    bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')), _mm_cmpeq_epi8(v, _mm_set1_epi8('/'))));
+    bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+    unsigned int good = _mm_movemask_epi8(_mm_andnot_si128(bad, IN_RANGE_SSE2(v, 0x21, 0x7e)));
+
+    if (good != 0xffff)
+      return i + __builtin_ctz(~good);
+  }
+  return i + scan_token_scalar(s + i, length - i);
+}
+
+//
+// AVX2 kernels (the same as SSE2 ones with 32 bytes)
+//
+
+__attribute__((target("avx2"), no_sanitize_address))
+static const char *scan_set_avx2(const char *s, const char *set, int skip) {
+  size_t offset = (uintptr_t)s & 31;
+  const __m256i *p = (const __m256i *)(s - offset);
+  const __m256i c0 = _mm256_set1_epi8(set[0]), c1 = _mm256_set1_epi8(set[1]);
+  const __m256i c2 = _mm256_set1_epi8(set[2]), c3 = _mm256_set1_epi8(set[3]);
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t mask = ~0u << offset;
+
+  while (1) {
+    __m256i v = _mm256_load_si256(p);
+    __m256i in_set = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c0), _mm256_cmpeq_epi8(v, c1)),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, c3)));
+    uint32_t found;
+
+    if (skip)
+      found = ~(uint32_t)_mm256_movemask_epi8(in_set);
+    else
+      found = _mm256_movemask_epi8(_mm256_or_si256(in_set, _mm256_cmpeq_epi8(v, zero)));
+    found &= mask;
+    if (found)
+      return (const char *)p + __builtin_ctz(found);
+    mask = ~0u;
+    p++;
+  }
+}
+
+__attribute__((target("avx2")))
+static const char *scan_find_avx2(const char *buf, size_t length, const char *needle, size_t needle_length) {
+  size_t i = 0;
+
+  if (needle_length < 2)
+    return scan_find_scalar(buf, length, needle, needle_length);
+
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+
+  for ( ; i + needle_length - 1 + 32 <= length; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + needle_length - 1));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+    while (mask) {
+      size_t j = i + __builtin_ctz(mask);
+
+      if (!memcmp(buf + j + 1, needle + 1, needle_length - 2))
+        return buf + j;
+      mask &= mask - 1;
+    }
+  }
+  return scan_find_sse2(buf + i, length - i, needle, needle_length);
+}
+
+#define IN_RANGE_AVX2(v, a, b) \
+  _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((a) - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8((b) + 1), v))
+
+__attribute__((target("avx2")))
+static size_t scan_token_avx2(const char *s, size_t length) {
+  size_t i = 0;
+
+  for ( ; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i bad = _mm256_or_si256(_mm256_or_si256(IN_RANGE_AVX2(v, 0x28, 0x29), IN_RANGE_AVX2(v, 0x3a, 0x40)),
+                                  _mm256_or_si256(IN_RANGE_AVX2(v, 0x5b, 0x5d), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))));
+    bad = _mm256_or_si256(bad, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')),
+                                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'))));
+    bad = _mm256_or_si256(bad, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')),
+                                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'))));
+    uint32_t good = _mm256_movemask_epi8(_mm256_andnot_si256(bad, IN_RANGE_AVX2(v, 0x21, 0x7e)));
+
+    if (good != 0xffffffffu)
+      return i + __builtin_ctz(~good);
+  }
+  return i + scan_token_sse2(s + i, length - i);
+}
+
+#endif // __SSE2__
+
+//
+// dispatch
+//
+
+typedef struct scan_kernels {
+  const char *(*set)(const char *s, const char *set, int skip);
+  const char *(*find)(const char *buf, size_t length, const char *needle, size_t needle_length);
+  size_t (*token)(const char *s, size_t length);
+} scan_kernels_t;
+
+static const scan_kernels_t all_kernels[] = {
+  {scan_set_scalar, scan_find_scalar, scan_token_scalar},
+#ifdef __SSE2__
+  {scan_set_sse2, scan_find_sse2, scan_token_sse2},
+  {scan_set_avx2, scan_find_avx2, scan_token_avx2},
+#endif
+};
+
+#ifdef __SSE2__
+static const scan_kernels_t *kernels = &all_kernels[SCAN_SSE2];    // (SSE2 is a part of x86-64)
+#else
+static const scan_kernels_t *kernels = &all_kernels[SCAN_SCALAR];
+#endif
+
+int scan_init(int max_level) {
+  int level = SCAN_SCALAR;
+
+#ifdef __SSE2__
+  level = SCAN_SSE2;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    level = SCAN_AVX2;
+#endif
+  if (level > max_level)
+    level = max_level;
+  kernels = &all_kernels[level];
+  return level;
+}
+
+const char *scan_word_end(const char *s) {
+  return kernels->set(s, word_delimiters, FALSE);
+}
+
+const char *scan_word_start(const char *s) {
+  return kernels->set(s, word_delimiters, TRUE);
+}
+
+const char *scan_crlf(const char *s) {
+  while (1) {
+    s = kernels->set(s, cr, FALSE);
+    if (*s == '\0')
+      return NULL;
+    if (s[1] == '\n')
+      return s;
+    s++;
+  }
+}
+
+const char *scan_find(const char *buf, size_t length, const char *needle, size_t needle_length) {
+  return kernels->find(buf, length, needle, needle_length);
+}
+
+size_t scan_token(const char *s, size_t length) {
+  return kernels->token(s, length);
+}
@@ -0,0 +1,37 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include "setup.h"
+
+//
+// Scanning of requests (SSE2 / AVX2)
+//
+// Kernels compare 16 (SSE2) or 32 (AVX2) bytes of a request at once;
+// AVX2 is used if the CPU has it (it is checked at runtime), other CPUs get
+// portable versions. NUL-terminated strings are read by aligned blocks,
+// so a block never crosses a page boundary after the end of a string.
+//
+
+#define SCAN_SCALAR  0
+#define SCAN_SSE2    1
+#define SCAN_AVX2    2
+
+// use the best kernels which the CPU supports, but not better than @max_level
+// (it is called by init_server(); microbenchmarks compare levels)
+// return the chosen level
+int scan_init(int max_level);
+
+// the end of a word of @s: ' ', '\t', '\r', '\n' or the end of the string
+const char *scan_word_end(const char *s);
+// the beginning of the next word of @s (after ' ', '\t', '\r', '\n')
+const char *scan_word_start(const char *s);
+// "\r\n" in @s or NULL
+const char *scan_crlf(const char *s);
+
+// @needle (@needle_length bytes) in @length bytes of @buf or NULL (like memmem())
+const char *scan_find(const char *buf, size_t length, const char *needle, size_t needle_length);
+
+// number of token characters (RFC 7230, 3.2.6) at the beginning of @s (@length bytes)
+size_t scan_token(const char *s, size_t length);
+
+#endif // _SCAN_H_
@@ -0,0 +1,318 @@
+#include "send_sched.h"
+#include <stdlib.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+
+//
+// Deficit round robin with token buckets (see send_sched.h)
+//
+// Queues are doubly linked lists of descriptors in a table, which is indexed
+// by descriptors, so a closed connection is unlinked at once.
+// Only the event loop uses the scheduler.
+//
+
+#define QUEUE_NONE         -1
+#define QUEUE_INTERACTIVE   0
+#define QUEUE_BULK          1
+#define QUEUES_COUNT        2
+
+#define BURST_MIN          4096     // bytes
+#define BURST_TIME         10       // a bucket keeps 1/10 s of its rate
+
+typedef struct token_bucket {
+  long long rate;           // bytes per second (0 -- no limit)
+  double burst;
+  double tokens;
+  long long refilled;       // CLOCK_MONOTONIC, ns
+} token_bucket_t;
+
+typedef struct send_conn {
+  int queue;                // QUEUE_*
+  int prev;
+  int next;
+  long long deficit;
+  long long allowance;      // (the last one of send_sched_next())
+  long long sent;           // bytes of the response
+  token_bucket_t bucket;
+} send_conn_t;
+
+typedef struct send_queue {
+  int head;
+  int tail;
+  int count;
+  int round_left;           // connections which aren't visited in this round
+} send_queue_t;
+
+static send_conn_t *conns;  // indexed by descriptors
+static int conns_count;
+static send_queue_t queues[QUEUES_COUNT];
+static token_bucket_t global_bucket;
+static long long connection_rate;
+static int send_lowat;
+
+static long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bucket_init(token_bucket_t *b, long long rate, long long now) {
+  b->rate = rate;
+  b->burst = rate / BURST_TIME;
+  if (b->burst < BURST_MIN)
+    b->burst = BURST_MIN;
+  b->tokens = b->burst;
+  b->refilled = now;
+}
+
+static void bucket_refill(token_bucket_t *b, long long now) {
+  if (!b->rate)
+    return;
+  b->tokens += (double)(now - b->refilled) * b->rate / 1e9;
+  if (b->tokens > b->burst)
+    b->tokens = b->burst;
+  b->refilled = now;
+}
+
+// a bucket gives tokens when a quarter of the burst is collected
+// (a throttled connection isn't woken up for every few bytes)
+static int bucket_empty(token_bucket_t *b) {
+  return b->rate && b->tokens < b->burst / 4;
+}
+
+// ns until the bucket isn't empty
+static long long bucket_wait(token_bucket_t *b) {
+  if (!bucket_empty(b))
+    return 0;
+  return (long long)((b->burst / 4 - b->tokens) * 1e9 / b->rate) + 1;
+}
+
+static long long bucket_limit(token_bucket_t *b, long long bytes) {
+  if (b->rate && bytes > (long long)b->tokens)
+    return (long long)b->tokens;
+  return bytes;
+}
+
+static void bucket_take(token_bucket_t *b, size_t bytes) {
+  if (b->rate)
+    b->tokens -= bytes;
+}
+
+static void queue_link(int q, int sfd) {
+  send_conn_t *c = &conns[sfd];
+
+  c->queue = q;
+  c->next = -1;
+  c->prev = queues[q].tail;
+  if (queues[q].tail >= 0)
+    conns[queues[q].tail].next = sfd;
+  else
+    queues[q].head = sfd;
+  queues[q].tail = sfd;
+  queues[q].count++;
+}
+
+static void queue_unlink(int sfd) {
+  send_conn_t *c = &conns[sfd];
+  int q = c->queue;
+
+  if (q == QUEUE_NONE)
+    return;
+  if (c->prev >= 0)
+    conns[c->prev].next = c->next;
+  else
+    queues[q].head = c->next;
+  if (c->next >= 0)
+    conns[c->next].prev = c->prev;
+  else
+    queues[q].tail = c->prev;
+  queues[q].count--;
+  c->queue = QUEUE_NONE;
+}
+
+int send_sched_init(long long rate, long long conn_rate, int lowat) {
+  struct rlimit limit;
+  int i;
+
+  // a descriptor is less than RLIMIT_NOFILE
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+    limit.rlim_cur = 65536;
+  conns_count = limit.rlim_cur;
+  conns = (send_conn_t *)calloc(conns_count, sizeof(send_conn_t));
+  if (!conns) {
+    PRINT("[send_sched_init]ERROR: out of memory\n");
+    return -1;
+  }
+  for (i = 0; i < conns_count; i++)
+    conns[i].queue = QUEUE_NONE;
+  for (i = 0; i < QUEUES_COUNT; i++) {
+    queues[i].head = queues[i].tail = -1;
+    queues[i].count = queues[i].round_left = 0;
+  }
+
+  bucket_init(&global_bucket, rate, now_ns());
+  connection_rate = conn_rate;
+  send_lowat = lowat;
+  return 0;
+}
+
+void send_sched_deinit() {
+  free(conns);
+  conns = NULL;
+  conns_count = 0;
+}
+
+void send_sched_set_rates(long long rate, long long conn_rate) {
+  long long now = now_ns();
+  int sfd;
+
+  if (!conns)
+    return;
+  bucket_init(&global_bucket, rate, now);
+  connection_rate = conn_rate;
+  // (connections which aren't open get it in send_sched_open())
+  for (sfd = 0; sfd < conns_count; sfd++)
+    bucket_init(&conns[sfd].bucket, connection_rate, now);
+}
+
+void send_sched_open(int sfd) {
+  send_conn_t *c;
+
+  if (sfd < 0 || sfd >= conns_count)
+    return;
+  c = &conns[sfd];
+  queue_unlink(sfd);
+  c->deficit = 0;
+  c->sent = 0;
+  bucket_init(&c->bucket, connection_rate, now_ns());
+
+  // the socket is writable (EPOLLOUT) when less than @send_lowat bytes wait in it
+  if (send_lowat > 0 &&
+      setsockopt(sfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &send_lowat, sizeof(send_lowat)) < 0) {
+#ifdef DEBUG
+    PRINT("[send_sched_open]TCP_NOTSENT_LOWAT on sfd=%d (errno=%d)\n", sfd, errno);
+#endif
+  }
+}
+
+void send_sched_close(int sfd) {
+  if (sfd < 0 || sfd >= conns_count)
+    return;
+  queue_unlink(sfd);
+}
+
+int send_sched_ready(int sfd) {
+  send_conn_t *c;
+
+  if (!conns || sfd < 0 || sfd >= conns_count)
+    return -1;
+  c = &conns[sfd];
+  if (c->queue == QUEUE_NONE)
+    queue_link((c->sent < SEND_INTERACTIVE_BYTES) ? QUEUE_INTERACTIVE : QUEUE_BULK, sfd);
+  return 0;
+}
+
+void send_sched_round() {
+  int q;
+
+  bucket_refill(&global_bucket, now_ns());
+  for (q = 0; q < QUEUES_COUNT; q++)
+    queues[q].round_left = queues[q].count;
+}
+
+int send_sched_next(size_t *allowance) {
+  send_conn_t *c;
+  long long now = now_ns();
+  long long bytes;
+  int q, sfd;
+
+  // interactive responses are sent first
+  for (q = 0; q < QUEUES_COUNT; q++) {
+    while (queues[q].round_left > 0 && queues[q].head >= 0) {
+      // (the round is continued when there are tokens)
+      if (bucket_empty(&global_bucket))
+        return -1;
+      queues[q].round_left--;
+
+      // the connection goes to the tail of its queue
+      sfd = queues[q].head;
+      c = &conns[sfd];
+      queue_unlink(sfd);
+      queue_link(q, sfd);
+
+      bucket_refill(&c->bucket, now);
+      if (bucket_empty(&c->bucket))
+        continue;
+
+      c->deficit += SEND_QUANTUM;
+      bytes = bucket_limit(&global_bucket, bucket_limit(&c->bucket, c->deficit));
+      c->allowance = bytes;
+      *allowance = (size_t)bytes;
+      return sfd;
+    }
+  }
+  return -1;
+}
+
+void send_sched_sent(int sfd, size_t bytes, int state) {
+  send_conn_t *c;
+
+  if (sfd < 0 || sfd >= conns_count)
+    return;
+  c = &conns[sfd];
+  c->sent += bytes;
+  bucket_take(&c->bucket, bytes);
+  bucket_take(&global_bucket, bytes);
+
+  // (a connection, which has nothing more to send now, doesn't keep its deficit)
+  if (state != SEND_MORE || (long long)bytes < c->allowance) {
+    c->deficit = 0;
+  } else {
+    c->deficit -= bytes;
+    if (c->deficit < 0)
+      c->deficit = 0;
+  }
+
+  if (state != SEND_MORE) {
+    queue_unlink(sfd);
+    // (the next response of the connection, HTTP/2 frames for example, is interactive again)
+    if (state == SEND_DONE)
+      c->sent = 0;
+    return;
+  }
+
+  // a big response becomes bulk
+  if (c->queue == QUEUE_INTERACTIVE && c->sent >= SEND_INTERACTIVE_BYTES) {
+    queue_unlink(sfd);
+    queue_link(QUEUE_BULK, sfd);
+  }
+}
+
+int send_sched_timeout() {
+  long long now, wait, min_wait = -1;
+  int q, sfd;
+
+  if (!conns || (queues[QUEUE_INTERACTIVE].count == 0 && queues[QUEUE_BULK].count == 0))
+    return -1;
+
+  now = now_ns();
+  bucket_refill(&global_bucket, now);
+  for (q = 0; q < QUEUES_COUNT; q++) {
+    for (sfd = queues[q].head; sfd >= 0; sfd = conns[sfd].next) {
+      bucket_refill(&conns[sfd].bucket, now);
+      wait = bucket_wait(&conns[sfd].bucket);
+      if (min_wait < 0 || wait < min_wait)
+        min_wait = wait;
+      if (min_wait == 0)
+        break;
+    }
+  }
+
+  wait = bucket_wait(&global_bucket);
+  if (wait > min_wait)
+    min_wait = wait;
+  // (round up to ms)
+  return (int)((min_wait + 999999) / 1000000);
+}
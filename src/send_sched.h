@@ -0,0 +1,64 @@
+#ifndef _SEND_SCHED_H_
+#define _SEND_SCHED_H_
+
+#include "setup.h"
+#include <stddef.h>
+
+//
+// Scheduler of responses which are being sent
+//
+// A connection, whose socket is writable and whose response isn't sent yet,
+// waits in a queue (without EPOLLOUT, see server_work.c). Each iteration of
+// the event loop makes one round over the queues (deficit round robin):
+// a connection may send its quantum (and what it didn't use in previous
+// rounds), then it goes to the tail of the queue.
+//
+// Responses are interactive while their first SEND_INTERACTIVE_BYTES bytes
+// are sent (pages, icons, listings), then they become bulk. The interactive
+// queue is served before the bulk one.
+//
+// SEND_RATE and CONNECTION_SEND_RATE in config (bytes per second, 0 -- no
+// limit) are token buckets for all connections and for each one.
+// SEND_LOWAT sets TCP_NOTSENT_LOWAT of connections, so only that many
+// bytes wait in a socket and the round decides what is sent next.
+//
+
+#define SEND_QUANTUM              65536           // bytes of a connection in a round
+#define SEND_INTERACTIVE_BYTES    (256 * 1024)
+#define SEND_LOWAT_DEFAULT        65536
+
+// what a connection did with its allowance (see send_sched_sent())
+#define SEND_MORE      0    // it can send more
+#define SEND_BLOCKED   1    // the socket is full (wait for EPOLLOUT)
+#define SEND_WAIT      2    // it waits for something else (a job of io_pool)
+#define SEND_DONE      3    // the response is sent
+
+// @rate, @connection_rate -- bytes per second (0 -- no limit)
+// return 0 if success, else -1
+int send_sched_init(long long rate, long long connection_rate, int lowat);
+void send_sched_deinit();
+// change the limits while connections are sent (see init)
+void send_sched_set_rates(long long rate, long long connection_rate);
+
+// a new connection on @sfd (its socket options are set)
+void send_sched_open(int sfd);
+// the connection on @sfd is closed (it is removed from queues)
+void send_sched_close(int sfd);
+
+// the socket is writable and the connection has a response to send
+// return 0 if it is queued, else -1 (then it sends as before)
+int send_sched_ready(int sfd);
+
+// start a round (each queued connection is visited once)
+void send_sched_round();
+// the next connection of the round and @allowance -- how many bytes it may send
+// return its descriptor or -1 if the round is over
+int send_sched_next(size_t *allowance);
+// the connection which was returned by send_sched_next() sent @bytes, @state -- SEND_*
+void send_sched_sent(int sfd, size_t bytes, int state);
+
+// timeout for epoll_wait(): 0 if some connections may send now, ms until
+// tokens for throttled connections are added or -1 if nothing is queued
+int send_sched_timeout();
+
+#endif // _SEND_SCHED_H_
@@ -2,11 +2,44 @@
 #include "request_handling.h"
 #include "log.h"
 #include "ext_epoll_data.h"
+#include "io_pool.h"
+#include "trace.h"
+#include "wwwroot_index.h"
+#include "send_sched.h"
+#include "readahead.h"
+#include "http2.h"
+#include "overload.h"
+#include "admin.h"
+#include "workers.h"
+#include "proxy.h"
+#include "tls.h"
+#include "archive.h"
+#include "dedup.h"
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+
+#ifndef EPIOCSPARAMS
+// (linux/eventpoll.h of Linux 6.9)
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#define BUSY_POLL_BUDGET  8     // packets of one busy poll of the NIC queue
+
 
-#define BUFSIZE 1024
+// see html_generation_for_dir.c
+extern void free_dir_listing(struct dir_listing *l);
+
+// see post_request.c
+extern void free_upload(struct upload *u);
 
 #define MEM_ZERO(ptr, size) memset((ptr), '\0', size * sizeof(char));
 
@@ -16,6 +49,16 @@
 // (List_t, Node_t types are declared in ext_epoll_data.h)
 List_t *list;
 
+static int efd;    // epoll descriptor to watch events
+static int listen_sfd;
+static int unix_sfd = -1;       // the listener of local clients (UNIX_SOCKET), shared by workers
+static int tls_sfd = -1;        // the listener of TLS_PORT, shared by workers (see tls.c)
+static int workers_count = 1;   // (see workers.c)
+static int adaptive_batch = EVENT_BATCH_DEFAULT;   // (EVENT_BATCH 0)
+static struct timespec last_events;                // (BUSY_POLL) the last epoll_wait() with events
+
+static int has_response_to_send(Node_t *node);
+
 //
 // set O_NONBLOCK flag on the descriptor
 //
@@ -117,8 +160,159 @@ void start_server() {
 #endif
 
 
+//
+// Blocking operations of connections (see io_pool.c)
+//
+// While a job of a connection is in a worker thread, events of the connection
+// are disabled (only EPOLLERR and EPOLLHUP are reported), so the connection
+// doesn't read new data or send anything until the job is completed.
+//
+
+// change events which are monitored on @sfd
+int set_connection_events(int sfd, uint32_t events) {
+  struct epoll_event event;
+
+  event.data.fd = sfd;
+  event.events = events;
+  if (epoll_ctl(efd, EPOLL_CTL_MOD, sfd, &event) < 0) {
+    PRINT("[set_connection_events]ERROR: epoll_ctl sfd=%d (errno=%d)\n", sfd, errno);
+    return -1;
+  }
+  return 0;
+}
+
+//
+// submit @job of the connection @node to io_pool
+// (if the pool is not available, the job is done in place)
+void submit_connection_job(Node_t *node, io_job_t *job) {
+  job->sfd = node->data.sfd;
+  job->conn_id = trace_connection_id(node->data.sfd);
+  node->data.io_job = job;
+
+  if (io_pool_submit(job) < 0) {
+    job->work(job);
+    job->complete(job);
+    return;
+  }
+  set_connection_events(node->data.sfd, 0);
+}
+
+//
+// this function is called by complete() of a job of a connection
+//
+// return the connection which waits for @job (its events are enabled again)
+// or NULL if the connection was closed while the job was in progress
+// (then complete() frees resources of the job)
+Node_t *finish_connection_job(io_job_t *job) {
+  Node_t *node;
+
+  if (job->sfd < 0)
+    return NULL;
+
+  node = find_node(list, job->sfd);
+  if (!node || node->data.io_job != job)
+    return NULL;
+
+  node->data.io_job = NULL;
+  set_connection_events(node->data.sfd, EPOLLIN | EPOLLOUT);
+  return node;
+}
+
+
 #define CHECK(s, res, errmsg) if((s = res) < 0) { perror(errmsg); exit(-1); }
 
+//
+// the listener isn't watched while descriptors are exhausted (see overload.c),
+// pending connections wait in its backlog
+//
+static void watch_listeners(uint32_t events) {
+  int sfds[3] = { listen_sfd, unix_sfd, tls_sfd };
+  struct epoll_event event;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    if (sfds[i] < 0)
+      continue;
+    event.data.fd = sfds[i];
+    event.events = events;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, sfds[i], &event) < 0)
+      PRINT("[watch_listeners]ERROR: epoll_ctl (errno=%d)\n", errno);
+  }
+}
+
+static void pause_listener() {
+  watch_listeners(0);
+}
+
+// (EPOLL_CTL_MOD reports pending connections of the edge-triggered listener again)
+static void resume_listener() {
+  watch_listeners(EPOLLIN | EPOLLOUT | EPOLLET);
+}
+
+// timeout of epoll_wait() (-1 -- wait indefinitely)
+static int loop_timeout() {
+  int send_timeout = send_sched_timeout();
+  int listener_timeout = overload_timeout();
+  int proxy_wait = proxy_timeout();
+  int timeout;
+
+  if (send_timeout < 0)
+    timeout = listener_timeout;
+  else if (listener_timeout < 0 || send_timeout < listener_timeout)
+    timeout = send_timeout;
+  else
+    timeout = listener_timeout;
+
+  if (proxy_wait >= 0 && (timeout < 0 || proxy_wait < timeout))
+    timeout = proxy_wait;
+  return timeout;
+}
+
+//
+// events of the next epoll_wait() (EVENT_BATCH 0): a full batch doubles it
+// (less system calls under load), a batch filled by less than a quarter halves it
+//
+static void adapt_batch(int n, int batch) {
+  if (n >= batch && adaptive_batch < EVENT_BATCH_MAX)
+    adaptive_batch *= 2;
+  else if (n < batch / 4 && adaptive_batch > EVENT_BATCH_MIN)
+    adaptive_batch /= 2;
+}
+
+//
+// BUSY_POLL: the epoll instance polls NIC queues itself (Linux 6.9, else net.core.busy_poll
+// of sysctl is used), and the event loop spins with epoll_wait(0) for BUSY_POLL us
+// after the last events before it sleeps, so a request doesn't wait for a wakeup
+//
+static void set_busy_poll(int efd) {
+  struct epoll_params params;
+
+  memset(&params, 0, sizeof(params));
+  params.busy_poll_usecs = srv_settings.busy_poll;
+  params.busy_poll_budget = BUSY_POLL_BUDGET;
+  params.prefer_busy_poll = 1;
+  if (ioctl(efd, EPIOCSPARAMS, &params) < 0) {
+#ifdef DEBUG
+    PRINT("[set_busy_poll]DEBUG: EPIOCSPARAMS (errno=%d), only the event loop spins\n", errno);
+#endif
+  }
+}
+
+// TRUE if the event loop has to spin (events came less than BUSY_POLL us ago)
+static int busy_polling() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - last_events.tv_sec) * 1000000 +
+         (now.tv_nsec - last_events.tv_nsec) / 1000 < srv_settings.busy_poll;
+}
+
+// EPOLLOUT only: a connection may send more (see EVENT_ORDER)
+static int is_write_event(struct epoll_event *event) {
+  return (event->events & EPOLLOUT) && !(event->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+         event->data.fd != listen_sfd && event->data.fd != unix_sfd && event->data.fd != tls_sfd;
+}
+
 //
 // handle all new incoming connections (by using accept() function)
 //
@@ -149,15 +343,27 @@ static int new_connections_handling(int listenSocketID, int efd) {
         // we have processed all incoming connections
         break;
       }
+      else if (overload_accept_failed(errno)) {
+        // out of descriptors: accept() would fail on each event
+        pause_listener();
+        break;
+      }
       else {
         PRINT("[new_connections_handling] ERROR: accept!\n");
         return -1;
       }
     }
 
+    // (503 if the server is overloaded, see overload.c)
+    if (overload_admit(infd) < 0) {
+      close(infd);
+      continue;
+    }
+
 #ifdef DEBUG
     PRINT("Accepted connection on descriptor %d\n", infd);
 #endif
+    TRACE_CONNECTION(infd, TRACE_ACCEPTED);
 
     // make the incoming socket non-blocking
     status = make_socket_non_blocking(infd);
@@ -166,6 +372,13 @@ static int new_connections_handling(int listenSocketID, int efd) {
       goto error;
     }
 
+    // (TCP_NOTSENT_LOWAT, see send_sched.c)
+    send_sched_open(infd);
+    // (reads of the socket poll the NIC queue, it isn't allowed without CAP_NET_ADMIN
+    //  over net.core.busy_read)
+    if (srv_settings.busy_poll && listenSocketID != unix_sfd)
+      setsockopt(infd, SOL_SOCKET, SO_BUSY_POLL, &srv_settings.busy_poll, sizeof(srv_settings.busy_poll));
+
     // add it to the list of fds to monitor
     event.data.fd = infd;
 
@@ -177,7 +390,8 @@ static int new_connections_handling(int listenSocketID, int efd) {
     //event.events = EPOLLIN | EPOLLOUT | EPOLLET;   // NOT WORKS PROPERLY!!!!!!!!!!!!!!
 
     // we use level-triggered for client descriptors
-    event.events = EPOLLIN | EPOLLOUT;
+    // (EPOLLOUT is watched when there is a response to send, see event_in_handling())
+    event.events = EPOLLIN;
 
     // add @infd to @efd (epoll descriptor)
     // and associate such @event with @infd
@@ -186,41 +400,22 @@ static int new_connections_handling(int listenSocketID, int efd) {
       PRINT("[new_connections_handling]epoll_ctl %d", infd);
       goto error;
     }
+
+    // the handshake is done on its events, then it is an HTTP connection (see tls.c)
+    if (listenSocketID == tls_sfd && tls_accept(infd) < 0) {
+      PRINT("[new_connections_handling]tls_accept %d", infd);
+      goto error;
+    }
   }
 
   return 0;
 
 error:
+  overload_close(infd);
   close(infd);
   return -1;
 }
 
-// This function adds @temporary_buf content to end of @big_buf (strcat)
-// If @big_buf memory is not enought for it, 
-//    reallocation for @big_buf will be done
-// @big_buf_max_len -- potential maximum size of @big_buf
-static char *strcat_buf(char *big_buf, char *temporary_buf, size_t *big_buf_max_len) {
-  size_t buf_len = strnlen(temporary_buf, BUFSIZE);
-  size_t actual_big_buf_len = strnlen(big_buf, *big_buf_max_len);
-
-  if ( actual_big_buf_len + buf_len >= *big_buf_max_len ) {
-    // if @big_buf memory is not enough
-    // reallocate @big_buf, increasing its size by BUFSIZE
-    (*big_buf_max_len) += BUFSIZE + 1;
-    // TODO: CHECK
-    big_buf = realloc(big_buf, *big_buf_max_len);
-    memset(big_buf + actual_big_buf_len, '\0', *big_buf_max_len - actual_big_buf_len);
-#ifdef DEBUG
-    PRINT("[strcat_buf]realloc(); now big_buf_max_len=%zu\n", *big_buf_max_len);
-#endif
-  }
-
-  big_buf = strncat(big_buf, temporary_buf, BUFSIZE);
-  //
-  big_buf[*big_buf_max_len - 1] = '\0';
-  return big_buf;
-}
-
 //
 // This function is caused by event_in_handling() (when req != NULL)
 // and by event_out_handling (req == NULL)
@@ -229,7 +424,8 @@ static char *strcat_buf(char *big_buf, char *temporary_buf, size_t *big_buf_max_
 // if it returns -1, it means that the original request was NOT COMPLETED yet (some chunks of requested resource remained)
 // else (if it returns 0) we should close connection on this socket (it removes this descriptor from epoll set of monitored fds)
 //
-static int call_request_handling(char *req, int fd) {
+// @length -- number of bytes in @req (it may contain '\0' bytes of a body)
+static int call_request_handling(char *req, size_t length, int fd) {
 #ifdef DEBUG
   PRINT("================================================================================\n");
   PRINT("================================================================================\n");
@@ -246,7 +442,7 @@ static int call_request_handling(char *req, int fd) {
 
   // handling of this request
   // see: request_handling.c
-  if (handle(req, fd, list) < 0) {
+  if (handle(req, length, fd, list) < 0) {
     // do NOT CLOSE this connection
     // wait new data on this socket (for new chunks)
     return -1;
@@ -254,11 +450,16 @@ static int call_request_handling(char *req, int fd) {
 
   // an original request was processed fully
   // so connection on this socket will be closed
+  TRACE_CONNECTION(fd, TRACE_LAST_BYTE);
+  TRACE_CONNECTION(fd, TRACE_CLOSED);
+  send_sched_close(fd);
+  overload_close(fd);
 
   PRINT("Closed connection on descriptor %d\n", fd);
   // Closing the descriptor will make epoll remove it
   //   from the set of descriptors which are monitored
-  if (close(fd) < 0)
+  // (TLS: the end of the response may be written later, see tls_close())
+  if (tls_close(fd) < 0)
     PRINT("[events_handling]ERROR: close fd=%d\n", fd);
   PRINT("\n\n");
 
@@ -266,6 +467,51 @@ static int call_request_handling(char *req, int fd) {
 }
 
 
+//
+// close the connection on @sfd before its response is finished
+// (an error, or the client has gone)
+//
+static void close_connection(int sfd) {
+  Node_t *node;
+
+  // we should delete this node from list (moreover, remove_node() free memory of @node)
+  node = find_node(list, sfd);
+  if (node != NULL) {
+    if (node->data.header != NULL)
+      free(node->data.header);
+    free_upload(node->data.upload);
+    // (jobs of its streams free them, see http2.c)
+    h2_close(node->data.h2);
+    if (node->data.io_job != NULL) {
+      // a worker thread still uses the file (or the listing) of this connection,
+      // it will be freed when the job is completed (see finish_connection_job())
+      node->data.io_job->sfd = -1;
+    } else {
+      if (node->data.listing != NULL)
+        free_dir_listing(node->data.listing);
+      free_dir_archive(node->data.archive);
+      readahead_close(node->data.readahead);
+      proxy_release(node->data.proxy, sfd);
+      if (node->data.fp != NULL) {
+        PRINT("close fd %p\n", node->data.fp);
+        if (fclose(node->data.fp) < 0) {
+          PRINT("ERROR: fclose with %p on socketfd=%d\n", node->data.fp, sfd);
+        }
+      }
+    }
+    remove_node(list, sfd);
+  }
+
+  // closing the descriptor automatically removes it from the watched set of epoll instance @efd
+  TRACE_CONNECTION(sfd, TRACE_CLOSED);
+  send_sched_close(sfd);
+  overload_close(sfd);
+  tls_drop(sfd);
+  if (sfd) {
+    close(sfd);
+  }
+}
+
 // 
 // handle events[i] element (events[i].data.fd descriptor):
 //   1. read available data completely (edge-triggered mode)
@@ -274,55 +520,88 @@ static int call_request_handling(char *req, int fd) {
 // @events -- a set of monitored descriptors
 // @i      -- the sequence number of element in @events array, which is to be processed
 static int event_in_handling(struct epoll_event *events, int i) {
+  Node_t *node;
   char *big_buf;
-  size_t big_buf_max_len = BUFSIZE;    // the current size of @big_buf (it can increase)
-
-  big_buf = (char *)malloc(BUFSIZE * sizeof(char));
-  MEM_ZERO(big_buf, BUFSIZE);
+  size_t buf_size = srv_settings.recv_buffer;
+  size_t big_buf_max_len = buf_size;   // the current size of @big_buf (it can increase)
+  size_t length = 0;                   // number of read bytes in @big_buf
+  int peer_closed = FALSE;
+
+  big_buf = (char *)malloc((big_buf_max_len + 1) * sizeof(char));
+  if (!big_buf) {
+    PRINT("[event_in_handling]ERROR: out of memory\n");
+    return -1;
+  }
 
 #ifdef DEBUG
   PRINT("[events_handling] from sfd=%d\n", events[i].data.fd);
 #endif
 
   // We have data on the fd waiting to be read. 
-  //   We must read available data completely,
-  //   as we are running in edge-triggered mode
-  //   and won't get a notification again for the same data
-  while (1) {
+  //   We read available data (but not more than READ_BATCH of config,
+  //   level-triggered epoll reports the rest again, so
+  //   a big upload isn't kept in memory)
+  // (bytes which OpenSSL has decrypted already are read too, epoll doesn't report them)
+  while (length < (size_t)srv_settings.read_batch || tls_pending(events[i].data.fd)) {
     ssize_t count;      // a number of read bytes
-    char buf[BUFSIZE];
 
-    MEM_ZERO(buf, BUFSIZE);
-    
-    //count = read(events[i].data.fd, buf, BUFSIZE);
-    count = recv(events[i].data.fd, buf, BUFSIZE, 0);
+    if (big_buf_max_len - length < buf_size) {
+      // if @big_buf memory is not enough, double it
+      char *new_buf = (char *)realloc(big_buf, big_buf_max_len * 2 + 1);
+
+      if (!new_buf)
+        break;
+      big_buf = new_buf;
+      big_buf_max_len *= 2;
+    }
+
+    count = tls_recv(events[i].data.fd, big_buf + length, big_buf_max_len - length);
     if (count == -1) {
       // earlier we set incoming socket descriptor O_NONBLOCK
       // so: 
       //   If errno == EAGAIN, 
       //      that means we have read all data
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        break;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // else 
+        //    there is another error
+        PRINT("[events_handling]ERROR: read from fd=%d\n", events[i].data.fd);
       }
-      // else 
-      //    there is another error
-      PRINT("[events_handling]ERROR: read from fd=%d\n", events[i].data.fd);
+      break;
     }
     else if (count == 0) {
       // end of data
       // the remote has closed the connection
+      peer_closed = TRUE;
       break;
     }
 
-    big_buf = strcat_buf(big_buf, buf, &big_buf_max_len);
+    length += count;
+  }
+  // a request header is parsed as a string
+  big_buf[length] = '\0';
+
+  // the client has gone while its response is prepared or sent
+  // (EOF would be reported again and again while the response waits for data)
+  node = find_node(list, events[i].data.fd);
+  if (peer_closed && length == 0 && node && node->data.type == GET_TYPE && !node->data.h2) {
+    close_connection(events[i].data.fd);
+    free(big_buf);
+    return 0;
   }
 
   // now the following function processes the @request
   // and send (if http @request will be correct) only header
   // (the requested resource will be sent by chunks (if it so large) in event_out_handling() )
-  call_request_handling(big_buf, events[i].data.fd);
-  if (big_buf)
-    free(big_buf);
+  if (call_request_handling(big_buf, length, events[i].data.fd) < 0) {
+    // the response is sent on EPOLLOUT
+    // (until the request is received, the connection waits for EPOLLIN only,
+    //  a GET which is answered at once, 404 for example, is closed on EPOLLOUT)
+    node = find_node(list, events[i].data.fd);
+    if (node && !node->data.io_job &&
+        (has_response_to_send(node) || (node->data.type == GET_TYPE && !node->data.h2 && !node->data.proxy)))
+      set_connection_events(events[i].data.fd, EPOLLIN | EPOLLOUT);
+  }
+  free(big_buf);
   return 0;
 }
 
@@ -340,6 +619,16 @@ static int event_in_handling(struct epoll_event *events, int i) {
 // 
 // call_request_handling() function will close connection if the request is processed fully
 // 
+//
+// the connection sends a file, a listing or an archive (which isn't sent fully yet)
+//
+static int has_response_to_send(Node_t *node) {
+  if (node->data.h2)
+    return h2_has_output(node->data.h2);
+  return node->data.type == GET_TYPE && node->data.status != REQUEST_COMPLETED &&
+         !node->data.io_job && (node->data.fp || node->data.listing || node->data.archive);
+}
+
 static int event_out_handling(struct epoll_event *events, int i) {
   Node_t *node;
 
@@ -348,7 +637,8 @@ static int event_out_handling(struct epoll_event *events, int i) {
   if (node == NULL) {
     // for cases, when a connection was set
     // and client is not ready to write into socket a request yet
-    //
+    // (it is woken up by the request, an idle connection doesn't spin the loop)
+    set_connection_events(events[i].data.fd, EPOLLIN);
     return -1;
   }
 
@@ -357,11 +647,73 @@ static int event_out_handling(struct epoll_event *events, int i) {
   PRINT("[events_handling] from sfd=%d\n", events[i].data.fd);
 #endif
 
-  call_request_handling(NULL, events[i].data.fd);
+  // a response is sent when the send scheduler chooses the connection
+  // (see send_responses())
+  if (has_response_to_send(node) && send_sched_ready(events[i].data.fd) == 0)
+    return set_connection_events(events[i].data.fd, EPOLLIN);
+
+  // an idle HTTP/2 connection waits for frames (or for jobs of its streams)
+  if (node->data.h2 && !has_response_to_send(node))
+    return set_connection_events(events[i].data.fd, EPOLLIN);
+
+  // (without the scheduler a quantum is sent on each EPOLLOUT)
+  node->data.send_quota = SEND_QUANTUM;
+  call_request_handling(NULL, 0, events[i].data.fd);
 
   return 0;
 }
 
+//
+// send parts of responses of the connections, which are chosen by the send scheduler
+// (one round of the scheduler in each iteration of the event loop, see send_sched.c)
+//
+static void send_responses() {
+  Node_t *node;
+  size_t allowance;
+  int sfd, state;
+
+  send_sched_round();
+  while ((sfd = send_sched_next(&allowance)) >= 0) {
+    node = find_node(list, sfd);
+    if (!node) {
+      send_sched_close(sfd);
+      continue;
+    }
+
+    node->data.send_quota = allowance;
+    node->data.send_blocked = FALSE;
+    node->data.send_waiting = FALSE;
+    if (call_request_handling(NULL, 0, sfd) == 0) {
+      // the connection is closed (@node is freed)
+      continue;
+    }
+    // @allowance -- sent bytes
+    allowance -= node->data.send_quota;
+    node->data.send_quota = 0;
+
+    if (node->data.io_job || node->data.send_waiting) {
+      // the next part is prepared by a worker
+      // (events are enabled by finish_connection_job() or by readahead,
+      //  then it is queued again)
+      state = SEND_WAIT;
+    } else if (!has_response_to_send(node)) {
+      state = SEND_DONE;
+    } else if (node->data.send_blocked) {
+      state = SEND_BLOCKED;
+    } else {
+      state = SEND_MORE;
+    }
+
+    // EPOLLOUT closes the connection or queues it again
+    // (an HTTP/2 connection stays open, it waits for new frames)
+    if (state == SEND_DONE && node->data.h2)
+      set_connection_events(sfd, EPOLLIN);
+    else if (state == SEND_DONE || state == SEND_BLOCKED)
+      set_connection_events(sfd, EPOLLIN | EPOLLOUT);
+    send_sched_sent(sfd, allowance, state);
+  }
+}
+
 static int event_handling(struct epoll_event *events, int i) {
   if (events[i].events & EPOLLIN) {
 #ifdef DEBUG
@@ -376,22 +728,89 @@ static int event_handling(struct epoll_event *events, int i) {
   }
 }
 
-void start_server() {
-  int listenSocketID, status;
-  int efd;    // epoll descriptor to watch events
+//
+// handle events[i] of epoll_wait()
+//
+static void dispatch_event(struct epoll_event *events, int i, int listenSocketID) {
+  int status;
+
+  if (events[i].data.fd == io_pool_eventfd()) {
+    // some blocking operations are completed
+    io_pool_complete();
+    return;
+  }
+  else if (admin_owns(events[i].data.fd)) {
+    // a command of the admin socket
+    admin_handle(events[i].data.fd, events[i].events);
+    return;
+  }
+  else if (proxy_owns(events[i].data.fd)) {
+    // a response of the upstream (see proxy.c)
+    proxy_handle(events[i].data.fd, events[i].events);
+    return;
+  }
+  else if (tls_owns(events[i].data.fd)) {
+    // a TLS handshake, or the end of a response before the connection is closed (see tls.c)
+    status = tls_handle(events[i].data.fd, events[i].events);
+    if (status < 0) {
+      close_connection(events[i].data.fd);
+    } else if (status > 0) {
+      // the request has come with the handshake
+      events[i].events = EPOLLIN;
+      event_handling(events, i);
+    }
+    return;
+  }
+  else if ((events[i].events & EPOLLERR) ||
+      (events[i].events & EPOLLHUP)
+     )
+  {
+    #ifdef DEBUG
+    PRINT("ERROR in wait\n");
+    #endif
+    
+    // An error (the connection was broken, for example) has occured on this fd, or the socket is not
+    //   ready for reading
+    close_connection(events[i].data.fd);
+    return;
+  }
+  else if (listenSocketID == events[i].data.fd || unix_sfd == events[i].data.fd ||
+           tls_sfd == events[i].data.fd) {
+    // We have a notification on the listening socket (or on the local one, or on TLS_PORT)
+    //   => one or more incoming connections
+    new_connections_handling(events[i].data.fd, efd);
+    return;
+  }
+  else {
+
+    // We have data on the fd (events[i].data.fd) waiting to be read. Read and
+    //   display it. We must read whatever data is available
+    //   completely, as we are running in edge-triggered mode
+    //   and WILL NOT get a notification again for the same data 
+
+    // (NOW LEVEL-TRIGGERED), but we try to read data completely too
+    event_handling(events, i);
+  }
+}
+
+//
+// the event loop of @worker on its listening socket @listenSocketID
+//
+static void serve(int worker, int listenSocketID) {
+  int status;
   struct epoll_event event;
   struct epoll_event *events; // for descriptors
+  char admin_path[256];
 
-  // create_and_bind_listen_socket(): see in setup.c
-  listenSocketID = create_and_bind_listen_socket();
+  listen_sfd = listenSocketID;
   
   CHECK(status, make_socket_non_blocking(listenSocketID), "make socket non-blocking");
 
-  CHECK(status, listen(listenSocketID, MAXCONNECTIONS), "listen");
-
   // create epoll descriptor
   // it returns a file descriptor referring to the new epoll instance in @efd
   CHECK(efd, epoll_create1(0), "epoll_create1");
+  if (srv_settings.busy_poll)
+    set_busy_poll(efd);
 
   // assign what event we need to monitor
   event.data.fd = listenSocketID;
@@ -400,9 +819,67 @@ void start_server() {
   // add the listening socket to watch for input events in an edge-triggered mode
   CHECK(status, epoll_ctl(efd, EPOLL_CTL_ADD, listenSocketID, &event), "epoll_ctl");
 
+  // local clients connect to UNIX_SOCKET, every worker accepts on it
+  // (a connection wakes all of them, the others get EAGAIN)
+  if (unix_sfd >= 0) {
+    CHECK(status, make_socket_non_blocking(unix_sfd), "make socket non-blocking");
+    event.data.fd = unix_sfd;
+    CHECK(status, epoll_ctl(efd, EPOLL_CTL_ADD, unix_sfd, &event), "epoll_ctl");
+  }
+  // (and TLS_PORT in the same way)
+  if (tls_sfd >= 0) {
+    CHECK(status, make_socket_non_blocking(tls_sfd), "make socket non-blocking");
+    event.data.fd = tls_sfd;
+    CHECK(status, epoll_ctl(efd, EPOLL_CTL_ADD, tls_sfd, &event), "epoll_ctl");
+  }
+
+  // start workers for blocking operations
+  // and watch completions of their jobs
+  if (io_pool_start(srv_settings.io_threads_min, srv_settings.io_threads_max) == 0) {
+    event.data.fd = io_pool_eventfd();
+    event.events = EPOLLIN;
+    CHECK(status, epoll_ctl(efd, EPOLL_CTL_ADD, io_pool_eventfd(), &event), "epoll_ctl");
+  } else {
+    PRINT("[start_server]ERROR: cannot start io threads, blocking operations will be done in the event loop\n");
+  }
+
+  // responses share the bandwidth (see send_sched.c)
+  // (limits of the whole server are split between workers, see workers.c)
+  if (send_sched_init(worker_share(srv_settings.send_rate), srv_settings.connection_send_rate,
+                      srv_settings.send_lowat) < 0)
+    PRINT("[start_server]ERROR: cannot start the send scheduler\n");
+
+  // connections over the limits are refused with 503 (see overload.c)
+  if (overload_init((int)worker_share(srv_settings.max_connections), worker_share(srv_settings.memory_watermark),
+                    srv_settings.retry_after) < 0)
+    PRINT("[start_server]ERROR: cannot start overload protection\n");
+
+  // options may be changed while the server runs (see admin.c)
+  // (each worker has its own socket "<ADMIN_SOCKET>.<worker>" and its own traces)
+  if (srv_settings.admin_socket) {
+    if (workers_count > 1)
+      snprintf(admin_path, sizeof(admin_path), "%s.%d", srv_settings.admin_socket, worker);
+    else
+      snprintf(admin_path, sizeof(admin_path), "%s", srv_settings.admin_socket);
+    if (admin_open(efd, admin_path) < 0)
+      PRINT("[start_server]ERROR: cannot open the admin socket\n");
+  }
+  if (workers_count > 1)
+    trace_set_worker(worker);
+
+  // requests are served from the cache of UPSTREAM (see proxy.c)
+  if (srv_settings.upstream && proxy_init(efd) < 0)
+    exit(EXIT_FAILURE);
+
+  // WWWROOT is indexed in the background (see wwwroot_index.c),
+  // requests use the file system until it is ready
+  if (srv_settings.wwwroot_index && wwwroot_index_start() < 0)
+    PRINT("[start_server]ERROR: cannot index %s\n", WWWROOT);
+
   // storage array for incoming events from epoll_wait(events)
-  // and maximum events count could be MAXEVENTS
-  events = (struct epoll_event *)calloc(MAXEVENTS, sizeof(struct epoll_event));
+  // and maximum events count could be EVENT_BATCH of config
+  // (it may be changed up to EVENT_BATCH_MAX while the server runs)
+  events = (struct epoll_event *)calloc(EVENT_BATCH_MAX, sizeof(struct epoll_event));
   if (events == NULL) {
     PRINT("[start_server]ERROR: out of memory for events array!\n");
     goto out_of_memory;
@@ -419,66 +896,61 @@ void start_server() {
 
   // The event loop
   while (1) {
-      int n, i;
+      int n, i, batch, timeout;
 
       // wait for events on @efd (the thread remains blocked waiting for events)
       // available events will be stored in @events array
-      // (-1) -- wait indefinitely
+      // (-1) -- wait indefinitely, if no responses are waiting for the send scheduler
+      //         (else until they may be sent, see send_sched_timeout())
+      //         and the listener isn't paused (see overload_timeout())
       // @n   -- number of ready descriptors
-      n = epoll_wait(efd, events, MAXEVENTS, -1);
+      //         (BUSY_POLL: 0 for a while after events)
+      // @batch -- EVENT_BATCH or the adaptive one
+      batch = srv_settings.event_batch ? srv_settings.event_batch : adaptive_batch;
+      timeout = loop_timeout();
+      if (srv_settings.busy_poll && busy_polling())
+        timeout = 0;
+      n = epoll_wait(efd, events, batch, timeout);
+      if (srv_settings.event_batch == 0)
+        adapt_batch(n, batch);
+      if (srv_settings.busy_poll && n > 0)
+        clock_gettime(CLOCK_MONOTONIC, &last_events);
+
+      // kill -USR2 interrupts epoll_wait() to write traces (see trace.c)
+      trace_dump_if_requested();
+
       for (i = 0; i < n; i++) {
-          if ((events[i].events & EPOLLERR) ||
-              (events[i].events & EPOLLHUP)
-             )
-          {
-            #ifdef DEBUG
-            PRINT("ERROR in wait\n");
-            #endif
-            
-            Node_t *node;
-            // An error (the connection was broken, for example) has occured on this fd, or the socket is not
-            //   ready for reading
-
-            // we should delete this node from list (moreover, remove_node() free memory of @node)
-            node = find_node(list, events[i].data.fd);
-            if (node != NULL) {
-              if (node->data.header != NULL)
-                free(node->data.header);
-              if (node->data.fp != NULL) {
-                PRINT("close fd %p\n", node->data.fp);
-                if (fclose(node->data.fp) < 0) {
-                  PRINT("ERROR: fclose with %p on socketfd=%d\n", node->data.fp, events[i].data.fd);
-                }
-              }
-              remove_node(list, events[i].data.fd);
-            }
-
-            // closing the descriptor automatically removes it from the watched set of epoll instance @efd
-            if (events[i].data.fd) {
-              close(events[i].data.fd);
-            }
-            continue;
-          }
-          else if (listenSocketID == events[i].data.fd) {
-            // We have a notification on the listening socket
-            //   => one or more incoming connections
-            new_connections_handling(listenSocketID, efd);
-            continue;
-          }
-          else {
-
-            // We have data on the fd (events[i].data.fd) waiting to be read. Read and
-            //   display it. We must read whatever data is available
-            //   completely, as we are running in edge-triggered mode
-            //   and WILL NOT get a notification again for the same data 
-
-            // (NOW LEVEL-TRIGGERED), but we try to read data completely too
-            event_handling(events, i);
-          }
+        // (EVENT_ORDER reads_first: writes wait for the second pass)
+        if (srv_settings.event_order == EVENT_ORDER_READS_FIRST && is_write_event(&events[i]))
+          continue;
+        dispatch_event(events, i, listenSocketID);
+      }
+      if (srv_settings.event_order == EVENT_ORDER_READS_FIRST) {
+        for (i = 0; i < n; i++) {
+          if (is_write_event(&events[i]))
+            dispatch_event(events, i, listenSocketID);
+        }
       }
+
+      // writable connections send their responses
+      send_responses();
+
+      // fetches which wait for the upstream too long fail
+      proxy_expire();
+
+      // descriptors are free again (or the pause is over)
+      if (overload_resume_listener())
+        resume_listener();
   }
 
   // free memory
+  wwwroot_index_stop();
+  io_pool_stop();
+  send_sched_deinit();
+  overload_deinit();
+  admin_close();
+  proxy_deinit();
+  tls_deinit();
   free(events);
   list_delete(list);
 
@@ -486,3 +958,45 @@ out_of_memory:
   close(efd);
   close(listenSocketID);
 }
+
+//
+// one event loop or a group of workers on cores (WORKERS, CPU_AFFINITY, see workers.c)
+//
+void start_server() {
+  int cpus[WORKERS_MAX];
+  int cpus_count = 0;
+  int listenSocketID, status;
+
+  workers_count = srv_settings.workers;
+  if (workers_count == 0)
+    workers_count = default_workers_count();
+  if (srv_settings.cpu_affinity)
+    cpus_count = parse_cpu_list(srv_settings.cpu_affinity, cpus, WORKERS_MAX);
+
+  // (workers inherit them)
+  if (srv_settings.unix_socket) {
+    unix_sfd = create_and_bind_unix_socket(srv_settings.unix_socket);
+    CHECK(status, listen(unix_sfd, srv_settings.listen_backlog), "listen");
+  }
+  // (the store of uploads is shared by workers, see dedup.c)
+  if (srv_settings.dedup && dedup_init() < 0)
+    exit(EXIT_FAILURE);
+  // (the keys of session tickets are made once for all workers)
+  if (srv_settings.tls_port) {
+    if (tls_init() < 0)
+      exit(EXIT_FAILURE);
+    tls_sfd = create_and_bind_listen_socket(srv_settings.tls_port, FALSE);
+    CHECK(status, listen(tls_sfd, srv_settings.listen_backlog), "listen");
+  }
+
+  if (workers_count == 1 && cpus_count <= 0) {
+    // create_and_bind_listen_socket(): see in setup.c
+    listenSocketID = create_and_bind_listen_socket(PORT, FALSE);
+    CHECK(status, listen(listenSocketID, srv_settings.listen_backlog), "listen");
+    serve(0, listenSocketID);
+    return;
+  }
+
+  PRINT("[start_server]%d workers\n", workers_count);
+  run_workers(workers_count, cpus, (cpus_count > 0) ? cpus_count : 0, serve);
+}
@@ -1,9 +1,27 @@
 
 #include "setup.h"
+#include "path_resolution.h"
+#include "upload_writer.h"
+#include "scan.h"
+#include "trace.h"
+#include "send_sched.h"
+#include "overload.h"
+#include "readahead.h"
+#include "io_pool.h"
+#include "workers.h"
+#include "proxy.h"
 #include <fcntl.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/un.h>
 
 #define BUF_SIZE 256
 
+#define IO_THREADS_MIN_DEFAULT 2
+#define IO_THREADS_MAX_DEFAULT 16
+
+server_settings srv_settings;
+
 // allocate memory for @srv_option and
 // set @srv_option with a value of @option_val
 // return pointer to srv_option if success
@@ -22,12 +40,35 @@ static char * set_server_option(char *srv_option, const char *option_val) {
   return srv_option;
 }
 
+// see mime_table.c
+extern int load_mime_table();
+extern void free_mime_table();
+
+// see get_icon_path_from_db.c
+extern int load_icon_table();
+extern void free_icon_table();
+extern int load_inline_icons();
+
+static int load_tables() {
+  // lookups don't read the file (see check_mime_support())
+  if (load_mime_table() < 0) {
+    PRINT("ERROR: cannot load mime types\n");
+    return -1;
+  }
+
+  // icons of listings (without the table they are queried from the database)
+  if (load_icon_table() < 0)
+    PRINT("ERROR: cannot load icons from %s\n", DB_NAME);
+  else if (srv_settings.inline_icons && load_inline_icons() < 0)
+    PRINT("ERROR: cannot inline icons, listings link them\n");
+
+  return 0;
+}
+
 //
 static int fopen_mime_file() {
   const char *mime_file = "./src/mime.types";
 
-  // TODO: this function should mmap() (man mmap) @mime_file
-  // it increases PERFORMANCE of the server!
   srv_settings.mime_file = fopen(mime_file, "r");
   if (srv_settings.mime_file == NULL) {
     // TODO: error handling
@@ -35,15 +76,261 @@ static int fopen_mime_file() {
     return -1;
   }
 
+  return load_tables();
+}
+
+int reload_server_tables() {
+  free_mime_table();
+  free_icon_table();
+  return load_tables();
+}
+
+//
+// Schema of config
+//
+// Each option is a field of srv_settings with its type and its range.
+// Numbers may have a suffix K, M or G (1024, 1024^2, 1024^3).
+// Live options may be set by the admin socket (see admin.c),
+// @apply gives the new value to the module which uses it
+// (other modules read srv_settings in the event loop).
+//
+
+#define OPTION_STRING   0     // char *
+#define OPTION_INT      1     // int
+#define OPTION_LONG     2     // long long
+#define OPTION_ENUM     3     // int, the index of the value in @values
+
+typedef struct config_option {
+  const char *name;
+  int type;
+  size_t offset;              // of the field in server_settings
+  long long min;
+  long long max;
+  const char *const *values;  // OPTION_ENUM (NULL-terminated)
+  int live;
+  void (*apply)();
+} config_option_t;
+
+static const char *const on_off_values[] = { "off", "on", NULL };
+static const char *const upload_fsync_values[] = { "none", "close", "group", NULL };   // UPLOAD_FSYNC_*
+static const char *const listing_icons_values[] = { "links", "inline", NULL };
+static const char *const event_order_values[] = { "fifo", "reads_first", NULL };  // EVENT_ORDER_*
+
+static void apply_send_rates() {
+  send_sched_set_rates(worker_share(srv_settings.send_rate), srv_settings.connection_send_rate);
+}
+
+static void apply_overload_limits() {
+  overload_set_limits((int)worker_share(srv_settings.max_connections), worker_share(srv_settings.memory_watermark),
+                      srv_settings.retry_after);
+}
+
+#define FIELD(field) offsetof(server_settings, field)
+
+static const config_option_t config_options[] = {
+  // name                  type           field                          min     max                 values                live   apply
+  { "PORT",                OPTION_STRING, FIELD(port),                   0, 0,                       NULL,                 FALSE, NULL },
+  { "WWWROOT",             OPTION_STRING, FIELD(wwwroot),                0, 0,                       NULL,                 FALSE, NULL },
+  { "GENERATED_HTMLS_DIR", OPTION_STRING, FIELD(generated_htmls_dir),    0, 0,                       NULL,                 FALSE, NULL },
+  { "TRACE",               OPTION_STRING, FIELD(trace_file),             0, 0,                       NULL,                 FALSE, NULL },
+  { "ADMIN_SOCKET",        OPTION_STRING, FIELD(admin_socket),           0, 0,                       NULL,                 FALSE, NULL },
+  { "CPU_AFFINITY",        OPTION_STRING, FIELD(cpu_affinity),           0, 0,                       NULL,                 FALSE, NULL },
+  { "WORKERS",             OPTION_INT,    FIELD(workers),                0, WORKERS_MAX,             NULL,                 FALSE, NULL },
+  { "UNIX_SOCKET",         OPTION_STRING, FIELD(unix_socket),            0, 0,                       NULL,                 FALSE, NULL },
+  { "TLS_PORT",            OPTION_STRING, FIELD(tls_port),               0, 0,                       NULL,                 FALSE, NULL },
+  { "TLS_CERT",            OPTION_STRING, FIELD(tls_cert),               0, 0,                       NULL,                 FALSE, NULL },
+  { "TLS_KEY",             OPTION_STRING, FIELD(tls_key),                0, 0,                       NULL,                 FALSE, NULL },
+  { "UPSTREAM",            OPTION_STRING, FIELD(upstream),               0, 0,                       NULL,                 FALSE, NULL },
+  { "PROXY_CACHE_DIR",     OPTION_STRING, FIELD(proxy_cache_dir),        0, 0,                       NULL,                 FALSE, NULL },
+  { "PROXY_TTL",           OPTION_INT,    FIELD(proxy_ttl),              0, 1 << 30,                 NULL,                 TRUE,  NULL },
+  { "PROXY_NEGATIVE_TTL",  OPTION_INT,    FIELD(proxy_negative_ttl),     0, 1 << 20,                 NULL,                 TRUE,  NULL },
+  { "IO_THREADS_MIN",      OPTION_INT,    FIELD(io_threads_min),         1, 1024,                    NULL,                 FALSE, NULL },
+  { "IO_THREADS_MAX",      OPTION_INT,    FIELD(io_threads_max),         1, 1024,                    NULL,                 FALSE, NULL },
+  { "IO_IDLE_TIMEOUT",     OPTION_INT,    FIELD(io_idle_timeout),        1, 3600,                    NULL,                 FALSE, NULL },
+  { "DIR_CACHE_TTL",       OPTION_INT,    FIELD(dir_cache_ttl),          0, 3600,                    NULL,                 FALSE, NULL },
+  { "UPLOAD_FSYNC",        OPTION_ENUM,   FIELD(upload_fsync),           0, 0,                       upload_fsync_values,  FALSE, NULL },
+  { "UPLOAD_O_DIRECT",     OPTION_ENUM,   FIELD(upload_direct),          0, 0,                       on_off_values,        FALSE, NULL },
+  { "DEDUP",               OPTION_ENUM,   FIELD(dedup),                  0, 0,                       on_off_values,        FALSE, NULL },
+  { "WWWROOT_INDEX",       OPTION_ENUM,   FIELD(wwwroot_index),          0, 0,                       on_off_values,        FALSE, NULL },
+  { "LISTING_ICONS",       OPTION_ENUM,   FIELD(inline_icons),           0, 0,                       listing_icons_values, FALSE, NULL },
+  { "LISTEN_BACKLOG",      OPTION_INT,    FIELD(listen_backlog),         1, 65535,                   NULL,                 FALSE, NULL },
+  { "SEND_LOWAT",          OPTION_INT,    FIELD(send_lowat),             0, 64 << 20,                NULL,                 FALSE, NULL },
+  { "SEND_RATE",           OPTION_LONG,   FIELD(send_rate),              0, 1LL << 40,               NULL,                 TRUE,  apply_send_rates },
+  { "CONNECTION_SEND_RATE",OPTION_LONG,   FIELD(connection_send_rate),   0, 1LL << 40,               NULL,                 TRUE,  apply_send_rates },
+  { "MAX_CONNECTIONS",     OPTION_INT,    FIELD(max_connections),        0, 1 << 24,                 NULL,                 TRUE,  apply_overload_limits },
+  { "MEMORY_WATERMARK",    OPTION_LONG,   FIELD(memory_watermark),       0, 1LL << 50,               NULL,                 TRUE,  apply_overload_limits },
+  { "RETRY_AFTER",         OPTION_INT,    FIELD(retry_after),            0, 86400,                   NULL,                 TRUE,  apply_overload_limits },
+  { "EVENT_BATCH",         OPTION_INT,    FIELD(event_batch),            0, EVENT_BATCH_MAX,         NULL,                 TRUE,  NULL },
+  { "EVENT_ORDER",         OPTION_ENUM,   FIELD(event_order),            0, 0,                       event_order_values,   TRUE,  NULL },
+  { "BUSY_POLL",           OPTION_INT,    FIELD(busy_poll),              0, 1000000,                 NULL,                 FALSE, NULL },
+  { "RECV_BUFFER",         OPTION_INT,    FIELD(recv_buffer),            256, 1 << 20,               NULL,                 TRUE,  NULL },
+  { "READ_BATCH",          OPTION_INT,    FIELD(read_batch),             1024, 64 << 20,             NULL,                 TRUE,  NULL },
+  { "READAHEAD_MAX",       OPTION_INT,    FIELD(readahead_max),          READAHEAD_WINDOW_MIN, 1 << 30, NULL,              TRUE,  NULL },
+};
+
+#define CONFIG_OPTIONS_COUNT (int)(sizeof(config_options) / sizeof(config_options[0]))
+
+int find_server_setting(const char *name) {
+  int i;
+
+  for (i = 0; i < CONFIG_OPTIONS_COUNT; i++) {
+    if (!strcmp(config_options[i].name, name))
+      return i;
+  }
+  return -1;
+}
+
+// parse @value with a suffix K, M or G
+// return 0 if success, else -1
+// (-1 if it overflows)
+static int parse_number(const char *value, long long *number) {
+  long long multiplier = 1;
+  char *end;
+
+  errno = 0;
+  *number = strtoll(value, &end, 10);
+  if (errno || end == value)
+    return -1;
+  switch (*end) {
+  case 'G':
+    multiplier *= 1024;
+    /* fallthrough */
+  case 'M':
+    multiplier *= 1024;
+    /* fallthrough */
+  case 'K':
+    multiplier *= 1024;
+    end++;
+  }
+  if (*number > LLONG_MAX / multiplier || *number < LLONG_MIN / multiplier)
+    return -1;
+  *number *= multiplier;
+  return *end ? -1 : 0;
+}
+
+int set_server_setting(const char *name, const char *value, int live, const char **error) {
+  const config_option_t *option;
+  char *field;
+  char *string;
+  long long number;
+  int i;
+
+  i = find_server_setting(name);
+  if (i < 0) {
+    *error = "the option is not known";
+    return -1;
+  }
+  option = &config_options[i];
+  field = (char *)&srv_settings + option->offset;
+  if (live && !option->live) {
+    *error = "the option cannot be changed while the server runs";
+    return -1;
+  }
+
+  switch (option->type) {
+  case OPTION_STRING:
+    string = set_server_option(NULL, value);
+    if (!string) {
+      *error = "out of memory";
+      return -1;
+    }
+    free(*(char **)field);
+    *(char **)field = string;
+    break;
+  case OPTION_ENUM:
+    for (i = 0; option->values[i]; i++) {
+      if (!strcmp(option->values[i], value))
+        break;
+    }
+    if (!option->values[i]) {
+      *error = "the value is not known";
+      return -1;
+    }
+    *(int *)field = i;
+    break;
+  default:
+    if (parse_number(value, &number) < 0) {
+      *error = "the value is not a number";
+      return -1;
+    }
+    if (number < option->min || number > option->max) {
+      *error = "the value is out of range";
+      return -1;
+    }
+    if (option->type == OPTION_INT)
+      *(int *)field = (int)number;
+    else
+      *(long long *)field = number;
+  }
+
+  if (live && option->apply)
+    option->apply();
   return 0;
 }
 
+int format_server_setting(int i, char *out, size_t size) {
+  const config_option_t *option;
+  const char *field;
+  const char *live;
+  int length;
+
+  if (i < 0 || i >= CONFIG_OPTIONS_COUNT)
+    return -1;
+  option = &config_options[i];
+  field = (const char *)&srv_settings + option->offset;
+  live = option->live ? " live" : "";
+
+  switch (option->type) {
+  case OPTION_STRING:
+    length = snprintf(out, size, "%s %s%s", option->name,
+                      *(char **)field ? *(char **)field : "-", live);
+    break;
+  case OPTION_ENUM:
+    length = snprintf(out, size, "%s %s%s", option->name, option->values[*(int *)field], live);
+    break;
+  case OPTION_INT:
+    length = snprintf(out, size, "%s %d%s", option->name, *(int *)field, live);
+    break;
+  default:
+    length = snprintf(out, size, "%s %lld%s", option->name, *(long long *)field, live);
+  }
+  if (length < 0 || (size_t)length >= size)
+    return -1;
+  return length;
+}
+
 // read @config_file and set some settings of the server
 int init_server(const char *config_file) {
   FILE *f;
   char option[BUF_SIZE];
   char option_value[BUF_SIZE];
-  char *res;
+  const char *error;
+  int cpus[WORKERS_MAX];
+  int scan_level;
+
+  srv_settings.io_threads_min = IO_THREADS_MIN_DEFAULT;
+  srv_settings.io_threads_max = IO_THREADS_MAX_DEFAULT;
+  srv_settings.io_idle_timeout = IO_POOL_IDLE_TIMEOUT;
+  srv_settings.dir_cache_ttl = DIR_FD_CACHE_TTL;
+  srv_settings.upload_fsync = UPLOAD_FSYNC_NONE;
+  srv_settings.upload_direct = FALSE;
+  srv_settings.dedup = FALSE;
+  srv_settings.wwwroot_index = TRUE;
+  srv_settings.send_rate = 0;
+  srv_settings.connection_send_rate = 0;
+  srv_settings.send_lowat = SEND_LOWAT_DEFAULT;
+  srv_settings.inline_icons = TRUE;
+  srv_settings.max_connections = 0;
+  srv_settings.memory_watermark = 0;
+  srv_settings.retry_after = RETRY_AFTER_DEFAULT;
+  srv_settings.event_batch = EVENT_BATCH_DEFAULT;
+  srv_settings.listen_backlog = LISTEN_BACKLOG_DEFAULT;
+  srv_settings.recv_buffer = RECV_BUFFER_DEFAULT;
+  srv_settings.read_batch = READ_BATCH_DEFAULT;
+  srv_settings.readahead_max = READAHEAD_WINDOW_MAX;
+  srv_settings.workers = 1;
+  srv_settings.proxy_ttl = PROXY_TTL_DEFAULT;
+  srv_settings.proxy_negative_ttl = PROXY_NEGATIVE_TTL_DEFAULT;
 
   // 1.
   if (NULL == (f = fopen(config_file, "r"))) {
@@ -56,43 +343,60 @@ int init_server(const char *config_file) {
       PRINT("[init_server]value for %s option is NOT SPECIFIED\n", option);
       goto error;
     }
-    if ( !strcmp(option, "PORT")) {
-
-      res = set_server_option(srv_settings.port, option_value);
-      srv_settings.port = res;
-      #ifdef DEBUG
-      PRINT("[init_server] DEBUG: port=%s\n",  srv_settings.port);
-      #endif
-      goto res_handling;
-    } else if (!strcmp(option, "WWWROOT")) {
-      res = set_server_option(srv_settings.wwwroot, option_value);
-      srv_settings.wwwroot = res;
-      #ifdef DEBUG
-      PRINT("[init_server] DEBUG: wwwroot=%s\n",  srv_settings.wwwroot);
-      #endif
-      goto res_handling;
-    } else if (!strcmp(option, "GENERATED_HTMLS_DIR")) {
-      res = set_server_option(srv_settings.generated_htmls_dir, option_value);
-      srv_settings.generated_htmls_dir = res;
-      #ifdef DEBUG
-      PRINT("[init_server] DEBUG: generated_htmls_dir=%s\n",  srv_settings.generated_htmls_dir);
-      #endif
-      goto res_handling;
+    if (find_server_setting(option) < 0) {
+      PRINT("[init_server]%s option IS NOT KNOWN\n", option);
+      continue;
     }
-
-    PRINT("[init_server]%s option IS NOT KNOWN\n", option);
-    continue;
-
-res_handling:
-    if (!res)
+    if (set_server_setting(option, option_value, FALSE, &error) < 0) {
+      PRINT("[init_server]ERROR: %s %s: %s\n", option, option_value, error);
       goto error;
+    }
+    #ifdef DEBUG
+    PRINT("[init_server] DEBUG: %s=%s\n", option, option_value);
+    #endif
   }
 
+  if (!PORT || !WWWROOT || !GENERATED_HTMLS) {
+    PRINT("[init_server]ERROR: PORT, WWWROOT and GENERATED_HTMLS_DIR must be set\n");
+    goto error;
+  }
+  if (srv_settings.io_threads_min > srv_settings.io_threads_max) {
+    PRINT("[init_server]ERROR: IO_THREADS_MIN is more than IO_THREADS_MAX\n");
+    goto error;
+  }
+  if (srv_settings.tls_port && (!srv_settings.tls_cert || !srv_settings.tls_key)) {
+    PRINT("[init_server]ERROR: TLS_PORT needs TLS_CERT and TLS_KEY\n");
+    goto error;
+  }
+  if (srv_settings.upstream && !srv_settings.proxy_cache_dir) {
+    PRINT("[init_server]ERROR: UPSTREAM needs PROXY_CACHE_DIR\n");
+    goto error;
+  }
+  if (srv_settings.cpu_affinity &&
+      parse_cpu_list(srv_settings.cpu_affinity, cpus, WORKERS_MAX) < 0) {
+    PRINT("[init_server]ERROR: CPU_AFFINITY %s is not auto or a list of cores\n", srv_settings.cpu_affinity);
+    goto error;
+  }
+
+  // SIMD kernels for parsing of requests (see scan.c)
+  scan_level = scan_init(SCAN_AVX2);
+  #ifdef DEBUG
+  PRINT("[init_server] DEBUG: scan level=%d\n", scan_level);
+  #endif
+
   // 2.
   if ( fopen_mime_file() < 0)
     goto error; 
 
-  // 3. close descriptors
+  // 3. all request paths are resolved relative to this descriptor
+  if (open_wwwroot_dir() < 0)
+    goto error;
+
+  // phases of requests are recorded if TRACE is set (see trace.c)
+  if (trace_init(srv_settings.trace_file) < 0)
+    goto error;
+
+  // 4. close descriptors
   fclose(f);
   return 0;
 
@@ -105,7 +409,19 @@ void deinit_server() {
   free(srv_settings.port);
   free(srv_settings.wwwroot);
   free(srv_settings.generated_htmls_dir);
+  free(srv_settings.trace_file);
+  free(srv_settings.admin_socket);
+  free(srv_settings.cpu_affinity);
+  free(srv_settings.upstream);
+  free(srv_settings.proxy_cache_dir);
+  free(srv_settings.unix_socket);
+  free(srv_settings.tls_port);
+  free(srv_settings.tls_cert);
+  free(srv_settings.tls_key);
   fclose(srv_settings.mime_file);
+  free_mime_table();
+  free_icon_table();
+  close_wwwroot_dir();
 }
 
 //
@@ -137,8 +453,10 @@ static struct addrinfo *resolve_server_addr_and_port(const char *addr, const cha
 }
 
 // 
+// @port -- PORT or TLS_PORT
+// @reuse_port -- the socket is one of the group of workers (SO_REUSEPORT)
 // returns: socket descriptor for ListenSocket
-int create_and_bind_listen_socket() {
+int create_and_bind_listen_socket(const char *port, int reuse_port) {
   struct addrinfo *servinfo;    // getaddrinfo function returns a list of structures
   int listenSocketID;
   int reuse_addr = 1;   // this is option value to reuse addr
@@ -146,7 +464,7 @@ int create_and_bind_listen_socket() {
 
   // we call with NULL, it means local host
 #define SRVNODE NULL
-  servinfo = resolve_server_addr_and_port(SRVNODE, PORT);
+  servinfo = resolve_server_addr_and_port(SRVNODE, port);
 #undef SRVNODE
 
   // find possible result from servinfo list
@@ -165,6 +483,12 @@ int create_and_bind_listen_socket() {
       perror("[create_and_bind_listen_socket]setsockopt(reuse addr)");
       exit(1);
     }
+    // (each worker listens on its own socket, see workers.c)
+    if (reuse_port &&
+        setsockopt(listenSocketID, SOL_SOCKET, SO_REUSEPORT, &reuse_addr, sizeof(int)) == -1) {
+      perror("[create_and_bind_listen_socket]setsockopt(reuse port)");
+      exit(1);
+    }
 
     // bind listenSocket with listened port
     // (ai_addr field has been filled with needed address info by getaddrinfo() earlier)
@@ -188,3 +512,30 @@ int create_and_bind_listen_socket() {
   
   return listenSocketID;
 }
+
+int create_and_bind_unix_socket(const char *path) {
+  struct sockaddr_un addr;
+  int sfd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    PRINT("[create_and_bind_unix_socket]ERROR: path %s is too long\n", path);
+    exit(-1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sfd < 0) {
+    perror("[create_and_bind_unix_socket]socket");
+    exit(-1);
+  }
+  // (a socket file of the last run)
+  // the mode of the file is given by umask (local clients may be other users)
+  unlink(path);
+  if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("[create_and_bind_unix_socket]ERROR: cannot bind");
+    exit(-1);
+  }
+  return sfd;
+}
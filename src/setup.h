@@ -20,8 +20,14 @@
 #define TRUE  1
 
 #define PORT (srv_settings.port)
-#define MAXEVENTS 128
-#define MAXCONNECTIONS 128   // max number of connections for listening
+#define EVENT_BATCH_DEFAULT     128           // events of one epoll_wait()
+#define EVENT_BATCH_MIN         16            // (EVENT_BATCH 0 -- the batch adapts to the load)
+#define EVENT_BATCH_MAX         4096
+#define EVENT_ORDER_FIFO        0             // events are handled in order of epoll_wait()
+#define EVENT_ORDER_READS_FIRST 1             // accepts and reads of a batch, then writes
+#define LISTEN_BACKLOG_DEFAULT  128           // max number of connections for listening
+#define RECV_BUFFER_DEFAULT     1024          // the first buffer of recv() (it is doubled)
+#define READ_BATCH_DEFAULT      (256 * 1024)  // max number of bytes which are read on one EPOLLIN
 #define WWWROOT (srv_settings.wwwroot)		// wwwroot dir
 #define MIME_FILE (srv_settings.mime_file)
 #define GENERATED_HTMLS (srv_settings.generated_htmls_dir)
@@ -35,9 +41,45 @@ typedef struct _server_settings {
   char *generated_htmls_dir;
   char *icons_db_path;        // relative to current directory of server
   FILE *mime_file;
+  int wwwroot_fd;             // WWWROOT opened as a directory (see path_resolution.c)
+  int io_threads_min;         // threads for blocking operations (see io_pool.c)
+  int io_threads_max;
+  int upload_fsync;           // UPLOAD_FSYNC_* (see upload_writer.h)
+  int upload_direct;          // write uploads with O_DIRECT
+  int dedup;                  // uploads share their content through a store in WWWROOT (see dedup.c)
+  int wwwroot_index;          // keep an index of WWWROOT in memory (see wwwroot_index.c)
+  long long send_rate;        // bytes per second of all responses (0 -- no limit, see send_sched.c)
+  long long connection_send_rate;   // ... of each response
+  int send_lowat;             // TCP_NOTSENT_LOWAT of connections (0 -- the default of the kernel)
+  char *trace_file;           // file for traces of requests (NULL -- no tracing, see trace.c)
+  int inline_icons;           // listings inline icons as data: URIs (see get_icon_path_from_db.c)
+  int max_connections;        // connections over it are refused with 503 (0 -- by RLIMIT_NOFILE, see overload.c)
+  long long memory_watermark; // bytes of the heap (0 -- no limit)
+  int retry_after;            // Retry-After of 503 (seconds)
+  int event_batch;            // events of one epoll_wait() (0 -- adaptive, see server_work.c)
+  int event_order;            // EVENT_ORDER_*
+  int busy_poll;              // microseconds of busy polling before the loop sleeps (0 -- off)
+  int listen_backlog;
+  int recv_buffer;
+  int read_batch;
+  int readahead_max;          // max window of readahead (see readahead.c)
+  int io_idle_timeout;        // seconds, then an idle io thread exits (see io_pool.c)
+  int dir_cache_ttl;          // seconds, then a cached directory is reopened (see path_resolution.c)
+  char *admin_socket;         // path of the admin socket (NULL -- none, see admin.c)
+  int workers;                // processes with event loops (0 -- by cores, see workers.c)
+  char *cpu_affinity;         // cores of workers: "auto" or "0-3,8" (NULL -- not pinned)
+  char *upstream;             // "host:port" of the proxied server (NULL -- WWWROOT is served, see proxy.c)
+  char *proxy_cache_dir;      // files of the upstream
+  int proxy_ttl;              // seconds, then a cached file is fetched again (0 -- never)
+  int proxy_negative_ttl;     // seconds, 404 of the upstream is remembered
+  char *unix_socket;          // path of the AF_UNIX listener for local clients (NULL -- none)
+  char *tls_port;             // port of TLS connections (NULL -- none, see tls.c)
+  char *tls_cert;             // certificate chain (PEM)
+  char *tls_key;              // its private key (PEM)
 } server_settings;
 
-server_settings srv_settings;
+// see setup.c
+extern server_settings srv_settings;
 
 
 // configure the server
@@ -45,8 +87,32 @@ server_settings srv_settings;
 int init_server(const char *config_file);
 void deinit_server();
 
+// Options of config are typed (see config_options in setup.c): their values
+// are checked at startup, and "live" ones may be changed by the admin socket
+// while the server runs.
+
+// set option @name to @value
+// @live -- TRUE if the server runs (only live options may be set, they are applied at once)
+// return 0 if success, else -1 (@error describes the reason)
+int set_server_setting(const char *name, const char *value, int live, const char **error);
+// number of option @name or -1
+int find_server_setting(const char *name);
+// "NAME VALUE" of option @i (" live" is appended if it may be set while the server runs)
+// return length of @out or -1 if there is no option @i
+int format_server_setting(int i, char *out, size_t size);
+
+// @port -- PORT or TLS_PORT
+// @reuse_port -- TRUE for a socket of a worker (see workers.c)
 // returns: socket descriptor for ListenSocket
-int create_and_bind_listen_socket();
+int create_and_bind_listen_socket(const char *port, int reuse_port);
+// the listener of local clients on @path (it is shared by workers)
+// returns: socket descriptor (it isn't listening yet)
+int create_and_bind_unix_socket(const char *path);
+
+// tables of mime types and icons are read again
+// (by a worker, so they are on its NUMA node)
+// return 0 if success, else -1
+int reload_server_tables();
 
 
 
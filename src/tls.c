@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include "tls.h"
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+//
+// TLS connections (see tls.h)
+//
+// Sessions are kept in a table by descriptors (like the send scheduler does),
+// a descriptor without a session is a plain connection.
+//
+
+#define TLS_HANDSHAKE   0
+#define TLS_OPEN        1
+#define TLS_CLOSING     2     // the response is written, then the connection is closed
+
+typedef struct tls_conn {
+  SSL *ssl;
+  int state;
+  int ktls;                   // records are made by the kernel
+  char *out;                  // (without kTLS) plaintext which OpenSSL hasn't written yet
+  size_t out_len;
+} tls_conn_t;
+
+static SSL_CTX *ctx;
+static tls_conn_t **conns;
+static int conns_count;
+static int mode_reported;
+
+// see server_work.c
+extern int set_connection_events(int sfd, uint32_t events);
+
+int tls_init() {
+  struct rlimit limit;
+
+  ctx = SSL_CTX_new(TLS_server_method());
+  if (!ctx) {
+    PRINT("[tls_init]ERROR: SSL_CTX_new\n");
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  // (EOF without close_notify is the end of a connection, as for plain ones)
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+  if (SSL_CTX_use_certificate_chain_file(ctx, srv_settings.tls_cert) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, srv_settings.tls_key, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    PRINT("[tls_init]ERROR: cannot load %s and %s\n", srv_settings.tls_cert, srv_settings.tls_key);
+    goto error;
+  }
+
+  // resumption: tickets (their keys are made here, so workers share them)
+  // and the cache of session IDs of each worker
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"sSs", 3);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_num_tickets(ctx, TLS_TICKETS);
+
+  // a session for each possible descriptor
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+    limit.rlim_cur = 65536;
+  conns_count = limit.rlim_cur;
+  conns = (tls_conn_t **)calloc(conns_count, sizeof(tls_conn_t *));
+  if (!conns) {
+    PRINT("[tls_init]ERROR: out of memory\n");
+    goto error;
+  }
+
+  // writes of OpenSSL don't use MSG_NOSIGNAL
+  signal(SIGPIPE, SIG_IGN);
+  return 0;
+
+error:
+  SSL_CTX_free(ctx);
+  ctx = NULL;
+  return -1;
+}
+
+void tls_deinit() {
+  int sfd;
+
+  if (!ctx)
+    return;
+  for (sfd = 0; sfd < conns_count; sfd++)
+    tls_drop(sfd);
+  free(conns);
+  conns = NULL;
+  conns_count = 0;
+  SSL_CTX_free(ctx);
+  ctx = NULL;
+}
+
+static tls_conn_t *find_conn(int sfd) {
+  if (!conns || sfd < 0 || sfd >= conns_count)
+    return NULL;
+  return conns[sfd];
+}
+
+int tls_accept(int sfd) {
+  tls_conn_t *c;
+
+  if (!conns || sfd < 0 || sfd >= conns_count)
+    return -1;
+  c = (tls_conn_t *)calloc(1, sizeof(tls_conn_t));
+  if (!c)
+    return -1;
+  c->ssl = SSL_new(ctx);
+  if (!c->ssl || SSL_set_fd(c->ssl, sfd) != 1) {
+    PRINT("[tls_accept]ERROR: SSL_new for sfd=%d\n", sfd);
+    SSL_free(c->ssl);
+    free(c);
+    return -1;
+  }
+  SSL_set_accept_state(c->ssl);
+  c->state = TLS_HANDSHAKE;
+  conns[sfd] = c;
+  return 0;
+}
+
+void tls_drop(int sfd) {
+  tls_conn_t *c = find_conn(sfd);
+
+  if (!c)
+    return;
+  SSL_free(c->ssl);
+  free(c->out);
+  free(c);
+  conns[sfd] = NULL;
+}
+
+int tls_owns(int sfd) {
+  tls_conn_t *c = find_conn(sfd);
+
+  return c && c->state != TLS_OPEN;
+}
+
+//
+// the next step of the handshake of @c
+// return (see tls_handle())
+//
+static int handshake(tls_conn_t *c, int sfd) {
+  int res;
+
+  ERR_clear_error();
+  res = SSL_do_handshake(c->ssl);
+  if (res != 1) {
+    switch (SSL_get_error(c->ssl, res)) {
+    case SSL_ERROR_WANT_READ:
+      set_connection_events(sfd, EPOLLIN);
+      return 0;
+    case SSL_ERROR_WANT_WRITE:
+      set_connection_events(sfd, EPOLLIN | EPOLLOUT);
+      return 0;
+    default:
+#ifdef DEBUG
+      PRINT("[tls_handle]DEBUG: handshake of sfd=%d has failed (%s)\n", sfd,
+            ERR_reason_error_string(ERR_peek_error()));
+#endif
+      return -1;
+    }
+  }
+
+  // OpenSSL has given the keys to the kernel (SSL_OP_ENABLE_KTLS) if it could
+  c->ktls = BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+  if (!mode_reported) {
+    PRINT("[tls_handle]%s\n", c->ktls ? "responses are encrypted by the kernel (kTLS)" :
+          "kTLS isn't available, responses are encrypted by OpenSSL");
+    mode_reported = TRUE;
+  }
+  if (!c->ktls) {
+    c->out = (char *)malloc(TLS_RECORD_MAX);
+    if (!c->out)
+      return -1;
+  }
+  c->state = TLS_OPEN;
+  set_connection_events(sfd, EPOLLIN);
+
+  // (the request may have come with the end of the handshake)
+  return SSL_has_pending(c->ssl) ? 1 : 0;
+}
+
+//
+// write the buffered record of @c
+// return 0 if it is written, else -1 (errno is EAGAIN if the socket is full)
+//
+static int flush(tls_conn_t *c) {
+  int res;
+
+  if (c->out_len == 0)
+    return 0;
+  // (a repeated write has the same arguments, as OpenSSL requires)
+  ERR_clear_error();
+  res = SSL_write(c->ssl, c->out, c->out_len);
+  if (res > 0) {
+    c->out_len = 0;
+    return 0;
+  }
+  errno = (SSL_get_error(c->ssl, res) == SSL_ERROR_WANT_WRITE) ? EAGAIN : EPIPE;
+  return -1;
+}
+
+// the connection is over, close_notify is sent if the socket takes it
+// return result of close()
+static int finish(tls_conn_t *c, int sfd) {
+  SSL_shutdown(c->ssl);
+  tls_drop(sfd);
+  return close(sfd);
+}
+
+int tls_handle(int sfd, uint32_t events) {
+  tls_conn_t *c = find_conn(sfd);
+
+  if (!c)
+    return -1;
+  if (events & (EPOLLERR | EPOLLHUP))
+    return -1;
+  if (c->state == TLS_HANDSHAKE)
+    return handshake(c, sfd);
+
+  // TLS_CLOSING
+  if (flush(c) < 0 && errno == EAGAIN)
+    return 0;
+  finish(c, sfd);
+  return 0;
+}
+
+ssize_t tls_recv(int sfd, void *buf, size_t length) {
+  tls_conn_t *c = find_conn(sfd);
+  int res;
+
+  if (!c)
+    return recv(sfd, buf, length, 0);
+
+  ERR_clear_error();
+  res = SSL_read(c->ssl, buf, length);
+  if (res > 0)
+    return res;
+  switch (SSL_get_error(c->ssl, res)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_ZERO_RETURN:
+    // the client has closed the connection
+    return 0;
+  default:
+    errno = ECONNRESET;
+    return -1;
+  }
+}
+
+int tls_pending(int sfd) {
+  tls_conn_t *c = find_conn(sfd);
+
+  return c && SSL_pending(c->ssl) > 0;
+}
+
+//
+// (without kTLS) @count bytes of @buf or of file @fd (if @buf is NULL) are copied into records
+// return bytes which are taken (the last record may wait in the buffer) or -1
+//
+static ssize_t write_records(tls_conn_t *c, const char *buf, int fd, size_t count) {
+  size_t taken = 0;
+  ssize_t n;
+
+  while (taken < count && flush(c) == 0) {
+    n = count - taken;
+    if (n > TLS_RECORD_MAX)
+      n = TLS_RECORD_MAX;
+    if (buf) {
+      memcpy(c->out, buf + taken, n);
+    } else {
+      n = read(fd, c->out, n);
+      if (n < 0)
+        return taken ? (ssize_t)taken : -1;
+      if (n == 0)
+        break;
+    }
+    c->out_len = n;
+    taken += n;
+  }
+  // (nothing is taken if the socket is full or broken, errno is set by flush())
+  if (taken == 0)
+    return (count && c->out_len) ? -1 : 0;
+
+  // (what the socket doesn't take now is written by the next call or by tls_close())
+  flush(c);
+  return taken;
+}
+
+ssize_t tls_send(int sfd, const void *buf, size_t length) {
+  tls_conn_t *c = find_conn(sfd);
+
+  if (!c || c->ktls)
+    return send(sfd, buf, length, MSG_NOSIGNAL);
+  return write_records(c, (const char *)buf, -1, length);
+}
+
+ssize_t tls_sendfile(int sfd, int fd, size_t count) {
+  tls_conn_t *c = find_conn(sfd);
+
+  if (!c || c->ktls)
+    return sendfile(sfd, fd, NULL, count);
+  return write_records(c, NULL, fd, count);
+}
+
+int tls_close(int sfd) {
+  tls_conn_t *c = find_conn(sfd);
+
+  if (!c)
+    return close(sfd);
+  if (c->out_len > 0 && flush(c) < 0 && errno == EAGAIN) {
+    // the end of the response is written on EPOLLOUT (see tls_handle())
+    c->state = TLS_CLOSING;
+    set_connection_events(sfd, EPOLLOUT);
+    return 0;
+  }
+  return finish(c, sfd);
+}
@@ -0,0 +1,55 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include "setup.h"
+#include <stdint.h>
+
+//
+// TLS on TLS_PORT (TLS_CERT, TLS_KEY in config)
+//
+// The handshake is done by OpenSSL in the event loop. Then the keys are given
+// to the kernel (kTLS, TCP_ULP "tls"), so a connection is served as a plain
+// one: the kernel makes records of what is sent, sendfile() of files works.
+// If the kernel can't do it, responses are encrypted by OpenSSL: tls_send()
+// and tls_sendfile() copy them into a record buffer of the connection (files
+// are read into it), and the end of a response is written before the
+// connection is closed (see tls_close()).
+//
+// Requests are read by OpenSSL in both cases (see tls_recv()). Sessions are
+// resumed by tickets (the keys are shared by workers) or by the session cache.
+//
+
+#define TLS_RECORD_MAX          16384     // plaintext of a record (the buffer of a connection without kTLS)
+#define TLS_SESSION_CACHE_SIZE  20480     // sessions of TLS 1.2 clients
+#define TLS_TICKETS             1         // tickets of TLS 1.3 which are sent after the handshake
+
+// (before workers are started) the context of TLS_CERT and TLS_KEY
+// return 0 if success, else -1
+int tls_init();
+void tls_deinit();
+
+// a new connection on @sfd of TLS_PORT, its handshake begins with EPOLLIN
+// return 0 if success, else -1
+int tls_accept(int sfd);
+
+// TRUE if events of @sfd are handled by tls_handle() (a handshake, or the end
+// of a response which is written before the connection is closed)
+int tls_owns(int sfd);
+// return 1 if the handshake is done and a request is read already (it has to be handled now),
+// 0 if the connection waits, -1 if it has to be closed
+int tls_handle(int sfd, uint32_t events);
+
+// recv(), send() and sendfile() (with the file offset) of a connection, which may be TLS
+ssize_t tls_recv(int sfd, void *buf, size_t length);
+ssize_t tls_send(int sfd, const void *buf, size_t length);
+ssize_t tls_sendfile(int sfd, int fd, size_t count);
+// TRUE if OpenSSL keeps decrypted bytes of @sfd (they aren't reported by epoll)
+int tls_pending(int sfd);
+
+// close @sfd after its response (a TLS connection writes what is left first)
+// return result of close() (0 if it is closed later)
+int tls_close(int sfd);
+// (the connection is closed at once) forget the session of @sfd
+void tls_drop(int sfd);
+
+#endif // _TLS_H_
@@ -0,0 +1,291 @@
+#include "trace.h"
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+
+//
+// Rings of events (see trace.h)
+//
+// A ring is written only by its thread: the event is stored, then @head is
+// increased (release). trace_dump() reads @head (acquire), copies the events
+// and drops those which were overwritten while they were copied, so it
+// doesn't stop the threads.
+// Rings are never freed: a ring of an exited worker is given to the next new thread.
+//
+
+typedef struct trace_ring {
+  trace_event_t events[TRACE_RING_EVENTS];
+  uint64_t head;                // number of events which were written
+  uint32_t thread;
+  int used;                     // the thread is alive
+  char name[16];
+  struct trace_ring *next;
+} trace_ring_t;
+
+// the state of a connection (only the event loop uses it)
+typedef struct trace_connection {
+  uint32_t id;
+  uint32_t events;              // mask of recorded events
+} trace_connection_t;
+
+int trace_enabled = FALSE;
+
+static char *trace_path;
+static volatile sig_atomic_t dump_requested;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;
+static uint32_t rings_count;
+static pthread_key_t ring_key;
+static __thread trace_ring_t *thread_ring;
+
+static trace_connection_t *connections;   // indexed by descriptors
+static size_t connections_count;
+static uint32_t last_id;
+
+static void request_dump(int sig) {
+  (void)sig;
+  dump_requested = 1;
+}
+
+// (a thread exits)
+static void release_ring(void *ring) {
+  pthread_mutex_lock(&rings_lock);
+  ((trace_ring_t *)ring)->used = FALSE;
+  pthread_mutex_unlock(&rings_lock);
+}
+
+int trace_init(const char *path) {
+  struct rlimit limit;
+  struct sigaction sa;
+
+  if (!path)
+    return 0;
+
+  trace_path = strdup(path);
+  if (!trace_path)
+    return -1;
+
+  // a descriptor is less than RLIMIT_NOFILE
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+    limit.rlim_cur = 65536;
+  connections_count = limit.rlim_cur;
+  connections = (trace_connection_t *)calloc(connections_count, sizeof(trace_connection_t));
+  if (!connections)
+    goto error;
+
+  if (pthread_key_create(&ring_key, release_ring) != 0)
+    goto error;
+
+  // epoll_wait() is interrupted, then the event loop writes the file
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_dump;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR2, &sa, NULL) < 0)
+    goto error;
+
+  trace_enabled = TRUE;
+  return 0;
+
+error:
+  PRINT("[trace_init]ERROR: cannot start tracing (errno=%d)\n", errno);
+  free(connections);
+  connections = NULL;
+  free(trace_path);
+  trace_path = NULL;
+  return -1;
+}
+
+void trace_set_worker(int worker) {
+  char *path;
+
+  if (!trace_path)
+    return;
+  path = (char *)malloc(strlen(trace_path) + 16);
+  if (!path)
+    return;
+  sprintf(path, "%s.%d", trace_path, worker);
+  free(trace_path);
+  trace_path = path;
+}
+
+// the ring of this thread (a new one or a ring of an exited thread)
+static trace_ring_t *get_thread_ring() {
+  trace_ring_t *ring;
+
+  pthread_mutex_lock(&rings_lock);
+  for (ring = rings; ring; ring = ring->next) {
+    if (!ring->used)
+      break;
+  }
+  if (!ring) {
+    ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+    if (!ring) {
+      pthread_mutex_unlock(&rings_lock);
+      return NULL;
+    }
+    ring->thread = rings_count++;
+    ring->next = rings;
+    rings = ring;
+  }
+  ring->used = TRUE;
+  prctl(PR_GET_NAME, ring->name);
+  pthread_mutex_unlock(&rings_lock);
+
+  pthread_setspecific(ring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+void trace_event(uint32_t id, int type) {
+  trace_ring_t *ring = thread_ring;
+  trace_event_t *e;
+  struct timespec ts;
+  uint64_t head;
+
+  if (!ring && !(ring = get_thread_ring()))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  head = ring->head;
+  e = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+  e->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  e->id = id;
+  e->type = type;
+  e->thread = ring->thread;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_connection_event(int sfd, int type) {
+  trace_connection_t *c;
+
+  if (sfd < 0 || (size_t)sfd >= connections_count)
+    return;
+  c = &connections[sfd];
+
+  if (type == TRACE_ACCEPTED) {
+    c->id = ++last_id;
+    if (c->id == 0)
+      c->id = ++last_id;
+    c->events = 0;
+  } else if (c->id == 0 || (type != TRACE_HEADER_PART && (c->events & (1U << type)))) {
+    return;
+  }
+  c->events |= 1U << type;
+  trace_event(c->id, type);
+
+  if (type == TRACE_CLOSED)
+    c->id = 0;
+}
+
+uint32_t trace_connection_id(int sfd) {
+  if (!trace_enabled || sfd < 0 || (size_t)sfd >= connections_count)
+    return 0;
+  return connections[sfd].id;
+}
+
+void trace_dump_if_requested() {
+  if (!dump_requested)
+    return;
+  dump_requested = 0;
+  trace_dump();
+}
+
+//
+// copy the events of @ring into @buf (TRACE_RING_EVENTS events)
+// return their number
+//
+static uint32_t copy_ring(trace_ring_t *ring, trace_event_t *buf) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+  uint64_t i;
+  uint64_t overwritten;
+
+  for (i = first; i < head; i++)
+    buf[i - first] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+
+  // the thread may have written new events over the oldest ones
+  overwritten = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  overwritten = (overwritten > TRACE_RING_EVENTS) ? overwritten - TRACE_RING_EVENTS : 0;
+  if (overwritten > first) {
+    if (overwritten > head)
+      overwritten = head;
+    memmove(buf, buf + (overwritten - first), (head - overwritten) * sizeof(trace_event_t));
+    first = overwritten;
+  }
+  return (uint32_t)(head - first);
+}
+
+int trace_dump() {
+  trace_file_header_t header;
+  trace_ring_header_t ring_header;
+  trace_event_t *buf = NULL;
+  trace_ring_t *ring;
+  struct timespec ts;
+  char *tmp_path = NULL;
+  FILE *f = NULL;
+
+  if (!trace_enabled)
+    return -1;
+
+  buf = (trace_event_t *)malloc(TRACE_RING_EVENTS * sizeof(trace_event_t));
+  tmp_path = (char *)malloc(strlen(trace_path) + sizeof(".tmp"));
+  if (!buf || !tmp_path)
+    goto error;
+  sprintf(tmp_path, "%s.tmp", trace_path);
+  f = fopen(tmp_path, "w");
+  if (!f)
+    goto error;
+
+  pthread_mutex_lock(&rings_lock);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.rings = rings_count;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  header.monotonic_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  header.realtime_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  fwrite(&header, sizeof(header), 1, f);
+
+  for (ring = rings; ring; ring = ring->next) {
+    memset(&ring_header, 0, sizeof(ring_header));
+    memcpy(ring_header.name, ring->name, sizeof(ring_header.name));
+    ring_header.name[sizeof(ring_header.name) - 1] = '\0';
+    ring_header.thread = ring->thread;
+    ring_header.count = copy_ring(ring, buf);
+    fwrite(&ring_header, sizeof(ring_header), 1, f);
+    fwrite(buf, sizeof(trace_event_t), ring_header.count, f);
+  }
+
+  pthread_mutex_unlock(&rings_lock);
+
+  if (fclose(f) != 0) {
+    f = NULL;
+    goto error;
+  }
+  f = NULL;
+  if (rename(tmp_path, trace_path) < 0)
+    goto error;
+
+#ifdef DEBUG
+  PRINT("[trace_dump]DEBUG: %u rings are written into %s\n", rings_count, trace_path);
+#endif
+  free(tmp_path);
+  free(buf);
+  return 0;
+
+error:
+  PRINT("[trace_dump]ERROR: cannot write %s (errno=%d)\n", trace_path, errno);
+  if (f)
+    fclose(f);
+  if (tmp_path)
+    unlink(tmp_path);
+  free(tmp_path);
+  free(buf);
+  return -1;
+}
@@ -0,0 +1,98 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "setup.h"
+#include <stdint.h>
+
+//
+// Tracing of requests
+//
+// If TRACE <file> is set in config, phases of each request are timestamped
+// (CLOCK_MONOTONIC) into a binary ring buffer of the thread which sees them:
+// the event loop records the lifecycle of connections, io_pool workers record
+// their jobs (opening of files, listing chunks, writing of uploads).
+// A ring keeps the last TRACE_RING_EVENTS events of its thread.
+//
+// kill -USR2 <pid of srv> writes all rings into the file,
+// tools/trace2json.c converts it into Chrome trace JSON (chrome://tracing, Perfetto).
+//
+// Without TRACE a trace point is one check of @trace_enabled.
+//
+
+#define TRACE_RING_EVENTS   65536   // events of one thread (a power of 2)
+
+// events
+#define TRACE_ACCEPTED         0    // accept() of the connection
+#define TRACE_HEADER_PART      1    // a part of the header is received
+#define TRACE_HEADER_COMPLETE  2    // CRLFCRLF is received
+#define TRACE_RESOLVED         3    // the requested file is opened (or not found)
+#define TRACE_FIRST_BYTE       4    // the first byte of the response is sent
+#define TRACE_LAST_BYTE        5    // the response is sent (or the body is received)
+#define TRACE_CLOSED           6    // the connection is closed
+#define TRACE_JOB_BEGIN        7    // (worker) a job of the connection is started
+#define TRACE_JOB_END          8    // (worker) the job is done
+#define TRACE_EVENTS_COUNT     9
+
+#define TRACE_EVENT_NAMES { "accepted", "header part", "header complete", "resolved", \
+                            "first byte", "last byte", "closed", "job begin", "job end" }
+
+//
+// the file:
+//   trace_file_header_t
+//   for each thread: trace_ring_header_t, @count events (the oldest first)
+//
+#define TRACE_MAGIC       "SSSTRACE"
+#define TRACE_VERSION     1
+
+typedef struct trace_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t rings;
+  int64_t monotonic_ns;     // CLOCK_MONOTONIC and CLOCK_REALTIME when the file was written
+  int64_t realtime_ns;
+} trace_file_header_t;
+
+typedef struct trace_ring_header {
+  char name[16];            // name of the thread
+  uint32_t thread;          // (it is used in events)
+  uint32_t count;
+} trace_ring_header_t;
+
+typedef struct trace_event {
+  uint64_t ts;              // CLOCK_MONOTONIC, ns
+  uint32_t id;              // number of the connection (from 1)
+  uint16_t type;            // TRACE_*
+  uint16_t thread;
+} trace_event_t;
+
+extern int trace_enabled;
+
+// @path -- file for trace_dump() (NULL -- tracing is off)
+// return 0 if success, else -1
+int trace_init(const char *path);
+// the file of worker @worker is "<path>.<worker>" (see workers.c)
+void trace_set_worker(int worker);
+
+// (any thread) record event @type of connection @id
+void trace_event(uint32_t id, int type);
+
+// (the event loop) record event @type of the connection on @sfd,
+// a new number is given to the connection on TRACE_ACCEPTED
+// (an event, except TRACE_HEADER_PART, is recorded once for a connection)
+void trace_connection_event(int sfd, int type);
+
+// number of the connection on @sfd (0 if it isn't traced)
+uint32_t trace_connection_id(int sfd);
+
+// (the event loop) write the rings into the file if SIGUSR2 was received
+void trace_dump_if_requested();
+// write the rings into the file (it is replaced)
+// return 0 if success, else -1
+int trace_dump();
+
+#define TRACE_CONNECTION(sfd, type) \
+  do { if (trace_enabled) trace_connection_event((sfd), (type)); } while (0)
+#define TRACE_JOB(id, type) \
+  do { if (trace_enabled) trace_event((id), (type)); } while (0)
+
+#endif // _TRACE_H_
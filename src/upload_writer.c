@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include "upload_writer.h"
+#include "dedup.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#define UPLOAD_DIRECT_ALIGN    4096
+#define UPLOAD_DIRECT_BUFFER   (512 * 1024)      // (a multiple of UPLOAD_DIRECT_ALIGN)
+#define GROUP_COMMIT_WINDOW    1000000L          // ns (1 ms), uploads which finish meanwhile join the batch
+
+// a file which waits for group commit
+typedef struct commit_entry {
+  int fd;
+  int res;
+  int done;
+  struct commit_entry *next;
+} commit_entry_t;
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static commit_entry_t *commit_pending;      // the next batch
+static int committing;                      // a worker syncs a batch
+
+static int write_all(int fd, const char *data, size_t length, long long offset) {
+  size_t done = 0;
+
+  while (done < length) {
+    ssize_t n = pwrite(fd, data + done, length - done, offset + done);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      PRINT("[write_all]ERROR: pwrite (errno=%d)\n", errno);
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// O_DIRECT writes must begin at an aligned offset
+// (a file system may not support it, then the page cache is used)
+static void open_direct(upload_writer_t *w, int dir_fd, const char *name) {
+  if (!srv_settings.upload_direct || w->written % UPLOAD_DIRECT_ALIGN != 0)
+    return;
+  w->direct_fd = openat(dir_fd, name, O_WRONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECT);
+  if (w->direct_fd >= 0 && !w->block &&
+      posix_memalign((void **)&w->block, UPLOAD_DIRECT_ALIGN, UPLOAD_DIRECT_BUFFER) != 0) {
+    close(w->direct_fd);
+    w->direct_fd = -1;
+    w->block = NULL;
+  }
+#ifdef DEBUG
+  if (w->direct_fd < 0)
+    PRINT("[open_direct]O_DIRECT isn't used for %s (errno=%d)\n", name, errno);
+#endif
+}
+
+upload_writer_t *upload_writer_open(int dir_fd, const char *name, int flags, long long offset) {
+  upload_writer_t *w;
+  struct stat st;
+
+  w = (upload_writer_t *)calloc(1, sizeof(upload_writer_t));
+  if (!w)
+    return NULL;
+  w->direct_fd = -1;
+  w->digest_dir = -1;
+  w->detach_dir = -1;
+
+  w->fd = openat(dir_fd, name, O_WRONLY | O_NOFOLLOW | O_CLOEXEC | flags, 0644);
+  if (w->fd < 0)
+    goto error;
+
+  if (offset < 0) {
+    if (fstat(w->fd, &st) < 0)
+      goto error;
+    offset = st.st_size;
+  }
+  w->start = w->written = offset;
+
+  open_direct(w, dir_fd, name);
+  return w;
+
+error:
+  if (w->fd >= 0)
+    close(w->fd);
+  free(w);
+  return NULL;
+}
+
+int upload_writer_digest(upload_writer_t *w, int dir_fd, const char *name) {
+  if (w->written != 0)
+    return -1;
+  w->digest = (content_digest_t *)malloc(sizeof(content_digest_t));
+  w->digest_name = strdup(name);
+  w->digest_dir = dup(dir_fd);
+  if (!w->digest || !w->digest_name || w->digest_dir < 0) {
+    PRINT("[upload_writer_digest]ERROR: digests of %s aren't computed\n", name);
+    if (w->digest_dir >= 0)
+      close(w->digest_dir);
+    free(w->digest);
+    free(w->digest_name);
+    w->digest = NULL;
+    w->digest_name = NULL;
+    w->digest_dir = -1;
+    return -1;
+  }
+  content_digest_init(w->digest);
+  return 0;
+}
+
+int upload_writer_dedup(upload_writer_t *w, int dir_fd, const char *name) {
+  if (w->written == 0) {
+    w->dedup = (w->digest != NULL);
+    return w->dedup ? 0 : -1;
+  }
+  if (!dedup_refers(dir_fd, name, w->fd))
+    return 0;
+  w->detach_name = strdup(name);
+  w->detach_dir = dup(dir_fd);
+  if (!w->detach_name || w->detach_dir < 0) {
+    free(w->detach_name);
+    w->detach_name = NULL;
+    if (w->detach_dir >= 0)
+      close(w->detach_dir);
+    w->detach_dir = -1;
+    return -1;
+  }
+  return 0;
+}
+
+//
+// the file stops referring to the store before it is changed
+// (a hard link of an object is replaced by a copy, which is opened instead)
+// return 0 if success, else -1
+static int detach_file(upload_writer_t *w) {
+  int res = dedup_unshare(w->detach_dir, w->detach_name, w->fd);
+  int fd;
+
+  if (res > 0) {
+    fd = openat(w->detach_dir, w->detach_name, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+      res = -1;
+    } else {
+      close(w->fd);
+      w->fd = fd;
+      if (w->direct_fd >= 0) {
+        close(w->direct_fd);
+        w->direct_fd = -1;
+        open_direct(w, w->detach_dir, w->detach_name);
+      }
+    }
+  }
+  close(w->detach_dir);
+  free(w->detach_name);
+  w->detach_dir = -1;
+  w->detach_name = NULL;
+  return (res < 0) ? -1 : 0;
+}
+
+// write aligned blocks of the buffer with O_DIRECT
+// (the rest of the buffer is moved to its beginning)
+static int write_direct_blocks(upload_writer_t *w) {
+  size_t aligned = w->block_len & ~((size_t)UPLOAD_DIRECT_ALIGN - 1);
+
+  if (aligned == 0)
+    return 0;
+  if (write_all(w->direct_fd, w->block, aligned, w->written) < 0)
+    return -1;
+  w->written += aligned;
+  w->block_len -= aligned;
+  memmove(w->block, w->block + aligned, w->block_len);
+  return 0;
+}
+
+int upload_writer_write(upload_writer_t *w, const char *data, size_t length) {
+  if (w->detach_name && length > 0 && detach_file(w) < 0)
+    return -1;
+  if (w->digest)
+    content_digest_update(w->digest, data, length);
+
+  if (w->direct_fd < 0) {
+    if (write_all(w->fd, data, length, w->written) < 0)
+      return -1;
+    w->written += length;
+    return 0;
+  }
+
+  while (length > 0) {
+    size_t n = UPLOAD_DIRECT_BUFFER - w->block_len;
+
+    if (n > length)
+      n = length;
+    memcpy(w->block + w->block_len, data, n);
+    w->block_len += n;
+    data += n;
+    length -= n;
+
+    if (w->block_len == UPLOAD_DIRECT_BUFFER && write_direct_blocks(w) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int upload_writer_flush(upload_writer_t *w) {
+  if (w->direct_fd < 0 || w->block_len == 0)
+    return 0;
+  if (write_direct_blocks(w) < 0)
+    return -1;
+
+  // the unaligned tail
+  if (write_all(w->fd, w->block, w->block_len, w->written) < 0)
+    return -1;
+  w->written += w->block_len;
+  w->block_len = 0;
+  return 0;
+}
+
+int upload_writer_commit(upload_writer_t *w) {
+  file_digest_t digest;
+
+  if (!w->dedup) {
+    if (upload_writer_flush(w) < 0)
+      return -1;
+    // (the file can be used without digests)
+    if (w->digest && w->digest_dir >= 0)
+      store_file_digest(w->digest, w->fd, w->digest_dir, w->digest_name);
+    return upload_sync(w->fd);
+  }
+
+  // the store has the content: the written data is dropped with the replaced file
+  // (the buffer of O_DIRECT isn't written, nothing is synced)
+  content_digest_final(w->digest, &digest);
+  if (dedup_link(w->digest_dir, w->digest_name, w->written + w->block_len, &digest) > 0) {
+    w->block_len = 0;
+    return 0;
+  }
+
+  if (upload_writer_flush(w) < 0)
+    return -1;
+  save_file_digest(&digest, w->fd, w->digest_dir, w->digest_name);
+  if (upload_sync(w->fd) < 0)
+    return -1;
+  dedup_store(w->digest_dir, w->digest_name, w->fd, &digest);
+  return 0;
+}
+
+void upload_writer_close(upload_writer_t *w) {
+  if (!w)
+    return;
+  if (w->direct_fd >= 0)
+    close(w->direct_fd);
+  close(w->fd);
+  if (w->digest_dir >= 0)
+    close(w->digest_dir);
+  if (w->detach_dir >= 0)
+    close(w->detach_dir);
+  free(w->detach_name);
+  free(w->digest_name);
+  free(w->digest);
+  free(w->block);
+  free(w);
+}
+
+int upload_preallocate(int fd, long long offset, long long length) {
+  if (length <= 0)
+    return 0;
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) < 0) {
+    if (errno == EOPNOTSUPP || errno == ENOSYS)
+      return 0;
+    PRINT("[upload_preallocate]ERROR: fallocate %lld bytes (errno=%d)\n", length, errno);
+    return -1;
+  }
+  return 0;
+}
+
+//
+// sync @fd with files of other workers
+// the first worker waits GROUP_COMMIT_WINDOW for others, then starts writeback
+// of all files of the batch at once and waits for each of them;
+// others wait until their files are synced (or become the next leader)
+static int group_commit(int fd) {
+  commit_entry_t e;
+  commit_entry_t *batch, *p, *next;
+  int count = 0;
+  struct timespec window = {0, GROUP_COMMIT_WINDOW};
+
+  e.fd = fd;
+  e.res = 0;
+  e.done = FALSE;
+
+  pthread_mutex_lock(&commit_lock);
+  e.next = commit_pending;
+  commit_pending = &e;
+
+  while (!e.done) {
+    if (committing) {
+      pthread_cond_wait(&commit_cond, &commit_lock);
+      continue;
+    }
+
+    // this worker syncs the next batch
+    committing = TRUE;
+    pthread_mutex_unlock(&commit_lock);
+    nanosleep(&window, NULL);
+    pthread_mutex_lock(&commit_lock);
+    batch = commit_pending;
+    commit_pending = NULL;
+    pthread_mutex_unlock(&commit_lock);
+
+    for (p = batch; p; p = p->next)
+      sync_file_range(p->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    for (p = batch; p; p = p->next) {
+      p->res = fdatasync(p->fd);
+      if (p->res < 0)
+        PRINT("[group_commit]ERROR: fdatasync (errno=%d)\n", errno);
+      count++;
+    }
+#ifdef DEBUG
+    PRINT("[group_commit]DEBUG: %d files are synced\n", count);
+#endif
+
+    pthread_mutex_lock(&commit_lock);
+    for (p = batch; p; p = next) {
+      // (@p is on the stack of its worker, it may return as soon as it is done)
+      next = p->next;
+      p->done = TRUE;
+    }
+    committing = FALSE;
+    pthread_cond_broadcast(&commit_cond);
+  }
+  pthread_mutex_unlock(&commit_lock);
+  return e.res;
+}
+
+int upload_sync(int fd) {
+  switch (srv_settings.upload_fsync) {
+    case UPLOAD_FSYNC_CLOSE :
+      if (fdatasync(fd) < 0) {
+        PRINT("[upload_sync]ERROR: fdatasync (errno=%d)\n", errno);
+        return -1;
+      }
+      return 0;
+    case UPLOAD_FSYNC_GROUP :
+      return group_commit(fd);
+  }
+  return 0;
+}
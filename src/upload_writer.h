@@ -0,0 +1,87 @@
+#ifndef _UPLOAD_WRITER_H_
+#define _UPLOAD_WRITER_H_
+
+#include "setup.h"
+#include "digest.h"
+
+//
+// Writer of uploaded files
+//
+// Data is written with pwrite() at the position of the writer (a file is written
+// by one connection sequentially, a segment of PUT too). If UPLOAD_O_DIRECT is on,
+// the data is collected into an aligned buffer and written with O_DIRECT by big blocks,
+// so huge uploads don't evict hot files from the page cache; the unaligned tail
+// is written through the page cache when the body ends.
+//
+// The data is made durable according to UPLOAD_FSYNC (see upload_sync()):
+//   none  -- the kernel writes it back when it wants;
+//   close -- fdatasync() when the upload is finished;
+//   group -- finished uploads are synced by batches (group commit),
+//            one worker syncs files of all workers which wait for it.
+// The reply to a client is sent after its file is synced.
+//
+// CRC32C and SHA-256 of a file, which is written from its beginning by one writer,
+// are computed while it is written and saved on commit (see digest.c).
+// With DEDUP on, a new file of POST is looked up by them in the store on commit,
+// and a file, which is appended to, leaves the store first (see dedup.c).
+//
+
+#define UPLOAD_FSYNC_NONE   0
+#define UPLOAD_FSYNC_CLOSE  1
+#define UPLOAD_FSYNC_GROUP  2
+
+typedef struct upload_writer {
+  int fd;
+  int direct_fd;          // O_DIRECT descriptor of the same file (-1 if it isn't used)
+  long long start;        // the offset of the first byte (see upload_writer_open())
+  long long written;      // the next byte is written at this offset of the file
+  char *block;            // data which waits for O_DIRECT write (it follows @written)
+  size_t block_len;
+  content_digest_t *digest;   // NULL if digests aren't computed
+  int digest_dir;             // where the file is (for the sidecar of its digests)
+  char *digest_name;
+  int dedup;                  // the file is shared with the store on commit (it has digests)
+  int detach_dir;             // the file leaves the store before the first write (-1 -- it doesn't)
+  char *detach_name;
+} upload_writer_t;
+
+// open file @name in directory @dir_fd (@flags are added to O_WRONLY)
+// for writing at @offset (-1 -- at the end of the file)
+// return the writer or NULL (errno is set)
+upload_writer_t *upload_writer_open(int dir_fd, const char *name, int flags, long long offset);
+
+// compute digests of the data, the file is called @name in directory @dir_fd
+// (the writer must be at the beginning of the file)
+// return 0 if success, else -1
+int upload_writer_digest(upload_writer_t *w, int dir_fd, const char *name);
+
+// the file is deduplicated by the store (see dedup.h):
+// a new file (with digests) is shared with the store on commit,
+// a file, which is appended to, stops referring to the store before the first write
+// (if it refers to it, then @w->detach_name is set)
+// return 0 if success, else -1
+int upload_writer_dedup(upload_writer_t *w, int dir_fd, const char *name);
+
+// (in a worker thread)
+// return 0 if success, else -1
+int upload_writer_write(upload_writer_t *w, const char *data, size_t length);
+// write the data which is kept in the buffer of O_DIRECT
+int upload_writer_flush(upload_writer_t *w);
+// flush the writer, save digests of the file and sync it (according to UPLOAD_FSYNC)
+// (a file, which the store has already, isn't flushed or synced: it becomes a copy of the object)
+int upload_writer_commit(upload_writer_t *w);
+
+// (the data which isn't flushed is lost)
+void upload_writer_close(upload_writer_t *w);
+
+// reserve @length bytes of the file from @offset (the size of the file isn't changed),
+// so the file isn't fragmented and there is no ENOSPC in the middle of an upload
+// return 0 if success (or the file system doesn't support it), else -1
+int upload_preallocate(int fd, long long offset, long long length);
+
+// (in a worker thread)
+// sync @fd according to UPLOAD_FSYNC
+// return 0 if success, else -1
+int upload_sync(int fd);
+
+#endif // _UPLOAD_WRITER_H_
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include "workers.h"
+#include "io_pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL  4       // (numaif.h) allocate on the node of the current core
+#endif
+
+#define CGROUP_PATH_LENGTH   512
+
+static int workers_count = 1;       // (see worker_share())
+
+// see io_pool.c
+extern void io_pool_set_affinity(const cpu_set_t *cpus);
+
+//
+// read a number "quota period" of @path (cpu.max of cgroup v2 or one number of v1)
+// return quota / period (cores) or 0 if there is no limit
+//
+static double read_cpu_quota(const char *path, const char *period_path) {
+  char quota[32];
+  long long period = 0;
+  FILE *f;
+  int res;
+
+  f = fopen(path, "r");
+  if (!f)
+    return 0;
+  res = fscanf(f, "%31s %lld", quota, &period);
+  fclose(f);
+  if (res < 1 || !strcmp(quota, "max") || atoll(quota) <= 0)
+    return 0;
+
+  // (cgroup v1 keeps the period in another file)
+  if (period_path && (f = fopen(period_path, "r")) != NULL) {
+    if (fscanf(f, "%lld", &period) != 1)
+      period = 0;
+    fclose(f);
+  }
+  if (period <= 0)
+    return 0;
+  return (double)atoll(quota) / period;
+}
+
+// the least quota of the cgroup of the server and of its parents (0 -- no limit)
+static double cgroup_cpu_quota() {
+  char line[CGROUP_PATH_LENGTH];
+  char path[CGROUP_PATH_LENGTH + 64];
+  char period_path[CGROUP_PATH_LENGTH + 64];
+  char *group = NULL, *slash;
+  double quota, min_quota = 0;
+  int v1 = FALSE;
+  FILE *f;
+
+  f = fopen("/proc/self/cgroup", "r");
+  if (!f)
+    return 0;
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!strncmp(line, "0::", 3)) {
+      group = strdup(line + 3);
+      break;
+    }
+    // "N:cpu,cpuacct:/path" of cgroup v1
+    if (strstr(line, ":cpu,") || strstr(line, ":cpu:")) {
+      group = strdup(strrchr(line, ':') + 1);
+      v1 = TRUE;
+      break;
+    }
+  }
+  fclose(f);
+  if (!group)
+    return 0;
+
+  // from the group up to the root
+  while (1) {
+    if (v1) {
+      snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_quota_us", group);
+      snprintf(period_path, sizeof(period_path), "/sys/fs/cgroup/cpu%s/cpu.cfs_period_us", group);
+      quota = read_cpu_quota(path, period_path);
+    } else {
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", group);
+      quota = read_cpu_quota(path, NULL);
+    }
+    if (quota > 0 && (min_quota == 0 || quota < min_quota))
+      min_quota = quota;
+
+    slash = strrchr(group, '/');
+    if (!slash || (slash == group && group[1] == '\0'))
+      break;
+    // "/a/b" -> "/a", "/a" -> "/"
+    if (slash == group)
+      slash[1] = '\0';
+    else
+      *slash = '\0';
+  }
+  free(group);
+  return min_quota;
+}
+
+int default_workers_count() {
+  cpu_set_t allowed;
+  double quota;
+  int count;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+  else
+    count = CPU_COUNT(&allowed);
+
+  // a quota of 1.5 cores is 2 workers
+  quota = cgroup_cpu_quota();
+  if (quota > 0 && quota < count)
+    count = (int)quota + ((quota > (int)quota) ? 1 : 0);
+
+  if (count < 1)
+    count = 1;
+  if (count > WORKERS_MAX)
+    count = WORKERS_MAX;
+  return count;
+}
+
+int parse_cpu_list(const char *list, int *cpus, int max) {
+  cpu_set_t allowed;
+  int count = 0;
+  int first, last, cpu;
+  char *end;
+
+  if (!strcmp(list, "auto")) {
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+      return -1;
+    for (cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+      if (CPU_ISSET(cpu, &allowed))
+        cpus[count++] = cpu;
+    }
+    return count;
+  }
+
+  // "0-3,8"
+  while (*list) {
+    first = last = strtol(list, &end, 10);
+    if (end == list || first < 0)
+      return -1;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list || last < first)
+        return -1;
+    }
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return -1;
+    list = end;
+
+    for (cpu = first; cpu <= last && count < max; cpu++) {
+      if (cpu >= CPU_SETSIZE)
+        return -1;
+      cpus[count++] = cpu;
+    }
+  }
+  return count ? count : -1;
+}
+
+//
+// cores of the NUMA node of @cpu (which the server may use) into @node_cpus
+// return 0 if success, else -1 (there is no information about nodes)
+//
+static int get_node_cpus(int cpu, cpu_set_t *node_cpus) {
+  char path[128];
+  char list[4096];
+  int cpus[CPU_SETSIZE];
+  cpu_set_t allowed;
+  struct dirent *entry;
+  DIR *dir;
+  FILE *f;
+  int node = -1;
+  int count, i;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  dir = opendir(path);
+  if (!dir)
+    return -1;
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1)
+      break;
+  }
+  closedir(dir);
+  if (node < 0)
+    return -1;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  f = fopen(path, "r");
+  if (!f)
+    return -1;
+  if (!fgets(list, sizeof(list), f)) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  list[strcspn(list, "\n")] = '\0';
+
+  count = parse_cpu_list(list, cpus, CPU_SETSIZE);
+  if (count < 0 || sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return -1;
+  CPU_ZERO(node_cpus);
+  for (i = 0; i < count; i++) {
+    if (CPU_ISSET(cpus[i], &allowed))
+      CPU_SET(cpus[i], node_cpus);
+  }
+  return CPU_COUNT(node_cpus) ? 0 : -1;
+}
+
+//
+// pin the worker (this process) to @cpu, its memory is allocated on the node of the core
+// and its io threads run on the cores of the node
+//
+static void place_worker(int worker, int cpu) {
+  cpu_set_t cpus;
+
+  // (io threads are started later, see io_pool_set_affinity())
+  if (get_node_cpus(cpu, &cpus) == 0) {
+    // (they don't take the core of the event loop if the node has others)
+    if (CPU_COUNT(&cpus) > 1)
+      CPU_CLR(cpu, &cpus);
+    io_pool_set_affinity(&cpus);
+  }
+
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+    PRINT("[place_worker]ERROR: worker %d cannot be pinned to cpu %d (errno=%d)\n", worker, cpu, errno);
+
+  // (a policy which was inherited, numactl --interleave for example, is replaced)
+  if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0) {
+#ifdef DEBUG
+    PRINT("[place_worker]DEBUG: set_mempolicy (errno=%d)\n", errno);
+#endif
+  }
+}
+
+//
+// a connection goes to the socket of the worker which is pinned to the core
+// that received it: socket @i of the group (the order of listen()) -- worker @i
+// (cores of other workers are spread by the remainder)
+//
+static int attach_steering(int sfd, int count, const int *cpus, int cpus_count) {
+  struct sock_filter code[2 * WORKERS_MAX + 3];
+  struct sock_fprog prog;
+  int i, n = 0;
+
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+  for (i = 0; i < count; i++) {
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i % cpus_count], 0, 1);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+  }
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+  prog.len = n;
+  prog.filter = code;
+  return setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+static pid_t start_worker(int worker, int *sfds, int count, const int *cpus, int cpus_count,
+                          void (*serve)(int worker, int listen_sfd)) {
+  pid_t pid;
+  int i;
+
+  // (the child would write the buffered log again)
+  fflush(LOG_STREAM);
+  pid = fork();
+  if (pid != 0)
+    return pid;
+
+  // the worker
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  for (i = 0; i < count; i++) {
+    if (i != worker)
+      close(sfds[i]);
+  }
+  if (cpus_count > 0)
+    place_worker(worker, cpus[worker % cpus_count]);
+  // (they are allocated on the node of the worker now)
+  if (reload_server_tables() < 0)
+    PRINT("[start_worker]ERROR: worker %d keeps tables of the first process\n", worker);
+
+  serve(worker, sfds[worker]);
+  deinit_server();
+  exit(EXIT_SUCCESS);
+}
+
+//
+// worker @i, which failed after the last @delay, is started again in a longer delay
+// return the new delay (seconds)
+//
+static int schedule_restart(int i, time_t *restart_at, int delay) {
+  delay = (delay > 0) ? 2 * delay : 1;
+  if (delay > WORKER_RESTART_DELAY_MAX)
+    delay = WORKER_RESTART_DELAY_MAX;
+  restart_at[i] = time(NULL) + delay;
+  PRINT("[run_workers]worker %d is restarted in %d s\n", i, delay);
+  return delay;
+}
+
+void run_workers(int count, const int *cpus, int cpus_count,
+                 void (*serve)(int worker, int listen_sfd)) {
+  int sfds[WORKERS_MAX];
+  pid_t pids[WORKERS_MAX];
+  time_t started[WORKERS_MAX];
+  time_t restart_at[WORKERS_MAX];   // time of a restart (0 if the worker runs)
+  int delays[WORKERS_MAX];          // the last delay of a restart (0 -- none)
+  int running = 0, waiting = 0;
+  int status, cpu, i;
+  time_t now;
+  pid_t pid;
+
+  if (count <= 0)
+    return;
+  // (workers inherit it)
+  workers_count = count;
+
+  // the group of listening sockets, in the order of workers
+  for (i = 0; i < count; i++) {
+    sfds[i] = create_and_bind_listen_socket(PORT, TRUE);
+    if (cpus_count > 0) {
+      cpu = cpus[i % cpus_count];
+      setsockopt(sfds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+    if (listen(sfds[i], srv_settings.listen_backlog) < 0) {
+      PRINT("[run_workers]ERROR: listen (errno=%d)\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  // (without pinning, or with more workers than cores, the kernel spreads connections)
+  if (cpus_count >= count && attach_steering(sfds[0], count, cpus, cpus_count) < 0)
+    PRINT("[run_workers]ERROR: connections aren't steered to cores (errno=%d)\n", errno);
+
+  for (i = 0; i < count; i++) {
+    pids[i] = start_worker(i, sfds, count, cpus, cpus_count, serve);
+    started[i] = time(NULL);
+    restart_at[i] = 0;
+    delays[i] = 0;
+    if (pids[i] > 0) {
+      running++;
+    } else {
+      delays[i] = schedule_restart(i, restart_at, 0);
+      waiting++;
+    }
+    PRINT("[run_workers]worker %d: pid %d, cpu %d\n", i, pids[i],
+          cpus_count > 0 ? cpus[i % cpus_count] : -1);
+  }
+
+  // a worker is always started again: its socket stays in the group and the steering
+  // keeps giving it connections, they wait in its backlog until it is restarted
+  // (a worker which fails soon after its start is restarted with a growing delay)
+  while (running > 0 || waiting > 0) {
+    pid = waitpid(-1, &status, (waiting > 0) ? WNOHANG : 0);
+    if (pid < 0 && errno != EINTR && errno != ECHILD)
+      break;
+    if (pid > 0) {
+      for (i = 0; i < count && pids[i] != pid; i++)
+        ;
+      if (i == count)
+        continue;
+      running--;
+      PRINT("[run_workers]worker %d (pid %d) has exited (status %d)\n", i, pid, status);
+      if (time(NULL) - started[i] < WORKER_RESTART_AFTER) {
+        delays[i] = schedule_restart(i, restart_at, delays[i]);
+      } else {
+        // (it is started again at once)
+        delays[i] = 0;
+        restart_at[i] = time(NULL);
+      }
+      waiting++;
+    } else if (waiting > 0) {
+      sleep(1);
+    }
+
+    now = time(NULL);
+    for (i = 0; i < count; i++) {
+      if (restart_at[i] == 0 || restart_at[i] > now)
+        continue;
+      restart_at[i] = 0;
+      waiting--;
+      pids[i] = start_worker(i, sfds, count, cpus, cpus_count, serve);
+      started[i] = now;
+      if (pids[i] > 0) {
+        running++;
+      } else {
+        PRINT("[run_workers]ERROR: fork of worker %d (errno=%d)\n", i, errno);
+        delays[i] = schedule_restart(i, restart_at, delays[i]);
+        waiting++;
+      }
+    }
+  }
+
+  for (i = 0; i < count; i++)
+    close(sfds[i]);
+}
+
+long long worker_share(long long limit) {
+  if (limit <= 0)
+    return limit;
+  // (a worker gets 1 at least)
+  return (limit / workers_count > 0) ? limit / workers_count : 1;
+}
@@ -0,0 +1,51 @@
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include "setup.h"
+
+//
+// Workers on cores
+//
+// With WORKERS > 1 (or CPU_AFFINITY) the server is a group of processes.
+// Each worker has its own event loop, io threads and caches (the index of
+// WWWROOT, tables of mime types and icons, the cache of directories), which it
+// allocates after it is placed on its core, so they are on its NUMA node and
+// no cache line is shared with other workers.
+//
+// Every worker listens on its own socket of a SO_REUSEPORT group. If workers
+// are pinned, a classic BPF program of the group gives a connection to the
+// worker of the core which received it (SO_INCOMING_CPU is set too),
+// so a connection stays on one core from the NIC queue to the response.
+// Io threads of a worker run on the cores of its node.
+//
+// The first process waits for the workers and starts again a worker which
+// exited (with a growing delay if it fails at once); workers exit with it.
+//
+// Workers share no memory: limits of the server are split between them (see
+// worker_share()), segmented uploads meet in their map files (see put_request.c).
+//
+
+#define WORKERS_MAX           1024
+#define WORKER_RESTART_AFTER      1    // seconds, a worker which fails earlier is restarted with a delay
+#define WORKER_RESTART_DELAY_MAX  30   // seconds, the delay doubles after each such failure
+
+// number of cores which the server may use: its affinity mask and the quota
+// of its cgroup (cpu.max, cpu.cfs_quota_us) are respected
+int default_workers_count();
+
+// cores of CPU_AFFINITY ("auto" -- the cores of the affinity mask in order,
+// or a list "0-3,8") into @cpus (up to @max)
+// return number of cores or -1 if @list is wrong
+int parse_cpu_list(const char *list, int *cpus, int max);
+
+// start @count workers, each one calls @serve(@worker, listening socket)
+// (workers of @cpus_count cores @cpus are pinned to them in turn, if @cpus_count > 0)
+// return when all workers have exited
+void run_workers(int count, const int *cpus, int cpus_count,
+                 void (*serve)(int worker, int listen_sfd));
+
+// the part of a limit of the whole server (SEND_RATE, MAX_CONNECTIONS, MEMORY_WATERMARK),
+// which each worker enforces: @limit / number of workers (0 -- no limit, it stays 0)
+long long worker_share(long long limit);
+
+#endif // _WORKERS_H_
@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+#include "wwwroot_index.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+
+//
+// The tree (see wwwroot_index.h)
+//
+// Children of a directory are kept in an array sorted by name (binary search,
+// listings go in name order). The index thread is the only writer: it takes
+// the write lock only to link or unlink nodes, stat() and scanning of new
+// directories are done before that. Requests take the read lock.
+//
+// An inotify event doesn't describe the change itself: the entry is stat()ed
+// again, so events may be handled in any order and a repeated one changes nothing.
+// If the queue of events overflows, the tree is built again.
+//
+// The kernel queues an event before the syscall, which caused it, returns.
+// So if the queue is empty and the thread isn't applying events,
+// the tree has all changes which were made before the lookup
+// (e.g. an upload which was just finished).
+//
+
+#define INDEX_WATCH_MASK  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                           IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_EXCL_UNLINK)
+#define INDEX_EVENTS_SIZE (64 * 1024)   // buffer for read() of inotify events
+
+typedef struct index_dir {
+  struct index_node **children;   // sorted by name
+  size_t count;
+  size_t cap;
+  int wd;                         // inotify watch (-1 if the directory isn't watched)
+} index_dir_t;
+
+typedef struct index_node {
+  struct index_node *parent;
+  index_dir_t *dir;               // (directories only)
+  long long size;
+  long long mtime;
+  const char *mime;
+  const char *icon;
+  unsigned char type;
+  char name[];
+} index_node_t;
+
+// see mime_table.c
+extern const char *lookup_mime_type(const char *extension);
+
+// see get_icon_path_from_db.c
+extern const char *lookup_icon_path(const char *filename, unsigned char type);
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static index_node_t *root;        // NULL while the tree is being built
+static int applying;              // the thread is applying events (see settled())
+
+static pthread_t index_thread;
+static int index_started = FALSE;
+static int inotify_fd = -1;
+static int stop_fd = -1;
+
+// watch descriptor -> directory (only the index thread uses it)
+static index_node_t **watches;
+static size_t watches_cap;
+
+static unsigned char mode_to_type(mode_t mode) {
+  if (S_ISDIR(mode))
+    return DT_DIR;
+  if (S_ISREG(mode))
+    return DT_REG;
+  if (S_ISLNK(mode))
+    return DT_LNK;
+  return DT_UNKNOWN;
+}
+
+static void set_stats(index_node_t *node, struct stat *st) {
+  node->size = st->st_size;
+  node->mtime = st->st_mtime;
+}
+
+static index_node_t *new_node(const char *name, struct stat *st) {
+  size_t name_len = strlen(name);
+  index_node_t *node;
+  const char *dot;
+
+  if (name_len >= INDEX_NAME_LENGTH)
+    return NULL;
+  node = (index_node_t *)calloc(1, sizeof(index_node_t) + name_len + 1);
+  if (!node)
+    return NULL;
+  memcpy(node->name, name, name_len + 1);
+  node->type = mode_to_type(st->st_mode);
+  set_stats(node, st);
+
+  if (node->type == DT_DIR) {
+    node->dir = (index_dir_t *)calloc(1, sizeof(index_dir_t));
+    if (!node->dir) {
+      free(node);
+      return NULL;
+    }
+    node->dir->wd = -1;
+  }
+
+  // the same mime type and icon as html_generation_for_dir.c gives
+  if (node->type == DT_REG && (dot = strrchr(name, '.')) != NULL && dot != name)
+    node->mime = lookup_mime_type(dot + 1);
+  node->icon = lookup_icon_path(name, node->type);
+  return node;
+}
+
+// (only the index thread calls it, @node isn't in the tree)
+static void free_subtree(index_node_t *node) {
+  size_t i;
+
+  if (node->dir) {
+    for (i = 0; i < node->dir->count; i++)
+      free_subtree(node->dir->children[i]);
+    if (node->dir->wd >= 0) {
+      inotify_rm_watch(inotify_fd, node->dir->wd);
+      watches[node->dir->wd] = NULL;
+    }
+    free(node->dir->children);
+    free(node->dir);
+  }
+  free(node);
+}
+
+static int compare_nodes(const void *a, const void *b) {
+  return strcmp((*(index_node_t * const *)a)->name, (*(index_node_t * const *)b)->name);
+}
+
+//
+// binary search of @name in @dir
+// return the position of the child or of the first child after @name,
+// @found is TRUE if the child exists
+//
+static size_t find_child(index_dir_t *dir, const char *name, int *found) {
+  size_t low = 0;
+  size_t high = dir->count;
+  size_t mid;
+  int res;
+
+  *found = FALSE;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    res = strcmp(dir->children[mid]->name, name);
+    if (res == 0) {
+      *found = TRUE;
+      return mid;
+    }
+    if (res < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+static int reserve_child(index_dir_t *dir) {
+  index_node_t **children;
+  size_t cap;
+
+  if (dir->count < dir->cap)
+    return 0;
+  cap = dir->cap ? dir->cap * 2 : 8;
+  children = (index_node_t **)realloc(dir->children, cap * sizeof(index_node_t *));
+  if (!children)
+    return -1;
+  dir->children = children;
+  dir->cap = cap;
+  return 0;
+}
+
+// watch directory @node, which is opened as @dir_fd
+static void watch_dir(index_node_t *node, int dir_fd) {
+  char path[64];
+  index_node_t **new_watches;
+  size_t cap;
+  int wd;
+
+  // the descriptor is given by its path in /proc, so the name of the directory isn't needed
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", dir_fd);
+  wd = inotify_add_watch(inotify_fd, path, INDEX_WATCH_MASK);
+  if (wd < 0) {
+    PRINT("[watch_dir]ERROR: cannot watch %s (errno=%d), it is looked up on disk\n", node->name, errno);
+    return;
+  }
+
+  if ((size_t)wd >= watches_cap) {
+    for (cap = watches_cap ? watches_cap : 1024; cap <= (size_t)wd; cap *= 2)
+      ;
+    new_watches = (index_node_t **)realloc(watches, cap * sizeof(index_node_t *));
+    if (!new_watches) {
+      inotify_rm_watch(inotify_fd, wd);
+      return;
+    }
+    memset(new_watches + watches_cap, 0, (cap - watches_cap) * sizeof(index_node_t *));
+    watches = new_watches;
+    watches_cap = cap;
+  }
+  watches[wd] = node;
+  node->dir->wd = wd;
+}
+
+//
+// read directory @node (opened as @dir_fd, this function closes it) and its subdirectories
+// (@node isn't in the tree yet)
+//
+static void scan_dir(index_node_t *node, int dir_fd) {
+  struct dirent *d;
+  struct stat st;
+  index_node_t *child;
+  DIR *dir;
+  int fd;
+
+  // the watch is added before the directory is read, so no change is lost
+  watch_dir(node, dir_fd);
+
+  dir = fdopendir(dir_fd);
+  if (!dir) {
+    close(dir_fd);
+    return;
+  }
+
+  while ((d = readdir(dir)) != NULL) {
+    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+      continue;
+    if (fstatat(dir_fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      continue;
+    if (reserve_child(node->dir) < 0 || (child = new_node(d->d_name, &st)) == NULL) {
+      // the directory isn't complete, so it is looked up on disk
+      PRINT("[scan_dir]ERROR: out of memory for %s\n", d->d_name);
+      if (node->dir->wd >= 0) {
+        inotify_rm_watch(inotify_fd, node->dir->wd);
+        watches[node->dir->wd] = NULL;
+        node->dir->wd = -1;
+      }
+      break;
+    }
+    child->parent = node;
+    node->dir->children[node->dir->count++] = child;
+
+    if (child->dir) {
+      fd = openat(dir_fd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd >= 0)
+        scan_dir(child, fd);
+    }
+  }
+  closedir(dir);
+
+  qsort(node->dir->children, node->dir->count, sizeof(index_node_t *), compare_nodes);
+}
+
+// path of @node relative to WWWROOT ("." for the root)
+static void node_path(index_node_t *node, char *path, size_t max) {
+  size_t len;
+
+  if (!node->parent) {
+    snprintf(path, max, ".");
+    return;
+  }
+  node_path(node->parent, path, max);
+  len = strlen(path);
+  if (!strcmp(path, "."))
+    len = 0;
+  snprintf(path + len, max - len, "%s%s", len ? "/" : "", node->name);
+}
+
+static void build_tree() {
+  index_node_t *new_root;
+  struct stat st;
+  int fd;
+
+  fd = openat(srv_settings.wwwroot_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0 || (new_root = new_node("", &st)) == NULL) {
+    PRINT("[build_tree]ERROR: cannot read %s (errno=%d)\n", WWWROOT, errno);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  scan_dir(new_root, fd);
+
+  pthread_rwlock_wrlock(&index_lock);
+  root = new_root;
+  pthread_rwlock_unlock(&index_lock);
+
+#ifdef DEBUG
+  PRINT("[build_tree]DEBUG: %s is indexed\n", WWWROOT);
+#endif
+}
+
+// the queue of events overflowed: build the tree again
+static void rebuild_tree() {
+  index_node_t *old;
+
+  pthread_rwlock_wrlock(&index_lock);
+  old = root;
+  root = NULL;
+  pthread_rwlock_unlock(&index_lock);
+
+  if (old)
+    free_subtree(old);
+  build_tree();
+}
+
+//
+// entry @name of directory @parent was changed: stat it again
+//
+static void update_entry(index_node_t *parent, const char *name) {
+  char path[PATH_MAX];
+  struct stat st;
+  index_node_t *old = NULL;
+  index_node_t *node = NULL;
+  size_t pos;
+  int found;
+  int exists;
+  int fd;
+
+  node_path(parent, path, sizeof(path));
+  if (strlen(path) + strlen(name) + 2 > sizeof(path))
+    return;
+  strcat(path, "/");
+  strcat(path, name);
+  exists = (fstatat(srv_settings.wwwroot_fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0);
+
+  pthread_rwlock_wrlock(&index_lock);
+  pos = find_child(parent->dir, name, &found);
+  if (found && exists && parent->dir->children[pos]->type == mode_to_type(st.st_mode)) {
+    // the same entry is changed
+    set_stats(parent->dir->children[pos], &st);
+    pthread_rwlock_unlock(&index_lock);
+    return;
+  }
+  if (found) {
+    old = parent->dir->children[pos];
+    memmove(parent->dir->children + pos, parent->dir->children + pos + 1,
+            (parent->dir->count - pos - 1) * sizeof(index_node_t *));
+    parent->dir->count--;
+  }
+  pthread_rwlock_unlock(&index_lock);
+
+  if (old)
+    free_subtree(old);
+  if (!exists || (node = new_node(name, &st)) == NULL)
+    return;
+
+  node->parent = parent;
+  if (node->dir) {
+    // a new directory (or a moved one) is read before it is linked
+    fd = openat(srv_settings.wwwroot_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0)
+      scan_dir(node, fd);
+  }
+
+  pthread_rwlock_wrlock(&index_lock);
+  if (reserve_child(parent->dir) < 0) {
+    pthread_rwlock_unlock(&index_lock);
+    free_subtree(node);
+    return;
+  }
+  pos = find_child(parent->dir, name, &found);
+  memmove(parent->dir->children + pos + 1, parent->dir->children + pos,
+          (parent->dir->count - pos) * sizeof(index_node_t *));
+  parent->dir->children[pos] = node;
+  parent->dir->count++;
+  pthread_rwlock_unlock(&index_lock);
+}
+
+static void apply_event(struct inotify_event *e) {
+  index_node_t *node;
+
+  if (e->mask & IN_Q_OVERFLOW) {
+    PRINT("[apply_event]ERROR: inotify queue overflow, %s is indexed again\n", WWWROOT);
+    rebuild_tree();
+    return;
+  }
+  if (e->wd < 0 || (size_t)e->wd >= watches_cap || (node = watches[e->wd]) == NULL)
+    return;
+
+  if (e->mask & IN_IGNORED) {
+    // the directory was removed (its entry is removed by the event of its parent)
+    pthread_rwlock_wrlock(&index_lock);
+    node->dir->wd = -1;
+    pthread_rwlock_unlock(&index_lock);
+    watches[e->wd] = NULL;
+    return;
+  }
+  if (e->len > 0 && e->name[0] != '\0')
+    update_entry(node, e->name);
+}
+
+static void *index_thread_main(void *arg) {
+  struct pollfd fds[2];
+  char *buf;
+  ssize_t n;
+  char *p;
+
+  (void)arg;
+  buf = (char *)malloc(INDEX_EVENTS_SIZE);
+  if (!buf)
+    return NULL;
+
+  build_tree();
+
+  fds[0].fd = inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = stop_fd;
+  fds[1].events = POLLIN;
+  while (1) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents)
+      break;
+
+    // (see settled())
+    __atomic_store_n(&applying, TRUE, __ATOMIC_SEQ_CST);
+    n = read(inotify_fd, buf, INDEX_EVENTS_SIZE);
+    for (p = buf; n > 0 && p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+      apply_event((struct inotify_event *)p);
+    __atomic_store_n(&applying, FALSE, __ATOMIC_SEQ_CST);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+int wwwroot_index_start() {
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    PRINT("[wwwroot_index_start]ERROR: inotify_init1 (errno=%d)\n", errno);
+    return -1;
+  }
+  stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd < 0)
+    goto error;
+
+  if (pthread_create(&index_thread, NULL, index_thread_main, NULL) != 0)
+    goto error;
+  index_started = TRUE;
+  return 0;
+
+error:
+  PRINT("[wwwroot_index_start]ERROR: cannot start the index thread\n");
+  close(inotify_fd);
+  inotify_fd = -1;
+  if (stop_fd >= 0)
+    close(stop_fd);
+  stop_fd = -1;
+  return -1;
+}
+
+void wwwroot_index_stop() {
+  uint64_t one = 1;
+
+  if (!index_started)
+    return;
+  if (write(stop_fd, &one, sizeof(one)) < 0)
+    PRINT("[wwwroot_index_stop]ERROR: write to eventfd (errno=%d)\n", errno);
+  pthread_join(index_thread, NULL);
+  index_started = FALSE;
+
+  if (root)
+    free_subtree(root);
+  root = NULL;
+  free(watches);
+  watches = NULL;
+  watches_cap = 0;
+  close(inotify_fd);
+  close(stop_fd);
+  inotify_fd = stop_fd = -1;
+}
+
+// all changes, which were made before this call, are in the tree
+static int settled() {
+  int queued = 0;
+
+  if (ioctl(inotify_fd, FIONREAD, &queued) < 0 || queued > 0)
+    return FALSE;
+  return !__atomic_load_n(&applying, __ATOMIC_SEQ_CST);
+}
+
+//
+// (the read lock is held)
+// find the node of normalised @path
+// return it or NULL, then @res is INDEX_MISSING or INDEX_UNKNOWN
+//
+static index_node_t *find_node(const char *path, int *res) {
+  char name[INDEX_NAME_LENGTH];
+  index_node_t *node = root;
+  const char *end;
+  size_t pos;
+  int found;
+
+  *res = INDEX_UNKNOWN;
+  if (!node)
+    return NULL;
+
+  while (*path == '/')
+    path++;
+  while (*path) {
+    end = strchrnul(path, '/');
+    if (node->type == DT_LNK || (size_t)(end - path) >= INDEX_NAME_LENGTH)
+      return NULL;
+    if (node->type != DT_DIR) {
+      *res = INDEX_MISSING;
+      return NULL;
+    }
+    if (node->dir->wd < 0)
+      return NULL;
+
+    memcpy(name, path, end - path);
+    name[end - path] = '\0';
+    pos = find_child(node->dir, name, &found);
+    if (!found) {
+      *res = INDEX_MISSING;
+      return NULL;
+    }
+    node = node->dir->children[pos];
+
+    path = end;
+    while (*path == '/')
+      path++;
+  }
+
+  // the target of a symlink isn't indexed
+  if (node->type == DT_LNK)
+    return NULL;
+  *res = INDEX_FOUND;
+  return node;
+}
+
+static void fill_entry(index_node_t *node, index_entry_t *entry) {
+  strcpy(entry->name, node->name);
+  entry->type = node->type;
+  entry->size = node->size;
+  entry->mtime = node->mtime;
+  entry->mime = node->mime;
+  entry->icon = node->icon;
+}
+
+int wwwroot_index_lookup(const char *path, index_entry_t *entry) {
+  index_node_t *node;
+  int res;
+
+  if (!index_started || !settled())
+    return INDEX_UNKNOWN;
+
+  pthread_rwlock_rdlock(&index_lock);
+  node = find_node(path, &res);
+  if (node && entry)
+    fill_entry(node, entry);
+  pthread_rwlock_unlock(&index_lock);
+  return res;
+}
+
+int wwwroot_index_list(const char *path, const char *after, index_entry_t *entries, int max) {
+  index_node_t *node;
+  size_t pos;
+  int found;
+  int res;
+  int count = 0;
+
+  if (!index_started)
+    return INDEX_UNKNOWN;
+
+  pthread_rwlock_rdlock(&index_lock);
+  node = find_node(path, &res);
+  if (!node || !node->dir || node->dir->wd < 0) {
+    pthread_rwlock_unlock(&index_lock);
+    return INDEX_UNKNOWN;
+  }
+
+  pos = find_child(node->dir, after, &found);
+  if (found)
+    pos++;
+  for ( ; pos < node->dir->count && count < max; pos++)
+    fill_entry(node->dir->children[pos], &entries[count++]);
+  pthread_rwlock_unlock(&index_lock);
+  return count;
+}
@@ -0,0 +1,50 @@
+#ifndef _WWWROOT_INDEX_H_
+#define _WWWROOT_INDEX_H_
+
+#include "setup.h"
+
+//
+// In-memory index of WWWROOT
+//
+// A thread walks WWWROOT at startup and builds a tree of all its files
+// (type, size, mtime, mime type and icon of each one), then keeps the tree
+// current by inotify events. GET of a missing file is rejected without
+// a lookup, and listings are generated from the tree without getdents64()
+// and stat() (see html_generation_for_dir.c).
+//
+// While the tree is being built, in directories which cannot be watched
+// (fs.inotify.max_user_watches is exhausted) and on paths through symlinks
+// lookups return INDEX_UNKNOWN, then the file system is used as before.
+//
+
+#define INDEX_UNKNOWN  -1
+#define INDEX_MISSING   0
+#define INDEX_FOUND     1
+
+#define INDEX_NAME_LENGTH 256
+
+typedef struct index_entry {
+  char name[INDEX_NAME_LENGTH];
+  unsigned char type;       // DT_DIR, DT_REG, DT_LNK or DT_UNKNOWN
+  long long size;
+  long long mtime;
+  const char *mime;         // mime type of a regular file (see mime_table.c) or NULL
+  const char *icon;         // path of its icon (see get_icon_path_from_db.c) or NULL
+} index_entry_t;
+
+// start the thread which builds the index (WWWROOT_INDEX on in config)
+// return 0 if success, else -1
+int wwwroot_index_start();
+void wwwroot_index_stop();
+
+// look up normalised @path (see normalize_request_path()),
+// @entry (it may be NULL) is filled if it is found
+// return INDEX_FOUND, INDEX_MISSING or INDEX_UNKNOWN
+int wwwroot_index_lookup(const char *path, index_entry_t *entry);
+
+// copy at most @max entries of directory @path, which follow name @after
+// ("" -- from the first one), into @entries (they are sorted by name)
+// return the number of entries (0 at the end) or INDEX_UNKNOWN
+int wwwroot_index_list(const char *path, const char *after, index_entry_t *entries, int max);
+
+#endif // _WWWROOT_INDEX_H_
@@ -0,0 +1,138 @@
+#include "chunked.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// chunked transfer coding: the encoder and the decoder, which is fed by parts
+//
+
+// the log of the server (see log.h), PRINT() writes into /dev/null here
+FILE *logfp;
+
+static int failures = 0;
+
+//
+// decode @body, which is split into parts at @splits (offsets, -1 ends them),
+// each part is decoded in place (as process_body() does)
+// return the length of decoded data in @out or -1 if the coding is broken
+// (@used -- bytes of @body which belong to it)
+//
+static long decode(const char *body, size_t length, const size_t *splits, char *out, size_t *used) {
+  chunked_decoder_t d;
+  char part[4096];
+  size_t from = 0, to, n;
+  long out_len = 0;
+  ssize_t res;
+
+  chunked_decoder_init(&d);
+  *used = 0;
+  while (from < length && !chunked_done(&d)) {
+    to = (*splits != (size_t)-1) ? *splits++ : length;
+    if (to > length)
+      to = length;
+    memcpy(part, body + from, to - from);
+    res = chunked_decode(&d, part, to - from, part, &n);
+    if (res < 0)
+      return -1;
+    memcpy(out + out_len, part, n);
+    out_len += n;
+    *used += res;
+    from = to;
+  }
+  return chunked_done(&d) ? out_len : -2;
+}
+
+// decode @body in one part, split at each offset and byte by byte, it must give @expected
+// (NULL if the coding is broken) and @expected_used bytes of @body must belong to it
+static void check(const char *test, const char *body, const char *expected, size_t expected_used) {
+  size_t length = strlen(body);
+  size_t splits[4096];
+  size_t used, split, i;
+  char out[4096];
+  long n;
+
+  // @split: 0 -- one part, 1..@length -- two parts, @length + 1 -- by bytes
+  for (split = 0; split <= length + 1; split++) {
+    if (split == 0) {
+      splits[0] = (size_t)-1;
+    } else if (split <= length) {
+      splits[0] = split;
+      splits[1] = (size_t)-1;
+    } else {
+      for (i = 0; i < length; i++)
+        splits[i] = i + 1;
+      splits[length] = (size_t)-1;
+    }
+
+    n = decode(body, length, splits, out, &used);
+    if (expected == NULL) {
+      if (n != -1) {
+        printf("FAIL: %s: broken coding is accepted (split %zu)\n", test, split);
+        failures++;
+        return;
+      }
+    } else if (n < 0 || (size_t)n != strlen(expected) || memcmp(out, expected, n) || used != expected_used) {
+      printf("FAIL: %s: %ld bytes, %zu used (split %zu)\n", test, n, used, split);
+      failures++;
+      return;
+    }
+  }
+}
+
+static void test_decoder() {
+  check("chunks", "3\r\nabc\r\n5\r\n12345\r\n0\r\n\r\n", "abc12345", 23);
+  check("hex sizes", "a\r\n0123456789\r\nF\r\nabcdefghijklmno\r\n0\r\n\r\n", "0123456789abcdefghijklmno", 40);
+  check("extensions", "3;name=value\r\nabc\r\n2 ; x\r\nde\r\n0;last\r\n\r\n", "abcde", 40);
+  check("trailer fields", "1\r\nx\r\n0\r\nX-A: 1\r\nX-B: 2\r\n\r\n", "x", 27);
+  check("bare LF", "3\nabc\n0\n\n", "abc", 9);
+  check("data after the body", "1\r\nx\r\n0\r\n\r\nGET / HTTP/1.1\r\n", "x", 11);
+  check("data like size lines", "5\r\n0\r\n\r\n\r\n0\r\n\r\n", "0\r\n\r\n", 15);
+
+  check("not hex", "g\r\nabc\r\n0\r\n\r\n", NULL, 0);
+  check("0x prefix", "0x3\r\nabc\r\n0\r\n\r\n", NULL, 0);
+  check("negative size", "-3\r\nabc\r\n0\r\n\r\n", NULL, 0);
+  check("empty size", "\r\nabc\r\n0\r\n\r\n", NULL, 0);
+  check("size overflow", "10000000000000000\r\nabc\r\n0\r\n\r\n", NULL, 0);
+  check("CR without LF", "3\rabc\r\n0\r\n\r\n", NULL, 0);
+  check("long data", "3\r\nabcd\r\n0\r\n\r\n", NULL, 0);
+  check("data without CRLF", "3\r\nabc0\r\n\r\n", NULL, 0);
+  check("last chunk without LF", "0\r\n\rx", NULL, 0);
+}
+
+// chunked_wrap() frames data in place, the decoder gives it back
+static void test_encoder() {
+  char buf[CHUNKED_HEADER_MAX + 70000 + CHUNKED_TRAILER_MAX + CHUNKED_LAST_LENGTH];
+  static char out[sizeof(buf)];
+  char *data = buf + CHUNKED_HEADER_MAX;
+  size_t sizes[] = { 1, 15, 16, 255, 4096, 70000 };
+  size_t chunk_length, n, i, j;
+  chunked_decoder_t d;
+  char *chunk;
+  ssize_t res;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (j = 0; j < sizes[i]; j++)
+      data[j] = (char)(j * 7 + i);
+    chunk = chunked_wrap(data, sizes[i], &chunk_length);
+    memcpy(chunk + chunk_length, CHUNKED_LAST, CHUNKED_LAST_LENGTH);
+
+    chunked_decoder_init(&d);
+    res = chunked_decode(&d, chunk, chunk_length + CHUNKED_LAST_LENGTH, out, &n);
+    if (res != (ssize_t)(chunk_length + CHUNKED_LAST_LENGTH) || !chunked_done(&d) ||
+        n != sizes[i] || memcmp(out, data, n)) {
+      printf("FAIL: chunked_wrap of %zu bytes\n", sizes[i]);
+      failures++;
+    }
+  }
+}
+
+int main() {
+  logfp = fopen("/dev/null", "w");
+
+  test_decoder();
+  test_encoder();
+
+  printf("test_chunked: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+#include "hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// HPACK decoder: examples of RFC 7541 and the dynamic table
+//
+
+// the log of the server (see log.h), PRINT() writes into /dev/null here
+FILE *logfp;
+
+#define MAX_FIELDS 16
+
+typedef struct fields {
+  int count;
+  char name[MAX_FIELDS][64];
+  char value[MAX_FIELDS][HPACK_STRING_MAX + 1];
+} fields_t;
+
+static int failures = 0;
+
+static void on_field(void *arg, const char *name, size_t name_length,
+                     const char *value, size_t value_length) {
+  fields_t *f = (fields_t *)arg;
+
+  if (f->count == MAX_FIELDS || name_length >= sizeof(f->name[0]))
+    return;
+  memcpy(f->name[f->count], name, name_length);
+  f->name[f->count][name_length] = '\0';
+  memcpy(f->value[f->count], value, value_length);
+  f->value[f->count][value_length] = '\0';
+  f->count++;
+}
+
+// decode @block and compare its fields with @expected ({ name, value, ..., NULL })
+// and the size of the dynamic table with @table_size
+static void check(const char *test, hpack_decoder_t *d, const unsigned char *block, size_t length,
+                  const char **expected, size_t table_size) {
+  static fields_t f;
+  int i;
+
+  f.count = 0;
+  if (hpack_decode(d, block, length, on_field, &f) < 0) {
+    printf("FAIL: %s: decoding error\n", test);
+    failures++;
+    return;
+  }
+  for (i = 0; expected[2 * i]; i++) {
+    if (i >= f.count || strcmp(f.name[i], expected[2 * i]) || strcmp(f.value[i], expected[2 * i + 1])) {
+      printf("FAIL: %s: field %d\n", test, i);
+      failures++;
+      return;
+    }
+  }
+  if (i != f.count) {
+    printf("FAIL: %s: %d fields (expected %d)\n", test, f.count, i);
+    failures++;
+  }
+  if (d->size != table_size) {
+    printf("FAIL: %s: table size %zu (expected %zu)\n", test, d->size, table_size);
+    failures++;
+  }
+}
+
+// RFC 7541, C.4: requests with Huffman coding on one connection
+static void test_rfc7541_c4() {
+  static const unsigned char c41[] = {
+    0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b,
+    0xa0, 0xab, 0x90, 0xf4, 0xff
+  };
+  static const unsigned char c42[] = {
+    0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf
+  };
+  static const unsigned char c43[] = {
+    0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xa9,
+    0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf
+  };
+  static const char *f41[] = {
+    ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com", NULL
+  };
+  static const char *f42[] = {
+    ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com",
+    "cache-control", "no-cache", NULL
+  };
+  static const char *f43[] = {
+    ":method", "GET", ":scheme", "https", ":path", "/index.html", ":authority", "www.example.com",
+    "custom-key", "custom-value", NULL
+  };
+  hpack_decoder_t d;
+
+  hpack_decoder_init(&d);
+  check("C.4.1", &d, c41, sizeof(c41), f41, 57);
+  check("C.4.2", &d, c42, sizeof(c42), f42, 110);
+  check("C.4.3", &d, c43, sizeof(c43), f43, 164);
+  hpack_decoder_free(&d);
+}
+
+// a field is added with the name of an entry which is evicted to make room for it
+static void test_self_referencing_insert() {
+  static unsigned char first[3 + 5 + 3 + 3900];
+  static unsigned char second[1 + 2 + 200];
+  static char big_value[3900 + 1], value[200 + 1];
+  const char *f1[] = { "x-big", big_value, NULL };
+  const char *f2[] = { "x-big", value, NULL };
+  hpack_decoder_t d;
+  size_t n = 0;
+
+  memset(big_value, 'a', 3900);
+  memset(value, 'b', 200);
+
+  // literal with incremental indexing, new name "x-big", value of 3900 bytes
+  first[n++] = 0x40;
+  first[n++] = 5;
+  memcpy(first + n, "x-big", 5);
+  n += 5;
+  first[n++] = 0x7f;                    // 127 + 3773
+  first[n++] = 0x80 | (3773 & 0x7f);
+  first[n++] = 3773 >> 7;
+  memcpy(first + n, big_value, 3900);
+  n += 3900;
+
+  // literal with incremental indexing, name of index 62 (the first entry), value of 200 bytes
+  // 3937 + 237 > 4096: the first entry is evicted
+  second[0] = 0x40 | 62;
+  second[1] = 0x7f;                     // 127 + 73
+  second[2] = 73;
+  memcpy(second + 3, value, 200);
+
+  hpack_decoder_init(&d);
+  check("insert", &d, first, n, f1, 5 + 3900 + 32);
+  check("self-referencing insert", &d, second, sizeof(second), f2, 5 + 200 + 32);
+  if (d.count != 1) {
+    printf("FAIL: self-referencing insert: %zu entries\n", d.count);
+    failures++;
+  }
+  hpack_decoder_free(&d);
+}
+
+int main() {
+  logfp = fopen("/dev/null", "w");
+
+  test_rfc7541_c4();
+  test_self_referencing_insert();
+
+  printf("test_hpack: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,346 @@
+#include "setup.h"
+#include "ext_epoll_data.h"
+#include "path_resolution.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+//
+// JSON and CBOR listings of a directory (see html_generation_for_dir.c)
+//
+
+// the log of the server (see log.h), PRINT() writes into /dev/null here
+FILE *logfp;
+
+// see html_generation_for_dir.c
+extern int start_dir_listing(Node_t *node, int dir_fd, char *dir_name, char *query, char *accept);
+extern int send_listing(Node_t *node, int sfd);
+
+// see mime_table.c
+extern int load_mime_table();
+
+// connections of the event loop (see server_work.c)
+extern List_t *list;
+
+#define BIG_FILE_SIZE  5000000000LL     // (sparse) its size needs 8 bytes in CBOR
+#define MTIME          1700000000LL     // 4 bytes in CBOR
+#define BODY_MAX       (1024 * 1024)
+
+static int failures = 0;
+static char dir[] = "/tmp/sss-test-listing-XXXXXX";
+
+static void fail(const char *format, const char *arg) {
+  printf("FAIL: ");
+  printf(format, arg);
+  printf("\n");
+  failures++;
+}
+
+static void make_file(const char *name, long long size) {
+  char path[256];
+  struct timespec times[2] = { { MTIME, 0 }, { MTIME, 0 } };
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) < 0)
+    fail("cannot create %s", name);
+  if (fd >= 0) {
+    futimens(fd, times);
+    close(fd);
+  }
+}
+
+//
+// list the directory with @query, the body is de-chunked into @body
+// return its length or -1
+//
+static long list_dir(const char *query, char *body) {
+  ext_epoll_data_t data;
+  Node_t *node;
+  char q[256];
+  char buf[64 * 1024];
+  static char raw[2 * BODY_MAX];
+  size_t raw_len = 0;
+  long body_len = 0;
+  char *p, *end;
+  int sv[2], done = FALSE;
+  ssize_t n;
+
+  snprintf(q, sizeof(q), "%s", query);
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    return -1;
+  fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+  // (the connection is known to the event loop)
+  memset(&data, 0, sizeof(data));
+  data.sfd = sv[0];
+  if (insert_node(list, data) < 0 || !(node = find_node(list, sv[0])))
+    return -1;
+  if (start_dir_listing(node, open(dir, O_RDONLY | O_DIRECTORY), "/d", q, NULL) < 0)
+    return -1;
+  while (!done) {
+    // (the send scheduler grants a quota, see send_sched.c)
+    node->data.send_quota = 65536;
+    done = (send_listing(node, sv[0]) == 0);
+    while ((n = recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0 && raw_len + n <= sizeof(raw)) {
+      memcpy(raw + raw_len, buf, n);
+      raw_len += n;
+    }
+  }
+  remove_node(list, sv[0]);
+  close(sv[0]);
+  close(sv[1]);
+
+  // chunks: "<hex size>\r\n<data>\r\n", the last one is empty
+  p = raw;
+  while (p < raw + raw_len) {
+    long size = strtol(p, &end, 16);
+
+    if (end == p || strncmp(end, "\r\n", 2) || size < 0 || end + 2 + size + 2 > raw + raw_len ||
+        body_len + size > BODY_MAX)
+      return -1;
+    memcpy(body + body_len, end + 2, size);
+    body_len += size;
+    p = end + 2 + size + 2;
+    if (size == 0)
+      break;
+  }
+  return (p == raw + raw_len) ? body_len : -1;
+}
+
+//
+// CBOR
+//
+
+typedef struct cbor_item {
+  int major;
+  unsigned long long value;     // the value, the length of a string, or -1 for indefinite length
+  const unsigned char *data;    // bytes of a string
+} cbor_item_t;
+
+// the head of an item at @p (before @end), return the next byte or NULL
+static const unsigned char *cbor_next(const unsigned char *p, const unsigned char *end, cbor_item_t *item) {
+  int info, bytes, i;
+
+  if (p >= end)
+    return NULL;
+  item->major = *p >> 5;
+  info = *p++ & 0x1f;
+  if (info < 24) {
+    item->value = info;
+  } else if (info == 31) {
+    item->value = (unsigned long long)-1;
+  } else if (info <= 27) {
+    bytes = 1 << (info - 24);
+    if (end - p < bytes)
+      return NULL;
+    item->value = 0;
+    for (i = 0; i < bytes; i++)
+      item->value = (item->value << 8) | *p++;
+    // (the shortest form is used)
+    if (item->value < (bytes == 1 ? 24 : bytes == 2 ? 0x100 : bytes == 4 ? 0x10000 : 0x100000000ULL))
+      return NULL;
+  } else {
+    return NULL;
+  }
+  item->data = p;
+  if (item->major == 2 || item->major == 3) {
+    if ((unsigned long long)(end - p) < item->value)
+      return NULL;
+    p += item->value;
+  }
+  return p;
+}
+
+// a string item equal to @str
+static int cbor_is(const cbor_item_t *item, int major, const char *str) {
+  return item->major == major && item->value == strlen(str) && !memcmp(item->data, str, item->value);
+}
+
+typedef struct cbor_entry {
+  char name[64];
+  int name_major;
+  char type[16];
+  long long size;
+  long long mtime;
+  char mime[64];
+} cbor_entry_t;
+
+static void copy_string(char *out, size_t max, const cbor_item_t *item) {
+  size_t len = (item->value < max) ? item->value : max - 1;
+
+  memcpy(out, item->data, len);
+  out[len] = '\0';
+}
+
+//
+// parse a CBOR listing: {_ "path": text, "entries": [_ {5 pairs}, ... ], ("next_offset": N) }
+// return number of entries or -1
+//
+static int parse_cbor_listing(const unsigned char *p, const unsigned char *end,
+                              cbor_entry_t *entries, int max, long long *next_offset) {
+  cbor_item_t item, key;
+  int count = 0, i;
+
+  *next_offset = -1;
+  if (!(p = cbor_next(p, end, &item)) || item.major != 5 || item.value != (unsigned long long)-1)
+    return -1;
+  if (!(p = cbor_next(p, end, &key)) || !cbor_is(&key, 3, "path") ||
+      !(p = cbor_next(p, end, &item)) || !cbor_is(&item, 3, "/d"))
+    return -1;
+  if (!(p = cbor_next(p, end, &key)) || !cbor_is(&key, 3, "entries") ||
+      !(p = cbor_next(p, end, &item)) || item.major != 4 || item.value != (unsigned long long)-1)
+    return -1;
+
+  while (p < end && *p != 0xff) {
+    cbor_entry_t *e = &entries[count];
+
+    if (count == max || !(p = cbor_next(p, end, &item)) || item.major != 5 || item.value != 5)
+      return -1;
+    memset(e, 0, sizeof(cbor_entry_t));
+    for (i = 0; i < 5; i++) {
+      if (!(p = cbor_next(p, end, &key)) || key.major != 3 || !(p = cbor_next(p, end, &item)))
+        return -1;
+      if (cbor_is(&key, 3, "name") && (item.major == 2 || item.major == 3)) {
+        copy_string(e->name, sizeof(e->name), &item);
+        e->name_major = item.major;
+      } else if (cbor_is(&key, 3, "type") && item.major == 3) {
+        copy_string(e->type, sizeof(e->type), &item);
+      } else if (cbor_is(&key, 3, "size") && item.major == 0) {
+        e->size = (long long)item.value;
+      } else if (cbor_is(&key, 3, "mtime") && item.major == 0) {
+        e->mtime = (long long)item.value;
+      } else if (cbor_is(&key, 3, "mime") && item.major == 3) {
+        copy_string(e->mime, sizeof(e->mime), &item);
+      } else if (!(cbor_is(&key, 3, "mime") && item.major == 7 && item.value == 22)) {
+        return -1;
+      }
+    }
+    count++;
+  }
+  if (p == end)
+    return -1;
+  p++;      // the end of the entries
+
+  if (p < end && *p != 0xff) {
+    if (!(p = cbor_next(p, end, &key)) || !cbor_is(&key, 3, "next_offset") ||
+        !(p = cbor_next(p, end, &item)) || item.major != 0)
+      return -1;
+    *next_offset = (long long)item.value;
+  }
+  // the end of the map is the end of the body
+  return (p + 1 == end && *p == 0xff) ? count : -1;
+}
+
+static void test_json() {
+  static char body[BODY_MAX + 1];
+  long len;
+
+  len = list_dir("format=json&sort=name", body);
+  if (len < 0) {
+    fail("%s", "json: broken chunks");
+    return;
+  }
+  body[len] = '\0';
+  if (strncmp(body, "{\"path\":\"/d\",\"entries\":[", strlen("{\"path\":\"/d\",\"entries\":[")))
+    fail("json: header %s", body);
+  if (!strstr(body, "{\"name\":\"a.txt\",\"type\":\"file\",\"size\":300,\"mtime\":1700000000,\"mime\":\"text/plain\"}"))
+    fail("json: a.txt %s", body);
+  if (!strstr(body, "{\"name\":\"big\",\"type\":\"file\",\"size\":5000000000,\"mtime\":1700000000,\"mime\":null}"))
+    fail("json: big %s", body);
+  if (!strstr(body, "{\"name\":\"sub\",\"type\":\"dir\","))
+    fail("json: sub %s", body);
+  // quotes, backslashes and control characters are escaped
+  if (!strstr(body, "{\"name\":\"q\\\"u\\\\o\\u000ate\\u001f\","))
+    fail("json: escaping %s", body);
+  if (strcmp(body + len - 4, "\n]}\n"))
+    fail("json: end %s", body);
+  if (!strstr(body, "\"q\\\"") || !strstr(strstr(body, "\"q\\\""), "\"sub\""))
+    fail("json: sorting %s", body);
+  // files of the server aren't listed
+  if (strstr(body, SERVER_FILES_PREFIX))
+    fail("json: a file of the server %s", body);
+
+  // a full page reports the next offset
+  len = list_dir("format=json&sort=name&offset=1&limit=2", body);
+  body[len > 0 ? len : 0] = '\0';
+  if (len < 0 || !strstr(body, "\n],\"next_offset\":3}\n") || strstr(body, "a.txt") || !strstr(body, "\"big\"") ||
+      !strstr(body, "\"bad"))
+    fail("json: paging %s", body);
+}
+
+static void test_cbor() {
+  static char body[BODY_MAX];
+  cbor_entry_t entries[8];
+  long long next_offset;
+  int count, i, found = 0;
+  long len;
+
+  len = list_dir("format=cbor&sort=name", body);
+  count = (len < 0) ? -1 : parse_cbor_listing((unsigned char *)body, (unsigned char *)body + len,
+                                              entries, 8, &next_offset);
+  if (count != 5 || next_offset != -1) {
+    fail("%s", "cbor: broken listing");
+    return;
+  }
+  for (i = 0; i < count; i++) {
+    cbor_entry_t *e = &entries[i];
+
+    if (!strcmp(e->name, "a.txt")) {
+      found += (e->size == 300 && e->mtime == MTIME && !strcmp(e->type, "file") && !strcmp(e->mime, "text/plain"));
+    } else if (!strcmp(e->name, "big")) {
+      found += (e->size == BIG_FILE_SIZE && e->mime[0] == '\0');
+    } else if (!strcmp(e->name, "sub")) {
+      found += !strcmp(e->type, "dir");
+    } else if (!strcmp(e->name, "bad\xff")) {
+      // (it isn't UTF-8: a byte string)
+      found += (e->name_major == 2);
+    } else if (!strcmp(e->name, "q\"u\\o\nte\x1f")) {
+      found += (e->name_major == 3 && e->size == 0);
+    }
+  }
+  if (found != 5)
+    fail("%s", "cbor: entries");
+
+  len = list_dir("format=cbor&sort=size&order=desc&limit=1", body);
+  count = (len < 0) ? -1 : parse_cbor_listing((unsigned char *)body, (unsigned char *)body + len,
+                                              entries, 8, &next_offset);
+  if (count != 1 || next_offset != 1 || strcmp(entries[0].name, "big"))
+    fail("%s", "cbor: paging");
+}
+
+int main() {
+  char path[256];
+
+  logfp = fopen("/dev/null", "w");
+  list = list_new();
+  srv_settings.mime_file = fopen("src/mime.types", "r");
+  if (!srv_settings.mime_file || load_mime_table() < 0)
+    fail("%s", "cannot load src/mime.types");
+
+  if (!mkdtemp(dir)) {
+    fail("%s", "mkdtemp");
+    return 1;
+  }
+  make_file("a.txt", 300);
+  make_file("big", BIG_FILE_SIZE);
+  make_file("q\"u\\o\nte\x1f", 0);
+  make_file("bad\xff", 1);
+  make_file(SERVER_FILES_PREFIX "digest.a.txt", 10);
+  snprintf(path, sizeof(path), "%s/sub", dir);
+  mkdir(path, 0755);
+
+  test_json();
+  test_cbor();
+
+  snprintf(path, sizeof(path), "rm -rf %s", dir);
+  if (system(path) != 0)
+    printf("cannot remove %s\n", dir);
+
+  printf("test_listing: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
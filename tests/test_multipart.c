@@ -0,0 +1,179 @@
+// (parse_multipart() is static)
+#include "../src/post_request.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// multipart/form-data parser of uploads, the body arrives by parts
+//
+
+// the log of the server (see log.h), PRINT() writes into /dev/null here
+FILE *logfp;
+
+#define BOUNDARY  "----sss-b0undary"
+
+static int failures = 0;
+static char dir[] = "/tmp/sss-test-multipart-XXXXXX";
+
+//
+// parse @body split at @split (0 -- in one part, -1 -- by bytes)
+// return the length of file data in @file or -1 if the body is incorrect
+//
+static long parse(const char *body, size_t length, long split, char *file, int *done) {
+  upload_t *u;
+  size_t from = 0, to, out_len;
+  long file_len = 0;
+  char *out;
+  int res = 0;
+
+  u = (upload_t *)calloc(1, sizeof(upload_t));
+  u->multipart = TRUE;
+  u->delimiter_len = sprintf(u->delimiter, "\r\n--%s", BOUNDARY);
+  u->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+  // (as start_upload() does: the first delimiter isn't preceded by CRLF)
+  add_body_data(u, "\r\n", 2);
+
+  while (from < length && res == 0) {
+    to = (split == 0) ? length : (split < 0) ? from + 1 : (from < (size_t)split) ? (size_t)split : length;
+    add_body_data(u, (char *)body + from, to - from);
+    out = (char *)malloc(u->buf_len + 1);
+    out_len = 0;
+    res = parse_multipart(u, -1, out, &out_len);
+    memcpy(file + file_len, out, out_len);
+    file_len += out_len;
+    free(out);
+    from = to;
+  }
+  *done = (u->part_state == PART_EPILOGUE);
+  free_upload(u);
+  return (res < 0) ? -1 : file_len;
+}
+
+// @body split at each offset and byte by byte must give @expected (NULL if it is incorrect)
+static void check(const char *test, const char *body, const char *expected) {
+  size_t length = strlen(body);
+  char file[8192];
+  long split, n;
+  int done;
+
+  for (split = -1; split < (long)length; split++) {
+    n = parse(body, length, split, file, &done);
+    if (expected == NULL) {
+      if (n >= 0 && done) {
+        printf("FAIL: %s: incorrect body is accepted (split %ld)\n", test, split);
+        failures++;
+        return;
+      }
+    } else if (n < 0 || !done || (size_t)n != strlen(expected) || memcmp(file, expected, n)) {
+      printf("FAIL: %s: %ld bytes (split %ld)\n", test, n, split);
+      failures++;
+      return;
+    }
+  }
+}
+
+static void test_parts() {
+  check("one file",
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"f\"; filename=\"a.txt\"\r\n"
+        "Content-Type: text/plain\r\n"
+        "\r\n"
+        "hello\r\nworld\r\n"
+        "--" BOUNDARY "--\r\n",
+        "hello\r\nworld");
+
+  check("preamble, fields and epilogue",
+        "preamble\r\n--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"x\"\r\n"
+        "\r\n"
+        "a field\r\n"
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"f\"; filename=\"b.bin\"\r\n"
+        "\r\n"
+        "data\r\n"
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"g\"; filename=\"c.bin\"\r\n"
+        "\r\n"
+        "the second file is not saved\r\n"
+        "--" BOUNDARY "--\r\n"
+        "epilogue --" BOUNDARY "\r\n",
+        "data");
+
+  // beginnings of the delimiter inside the data are data
+  check("partial delimiters",
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"f\"; filename=\"d.bin\"\r\n"
+        "\r\n"
+        "\r\n--" "\r\n-" "--" BOUNDARY "x\r\n--" "----sss-b0undar\r\n"
+        "--" BOUNDARY "--",
+        "\r\n--" "\r\n-" "--" BOUNDARY "x\r\n--" "----sss-b0undar");
+
+  check("empty file",
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"f\"; filename=\"e.bin\"\r\n"
+        "\r\n"
+        "\r\n--" BOUNDARY "--",
+        "");
+
+  check("garbage after the delimiter",
+        "--" BOUNDARY "xx\r\n"
+        "Content-Disposition: form-data; name=\"f\"; filename=\"f.bin\"\r\n"
+        "\r\n"
+        "data\r\n--" BOUNDARY "--",
+        NULL);
+  check("file name with a path",
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"f\"; filename=\"../g.bin\"\r\n"
+        "\r\n"
+        "data\r\n--" BOUNDARY "--",
+        NULL);
+  check("file of the server",
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"f\"; filename=\".sss-upload.x\"\r\n"
+        "\r\n"
+        "data\r\n--" BOUNDARY "--",
+        NULL);
+  check("no closing delimiter",
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"f\"; filename=\"h.bin\"\r\n"
+        "\r\n"
+        "data\r\n--" BOUNDARY,
+        NULL);
+}
+
+// headers of a part are limited
+static void test_long_headers() {
+  static char body[3 * PART_HEADERS_MAX];
+  char file[16];
+  size_t len;
+  int done;
+
+  len = sprintf(body, "--" BOUNDARY "\r\nX-Long: ");
+  memset(body + len, 'a', 2 * PART_HEADERS_MAX);
+  len += 2 * PART_HEADERS_MAX;
+  body[len] = '\0';
+  if (parse(body, len, 0, file, &done) >= 0) {
+    printf("FAIL: long part headers are accepted\n");
+    failures++;
+  }
+}
+
+int main() {
+  char command[256];
+
+  logfp = fopen("/dev/null", "w");
+  if (!mkdtemp(dir)) {
+    printf("FAIL: mkdtemp\n");
+    return 1;
+  }
+
+  test_parts();
+  test_long_headers();
+
+  snprintf(command, sizeof(command), "rm -rf %s", dir);
+  if (system(command) != 0)
+    printf("cannot remove %s\n", dir);
+
+  printf("test_multipart: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+#include "path_resolution.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+//
+// normalize_request_path() and open_beneath_root()
+//
+
+// the log of the server (see log.h), PRINT() writes into /dev/null here
+FILE *logfp;
+
+static int failures = 0;
+
+static void check(const char *raw, int expected_res, const char *expected_path) {
+  char path[REQUEST_PATH_LENGTH];
+  int res = normalize_request_path(raw, path, sizeof(path));
+
+  if (res != expected_res || (res == 0 && strcmp(path, expected_path))) {
+    printf("FAIL: \"%s\" -> %d \"%s\" (expected %d \"%s\")\n", raw, res,
+           res == 0 ? path : "", expected_res, expected_path ? expected_path : "");
+    failures++;
+  }
+}
+
+static void check_open(const char *path, int expected_ok) {
+  int fd = open_beneath_root(path, O_RDONLY, 0);
+
+  if ((fd >= 0) != expected_ok) {
+    printf("FAIL: open \"%s\" -> %d (errno=%d)\n", path, fd, errno);
+    failures++;
+  }
+  if (fd >= 0)
+    close(fd);
+}
+
+static void test_normalize() {
+  char long_path[2 * REQUEST_PATH_LENGTH];
+
+  check("/", 0, "/");
+  check("", 0, "/");
+  check("/a//b/./c", 0, "/a/b/c");
+  check("/a/b/../c?x=1", 0, "/a/c");
+  check("/a/b/..#x", 0, "/a");
+  check("/%41%20b", 0, "/A b");
+  check("/a%2fb", -1, NULL);
+  check("/a/%2e%2e/b", 0, "/b");
+  check("/..", -1, NULL);
+  check("/../a", -1, NULL);
+  check("/a/../../b", -1, NULL);
+  check("/a%zz", -1, NULL);
+  check("/a%2", -1, NULL);
+  check("/a%00b", -1, NULL);
+
+  // files of the server (for every method)
+  check("/.sss-upload.f", -2, NULL);
+  check("/a/.sss-digest.b", -2, NULL);
+  check("/d/.sss-upload.f.map", -2, NULL);
+  check("/%2esss-upload.f", -2, NULL);
+  check("/x/../.sss-upload.f", -2, NULL);
+  check("/.sss-upload.f/..", -2, NULL);
+  check("/.sss-store/56/x", -2, NULL);
+  check("/.sss-store", -2, NULL);
+  check("/%2esss-store/56/x", -2, NULL);
+  check("/d/.sss-dedup.f", -2, NULL);
+  check("/.hidden/sss-x/a.sss-b", 0, "/.hidden/sss-x/a.sss-b");
+
+  memset(long_path, 'a', sizeof(long_path) - 1);
+  long_path[0] = '/';
+  long_path[sizeof(long_path) - 1] = '\0';
+  check(long_path, -1, NULL);
+}
+
+// symlinks can't lead out of the root (also through cached directories)
+static void test_open_beneath_root() {
+  char root[] = "/tmp/sss-test-root-XXXXXX";
+  char path[256];
+  int i;
+
+  if (!mkdtemp(root)) {
+    printf("FAIL: mkdtemp (errno=%d)\n", errno);
+    failures++;
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/d", root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/d/f", root);
+  close(open(path, O_WRONLY | O_CREAT, 0644));
+  snprintf(path, sizeof(path), "%s/out", root);
+  symlink("/etc", path);
+  snprintf(path, sizeof(path), "%s/d/up", root);
+  symlink("../..", path);
+  snprintf(path, sizeof(path), "%s/d/in", root);
+  symlink("f", path);
+
+  srv_settings.wwwroot = root;
+  if (open_wwwroot_dir() < 0) {
+    printf("FAIL: open_wwwroot_dir\n");
+    failures++;
+    return;
+  }
+  // (the directory becomes hot after a few lookups)
+  for (i = 0; i < 8; i++) {
+    check_open("/d/f", TRUE);
+    check_open("/d/in", TRUE);
+    check_open("/d/g", FALSE);
+    check_open("/out/passwd", FALSE);
+    check_open("/d/up/etc/passwd", FALSE);
+  }
+  close_wwwroot_dir();
+
+  snprintf(path, sizeof(path), "rm -rf %s", root);
+  if (system(path) != 0)
+    printf("cannot remove %s\n", root);
+}
+
+int main() {
+  logfp = fopen("/dev/null", "w");
+
+  test_normalize();
+  test_open_beneath_root();
+
+  printf("test_path_resolution: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+//
+// SSE2 and AVX2 kernels of scan.c give the same results as the portable ones
+//
+// Strings are placed at every alignment and right before a page which can't be read,
+// so a kernel which reads beyond the end of a string (or of a buffer) crashes.
+//
+
+// the log of the server (see log.h), PRINT() writes into /dev/null here
+FILE *logfp;
+
+#define CASES       20000
+#define STRING_MAX  300
+#define PAGE        4096
+
+static int failures = 0;
+static char *guard;       // the page after the buffer (PROT_NONE)
+
+// characters of requests, delimiters are frequent
+static char random_char() {
+  static const char chars[] = "aZ09-_:/. \t\r\n\r\n\"%~\x80\xff";
+
+  return chars[rand() % (sizeof(chars) - 1)];
+}
+
+typedef struct results {
+  const char *word_end;
+  const char *word_start;
+  const char *crlf;
+  const char *find[4];
+  size_t token;
+} results_t;
+
+static void scan_all(const char *s, size_t length, const char **needles, const size_t *needle_lengths,
+                     results_t *r) {
+  int i;
+
+  r->word_end = scan_word_end(s);
+  r->word_start = scan_word_start(s);
+  r->crlf = scan_crlf(s);
+  for (i = 0; i < 4; i++)
+    r->find[i] = scan_find(s, length, needles[i], needle_lengths[i]);
+  r->token = scan_token(s, length);
+}
+
+static void test_level(int level) {
+  const char *needles[4];
+  size_t needle_lengths[4];
+  results_t expected, got;
+  char needle_buf[4][16];
+  size_t length, i;
+  char *s;
+  int n, j;
+
+  srand(level);
+  for (n = 0; n < CASES && !failures; n++) {
+    // the string ends at the guard page or begins at the beginning of a page (with an offset)
+    length = rand() % STRING_MAX;
+    s = (n % 2) ? guard - length - 1 : guard - 2 * PAGE + rand() % 64;
+    for (i = 0; i < length; i++)
+      s[i] = random_char();
+    s[length] = '\0';
+    if (n % 7 == 0 && length > 0) {
+      // a long token
+      for (i = 0; i < length - 1; i++)
+        s[i] = 'a' + i % 26;
+    }
+
+    // needles: from the string (they are found), "\r\n\r\n" and random ones
+    for (j = 0; j < 4; j++) {
+      needle_lengths[j] = 1 + rand() % 12;
+      if (j == 0 && length >= needle_lengths[j]) {
+        memcpy(needle_buf[j], s + rand() % (length - needle_lengths[j] + 1), needle_lengths[j]);
+      } else if (j == 1) {
+        memcpy(needle_buf[j], "\r\n\r\n", 4);
+        needle_lengths[j] = 4;
+      } else {
+        for (i = 0; i < needle_lengths[j]; i++)
+          needle_buf[j][i] = random_char();
+      }
+      needles[j] = needle_buf[j];
+    }
+
+    scan_init(SCAN_SCALAR);
+    scan_all(s, length, needles, needle_lengths, &expected);
+    scan_init(level);
+    scan_all(s, length, needles, needle_lengths, &got);
+
+    if (memcmp(&expected, &got, sizeof(results_t))) {
+      printf("FAIL: level %d differs on \"", level);
+      for (i = 0; i < length; i++)
+        printf((s[i] >= ' ' && s[i] < 0x7f) ? "%c" : "\\x%02x", (unsigned char)s[i]);
+      printf("\"\n");
+      failures++;
+    }
+  }
+}
+
+int main() {
+  char *pages;
+  int level, max_level;
+
+  logfp = fopen("/dev/null", "w");
+  pages = (char *)mmap(NULL, 3 * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED)
+    return 1;
+  guard = pages + 2 * PAGE;
+  mprotect(guard, PAGE, PROT_NONE);
+
+  // (the CPU may have no AVX2)
+  max_level = scan_init(SCAN_AVX2);
+  for (level = SCAN_SCALAR; level <= max_level; level++)
+    test_level(level);
+  scan_init(SCAN_AVX2);
+
+  printf("test_scan: %s (levels up to %d)\n", failures ? "FAILED" : "ok", max_level);
+  return failures ? 1 : 0;
+}
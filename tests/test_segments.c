@@ -0,0 +1,190 @@
+// (the bitmap of an upload is private)
+#include "../src/put_request.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+//
+// segmented uploads: checks of Content-Range, received blocks and their ranges
+//
+
+// the log of the server (see log.h), PRINT() writes into /dev/null here
+FILE *logfp;
+
+#define B      UPLOAD_BLOCK_SIZE
+#define TOTAL  (5 * B + 100)            // 6 blocks, the last one is short
+
+static int failures = 0;
+static char root[] = "/tmp/sss-test-segments-XXXXXX";
+static char data[TOTAL];
+
+static void expect(const char *test, int ok) {
+  if (!ok) {
+    printf("FAIL: %s\n", test);
+    failures++;
+  }
+}
+
+static void test_check_segment() {
+  expect("whole file", check_segment(0, TOTAL - 1, TOTAL) == 0);
+  expect("blocks", check_segment(B, 3 * B - 1, TOTAL) == 0);
+  expect("the last block", check_segment(5 * B, TOTAL - 1, TOTAL) == 0);
+  expect("a small file", check_segment(0, 99, 100) == 0);
+
+  expect("misaligned first", check_segment(1, B - 1, TOTAL) < 0);
+  expect("misaligned last", check_segment(0, B, TOTAL) < 0);
+  expect("misaligned both", check_segment(B / 2, B + B / 2, TOTAL) < 0);
+  expect("last after the end", check_segment(5 * B, TOTAL, TOTAL) < 0);
+  expect("first after last", check_segment(2 * B, B - 1, TOTAL) < 0);
+  expect("negative first", check_segment(-B, B - 1, TOTAL) < 0);
+  expect("beyond the file", check_segment(6 * B, 7 * B - 1, TOTAL) < 0);
+}
+
+// write segment [@first, @last] of the upload (as one request)
+static int write_range(segmented_upload_t *s, long long first, long long last) {
+  upload_writer_t *w = open_segment_writer(s, first, last - first + 1);
+  int res;
+
+  if (!w)
+    return -1;
+  res = write_segment(s, w, data + first, last - first + 1, TRUE);
+  upload_writer_close(w);
+  return res;
+}
+
+static void expect_ranges(const char *test, segmented_upload_t *s, const char *expected) {
+  char buf[256];
+
+  format_received_ranges(s, buf, sizeof(buf));
+  if (strcmp(buf, expected)) {
+    printf("FAIL: %s: \"%s\" (expected \"%s\")\n", test, buf, expected);
+    failures++;
+  }
+}
+
+//
+// (in a child process, like a worker of WORKERS, see workers.c)
+// segment [@first, @last] is written by an upload of its own
+// return 0 if the upload of the parent is continued, else -1
+//
+static int another_process(long long first, long long last) {
+  segmented_upload_t *s;
+  pid_t pid;
+  int status, res;
+
+  pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    // (uploads of the parent aren't known here)
+    uploads = NULL;
+    // the file with other length isn't truncated while it is written
+    if (open_segmented_upload("/f.bin", TOTAL - 1) != NULL || errno != EBUSY)
+      _exit(1);
+    s = open_segmented_upload("/f.bin", TOTAL);
+    if (!s || s->received != 4)
+      _exit(2);
+    res = write_range(s, first, last);
+    if (res < 0 || s->received != 5 || is_segmented_upload_complete(s))
+      _exit(3);
+    release_segmented_upload(s);
+    _exit(0);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("FAIL: the child process: %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return -1;
+  }
+  return 0;
+}
+
+static void test_upload() {
+  segmented_upload_t *s;
+  char path[256], buf[64];
+  struct stat st;
+  int fd;
+
+  s = open_segmented_upload("/f.bin", TOTAL);
+  if (!s) {
+    expect("open an upload", FALSE);
+    return;
+  }
+  expect_ranges("nothing", s, "");
+
+  // blocks 1, 2 and 4, then overlapping segments: blocks aren't counted twice
+  expect("write", write_range(s, B, 3 * B - 1) == 0);
+  expect("write", write_range(s, 4 * B, 5 * B - 1) == 0);
+  expect_ranges("holes", s, "bytes=65536-196607,262144-327679");
+  expect("overlapping write", write_range(s, 0, 2 * B - 1) == 0);
+  expect("overlapping write", write_range(s, B, 2 * B - 1) == 0);
+  expect("received blocks", s->received == 4);
+  expect_ranges("overlapping", s, "bytes=0-196607,262144-327679");
+
+  // the ranges are cut at a range
+  expect("short buffer", format_received_ranges(s, buf, 20) == strlen("bytes=0-196607") &&
+                         !strcmp(buf, "bytes=0-196607"));
+
+  // a resumed upload (after a restart) gets the blocks from the map
+  // (other uploads of the file must have the same length)
+  expect("other length", open_segmented_upload("/f.bin", TOTAL + 1) == NULL && errno == EBUSY);
+  release_segmented_upload(s);
+  s = open_segmented_upload("/f.bin", TOTAL);
+  if (!s) {
+    expect("resume an upload", FALSE);
+    return;
+  }
+  expect("resumed blocks", s->received == 4);
+  expect_ranges("resumed", s, "bytes=0-196607,262144-327679");
+
+  // another worker process uploads block 3 of the same file
+  expect("another process", another_process(3 * B, 4 * B - 1) == 0);
+  expect_ranges("blocks of another process", s, "bytes=0-327679");
+  expect("not complete", !is_segmented_upload_complete(s));
+
+  // the last block completes the file
+  expect("write the end", write_range(s, 5 * B, TOTAL - 1) == 0);
+  expect("received all", s->received == 6);
+  expect("complete", is_segmented_upload_complete(s));
+  expect_ranges("all", s, "bytes=0-327779");
+  release_segmented_upload(s);
+
+  snprintf(path, sizeof(path), "%s/f.bin", root);
+  fd = open(path, O_RDONLY);
+  expect("the file", fd >= 0 && fstat(fd, &st) == 0 && st.st_size == TOTAL);
+  if (fd >= 0) {
+    static char file[TOTAL];
+
+    expect("the content", read(fd, file, TOTAL) == TOTAL && !memcmp(file, data, TOTAL));
+    close(fd);
+  }
+  snprintf(path, sizeof(path), "%s/" UPLOAD_TMP_PREFIX "f.bin" UPLOAD_MAP_SUFFIX, root);
+  expect("the map is removed", access(path, F_OK) < 0);
+}
+
+int main() {
+  char command[256];
+  int i;
+
+  logfp = fopen("/dev/null", "w");
+  for (i = 0; i < TOTAL; i++)
+    data[i] = (char)(i * 31 + i / B);
+  if (!mkdtemp(root)) {
+    printf("FAIL: mkdtemp\n");
+    return 1;
+  }
+  srv_settings.wwwroot = root;
+  if (open_wwwroot_dir() < 0) {
+    printf("FAIL: open_wwwroot_dir\n");
+    return 1;
+  }
+
+  test_check_segment();
+  test_upload();
+
+  close_wwwroot_dir();
+  snprintf(command, sizeof(command), "rm -rf %s", root);
+  if (system(command) != 0)
+    printf("cannot remove %s\n", root);
+
+  printf("test_segments: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
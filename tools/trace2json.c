@@ -0,0 +1,233 @@
+//
+// Converter of traces of srv (see src/trace.h) into Chrome trace JSON
+// (chrome://tracing or https://ui.perfetto.dev)
+//
+//   ./trace2json <trace file> > trace.json
+//
+// Each request is an async track "request <id>" with its phases:
+//   read header  -- accept() .. CRLFCRLF (parts of the header are instant events)
+//   resolve      -- the header .. the file is opened
+//   first byte   -- .. the first byte of the response
+//   send         -- .. the last byte
+//   close        -- .. close()
+// (a phase which wasn't recorded is joined with the next one).
+// Jobs of io_pool workers are slices of their threads.
+// Timestamps are microseconds from the first event.
+//
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+typedef struct request {
+  uint32_t id;
+  uint64_t begin;           // accept() (or the first event, if it was overwritten)
+  uint64_t last;            // the end of the last phase
+  int closed;
+} request_t;
+
+static const char *event_names[] = TRACE_EVENT_NAMES;
+
+// the phase which ends with an event
+static const char *phase_names[TRACE_EVENTS_COUNT] = {
+  [TRACE_HEADER_COMPLETE] = "read header",
+  [TRACE_RESOLVED]        = "resolve",
+  [TRACE_FIRST_BYTE]      = "first byte",
+  [TRACE_LAST_BYTE]       = "send",
+  [TRACE_CLOSED]          = "close",
+};
+
+static trace_event_t *events;
+static size_t events_count;
+static trace_ring_header_t *threads;
+static uint32_t threads_count;
+
+static request_t *requests;     // open addressing by id
+static size_t requests_cap;
+
+static uint64_t first_ts;
+static int first_output = 1;
+
+static int compare_events(const void *a, const void *b) {
+  const trace_event_t *x = (const trace_event_t *)a;
+  const trace_event_t *y = (const trace_event_t *)b;
+
+  if (x->ts != y->ts)
+    return (x->ts > y->ts) ? 1 : -1;
+  return (int)x->type - (int)y->type;
+}
+
+static int read_trace(const char *path) {
+  trace_file_header_t header;
+  trace_ring_header_t ring;
+  trace_event_t *new_events;
+  FILE *f;
+  uint32_t i;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION) {
+    fprintf(stderr, "%s is not a trace of srv\n", path);
+    goto error;
+  }
+
+  threads = (trace_ring_header_t *)calloc(header.rings ? header.rings : 1, sizeof(trace_ring_header_t));
+  if (!threads)
+    goto error;
+  for (i = 0; i < header.rings; i++) {
+    if (fread(&ring, sizeof(ring), 1, f) != 1 || ring.count > TRACE_RING_EVENTS)
+      goto truncated;
+    ring.name[sizeof(ring.name) - 1] = '\0';
+    if (ring.thread < header.rings)
+      threads[ring.thread] = ring;
+    new_events = (trace_event_t *)realloc(events, (events_count + ring.count + 1) * sizeof(trace_event_t));
+    if (!new_events)
+      goto error;
+    events = new_events;
+    if (fread(events + events_count, sizeof(trace_event_t), ring.count, f) != ring.count)
+      goto truncated;
+    events_count += ring.count;
+  }
+  threads_count = header.rings;
+  fclose(f);
+  return 0;
+
+truncated:
+  fprintf(stderr, "%s is truncated\n", path);
+error:
+  fclose(f);
+  return -1;
+}
+
+static request_t *find_request(uint32_t id) {
+  size_t i = (id * 2654435761U) & (requests_cap - 1);
+
+  while (requests[i].id && requests[i].id != id)
+    i = (i + 1) & (requests_cap - 1);
+  requests[i].id = id;
+  return &requests[i];
+}
+
+static double us(uint64_t ts) {
+  return (ts - first_ts) / 1000.0;
+}
+
+static void print_separator() {
+  if (!first_output)
+    printf(",\n");
+  first_output = 0;
+}
+
+// the beginning (@ph "b") or the end ("e") of a slice of the async track of request @id
+// (slices are nested in the order they are printed)
+static void print_async(const char *ph, const char *name, uint32_t id, uint64_t ts) {
+  print_separator();
+  printf("{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%s\",\"id\":%" PRIu32 ",\"pid\":1,\"tid\":0,\"ts\":%.3f}",
+         name, ph, id, us(ts));
+}
+
+static void print_request(const char *ph, request_t *r, uint64_t ts) {
+  char name[32];
+
+  snprintf(name, sizeof(name), "request %" PRIu32, r->id);
+  print_async(ph, name, r->id, ts);
+}
+
+int main(int argc, char **argv) {
+  uint64_t *job_begin;
+  trace_event_t *e;
+  request_t *r;
+  size_t i;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (read_trace(argv[1]) < 0)
+    return EXIT_FAILURE;
+
+  qsort(events, events_count, sizeof(trace_event_t), compare_events);
+  first_ts = events_count ? events[0].ts : 0;
+
+  for (requests_cap = 16; requests_cap < events_count * 2; requests_cap *= 2)
+    ;
+  requests = (request_t *)calloc(requests_cap, sizeof(request_t));
+  job_begin = (uint64_t *)calloc(threads_count + 1, sizeof(uint64_t));
+  if (!requests || !job_begin) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("{\"traceEvents\":[\n");
+  print_separator();
+  printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"srv\"}}");
+  for (i = 0; i < threads_count; i++) {
+    print_separator();
+    printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%" PRIu32 ",\"args\":{\"name\":\"%s %" PRIu32 "\"}}",
+           threads[i].thread + 1, threads[i].name, threads[i].thread);
+  }
+
+  for (i = 0; i < events_count; i++) {
+    e = &events[i];
+    if (e->type >= TRACE_EVENTS_COUNT)
+      continue;
+
+    // jobs of workers
+    if (e->type == TRACE_JOB_BEGIN || e->type == TRACE_JOB_END) {
+      if (e->thread >= threads_count)
+        continue;
+      if (e->type == TRACE_JOB_BEGIN) {
+        job_begin[e->thread] = e->ts;
+      } else if (job_begin[e->thread]) {
+        print_separator();
+        printf("{\"name\":\"job\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+               "\"args\":{\"request\":%" PRIu32 "}}",
+               e->thread + 1, us(job_begin[e->thread]), (e->ts - job_begin[e->thread]) / 1000.0, e->id);
+        job_begin[e->thread] = 0;
+      }
+      continue;
+    }
+
+    // an instant event on the thread
+    print_separator();
+    printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+           "\"args\":{\"request\":%" PRIu32 "}}",
+           event_names[e->type], e->thread + 1, us(e->ts), e->id);
+
+    // phases of the request
+    r = find_request(e->id);
+    if (e->type == TRACE_ACCEPTED || !r->begin) {
+      if (r->begin && !r->closed)
+        print_request("e", r, r->last);   // the number was reused (the server was restarted)
+      r->begin = r->last = e->ts;
+      r->closed = 0;
+      print_request("b", r, e->ts);
+      if (e->type == TRACE_ACCEPTED)
+        continue;
+    }
+    if (r->closed || !phase_names[e->type])
+      continue;
+    print_async("b", phase_names[e->type], r->id, r->last);
+    print_async("e", phase_names[e->type], r->id, e->ts);
+    r->last = e->ts;
+    if (e->type == TRACE_CLOSED) {
+      print_request("e", r, e->ts);
+      r->closed = 1;
+    }
+  }
+
+  // requests which aren't closed yet
+  for (i = 0; i < requests_cap; i++) {
+    if (requests[i].id && requests[i].begin && !requests[i].closed)
+      print_request("e", &requests[i], requests[i].last);
+  }
+
+  printf("\n],\"displayTimeUnit\":\"ms\"}\n");
+  return EXIT_SUCCESS;
+}